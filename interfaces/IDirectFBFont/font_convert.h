@@ -0,0 +1,466 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#ifndef __FONT_CONVERT_H__
+#define __FONT_CONVERT_H__
+
+#include <direct/memcpy.h>
+#include <directfb.h>
+
+/*
+ * Conversion of a row of glyph coverage, either 8 bit grays or 1 bit monochrome (most significant bit first), to a
+ * row of the glyph cache surface. There is one function per pixel format, picked once per glyph by font_convert_func(),
+ * with a plain loop over the row that the compiler can vectorize.
+ */
+
+typedef void (*FontConvertFunc)( const u8 *src, void *dst, int width );
+
+#define MONO_BIT(src,i) ((src)[(i)>>3] & (0x80 >> ((i) & 7)))
+
+static __inline__ void
+store_24( u8  *dst,
+          u32  d )
+{
+#ifdef WORDS_BIGENDIAN
+     dst[0] = (d >> 16) & 0xFF;
+     dst[1] = (d >>  8) & 0xFF;
+     dst[2] = (d >>  0) & 0xFF;
+#else
+     dst[0] = (d >>  0) & 0xFF;
+     dst[1] = (d >>  8) & 0xFF;
+     dst[2] = (d >> 16) & 0xFF;
+#endif
+}
+
+/**********************************************************************************************************************/
+
+static __inline__ void
+grays_to_argb( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = (src[i] << 24) | 0xFFFFFF;
+}
+
+static __inline__ void
+grays_to_argb_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = src[i] * 0x01010101;
+}
+
+static __inline__ void
+grays_to_airgb( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = ((src[i] ^ 0xFF) << 24) | 0xFFFFFF;
+}
+
+static __inline__ void
+grays_to_argb8565( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i++)
+          store_24( dst8 + i * 3, (src[i] << 16) | 0xFFFF );
+}
+
+static __inline__ void
+grays_to_argb8565_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i++)
+          store_24( dst8 + i * 3, (src[i] << 16) | ((src[i] & 0xF8) << 8) | ((src[i] & 0xFC) << 3) | (src[i] >> 3) );
+}
+
+static __inline__ void
+grays_to_argb4444( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (src[i] << 8) | 0x0FFF;
+}
+
+static __inline__ void
+grays_to_rgba4444( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (src[i] >> 4) | 0xFFF0;
+}
+
+static __inline__ void
+grays_to_4444_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (src[i] >> 4) * 0x1111;
+}
+
+static __inline__ void
+grays_to_argb2554( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (src[i] << 8) | 0x3FFF;
+}
+
+static __inline__ void
+grays_to_argb1555( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (src[i] << 8) | 0x7FFF;
+}
+
+static __inline__ void
+grays_to_argb1555_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++) {
+          u16 x = src[i] >> 3;
+
+          dst16[i] = ((src[i] & 0x80) << 8) | (x << 10) | (x << 5) | x;
+     }
+}
+
+static __inline__ void
+grays_to_rgba5551( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = 0xFFFE | (src[i] >> 7);
+}
+
+static __inline__ void
+grays_to_rgba5551_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++) {
+          u16 x = src[i] >> 3;
+
+          dst16[i] = (x << 11) | (x << 6) | (x << 1) | (src[i] >> 7);
+     }
+}
+
+static __inline__ void
+grays_to_a8( const u8 *src, void *dst, int width )
+{
+     direct_memcpy( dst, src, width );
+}
+
+static __inline__ void
+grays_to_a4( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width - 1; i += 2)
+          dst8[i>>1] = (src[i] & 0xF0) | (src[i+1] >> 4);
+
+     if (width & 1)
+          dst8[i>>1] = src[i] & 0xF0;
+}
+
+static __inline__ void
+grays_to_a1( const u8 *src, void *dst, int width )
+{
+     int  i, n;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i += 8) {
+          u8 p = 0;
+
+          for (n = 0; n < 8 && i + n < width; n++)
+               p |= (src[i+n] & 0x80) >> n;
+
+          dst8[i>>3] = p;
+     }
+}
+
+static __inline__ void
+grays_to_a1_lsb( const u8 *src, void *dst, int width )
+{
+     int  i, n;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i += 8) {
+          u8 p = 0;
+
+          for (n = 0; n < 8 && i + n < width; n++)
+               p |= (src[i+n] & 0x80) >> (7 - n);
+
+          dst8[i>>3] = p;
+     }
+}
+
+static __inline__ void
+grays_to_lut2( const u8 *src, void *dst, int width )
+{
+     int  i, n;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i += 4) {
+          u8 p = 0;
+
+          for (n = 0; n < 4 && i + n < width; n++)
+               p |= (src[i+n] & 0xC0) >> (n * 2);
+
+          dst8[i>>2] = p;
+     }
+}
+
+/**********************************************************************************************************************/
+
+static __inline__ void
+mono_to_argb( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = ((MONO_BIT( src, i ) ? 0xFF : 0x00) << 24) | 0xFFFFFF;
+}
+
+static __inline__ void
+mono_to_argb_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = MONO_BIT( src, i ) ? 0xFFFFFFFF : 0x00000000;
+}
+
+static __inline__ void
+mono_to_airgb( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = ((MONO_BIT( src, i ) ? 0x00 : 0xFF) << 24) | 0xFFFFFF;
+}
+
+static __inline__ void
+mono_to_airgb_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u32 *dst32 = dst;
+
+     for (i = 0; i < width; i++)
+          dst32[i] = MONO_BIT( src, i ) ? 0x00FFFFFF : 0xFF000000;
+}
+
+static __inline__ void
+mono_to_argb8565( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i++)
+          store_24( dst8 + i * 3, ((MONO_BIT( src, i ) ? 0xFF : 0x00) << 16) | 0xFFFF );
+}
+
+static __inline__ void
+mono_to_argb8565_pre( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i++)
+          store_24( dst8 + i * 3, MONO_BIT( src, i ) ? 0xFFFFFF : 0x000000 );
+}
+
+static __inline__ void
+mono_to_argb4444( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = ((MONO_BIT( src, i ) ? 0xF : 0x0) << 12) | 0xFFF;
+}
+
+static __inline__ void
+mono_to_rgba4444( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (MONO_BIT( src, i ) ? 0xF : 0x0) | 0xFFF0;
+}
+
+static __inline__ void
+mono_to_argb2554( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = ((MONO_BIT( src, i ) ? 0x3 : 0x0) << 14) | 0x3FFF;
+}
+
+static __inline__ void
+mono_to_argb1555( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = ((MONO_BIT( src, i ) ? 0x1 : 0x0) << 15) | 0x7FFF;
+}
+
+static __inline__ void
+mono_to_rgba5551( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u16 *dst16 = dst;
+
+     for (i = 0; i < width; i++)
+          dst16[i] = (MONO_BIT( src, i ) ? 0x1 : 0x0) | 0xFFFE;
+}
+
+static __inline__ void
+mono_to_a8( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i++)
+          dst8[i] = MONO_BIT( src, i ) ? 0xFF : 0x00;
+}
+
+static __inline__ void
+mono_to_a4( const u8 *src, void *dst, int width )
+{
+     int  i;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i += 2)
+          dst8[i>>1] = (MONO_BIT( src, i ) ? 0xF0 : 0x00) | ((i + 1 < width && MONO_BIT( src, i + 1 )) ? 0x0F : 0x00);
+}
+
+static __inline__ void
+mono_to_a1( const u8 *src, void *dst, int width )
+{
+     direct_memcpy( dst, src, (width + 7) >> 3 );
+}
+
+static __inline__ void
+mono_to_a1_lsb( const u8 *src, void *dst, int width )
+{
+     int  i, n;
+     u8  *dst8 = dst;
+
+     for (i = 0; i < width; i += 8) {
+          u8 p = 0;
+
+          for (n = 0; n < 8 && i + n < width; n++)
+               p |= ((src[i>>3] >> (7 - n)) & 1) << n;
+
+          dst8[i>>3] = p;
+     }
+}
+
+/**********************************************************************************************************************/
+
+/*
+ * Get the conversion function to a pixel format, returns NULL if the format is not supported.
+ */
+static __inline__ FontConvertFunc
+font_convert_func( DFBSurfacePixelFormat format,
+                   bool                  premultiplied,
+                   bool                  mono )
+{
+     switch (format) {
+          case DSPF_ARGB:
+          case DSPF_ABGR:
+               if (mono)
+                    return premultiplied ? mono_to_argb_pre : mono_to_argb;
+               return premultiplied ? grays_to_argb_pre : grays_to_argb;
+          case DSPF_AiRGB:
+               if (mono)
+                    return premultiplied ? mono_to_airgb_pre : mono_to_airgb;
+               return grays_to_airgb;
+          case DSPF_ARGB8565:
+               if (mono)
+                    return premultiplied ? mono_to_argb8565_pre : mono_to_argb8565;
+               return premultiplied ? grays_to_argb8565_pre : grays_to_argb8565;
+          case DSPF_ARGB4444:
+               if (mono)
+                    return mono_to_argb4444;
+               return premultiplied ? grays_to_4444_pre : grays_to_argb4444;
+          case DSPF_RGBA4444:
+               if (mono)
+                    return mono_to_rgba4444;
+               return premultiplied ? grays_to_4444_pre : grays_to_rgba4444;
+          case DSPF_ARGB2554:
+               return mono ? mono_to_argb2554 : grays_to_argb2554;
+          case DSPF_ARGB1555:
+               if (mono)
+                    return mono_to_argb1555;
+               return premultiplied ? grays_to_argb1555_pre : grays_to_argb1555;
+          case DSPF_RGBA5551:
+               if (mono)
+                    return mono_to_rgba5551;
+               return premultiplied ? grays_to_rgba5551_pre : grays_to_rgba5551;
+          case DSPF_A8:
+               return mono ? mono_to_a8 : grays_to_a8;
+          case DSPF_A4:
+               return mono ? mono_to_a4 : grays_to_a4;
+          case DSPF_A1:
+               return mono ? mono_to_a1 : grays_to_a1;
+          case DSPF_A1_LSB:
+               return mono ? mono_to_a1_lsb : grays_to_a1_lsb;
+          case DSPF_LUT2:
+               return mono ? NULL : grays_to_lut2;
+          default:
+               return NULL;
+     }
+}
+
+#endif
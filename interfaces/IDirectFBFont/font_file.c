@@ -0,0 +1,121 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#include <direct/filesystem.h>
+#include <direct/mem.h>
+#include <direct/messages.h>
+#include <direct/thread.h>
+#include <sys/stat.h>
+
+#include "font_file.h"
+
+D_DEBUG_DOMAIN( Font_File, "Font/File", "Font File Mappings" );
+
+/* The mutex protects the list of mappings and their reference counts. */
+static DirectLink  *files       = NULL;
+static DirectMutex  files_mutex = DIRECT_MUTEX_INITIALIZER();
+
+/**********************************************************************************************************************/
+
+FontFile *
+font_file_open( const char *filename )
+{
+     DirectFile      fd;
+     DirectFileInfo  info;
+     struct stat     st;
+     FontFile       *file;
+     void           *map;
+
+     if (stat( filename, &st ))
+          return NULL;
+
+     direct_mutex_lock( &files_mutex );
+
+     direct_list_foreach (file, files) {
+          if (file->dev == st.st_dev && file->ino == st.st_ino && file->size == st.st_size &&
+              file->mtime == st.st_mtime) {
+               D_DEBUG_AT( Font_File, "%s( '%s' ) -> sharing mapping with %d users\n", __FUNCTION__,
+                           filename, file->ref );
+
+               file->ref++;
+
+               direct_mutex_unlock( &files_mutex );
+
+               return file;
+          }
+     }
+
+     file = D_CALLOC( 1, sizeof(FontFile) );
+     if (!file) {
+          D_OOM();
+          goto error;
+     }
+
+     if (direct_file_open( &fd, filename, O_RDONLY, 0 ))
+          goto error;
+
+     if (direct_file_get_info( &fd, &info ) || info.size <= 0 ||
+         direct_file_map( &fd, NULL, 0, info.size, DFP_READ, &map )) {
+          direct_file_close( &fd );
+          goto error;
+     }
+
+     direct_file_close( &fd );
+
+     D_DEBUG_AT( Font_File, "%s( '%s' ) -> mapped %zu bytes\n", __FUNCTION__, filename, (size_t) info.size );
+
+     file->ref      = 1;
+     file->dev      = st.st_dev;
+     file->ino      = st.st_ino;
+     file->size     = st.st_size;
+     file->mtime    = st.st_mtime;
+     file->map      = map;
+     file->map_size = info.size;
+
+     direct_list_append( &files, &file->link );
+
+     direct_mutex_unlock( &files_mutex );
+
+     return file;
+
+error:
+     if (file)
+          D_FREE( file );
+
+     direct_mutex_unlock( &files_mutex );
+
+     return NULL;
+}
+
+void
+font_file_close( FontFile *file )
+{
+     direct_mutex_lock( &files_mutex );
+
+     if (--file->ref == 0) {
+          D_DEBUG_AT( Font_File, "%s() -> unmapping %zu bytes\n", __FUNCTION__, file->map_size );
+
+          direct_list_remove( &files, &file->link );
+
+          direct_file_unmap( file->map, file->map_size );
+
+          D_FREE( file );
+     }
+
+     direct_mutex_unlock( &files_mutex );
+}
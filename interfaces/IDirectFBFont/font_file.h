@@ -0,0 +1,57 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#ifndef __FONT_FILE_H__
+#define __FONT_FILE_H__
+
+#include <direct/list.h>
+#include <sys/types.h>
+
+/*
+ * Registry of font file mappings, shared by all the font providers of the process. It lives in its own library linked
+ * by the providers, so a font file is mapped once however many fonts and provider modules use it.
+ *
+ * A file is identified by its device, inode, size and modification time, a file modified since it was mapped gets a
+ * new mapping.
+ */
+
+typedef struct {
+     DirectLink   link;
+
+     int          ref;               /* number of users of the mapping */
+
+     dev_t        dev;               /* identity of the font file */
+     ino_t        ino;
+     off_t        size;
+     time_t       mtime;
+
+     void        *map;               /* read-only mapping of the font file */
+     size_t       map_size;
+} FontFile;
+
+/*
+ * Get the mapping of a font file with a reference held by the caller, returns NULL if the file can't be mapped.
+ */
+FontFile *font_file_open ( const char *filename );
+
+/*
+ * Drop the reference on the mapping of a font file, the file is unmapped with its last reference.
+ */
+void      font_file_close( FontFile   *file );
+
+#endif
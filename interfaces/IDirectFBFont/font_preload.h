@@ -0,0 +1,304 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#ifndef __FONT_PRELOAD_H__
+#define __FONT_PRELOAD_H__
+
+#include <core/fonts.h>
+#include <direct/clock.h>
+#include <direct/list.h>
+#include <direct/system.h>
+#include <direct/thread.h>
+#include <direct/util.h>
+
+/*
+ * Glyph preloading, enabled by setting the FONT_PRELOAD environment variable either to a sample text in UTF-8, or to a
+ * comma separated list of Unicode characters and ranges such as "U+0020-U+007E,U+4E00-U+9FFF".
+ *
+ * The glyphs are rendered into the glyph cache of each new font by a background thread, so that the first strings
+ * drawn with the font don't have to render them. Ranges are limited to FONT_PRELOAD_MAX characters in total.
+ */
+
+D_DEBUG_DOMAIN( FontPreload, "Font/Preload", "Glyph Preloading" );
+
+#define FONT_PRELOAD_MAX   65536        /* maximum number of characters of the ranges */
+#define FONT_PRELOAD_BATCH 256          /* number of characters decoded while holding the font lock */
+
+typedef struct {
+     DirectLink     link;
+
+     CoreFont      *font;
+     char          *spec;       /* value of FONT_PRELOAD */
+
+     bool           stop;       /* set when the font is destroyed, protected by font_preload.lock */
+
+     DirectThread  *thread;
+} FontPreload;
+
+static struct {
+     DirectMutex    lock;
+
+     DirectLink    *preloads;   /* fonts being preloaded */
+} font_preload;
+
+/**********************************************************************************************************************/
+
+static int
+font_preload_compare( const void *a,
+                      const void *b )
+{
+     unsigned int index_a = *(const unsigned int*) a;
+     unsigned int index_b = *(const unsigned int*) b;
+
+     return (index_a > index_b) - (index_a < index_b);
+}
+
+static bool
+font_preload_stopped( FontPreload *preload )
+{
+     bool stop;
+
+     direct_mutex_lock( &font_preload.lock );
+
+     stop = preload->stop;
+
+     direct_mutex_unlock( &font_preload.lock );
+
+     return stop;
+}
+
+/*
+ * Parse a list of characters and ranges, returns the number of characters, or -1 if the list is not valid. At most
+ * FONT_PRELOAD_MAX characters are stored, a larger number of characters is returned as FONT_PRELOAD_MAX + 1.
+ */
+static int
+font_preload_ranges( const char    *spec,
+                     unsigned int  *ret_chars )
+{
+     const char    *p   = spec;
+     int            num = 0;
+     unsigned long  first, last, c;
+     char          *end;
+
+     while (*p) {
+          if (strncasecmp( p, "U+", 2 ))
+               return -1;
+
+          first = last = strtoul( p + 2, &end, 16 );
+          p = end;
+
+          if (*p == '-') {
+               if (strncasecmp( p + 1, "U+", 2 ))
+                    return -1;
+
+               last = strtoul( p + 3, &end, 16 );
+               p = end;
+          }
+
+          if (*p == ',')
+               p++;
+          else if (*p)
+               return -1;
+
+          if (last < first || last > 0x10ffff)
+               return -1;
+
+          for (c = first; ret_chars && c <= last && num + c - first < FONT_PRELOAD_MAX; c++)
+               ret_chars[num + c - first] = c;
+
+          num = MIN( num + last - first + 1, FONT_PRELOAD_MAX + 1 );
+     }
+
+     return num;
+}
+
+static void *
+font_preload_thread( DirectThread *thread,
+                     void         *arg )
+{
+     FontPreload    *preload = arg;
+     CoreFont       *font    = preload->font;
+     unsigned int   *indices;
+     int             num, i, j, n;
+     unsigned int    layer;
+     unsigned int    layers  = (font->attributes & DFFA_OUTLINED) ? 2 : 1;
+     unsigned long   bytes   = 0;
+     long long       start   = direct_clock_get_millis();
+
+     /* Map the characters to glyph indices. */
+     num = font_preload_ranges( preload->spec, NULL );
+     if (num > FONT_PRELOAD_MAX) {
+          D_INFO( "Font/Preload: Limiting the ranges to %d characters\n", FONT_PRELOAD_MAX );
+          num = FONT_PRELOAD_MAX;
+     }
+
+     indices = D_MALLOC( ((num < 0) ? strlen( preload->spec ) + 1 : num + 1) * sizeof(unsigned int) );
+     if (!indices) {
+          D_OOM();
+          return NULL;
+     }
+
+     if (num < 0) {
+          dfb_font_lock( font );
+
+          if (dfb_font_decode_text( font, DTEID_UTF8, preload->spec, strlen( preload->spec ), indices, &num ))
+               num = 0;
+
+          dfb_font_unlock( font );
+     }
+     else {
+          font_preload_ranges( preload->spec, indices );
+
+          /* Decode the characters in place, in batches to limit the number of font locks. */
+          for (i = 0; i < num && !font_preload_stopped( preload ); i += FONT_PRELOAD_BATCH) {
+               dfb_font_lock( font );
+
+               for (j = i; j < num && j < i + FONT_PRELOAD_BATCH; j++) {
+                    if (dfb_font_decode_character( font, DTEID_UTF8, indices[j], &indices[j] ))
+                         indices[j] = 0;
+               }
+
+               dfb_font_unlock( font );
+          }
+
+          if (i < num)
+               num = 0;
+     }
+
+     /* Render each glyph once. */
+     qsort( indices, num, sizeof(unsigned int), font_preload_compare );
+
+     for (i = 0, n = 0; i < num && !font_preload_stopped( preload ); i++) {
+          if (i && indices[i] == indices[i-1])
+               continue;
+
+          dfb_font_lock( font );
+
+          for (layer = 0; layer < layers; layer++) {
+               CoreGlyphData *glyph;
+
+               if (dfb_font_get_glyph_data( font, indices[i], layer, &glyph ))
+                    continue;
+
+               bytes += DFB_BYTES_PER_LINE( font->pixel_format, glyph->width ) * glyph->height;
+          }
+
+          dfb_font_unlock( font );
+
+          n++;
+     }
+
+     D_FREE( indices );
+
+     D_INFO( "Font/Preload: %d glyphs in %lld ms, %lu bytes%s\n",
+             n, direct_clock_get_millis() - start, bytes, font_preload_stopped( preload ) ? " (stopped)" : "" );
+
+     return NULL;
+}
+
+/*
+ * Start preloading the glyphs of a newly created font if FONT_PRELOAD is set.
+ */
+static void
+font_preload_start( CoreFont *font )
+{
+     const char  *value;
+     FontPreload *preload;
+
+     value = direct_getenv( "FONT_PRELOAD" );
+     if (!value || !*value)
+          return;
+
+     preload = D_CALLOC( 1, sizeof(FontPreload) );
+     if (!preload) {
+          D_OOM();
+          return;
+     }
+
+     preload->font = font;
+     preload->spec = D_STRDUP( value );
+     if (!preload->spec) {
+          D_OOM();
+          D_FREE( preload );
+          return;
+     }
+
+     D_DEBUG_AT( FontPreload, "%s( %p ) <- '%s'\n", __FUNCTION__, font, preload->spec );
+
+     direct_mutex_lock( &font_preload.lock );
+
+     preload->thread = direct_thread_create( DTT_DEFAULT, font_preload_thread, preload, "Font Preload" );
+     if (preload->thread)
+          direct_list_append( &font_preload.preloads, &preload->link );
+
+     direct_mutex_unlock( &font_preload.lock );
+
+     if (!preload->thread) {
+          D_FREE( preload->spec );
+          D_FREE( preload );
+     }
+}
+
+/*
+ * Stop preloading the glyphs of a font about to be destroyed.
+ */
+static void
+font_preload_stop( CoreFont *font )
+{
+     FontPreload *preload;
+
+     direct_mutex_lock( &font_preload.lock );
+
+     direct_list_foreach (preload, font_preload.preloads) {
+          if (preload->font == font) {
+               direct_list_remove( &font_preload.preloads, &preload->link );
+
+               preload->stop = true;
+               break;
+          }
+     }
+
+     direct_mutex_unlock( &font_preload.lock );
+
+     if (!preload)
+          return;
+
+     D_DEBUG_AT( FontPreload, "%s( %p )\n", __FUNCTION__, font );
+
+     direct_thread_join( preload->thread );
+     direct_thread_destroy( preload->thread );
+
+     D_FREE( preload->spec );
+     D_FREE( preload );
+}
+
+__attribute__((constructor))
+static void
+font_preload_init( void )
+{
+     direct_mutex_init( &font_preload.lock );
+}
+
+__attribute__((destructor))
+static void
+font_preload_deinit( void )
+{
+     direct_mutex_deinit( &font_preload.lock );
+}
+
+#endif
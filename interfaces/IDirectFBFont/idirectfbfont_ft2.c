@@ -23,10 +23,17 @@
 #include <direct/utf8.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SIZES_H
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
 #include <math.h>
 #include <media/idirectfbfont.h>
 #include <misc/conf.h>
 
+#include "font_convert.h"
+#include "font_file.h"
+#include "font_preload.h"
+
 D_DEBUG_DOMAIN( Font_FT2, "Font/FT2", "FreeType2 Font Provider" );
 
 static DFBResult Probe    ( IDirectFBFont_ProbeContext *ctx );
@@ -42,40 +49,131 @@ DIRECT_INTERFACE_IMPLEMENTATION( IDirectFBFont, FT2 )
 
 /**********************************************************************************************************************/
 
+/* The library mutex only protects the library object, the list of shared faces and their reference counts, and the
+   creation and destruction of faces. */
 static FT_Library  library           = NULL;
 static int         library_ref_count = 0;
 static DirectMutex library_mutex     = DIRECT_MUTEX_INITIALIZER();
 
+/*
+ * A face is shared by all fonts created from the same font file with the same face index, on the mapping of the file
+ * shared through the font file registry. Each font has its own size object on the face, activated along with its
+ * transformation before each use of the face.
+ */
 typedef struct {
+     DirectLink   link;
+
+     int          ref;               /* number of fonts using the face */
+
+     FontFile    *file;              /* shared mapping of the font file, NULL if the face is not shared */
+     FT_Long      index;
+
      FT_Face      face;
+     DirectMutex  lock;              /* serializes the use of the face */
+     void        *active;            /* font whose size and transformation are active */
+} FT2Face;
+
+static DirectLink *faces = NULL;
+
+typedef struct {
+     FT2Face     *shared;
+     FT_Face      face;
+     FT_Size      size;              /* size object of the font on the shared face */
+     FT_Int       load_flags;
+     FT_Matrix    matrix;
+     bool         transform;         /* the font is rotated */
      int          disable_charmap;
      int          fixed_advance;
      bool         fixed_clip;
-     unsigned int indices[256];
+     unsigned int indices[256];      /* glyph indices of the first 256 characters */
+     unsigned int **pages;           /* glyph indices of the other characters by pages of 256, filled on first use */
      int          outline_radius;
      int          outline_opacity;
      float        up_unit_x;
      float        up_unit_y;
 } FT2ImplData;
 
-#define KERNING_CACHE_MIN    0
-#define KERNING_CACHE_MAX  127
-#define KERNING_CACHE_SIZE (KERNING_CACHE_MAX - KERNING_CACHE_MIN + 1)
+#define KERNING_CACHE_EMPTY 0xFFFFFFFF
 
 typedef struct {
-     bool initialised;
-     char x;
-     char y;
+     unsigned int prev;              /* KERNING_CACHE_EMPTY for an empty entry */
+     unsigned int current;
+     s16          x;
+     s16          y;
 } KerningCacheEntry;
 
 typedef struct {
-     FT2ImplData       base;
-     KerningCacheEntry kerning[KERNING_CACHE_SIZE][KERNING_CACHE_SIZE];
+     FT2ImplData        base;
+     KerningCacheEntry *kerning;     /* hash table of character pairs, with open addressing */
+     unsigned int       size;        /* number of entries, a power of two */
+     unsigned int       count;       /* number of used entries */
+     bool               complete;    /* all pairs with kerning are in the table, others have none */
 } FT2ImplKerningData;
 
 /**********************************************************************************************************************/
 
-#define CHAR_INDEX(c) (((c) < 256) ? data->indices[c] : FT_Get_Char_Index( data->face, c ))
+/*
+ * Activate the size and the transformation of the font on its shared face, the face must be locked.
+ */
+static void
+activate_size( FT2ImplData *data )
+{
+     if (data->shared->active == data)
+          return;
+
+     FT_Activate_Size( data->size );
+     FT_Set_Transform( data->face, data->transform ? &data->matrix : NULL, NULL );
+
+     data->shared->active = data;
+}
+
+/**********************************************************************************************************************/
+
+#define CHAR_PAGES (0x110000 >> 8)
+
+/*
+ * Get the glyph index of a character, the face must be locked.
+ */
+static unsigned int
+char_index( FT2ImplData  *data,
+            unsigned int  c )
+{
+     FT_ULong      charcode;
+     FT_UInt       index;
+     unsigned int *page;
+
+     if (c < 256)
+          return data->indices[c];
+
+     if (c >= 0x110000)
+          return FT_Get_Char_Index( data->face, c );
+
+     if (!data->pages) {
+          data->pages = D_CALLOC( CHAR_PAGES, sizeof(unsigned int*) );
+          if (!data->pages)
+               return FT_Get_Char_Index( data->face, c );
+     }
+
+     page = data->pages[c>>8];
+     if (!page) {
+          page = D_CALLOC( 256, sizeof(unsigned int) );
+          if (!page)
+               return FT_Get_Char_Index( data->face, c );
+
+          /* Walk the charmap over the page. */
+          charcode = FT_Get_Next_Char( data->face, (c & ~0xFF) - 1, &index );
+
+          while (index && charcode <= (c | 0xFF)) {
+               page[charcode & 0xFF] = index;
+
+               charcode = FT_Get_Next_Char( data->face, charcode, &index );
+          }
+
+          data->pages[c>>8] = page;
+     }
+
+     return page[c & 0xFF];
+}
 
 static DFBResult
 ft2UTF8GetCharacterIndex( CoreFont     *thiz,
@@ -90,11 +188,11 @@ ft2UTF8GetCharacterIndex( CoreFont     *thiz,
      if (data->disable_charmap)
           *ret_index = character;
      else {
-          direct_mutex_lock( &library_mutex );
+          direct_mutex_lock( &data->shared->lock );
 
-          *ret_index = CHAR_INDEX( character );
+          *ret_index = char_index( data, character );
 
-          direct_mutex_unlock( &library_mutex );
+          direct_mutex_unlock( &data->shared->lock );
      }
 
      return DFB_OK;
@@ -118,11 +216,34 @@ ft2UTF8DecodeText( CoreFont     *thiz,
      D_ASSERT( ret_indices != NULL );
      D_ASSERT( ret_num != NULL );
 
-     direct_mutex_lock( &library_mutex );
+     direct_mutex_lock( &data->shared->lock );
 
      while (pos < length) {
           unsigned int c;
 
+          /* Look for runs of ASCII characters eight bytes at a time. */
+          while (pos + 8 <= length) {
+               u64 word;
+               int end;
+
+               memcpy( &word, &bytes[pos], 8 );
+
+               if (word & 0x8080808080808080ULL)
+                    break;
+
+               if (data->disable_charmap) {
+                    for (end = pos + 8; pos < end; pos++)
+                         ret_indices[num++] = bytes[pos];
+               }
+               else {
+                    for (end = pos + 8; pos < end; pos++)
+                         ret_indices[num++] = data->indices[bytes[pos]];
+               }
+          }
+
+          if (pos == length)
+               break;
+
           if (bytes[pos] < 128) {
                c = bytes[pos++];
           }
@@ -134,10 +255,10 @@ ft2UTF8DecodeText( CoreFont     *thiz,
           if (data->disable_charmap)
                ret_indices[num++] = c;
           else
-               ret_indices[num++] = CHAR_INDEX( c );
+               ret_indices[num++] = char_index( data, c );
      }
 
-     direct_mutex_unlock( &library_mutex );
+     direct_mutex_unlock( &data->shared->lock );
 
      *ret_num = num;
 
@@ -217,15 +338,16 @@ get_glyph_info( CoreFont      *thiz,
      FT_Int       load_flags;
      FT2ImplData *data = thiz->impl_data;
 
-     direct_mutex_lock( &library_mutex );
+     direct_mutex_lock( &data->shared->lock );
 
-     face = data->face;
+     activate_size( data );
 
-     load_flags = (long) face->generic.data;
+     face       = data->face;
+     load_flags = data->load_flags;
 
      if ((err = FT_Load_Glyph( face, index, load_flags ))) {
           D_DEBUG_AT( Font_FT2, "Could not load glyph for character index #%u!\n", index );
-          direct_mutex_unlock( &library_mutex );
+          direct_mutex_unlock( &data->shared->lock );
           return DFB_FAILURE;
      }
 
@@ -235,13 +357,11 @@ get_glyph_info( CoreFont      *thiz,
           err = FT_Render_Glyph( face->glyph, load_flags ? ft_render_mode_mono : ft_render_mode_normal );
           if (err) {
                D_ERROR( "Font/FT2: Could not render glyph for character index #%u!\n", index );
-               direct_mutex_unlock( &library_mutex );
+               direct_mutex_unlock( &data->shared->lock );
                return DFB_FAILURE;
           }
      }
 
-     direct_mutex_unlock( &library_mutex );
-
      info->width  = face->glyph->bitmap.width;
      info->height = face->glyph->bitmap.rows;
 
@@ -254,6 +374,8 @@ get_glyph_info( CoreFont      *thiz,
           info->yadvance = -face->glyph->advance.y << 2;
      }
 
+     direct_mutex_unlock( &data->shared->lock );
+
      if (data->fixed_clip && info->width > data->fixed_advance)
           info->width = data->fixed_advance;
 
@@ -265,6 +387,92 @@ get_glyph_info( CoreFont      *thiz,
      return DFB_OK;
 }
 
+/*
+ * Build the outline layer of a glyph: each pixel is the sum of the glyph coverage divided by the radius over a box of
+ * radius x radius pixels, saturated to 255. The box sum is computed with running sums along the rows and then along the
+ * columns, so the cost per pixel does not depend on the radius.
+ */
+static DFBResult
+outline_glyph( const FT_Bitmap *bitmap,
+               int              width,
+               int              height,
+               int              radius,
+               u8              *outline )
+{
+     int  x, y, sum;
+     int  pitch = width + radius;
+     u8  *line;
+     u8  *rows;
+     int *columns;
+
+     /* Column sums, coverage of a source line divided by the radius, row sums. The column sums come first to keep
+        them aligned for int access. */
+     columns = D_MALLOC( pitch * sizeof(int) + width + height * pitch );
+     if (!columns)
+          return D_OOM();
+
+     line = (u8*) (columns + pitch);
+     rows = line + width;
+
+     /* Horizontal pass, each row sum fits in 8 bits as it adds up at most radius values of 255 / radius. */
+     for (y = 0; y < height; y++) {
+          const u8 *src = bitmap->buffer + y * bitmap->pitch;
+          u8       *dst = rows + y * pitch;
+
+          /* Pixels outside of the bitmap are not covered. */
+          memset( line, 0, width );
+
+          if (y < bitmap->rows) {
+               if (bitmap->pixel_mode == ft_pixel_mode_mono) {
+                    for (x = 0; x < width && x < bitmap->width; x++)
+                         line[x] = (src[x>>3] & (0x80 >> (x & 7))) ? 0xFF / radius : 0;
+               }
+               else {
+                    for (x = 0; x < width && x < bitmap->width; x++)
+                         line[x] = src[x] / radius;
+               }
+          }
+
+          for (x = 0, sum = 0; x < pitch; x++) {
+               if (x < width)
+                    sum += line[x];
+
+               if (x >= radius)
+                    sum -= line[x-radius];
+
+               dst[x] = sum;
+          }
+     }
+
+     /* Vertical pass. */
+     memset( columns, 0, pitch * sizeof(int) );
+
+     for (y = 0; y < height + radius; y++) {
+          u8 *dst = outline + y * pitch;
+
+          if (y < height) {
+               const u8 *row = rows + y * pitch;
+
+               for (x = 0; x < pitch; x++)
+                    columns[x] += row[x];
+          }
+
+          if (y >= radius) {
+               const u8 *row = rows + (y - radius) * pitch;
+
+               for (x = 0; x < pitch; x++)
+                    columns[x] -= row[x];
+          }
+
+          for (x = 0; x < pitch; x++)
+               dst[x] = (columns[x] < 255) ? columns[x] : 255;
+     }
+
+     D_FREE( columns );
+
+     return DFB_OK;
+}
+
 static DFBResult
 render_glyph( CoreFont      *thiz,
               unsigned int   index,
@@ -276,28 +484,29 @@ render_glyph( CoreFont      *thiz,
      FT_Int                 load_flags;
      int                    y;
      u8                    *src;
+     FontConvertFunc        convert = NULL;
      FT2ImplData           *data    = thiz->impl_data;
      CoreSurface           *surface = info->surface;
      CoreSurfaceBufferLock  lock;
 
-     direct_mutex_lock( &library_mutex );
+     /* The face is locked until the rendered glyph in its glyph slot has been copied. */
+     direct_mutex_lock( &data->shared->lock );
 
-     face = data->face;
+     activate_size( data );
 
-     load_flags = (long) face->generic.data;
-     load_flags |= FT_LOAD_RENDER;
+     face       = data->face;
+     load_flags = data->load_flags | FT_LOAD_RENDER;
 
      if ((err = FT_Load_Glyph( face, index, load_flags ))) {
           D_DEBUG_AT( Font_FT2, "Could not load glyph for character index #%u!\n", index );
-          direct_mutex_unlock( &library_mutex );
+          direct_mutex_unlock( &data->shared->lock );
           return DFB_FAILURE;
      }
 
-     direct_mutex_unlock( &library_mutex );
-
      ret = dfb_surface_lock_buffer( surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret) {
           D_DERROR( ret, "Font/FT2: Unable to lock surface!\n" );
+          direct_mutex_unlock( &data->shared->lock );
           return ret;
      }
 
@@ -313,39 +522,22 @@ render_glyph( CoreFont      *thiz,
      info->top  = -face->glyph->bitmap_top  - thiz->ascender * thiz->up_unit_y;
 
      if (info->layer == 1 && info->width > 0 && info->height > 0) {
-          int   xoffset, yoffset;
-          void *blurred = NULL;
-          int   radius  = data->outline_radius;
+          u8  *blurred = NULL;
+          int  radius  = data->outline_radius;
 
           switch (face->glyph->bitmap.pixel_mode) {
                case ft_pixel_mode_grays:
-                    blurred = D_CALLOC( 1, (info->width + radius) * (info->height + radius) );
-                    if (blurred) {
-                         for (yoffset = 0; yoffset < radius; yoffset++) {
-                              for (xoffset = 0; xoffset < radius; xoffset++) {
-                                   src = face->glyph->bitmap.buffer;
-
-                                   for (y = 0; y < info->height; y++) {
-                                        int  i;
-                                        u8  *dst8 = blurred + xoffset + (y + yoffset) * (info->width + radius);
-
-                                        for (i = 0; i < info->width; i++) {
-                                             int val = dst8[i] + src[i] / radius;
-
-                                             dst8[i] = (val < 255) ? val : 255;
-                                        }
-
-                                        src += face->glyph->bitmap.pitch;
-                                   }
-                              }
-                         }
-                    }
-                    else
+               case ft_pixel_mode_mono:
+                    blurred = D_MALLOC( (info->width + radius) * (info->height + radius) );
+                    if (!blurred) {
                          D_OOM();
-                    break;
+                         break;
+                    }
 
-               case ft_pixel_mode_mono:
-                    D_UNIMPLEMENTED();
+                    if (outline_glyph( &face->glyph->bitmap, info->width, info->height, radius, blurred )) {
+                         D_FREE( blurred );
+                         blurred = NULL;
+                    }
                     break;
 
                default:
@@ -362,8 +554,9 @@ render_glyph( CoreFont      *thiz,
                lock.addr += DFB_BYTES_PER_LINE( surface->config.format, info->start );
 
                for (y = 0; y < info->height; y++) {
-                    int  i;
+                    int  i, j, n;
                     u8  *dst8  = lock.addr;
+                    u16 *dst16 = lock.addr;
                     u32 *dst32 = lock.addr;
 
                     switch (face->glyph->bitmap.pixel_mode) {
@@ -391,8 +584,56 @@ render_glyph( CoreFont      *thiz,
                               }
                               break;
 
+                         /* The outline of a monochrome glyph is set wherever it covers any pixel. */
                          case ft_pixel_mode_mono:
-                              D_UNIMPLEMENTED();
+                              switch (surface->config.format) {
+                                   case DSPF_ARGB:
+                                   case DSPF_ABGR:
+                                        if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
+                                             for (i = 0; i < info->width; i++)
+                                                  dst32[i] = src[i] ? 0xFFFFFFFF : 0x00000000;
+                                        }
+                                        else {
+                                             for (i = 0; i < info->width; i++)
+                                                  dst32[i] = ((src[i] ? 0xFF : 0x00) << 24) | 0xFFFFFF;
+                                        }
+                                        break;
+                                   case DSPF_ARGB1555:
+                                        for (i = 0; i < info->width; i++)
+                                             dst16[i] = ((src[i] ? 0x1 : 0x0) << 15) | 0x7FFF;
+                                        break;
+                                   case DSPF_RGBA5551:
+                                        for (i = 0; i < info->width; i++)
+                                             dst16[i] = (src[i] ? 0x1 : 0x0) | 0xFFFE;
+                                        break;
+                                   case DSPF_A8:
+                                        for (i = 0; i < info->width; i++)
+                                             dst8[i] = src[i] ? 0xFF : 0x00;
+                                        break;
+                                   case DSPF_A1:
+                                        for (i = 0, j = 0; i < info->width; ++j) {
+                                             u8 p = 0;
+
+                                             for (n = 0; n < 8 && i < info->width; ++i, ++n)
+                                                  p |= (src[i] ? 0x80 : 0x00) >> n;
+
+                                             dst8[j] = p;
+                                        }
+                                        break;
+                                   case DSPF_A1_LSB:
+                                        for (i = 0, j = 0; i < info->width; ++j) {
+                                             u8 p = 0;
+
+                                             for (n = 0; n < 8 && i < info->width; ++i, ++n)
+                                                  p |= (src[i] ? 0x01 : 0x00) << n;
+
+                                             dst8[j] = p;
+                                        }
+                                        break;
+                                   default:
+                                        D_UNIMPLEMENTED();
+                                        break;
+                              }
                               break;
 
                          default:
@@ -419,253 +660,191 @@ render_glyph( CoreFont      *thiz,
                     info->width = data->fixed_advance;
           }
 
-          src = face->glyph->bitmap.buffer;
+          switch (face->glyph->bitmap.pixel_mode) {
+               case ft_pixel_mode_grays:
+               case ft_pixel_mode_mono:
+                    convert = font_convert_func( surface->config.format, thiz->surface_caps & DSCAPS_PREMULTIPLIED,
+                                                 face->glyph->bitmap.pixel_mode == ft_pixel_mode_mono );
+                    if (!convert)
+                         D_UNIMPLEMENTED();
+                    break;
 
-          lock.addr += DFB_BYTES_PER_LINE( surface->config.format, info->start );
+               default:
+                    break;
+          }
 
-          for (y = 0; y < info->height; y++) {
-               int  i, j, n;
-               u8  *dst8  = lock.addr;
-               u16 *dst16 = lock.addr;
-               u32 *dst32 = lock.addr;
+          if (convert) {
+               src = face->glyph->bitmap.buffer;
 
-               switch (face->glyph->bitmap.pixel_mode) {
-                    case ft_pixel_mode_grays:
-                         switch (surface->config.format) {
-                              case DSPF_ARGB:
-                              case DSPF_ABGR:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = src[i] * 0x01010101;
-                                   }
-                                   else
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = (src[i] << 24) | 0xFFFFFF;
-                                   break;
-                              case DSPF_AiRGB:
-                                   for (i = 0; i < info->width; i++)
-                                        dst32[i] = ((src[i] ^ 0xFF) << 24) | 0xFFFFFF;
-                                   break;
-                              case DSPF_ARGB8565:
-                                   for (i = 0, j = -1; i < info->width; ++i) {
-                                       u32 d;
-
-                                       if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                            d = src[i] * 0x01010101;
-                                            d = ((d & 0xFF000000) >> 8) |
-                                                ((d & 0x00F80000) >> 8) |
-                                                ((d & 0x0000FC00) >> 5) |
-                                                ((d & 0x000000F8) >> 3);
-                                       }
-                                       else
-                                            d = (src[i] << 16) | 0xFFFF;
-#ifdef WORDS_BIGENDIAN
-                                        dst8[++j] = (d >> 16) & 0xFF;
-                                        dst8[++j] = (d >>  8) & 0xFF;
-                                        dst8[++j] = (d >>  0) & 0xFF;
-#else
-                                        dst8[++j] = (d >>  0) & 0xFF;
-                                        dst8[++j] = (d >>  8) & 0xFF;
-                                        dst8[++j] = (d >> 16) & 0xFF;
-#endif
-                                   }
-                                   break;
-                              case DSPF_ARGB4444:
-                              case DSPF_RGBA4444:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++)
-                                             dst16[i] = (src[i] >> 4) * 0x1111;
-                                   }
-                                   else {
-                                        if (surface->config.format == DSPF_ARGB4444) {
-                                             for (i = 0; i < info->width; i++)
-                                                  dst16[i] = (src[i] << 8) | 0x0FFF;
-                                        }
-                                        else {
-                                             for (i = 0; i < info->width; i++)
-                                                  dst16[i] = (src[i] >> 4) | 0xFFF0;
-                                        }
-                                   }
-                                   break;
-                              case DSPF_ARGB2554:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = (src[i] << 8) | 0x3FFF;
-                                   break;
-                              case DSPF_ARGB1555:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++) {
-                                             unsigned short x = src[i] >> 3;
-                                             dst16[i] = ((src[i] & 0x80) << 8) | (x << 10) | (x << 5) | x;
-                                        }
-                                   }
-                                   else {
-                                        for (i = 0; i < info->width; i++)
-                                             dst16[i] = (src[i] << 8) | 0x7FFF;
-                                   }
-                                   break;
-                              case DSPF_RGBA5551:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++) {
-                                             unsigned short x = src[i] >> 3;
-                                             dst16[i] = (x << 11) | (x << 6) | (x << 1) | (src[i] >> 7);
-                                        }
-                                   }
-                                   else {
-                                        for (i = 0; i < info->width; i++)
-                                             dst16[i] = 0xFFFE | (src[i] >> 7);
-                                   }
-                                   break;
-                              case DSPF_A8:
-                                   direct_memcpy( lock.addr, src, info->width );
-                                   break;
-                              case DSPF_A4:
-                                   for (i = 0, j = 0; i < info->width; i += 2, j++)
-                                        dst8[j] = (src[i] & 0xF0) | (src[i+1] >> 4);
-                                   break;
-                              case DSPF_A1:
-                                   for (i = 0, j = 0; i < info->width; ++j) {
-                                        u8 p = 0;
-
-                                        for (n = 0; n < 8 && i < info->width; ++i, ++n)
-                                             p |= (src[i] & 0x80) >> n;
-
-                                        dst8[j] = p;
-                                   }
-                                   break;
-                              case DSPF_A1_LSB:
-                                   for (i = 0, j = 0; i < info->width; ++j) {
-                                        u8 p = 0;
-
-                                        for (n = 0; n < 8 && i < info->width; ++i, ++n)
-                                             p |= (src[i] & 0x80) >> (7-n);
-
-                                        dst8[j] = p;
-                                   }
-                                   break;
-                              case DSPF_LUT2:
-                                   for (i = 0, j = 0; i < info->width; ++j) {
-                                        u8 p = 0;
-
-                                        for (n = 0; n < 8 && i < info->width; ++i, n += 2)
-                                             p |= (src[i] & 0xC0) >> n;
-
-                                        dst8[j] = p;
-                                   }
-                                   break;
-                              default:
-                                   D_UNIMPLEMENTED();
-                                   break;
-                         }
-                         break;
+               lock.addr += DFB_BYTES_PER_LINE( surface->config.format, info->start );
 
-                    case ft_pixel_mode_mono:
-                         switch (surface->config.format) {
-                              case DSPF_ARGB:
-                              case DSPF_ABGR:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = (src[i>>3] & (1 << (7 - (i % 8)))) ? 0xFFFFFFFF : 0x00000000;
-                                   }
-                                   else {
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0xFF : 0x00) << 24) |
-                                                        0xFFFFFF;
-                                   }
-                                   break;
-                              case DSPF_AiRGB:
-                                   if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = (src[i>>3] & (1 << (7 - (i % 8)))) ? 0x00FFFFFF : 0xFF000000;
-                                   }
-                                   else {
-                                        for (i = 0; i < info->width; i++)
-                                             dst32[i] = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0x00 : 0xFF) << 24) |
-                                                        0xFFFFFF;
-                                   }
-                                   break;
-                              case DSPF_ARGB8565:
-                                   for (i = 0, j = -1; i < info->width; ++i) {
-                                        u32 d;
+               for (y = 0; y < info->height; y++) {
+                    convert( src, lock.addr, info->width );
 
-                                        if (thiz->surface_caps & DSCAPS_PREMULTIPLIED) {
-                                             d = (src[i>>3] & (1 << (7 - (i % 8)))) ? 0xFFFFFF : 0x000000;
-                                        }
-                                        else
-                                             d = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0xFF : 0x00) << 16) | 0xFFFF;
-#ifdef WORDS_BIGENDIAN
-                                        dst8[++j] = (d >> 16) & 0xFF;
-                                        dst8[++j] = (d >>  8) & 0xFF;
-                                        dst8[++j] = (d >>  0) & 0xFF;
-#else
-                                        dst8[++j] = (d >>  0) & 0xFF;
-                                        dst8[++j] = (d >>  8) & 0xFF;
-                                        dst8[++j] = (d >> 16) & 0xFF;
-#endif
-                                   }
-                                   break;
-                              case DSPF_ARGB4444:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0xF : 0x0) << 12) | 0xFFF;
-                                   break;
-                              case DSPF_RGBA4444:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = ((src[i>>3] & (1 << (7 - (i % 8)))) ? 0xF : 0x0) | 0xFFF0;
-                                   break;
-                              case DSPF_ARGB2554:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0x3 : 0x0) << 14) | 0x3FFF;
-                                   break;
-                              case DSPF_ARGB1555:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = (((src[i>>3] & (1 << (7 - (i % 8)))) ? 0x1 : 0x0) << 15) | 0x7FFF;
-                                   break;
-                              case DSPF_RGBA5551:
-                                   for (i = 0; i < info->width; i++)
-                                        dst16[i] = ((src[i>>3] & (1 << (7 - (i % 8)))) ? 0x1 : 0x0) | 0xFFFE;
-                                   break;
-                              case DSPF_A8:
-                                   for (i = 0; i < info->width; i++)
-                                        dst8[i] = (src[i>>3] & (1 << (7 - (i % 8)))) ? 0xFF : 0x00;
-                                   break;
-                              case DSPF_A4:
-                                   for (i = 0, j = 0; i < info->width; i += 2, j++)
-                                        dst8[j] = ((src[i>>3] & (1 << (7 - (i % 8)))) ? 0xF0 : 0x00) |
-                                                  ((src[(i+1)>>3] & (1 << (7 - ((i + 1) % 8)))) ? 0x0F : 0x00);
-                                   break;
-                              case DSPF_A1:
-                                   direct_memcpy( lock.addr, src, DFB_BYTES_PER_LINE( DSPF_A1, info->width ) );
-                                   break;
-                              case DSPF_A1_LSB:
-                                   for (i = 0, j = 0; i < info->width; ++j) {
-                                        u8 p = 0;
-
-                                        for (n = 0; n < 8 && i < info->width; ++i, ++n)
-                                             p |= (((src[i] >> n) & 1) << (7 - n));
-
-                                        dst8[j] = p;
-                                   }
-                                   break;
-                              default:
-                                   D_UNIMPLEMENTED();
-                                   break;
-                         }
-                         break;
+                    src += face->glyph->bitmap.pitch;
+                    lock.addr += lock.pitch;
+               }
+          }
+     }
 
-                    default:
-                         break;
+     dfb_surface_unlock_buffer( surface, &lock );
 
-               }
+     direct_mutex_unlock( &data->shared->lock );
+
+     return DFB_OK;
+}
 
-               src += face->glyph->bitmap.pitch;
-               lock.addr += lock.pitch;
+static KerningCacheEntry *
+kerning_cache_entry( FT2ImplKerningData *data,
+                     unsigned int        prev,
+                     unsigned int        current )
+{
+     KerningCacheEntry *entry;
+     unsigned int       hash = (prev * 0x9E3779B1) ^ (current * 0x85EBCA6B);
+
+     /* Linear probing, returns the entry of the pair or the empty entry where to add it. */
+     for (hash ^= hash >> 15;; hash++) {
+          entry = &data->kerning[hash & (data->size - 1)];
+
+          if (entry->prev == KERNING_CACHE_EMPTY || (entry->prev == prev && entry->current == current))
+               return entry;
+     }
+}
+
+static DFBResult
+kerning_cache_add( FT2ImplKerningData *data,
+                   unsigned int        prev,
+                   unsigned int        current,
+                   int                 x,
+                   int                 y )
+{
+     KerningCacheEntry *entry;
+
+     /* Keep the table at most three quarters full. */
+     if ((data->count + 1) * 4 > data->size * 3) {
+          unsigned int       i;
+          KerningCacheEntry *kerning = data->kerning;
+          unsigned int       size    = data->size;
+
+          data->size    = size ? size * 2 : 256;
+          data->kerning = D_MALLOC( data->size * sizeof(KerningCacheEntry) );
+          if (!data->kerning) {
+               data->kerning = kerning;
+               data->size    = size;
+               return D_OOM();
+          }
+
+          memset( data->kerning, 0xFF, data->size * sizeof(KerningCacheEntry) );
+
+          for (i = 0; i < size; i++) {
+               if (kerning[i].prev != KERNING_CACHE_EMPTY)
+                    *kerning_cache_entry( data, kerning[i].prev, kerning[i].current ) = kerning[i];
           }
+
+          if (kerning)
+               D_FREE( kerning );
      }
 
-     dfb_surface_unlock_buffer( surface, &lock );
+     entry = kerning_cache_entry( data, prev, current );
+
+     if (entry->prev == KERNING_CACHE_EMPTY)
+          data->count++;
+
+     entry->prev    = prev;
+     entry->current = current;
+     entry->x       = x;
+     entry->y       = y;
 
      return DFB_OK;
 }
 
+/*
+ * Fill the kerning cache with the pairs of the format 0 subtables of the 'kern' table, which are the only ones
+ * FT_Get_Kerning() uses for TrueType and OpenType fonts, so that any other pair can be known to have no kerning.
+ * The face must be locked.
+ */
+static void
+kerning_cache_load( FT2ImplKerningData *data,
+                    CoreFont           *font )
+{
+     FT_Error      err;
+     FT_ULong      length = 0;
+     FT_Byte      *table;
+     FT_Byte      *p, *end;
+     unsigned int  i, num_tables, num_pairs;
+
+     if (!FT_IS_SFNT( data->base.face ))
+          return;
+
+     activate_size( &data->base );
+
+     err = FT_Load_Sfnt_Table( data->base.face, TTAG_kern, 0, NULL, &length );
+     if (err || length < 4)
+          return;
+
+     table = D_MALLOC( length );
+     if (!table) {
+          D_OOM();
+          return;
+     }
+
+     err = FT_Load_Sfnt_Table( data->base.face, TTAG_kern, 0, table, &length );
+     if (err)
+          goto out;
+
+     end = table + length;
+
+     /* Only version 0 tables (not the Apple ones) are parsed. */
+     if (table[0] || table[1])
+          goto out;
+
+     num_tables = (table[2] << 8) | table[3];
+
+     for (p = table + 4; num_tables--; ) {
+          FT_Byte      *next;
+          unsigned int  coverage;
+
+          if (end - p < 6)
+               goto out;
+
+          next     = p + ((p[2] << 8) | p[3]);
+          coverage = (p[4] << 8) | p[5];
+
+          if (next <= p || next > end)
+               next = end;
+
+          /* Horizontal format 0 subtable. */
+          if ((coverage & 0xFF07) == 0x0001 && end - p >= 14) {
+               num_pairs = (p[6] << 8) | p[7];
+
+               for (i = 0, p += 14; i < num_pairs && end - p >= 6; i++, p += 6) {
+                    FT_Vector    vector;
+                    unsigned int prev    = (p[0] << 8) | p[1];
+                    unsigned int current = (p[2] << 8) | p[3];
+
+                    FT_Get_Kerning( data->base.face, prev, current, ft_kerning_default, &vector );
+
+                    if (vector.x || vector.y) {
+                         if (kerning_cache_add( data, prev, current,
+                                                (int) (-vector.x * font->up_unit_y + vector.y * font->up_unit_x) >> 6,
+                                                (int) ( vector.y * font->up_unit_y + vector.x * font->up_unit_x) >> 6 ))
+                              goto out;
+                    }
+               }
+          }
+
+          p = next;
+     }
+
+     data->complete = true;
+
+out:
+     D_DEBUG_AT( Font_FT2, "  -> kerning cache %s with %u pairs, %zu bytes\n", data->complete ? "loaded" : "started",
+                 data->count, data->size * sizeof(KerningCacheEntry) );
+
+     D_FREE( table );
+}
+
 static DFBResult
 get_kerning( CoreFont     *thiz,
              unsigned int  prev,
@@ -674,52 +853,53 @@ get_kerning( CoreFont     *thiz,
              int          *kern_y )
 {
      FT_Vector           vector;
-     KerningCacheEntry  *cache;
+     KerningCacheEntry  *entry;
+     int                 x    = 0;
+     int                 y    = 0;
      FT2ImplKerningData *data = thiz->impl_data;
 
      D_ASSUME( kern_x != NULL || kern_y != NULL );
 
-     /* Use cached values if characters are in the cachable range and the cache entry is already filled. */
-     if (prev    >= KERNING_CACHE_MIN && prev    <= KERNING_CACHE_MAX &&
-         current >= KERNING_CACHE_MIN && current <= KERNING_CACHE_MAX) {
-          cache = &data->kerning[prev-KERNING_CACHE_MIN][current-KERNING_CACHE_MIN];
+     if (data->complete) {
+          /* The table does not change anymore, pairs not found have no kerning. */
+          if (data->count) {
+               entry = kerning_cache_entry( data, prev, current );
+               if (entry->prev != KERNING_CACHE_EMPTY) {
+                    x = entry->x;
+                    y = entry->y;
+               }
+          }
+     }
+     else {
+          direct_mutex_lock( &data->base.shared->lock );
 
-          if (!cache->initialised && FT_HAS_KERNING( data->base.face )) {
-               direct_mutex_lock( &library_mutex );
+          entry = data->count ? kerning_cache_entry( data, prev, current ) : NULL;
+          if (entry && entry->prev != KERNING_CACHE_EMPTY) {
+               x = entry->x;
+               y = entry->y;
+          }
+          else {
+               activate_size( &data->base );
 
                /* Lookup kerning values for the character pair. */
                FT_Get_Kerning( data->base.face, prev, current, ft_kerning_default, &vector );
 
-               direct_mutex_unlock( &library_mutex );
+               /* Convert to integer. */
+               x = (int) (-vector.x * thiz->up_unit_y + vector.y * thiz->up_unit_x) >> 6;
+               y = (int) ( vector.y * thiz->up_unit_y + vector.x * thiz->up_unit_x) >> 6;
 
                /* Fill cache. */
-               cache->x           = (int) (-vector.x * data->base.up_unit_x + vector.y * data->base.up_unit_x) >> 6;
-               cache->y           = (int) ( vector.y * data->base.up_unit_y + vector.x * data->base.up_unit_x) >> 6;
-               cache->initialised = true;
+               kerning_cache_add( data, prev, current, x, y );
           }
 
-          if (kern_x)
-               *kern_x = cache->x;
-
-          if (kern_y)
-               *kern_y = cache->y;
-
-          return DFB_OK;
+          direct_mutex_unlock( &data->base.shared->lock );
      }
 
-     direct_mutex_lock( &library_mutex );
-
-     /* Lookup kerning values for the character pair. */
-     FT_Get_Kerning( data->base.face, prev, current, ft_kerning_default, &vector );
-
-     direct_mutex_unlock( &library_mutex );
-
-     /* Convert to integer. */
      if (kern_x)
-          *kern_x = (int) (-vector.x * thiz->up_unit_y + vector.y * thiz->up_unit_x) >> 6;
+          *kern_x = x;
 
      if (kern_y)
-          *kern_y = (int) ( vector.y * thiz->up_unit_y + vector.x * thiz->up_unit_x) >> 6;
+          *kern_y = y;
 
      return DFB_OK;
 }
@@ -764,20 +944,151 @@ release_freetype()
      direct_mutex_unlock( &library_mutex );
 }
 
+/*
+ * Get the face of a font file, shared with the other fonts using the same file and face index, or a face of its own
+ * if the font is not loaded from a file.
+ */
+static FT_Error
+open_face( IDirectFBFont_ProbeContext  *ctx,
+           FT_Long                      index,
+           FT2Face                    **ret_face )
+{
+     FT_Error  err;
+     FT2Face  *face;
+     FontFile *file = NULL;
+
+     /* Use the shared mapping of the font file, the face outlives the content of the font being created. */
+     if (ctx->filename)
+          file = font_file_open( ctx->filename );
+
+     direct_mutex_lock( &library_mutex );
+
+     if (file) {
+          direct_list_foreach (face, faces) {
+               if (face->file == file && face->index == index) {
+                    D_DEBUG_AT( Font_FT2, "  -> sharing face %ld of '%s' with %d fonts\n",
+                                index, ctx->filename, face->ref );
+
+                    face->ref++;
+
+                    direct_mutex_unlock( &library_mutex );
+
+                    /* The face holds its own reference on the mapping. */
+                    font_file_close( file );
+
+                    *ret_face = face;
+
+                    return 0;
+               }
+          }
+     }
+
+     face = D_CALLOC( 1, sizeof(FT2Face) );
+     if (!face) {
+          D_OOM();
+          err = FT_Err_Out_Of_Memory;
+          goto error;
+     }
+
+     if (file)
+          err = FT_New_Memory_Face( library, file->map, file->map_size, index, &face->face );
+     else
+          err = FT_New_Memory_Face( library, ctx->content, ctx->content_size, index, &face->face );
+
+     if (err)
+          goto error;
+
+     face->ref   = 1;
+     face->index = index;
+
+     if (file) {
+          face->file = file;
+
+          direct_list_append( &faces, &face->link );
+     }
+
+     direct_mutex_init( &face->lock );
+
+     direct_mutex_unlock( &library_mutex );
+
+     *ret_face = face;
+
+     return 0;
+
+error:
+     if (face)
+          D_FREE( face );
+
+     direct_mutex_unlock( &library_mutex );
+
+     if (file)
+          font_file_close( file );
+
+     return err;
+}
+
+static void
+close_face( FT2Face *face )
+{
+     FontFile *file = NULL;
+
+     direct_mutex_lock( &library_mutex );
+
+     if (--face->ref == 0) {
+          FT_Done_Face( face->face );
+
+          if (face->file) {
+               direct_list_remove( &faces, &face->link );
+
+               file = face->file;
+          }
+
+          direct_mutex_deinit( &face->lock );
+
+          D_FREE( face );
+     }
+
+     direct_mutex_unlock( &library_mutex );
+
+     if (file)
+          font_file_close( file );
+}
+
 /**********************************************************************************************************************/
 
 static void
 IDirectFBFont_FT2_Destruct( IDirectFBFont *thiz )
 {
-     FT2ImplData *data = ((IDirectFBFont_data*) thiz->priv)->font->impl_data;
+     int          i;
+     CoreFont    *font = ((IDirectFBFont_data*) thiz->priv)->font;
+     FT2ImplData *data = font->impl_data;
 
      D_DEBUG_AT( Font_FT2, "%s( %p )\n", __FUNCTION__, thiz );
 
-     direct_mutex_lock( &library_mutex );
+     font_preload_stop( font );
 
-     FT_Done_Face( data->face );
+     direct_mutex_lock( &data->shared->lock );
 
-     direct_mutex_unlock( &library_mutex );
+     if (data->shared->active == data)
+          data->shared->active = NULL;
+
+     FT_Done_Size( data->size );
+
+     direct_mutex_unlock( &data->shared->lock );
+
+     close_face( data->shared );
+
+     if (data->pages) {
+          for (i = 0; i < CHAR_PAGES; i++) {
+               if (data->pages[i])
+                    D_FREE( data->pages[i] );
+          }
+
+          D_FREE( data->pages );
+     }
+
+     if (font->GetKerning && ((FT2ImplKerningData*) data)->kerning)
+          D_FREE( ((FT2ImplKerningData*) data)->kerning );
 
      D_FREE( data );
 
@@ -836,7 +1147,11 @@ Construct( IDirectFBFont              *thiz,
      DFBResult    ret;
      int          i;
      FT_Error     err;
+     FT2Face     *shared     = NULL;
      FT_Face      face       = NULL;
+     FT_Size      size       = NULL;
+     FT_Matrix    matrix;
+     bool         transform  = false;
      FT_Int       load_flags = FT_LOAD_DEFAULT;
      FT_ULong     mask       = 0;
      float        sin_rot    = 0.0;
@@ -867,14 +1182,8 @@ Construct( IDirectFBFont              *thiz,
           return ret;
      }
 
-     /* Open the font loaded into memory. */
-     direct_mutex_lock( &library_mutex );
-
-     err = FT_New_Memory_Face( library, ctx->content, ctx->content_size, (desc->flags & DFDESC_INDEX) ? desc->index : 0,
-                               &face );
-
-     direct_mutex_unlock( &library_mutex );
-
+     /* Open the face of the font file, or the font loaded into memory. */
+     err = open_face( ctx, (desc->flags & DFDESC_INDEX) ? desc->index : 0, &shared );
      if (err) {
           switch (err) {
                case FT_Err_Unknown_File_Format:
@@ -888,6 +1197,8 @@ Construct( IDirectFBFont              *thiz,
           goto error;
      }
 
+     face = shared->face;
+
      if ((desc->flags & DFDESC_ROTATION) && desc->rotation) {
           if (!FT_IS_SCALABLE( face )) {
                D_ERROR( "Font/FT2: Face %u is not scalable so cannot be rotated!\n",
@@ -904,18 +1215,12 @@ Construct( IDirectFBFont              *thiz,
           int sin_rot_fx = sin_rot * 65536;
           int cos_rot_fx = cos_rot * 65536;
 
-          FT_Matrix matrix;
-
           matrix.xx =  cos_rot_fx;
           matrix.xy = -sin_rot_fx;
           matrix.yx =  sin_rot_fx;
           matrix.yy =  cos_rot_fx;
 
-          direct_mutex_lock( &library_mutex );
-
-          FT_Set_Transform( face, &matrix, NULL );
-
-          direct_mutex_unlock( &library_mutex );
+          transform = true;
      }
 
      if (desc->flags & DFDESC_ATTRIBUTES) {
@@ -938,37 +1243,29 @@ Construct( IDirectFBFont              *thiz,
          ((desc->flags & DFDESC_ATTRIBUTES) && (desc->attributes & DFFA_MONOCHROME)))
           load_flags |= FT_LOAD_TARGET_MONO;
 
-     if (!((desc->flags & DFDESC_ATTRIBUTES) && (desc->attributes & DFFA_NOCHARMAP))) {
-          direct_mutex_lock( &library_mutex );
+     /* The charmap selection is the same for all fonts sharing the face. */
+     direct_mutex_lock( &shared->lock );
 
+     if (!((desc->flags & DFDESC_ATTRIBUTES) && (desc->attributes & DFFA_NOCHARMAP))) {
           err = FT_Select_Charmap( face, ft_encoding_unicode );
 
-          direct_mutex_unlock( &library_mutex );
-
           if (err) {
                D_DEBUG_AT( Font_FT2, "  -> couldn't select Unicode encoding, falling back to Latin1\n" );
 
-               direct_mutex_lock( &library_mutex );
-
                err = FT_Select_Charmap( face, ft_encoding_latin_1 );
-
-               direct_mutex_unlock( &library_mutex );
           }
 
           if (err) {
                D_DEBUG_AT( Font_FT2, "  -> couldn't select Unicode/Latin1 encoding, trying Symbol\n" );
 
-               direct_mutex_lock( &library_mutex );
-
                err = FT_Select_Charmap( face, ft_encoding_symbol );
 
-               direct_mutex_unlock( &library_mutex );
-
                if (!err) {
                     mask = 0xF000;
                }
                else {
                     D_ERROR( "Font/FT2: Could not select charmap!\n" );
+                    direct_mutex_unlock( &shared->lock );
                     ret = DFB_FAILURE;
                     goto error;
                }
@@ -985,11 +1282,15 @@ Construct( IDirectFBFont              *thiz,
      else if (desc->flags & DFDESC_WIDTH)
           fw = desc->width << 6;
 
-     direct_mutex_lock( &library_mutex );
+     /* Create the size object of the font, the size active on the face now belongs to no font. */
+     err = FT_New_Size( face, &size );
+     if (!err) {
+          FT_Activate_Size( size );
 
-     err = FT_Set_Char_Size( face, fw, fh, 0, 0 );
+          shared->active = NULL;
 
-     direct_mutex_unlock( &library_mutex );
+          err = FT_Set_Char_Size( face, fw, fh, 0, 0 );
+     }
 
      if (err) {
           D_ERROR( "Font/FT2: Could not set pixel size to %dx%d!\n",
@@ -997,12 +1298,12 @@ Construct( IDirectFBFont              *thiz,
                    desc->flags & DFDESC_WIDTH        ? desc->width        : 0,
                    desc->flags & DFDESC_FRACT_HEIGHT ? desc->fract_height :
                    desc->flags & DFDESC_HEIGHT       ? desc->height       : 0 );
+          direct_mutex_unlock( &shared->lock );
           ret = DFB_FAILURE;
           goto error;
      }
 
-     face->generic.data      = (void*)(long) load_flags;
-     face->generic.finalizer = NULL;
+     direct_mutex_unlock( &shared->lock );
 
      /* Create the font object. */
      ret = dfb_font_create( core, desc, &font );
@@ -1027,10 +1328,10 @@ Construct( IDirectFBFont              *thiz,
                font->pixel_format == DSPF_A1_LSB   ||
                font->pixel_format == DSPF_LUT2 );
 
-     font->ascender   = face->size->metrics.ascender >> 6;
-     font->descender  = face->size->metrics.descender >> 6;
+     font->ascender   = size->metrics.ascender >> 6;
+     font->descender  = size->metrics.descender >> 6;
      font->height     = font->ascender - font->descender + 1;
-     font->maxadvance = face->size->metrics.max_advance >> 6;
+     font->maxadvance = size->metrics.max_advance >> 6;
      font->up_unit_x  = -sin_rot;
      font->up_unit_y  = -cos_rot;
      font->flags      = CFF_SUBPIXEL_ADVANCE;
@@ -1056,9 +1357,16 @@ Construct( IDirectFBFont              *thiz,
           goto error;
      }
 
+     data->shared          = shared;
      data->face            = face;
+     data->size            = size;
+     data->load_flags      = load_flags;
+     data->transform       = transform;
      data->disable_charmap = font->attributes & DFFA_NOCHARMAP;
 
+     if (transform)
+          data->matrix = matrix;
+
      if (desc->flags & DFDESC_FIXEDADVANCE) {
           data->fixed_advance = desc->fixed_advance;
           font->maxadvance    = desc->fixed_advance;
@@ -1067,9 +1375,13 @@ Construct( IDirectFBFont              *thiz,
                data->fixed_clip = true;
      }
 
+     direct_mutex_lock( &shared->lock );
+
      for (i = 0; i < 256; i++)
           data->indices[i] = FT_Get_Char_Index( face, i | mask );
 
+     direct_mutex_unlock( &shared->lock );
+
      if (font->attributes & DFFA_OUTLINED) {
           if (desc->flags & DFDESC_OUTLINE_WIDTH)
                data->outline_radius = 1 + (desc->outline_width >> 16) * 2;
@@ -1085,6 +1397,14 @@ Construct( IDirectFBFont              *thiz,
      data->up_unit_x = font->up_unit_x;
      data->up_unit_y = font->up_unit_y;
 
+     if (font->GetKerning) {
+          direct_mutex_lock( &shared->lock );
+
+          kerning_cache_load( (FT2ImplKerningData*) data, font );
+
+          direct_mutex_unlock( &shared->lock );
+     }
+
      font->impl_data = data;
 
      ret = dfb_font_register_encoding( font, "UTF8",   &ft2UTF8Funcs,   DTEID_UTF8 );
@@ -1099,20 +1419,35 @@ Construct( IDirectFBFont              *thiz,
 
      thiz->Release = IDirectFBFont_FT2_Release;
 
+     font_preload_start( font );
+
      return DFB_OK;
 
 error:
      if (font) {
-          if (data)
+          if (data) {
+               if (font->GetKerning && ((FT2ImplKerningData*) data)->kerning)
+                    D_FREE( ((FT2ImplKerningData*) data)->kerning );
+
                D_FREE( data );
+          }
 
           dfb_font_destroy( font );
      }
 
-     if (face) {
-          direct_mutex_lock( &library_mutex );
-          FT_Done_Face( face );
-          direct_mutex_unlock( &library_mutex );
+     if (shared) {
+          if (size) {
+               direct_mutex_lock( &shared->lock );
+
+               if (shared->active == data)
+                    shared->active = NULL;
+
+               FT_Done_Size( size );
+
+               direct_mutex_unlock( &shared->lock );
+          }
+
+          close_face( shared );
      }
 
      release_freetype();
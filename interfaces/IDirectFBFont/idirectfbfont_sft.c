@@ -16,6 +16,7 @@
    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
 */
 
+#include <config.h>
 #include <core/fonts.h>
 #include <core/surface_buffer.h>
 #include <direct/memcpy.h>
@@ -23,6 +24,10 @@
 #include <media/idirectfbfont.h>
 #include <schrift.h>
 
+#include "font_convert.h"
+#include "font_file.h"
+#include "font_preload.h"
+
 D_DEBUG_DOMAIN( Font_Schrift, "Font/Schrift", "Schrift Font Provider" );
 
 static DFBResult Probe    ( IDirectFBFont_ProbeContext *ctx );
@@ -38,6 +43,13 @@ DIRECT_INTERFACE_IMPLEMENTATION( IDirectFBFont, Schrift )
 
 /**********************************************************************************************************************/
 
+typedef struct {
+     SFT        sft;                 /* first member, so that the implementation data is used as the SFT object */
+     FontFile  *file;                /* shared mapping of the font file, NULL if the font is not loaded from a file */
+} SFTImplData;
+
+/**********************************************************************************************************************/
+
 static DFBResult
 sftUTF8GetCharacterIndex( CoreFont     *thiz,
                           unsigned int  character,
@@ -124,19 +136,31 @@ render_glyph( CoreFont      *thiz,
      SFT_GMetrics           metrics;
      int                    y;
      u8                    *src;
+     FontConvertFunc        convert;
      SFT                   *sft     = thiz->impl_data;
      CoreSurface           *surface = info->surface;
      CoreSurfaceBufferLock  lock;
 
+     convert = font_convert_func( surface->config.format, thiz->surface_caps & DSCAPS_PREMULTIPLIED, false );
+     if (!convert) {
+          D_UNIMPLEMENTED();
+          return DFB_UNSUPPORTED;
+     }
+
+     /* The rasterizer has no row stride, so the glyph is rendered into a temporary image. */
      image.pixels = D_CALLOC( info->height, info->width );
      image.width  = info->width;
      image.height = info->height;
 
+     if (!image.pixels)
+          return D_OOM();
+
      sft_render( sft, index, image );
 
      ret = dfb_surface_lock_buffer( surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret) {
           D_DERROR( ret, "Font/Schrift: Unable to lock surface!\n" );
+          D_FREE( image.pixels );
           return ret;
      }
 
@@ -156,9 +180,9 @@ render_glyph( CoreFont      *thiz,
      lock.addr += DFB_BYTES_PER_LINE( surface->config.format, info->start );
 
      for (y = 0; y < info->height; y++) {
-          direct_memcpy( lock.addr, src, info->width );
+          convert( src, lock.addr, info->width );
 
-          src += info->width;
+          src += image.width;
           lock.addr += lock.pitch;
      }
 
@@ -174,13 +198,18 @@ render_glyph( CoreFont      *thiz,
 static void
 IDirectFBFont_Schrift_Destruct( IDirectFBFont *thiz )
 {
-     SFT *sft = ((IDirectFBFont_data*) thiz->priv)->font->impl_data;
+     SFTImplData *data = ((IDirectFBFont_data*) thiz->priv)->font->impl_data;
 
      D_DEBUG_AT( Font_Schrift, "%s( %p )\n", __FUNCTION__, thiz );
 
-     sft_freefont( sft->font );
+     font_preload_stop( ((IDirectFBFont_data*) thiz->priv)->font );
+
+     sft_freefont( data->sft.font );
 
-     D_FREE( sft );
+     if (data->file)
+          font_file_close( data->file );
+
+     D_FREE( data );
 
      IDirectFBFont_Destruct( thiz );
 }
@@ -222,7 +251,8 @@ Construct( IDirectFBFont              *thiz,
 {
      DFBResult     ret;
      SFT_LMetrics  metrics;
-     SFT          *sft  = NULL;
+     SFTImplData  *data = NULL;
+     SFT          *sft;
      CoreFont     *font = NULL;
 
      D_DEBUG_AT( Font_Schrift, "%s( %p )\n", __FUNCTION__, thiz );
@@ -237,13 +267,23 @@ Construct( IDirectFBFont              *thiz,
      D_DEBUG_AT( Font_Schrift, "  -> font at pixel height %d\n", desc->height );
 
      /* Open the file. */
-     sft = D_CALLOC( 1, sizeof(SFT) );
-     if (!sft) {
+     data = D_CALLOC( 1, sizeof(SFTImplData) );
+     if (!data) {
           ret = D_OOM();
           goto error;
      }
 
-     sft->font = sft_loadmem( ctx->content, ctx->content_size );
+     sft = &data->sft;
+
+     /* Use the shared mapping of the font file, held once for all the fonts created from it. */
+     if (ctx->filename)
+          data->file = font_file_open( ctx->filename );
+
+     if (data->file)
+          sft->font = sft_loadmem( data->file->map, data->file->map_size );
+     else
+          sft->font = sft_loadmem( ctx->content, ctx->content_size );
+
      if (!sft->font) {
           D_ERROR( "Font/Schrift: Failed to load font!\n" );
           ret = DFB_FAILURE;
@@ -274,7 +314,7 @@ Construct( IDirectFBFont              *thiz,
      font->GetGlyphData = get_glyph_info;
      font->RenderGlyph  = render_glyph;
 
-     font->impl_data = sft;
+     font->impl_data = data;
 
      ret = dfb_font_register_encoding( font, "UTF8", &sftUTF8Funcs, DTEID_UTF8 );
      if (ret)
@@ -284,14 +324,23 @@ Construct( IDirectFBFont              *thiz,
 
      thiz->Release = IDirectFBFont_Schrift_Release;
 
+     font_preload_start( font );
+
      return DFB_OK;
 
 error:
      if (font)
           dfb_font_destroy( font );
 
-     if (sft)
-          D_FREE( sft );
+     if (data) {
+          if (data->sft.font)
+               sft_freefont( data->sft.font );
+
+          if (data->file)
+               font_file_close( data->file );
+
+          D_FREE( data );
+     }
 
      return ret;
 }
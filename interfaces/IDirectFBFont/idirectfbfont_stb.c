@@ -16,6 +16,7 @@
    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
 */
 
+#include <config.h>
 #include <core/fonts.h>
 #include <core/surface_buffer.h>
 #include <direct/memcpy.h>
@@ -24,6 +25,10 @@
 #define  STB_TRUETYPE_IMPLEMENTATION
 #include <stb_truetype.h>
 
+#include "font_convert.h"
+#include "font_file.h"
+#include "font_preload.h"
+
 D_DEBUG_DOMAIN( Font_STB, "Font/STB", "STB Font Provider" );
 
 static DFBResult Probe    ( IDirectFBFont_ProbeContext *ctx );
@@ -39,17 +44,26 @@ DIRECT_INTERFACE_IMPLEMENTATION( IDirectFBFont, STB )
 
 /**********************************************************************************************************************/
 
+typedef struct {
+     stbtt_fontinfo  fontinfo;
+     float           scale;          /* glyph scale for the pixel height */
+     float           advance_scale;  /* advance scale for the em size */
+     FontFile       *file;           /* shared mapping of the font file, NULL if the font is not loaded from a file */
+} STBImplData;
+
+/**********************************************************************************************************************/
+
 static DFBResult
 stbUTF8GetCharacterIndex( CoreFont     *thiz,
                           unsigned int  character,
                           unsigned int *ret_index )
 {
-     stbtt_fontinfo *fontinfo = thiz->impl_data;
+     STBImplData *data = thiz->impl_data;
 
      D_MAGIC_ASSERT( thiz, CoreFont );
      D_ASSERT( ret_index != NULL );
 
-     *ret_index = stbtt_FindGlyphIndex( fontinfo, character );
+     *ret_index = stbtt_FindGlyphIndex( &data->fontinfo, character );
 
      return DFB_OK;
 }
@@ -61,10 +75,10 @@ stbUTF8DecodeText( CoreFont     *thiz,
                    unsigned int *ret_indices,
                    int          *ret_num )
 {
-     stbtt_fontinfo *fontinfo = thiz->impl_data;
-     const u8       *bytes    = text;
-     int             pos      = 0;
-     int             num      = 0;
+     STBImplData *data  = thiz->impl_data;
+     const u8    *bytes = text;
+     int          pos   = 0;
+     int          num   = 0;
 
      D_MAGIC_ASSERT( thiz, CoreFont );
      D_ASSERT( text != NULL );
@@ -83,7 +97,7 @@ stbUTF8DecodeText( CoreFont     *thiz,
                pos += DIRECT_UTF8_SKIP(bytes[pos]);
           }
 
-          ret_indices[num++] = stbtt_FindGlyphIndex( fontinfo, c );
+          ret_indices[num++] = stbtt_FindGlyphIndex( &data->fontinfo, c );
      }
 
      *ret_num = num;
@@ -103,17 +117,14 @@ get_glyph_info( CoreFont      *thiz,
                 unsigned int   index,
                 CoreGlyphData *info )
 {
-     int             advanceWidth;
-     float           scale;
-     int             x0, y0, x1, y1;
-     stbtt_fontinfo *fontinfo = thiz->impl_data;
+     int          advanceWidth;
+     int          x0, y0, x1, y1;
+     STBImplData *data = thiz->impl_data;
 
-     scale = stbtt_ScaleForPixelHeight( fontinfo, thiz->description.height );
+     stbtt_GetGlyphHMetrics( &data->fontinfo, index, &advanceWidth, NULL );
+     stbtt_GetGlyphBitmapBox( &data->fontinfo, index, data->scale, data->scale, &x0, &y0, &x1, &y1 );
 
-     stbtt_GetGlyphHMetrics( fontinfo, index, &advanceWidth, NULL );
-     stbtt_GetGlyphBitmapBox( fontinfo, index, scale, scale, &x0, &y0, &x1, &y1 );
-
-     info->xadvance = advanceWidth * 256 * stbtt_ScaleForMappingEmToPixels( fontinfo, thiz->description.height );
+     info->xadvance = advanceWidth * 256 * data->advance_scale;
      info->width    = x1 - x0;
      info->height   = y1 - y0;
 
@@ -126,20 +137,19 @@ render_glyph( CoreFont      *thiz,
               CoreGlyphData *info )
 {
      DFBResult              ret;
-     unsigned char         *bitmap;
-     float                  scale;
      int                    x0, y0;
      int                    y;
-     u8                    *src;
-     stbtt_fontinfo        *fontinfo = thiz->impl_data;
-     CoreSurface           *surface  = info->surface;
+     u8                    *bitmap;
+     FontConvertFunc        convert;
+     STBImplData           *data    = thiz->impl_data;
+     CoreSurface           *surface = info->surface;
      CoreSurfaceBufferLock  lock;
 
-     bitmap = D_CALLOC( info->height, info->width );
-
-     scale = stbtt_ScaleForPixelHeight( fontinfo, thiz->description.height );
-
-     stbtt_MakeGlyphBitmap( fontinfo, bitmap, info->width, info->height, info->width, scale, scale, index );
+     convert = font_convert_func( surface->config.format, thiz->surface_caps & DSCAPS_PREMULTIPLIED, false );
+     if (!convert) {
+          D_UNIMPLEMENTED();
+          return DFB_UNSUPPORTED;
+     }
 
      ret = dfb_surface_lock_buffer( surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret) {
@@ -153,25 +163,41 @@ render_glyph( CoreFont      *thiz,
      if (info->height > surface->config.size.h)
           info->height = surface->config.size.h;
 
-     stbtt_GetGlyphBitmapBox( fontinfo, index, scale, scale, &x0, &y0, NULL, NULL );
+     stbtt_GetGlyphBitmapBox( &data->fontinfo, index, data->scale, data->scale, &x0, &y0, NULL, NULL );
 
      info->left = x0 - thiz->ascender * thiz->up_unit_x;
      info->top  = y0 - thiz->ascender * thiz->up_unit_y - 1;
 
-     src = bitmap;
-
      lock.addr += DFB_BYTES_PER_LINE( surface->config.format, info->start );
 
-     for (y = 0; y < info->height; y++) {
-          direct_memcpy( lock.addr, src, info->width );
+     if (surface->config.format == DSPF_A8) {
+          /* Rasterize straight into the glyph cache, glyphs without any contour leave it untouched. */
+          for (y = 0; y < info->height; y++)
+               memset( lock.addr + y * lock.pitch, 0, info->width );
 
-          src += info->width;
-          lock.addr += lock.pitch;
+          stbtt_MakeGlyphBitmap( &data->fontinfo, lock.addr, info->width, info->height, lock.pitch,
+                                 data->scale, data->scale, index );
      }
+     else {
+          bitmap = D_CALLOC( info->height, info->width );
+          if (!bitmap) {
+               dfb_surface_unlock_buffer( surface, &lock );
+               return D_OOM();
+          }
 
-     dfb_surface_unlock_buffer( surface, &lock );
+          stbtt_MakeGlyphBitmap( &data->fontinfo, bitmap, info->width, info->height, info->width,
+                                 data->scale, data->scale, index );
 
-     D_FREE( bitmap );
+          for (y = 0; y < info->height; y++) {
+               convert( bitmap + y * info->width, lock.addr, info->width );
+
+               lock.addr += lock.pitch;
+          }
+
+          D_FREE( bitmap );
+     }
+
+     dfb_surface_unlock_buffer( surface, &lock );
 
      return DFB_OK;
 }
@@ -181,11 +207,16 @@ render_glyph( CoreFont      *thiz,
 static void
 IDirectFBFont_STB_Destruct( IDirectFBFont *thiz )
 {
-     stbtt_fontinfo *fontinfo = ((IDirectFBFont_data*) thiz->priv)->font->impl_data;
+     STBImplData *data = ((IDirectFBFont_data*) thiz->priv)->font->impl_data;
 
      D_DEBUG_AT( Font_STB, "%s( %p )\n", __FUNCTION__, thiz );
 
-     D_FREE( fontinfo );
+     font_preload_stop( ((IDirectFBFont_data*) thiz->priv)->font );
+
+     if (data->file)
+          font_file_close( data->file );
+
+     D_FREE( data );
 
      IDirectFBFont_Destruct( thiz );
 }
@@ -222,11 +253,11 @@ Construct( IDirectFBFont              *thiz,
            IDirectFBFont_ProbeContext *ctx,
            DFBFontDescription         *desc )
 {
-     DFBResult       ret;
-     int             err;
-     int             ascent, descent;
-     stbtt_fontinfo *fontinfo = NULL;
-     CoreFont       *font     = NULL;
+     DFBResult    ret;
+     int          err;
+     int          ascent, descent;
+     STBImplData *data = NULL;
+     CoreFont    *font = NULL;
 
      D_DEBUG_AT( Font_STB, "%s( %p )\n", __FUNCTION__, thiz );
 
@@ -240,13 +271,17 @@ Construct( IDirectFBFont              *thiz,
      D_DEBUG_AT( Font_STB, "  -> font at pixel height %d\n", desc->height );
 
      /* Open the font loaded into memory. */
-     fontinfo = D_CALLOC( 1, sizeof(stbtt_fontinfo) );
-     if (!fontinfo) {
+     data = D_CALLOC( 1, sizeof(STBImplData) );
+     if (!data) {
           ret = D_OOM();
           goto error;
      }
 
-     err = stbtt_InitFont( fontinfo, ctx->content, 0 );
+     /* Use the shared mapping of the font file, held once for all the fonts created from it. */
+     if (ctx->filename)
+          data->file = font_file_open( ctx->filename );
+
+     err = stbtt_InitFont( &data->fontinfo, data->file ? data->file->map : ctx->content, 0 );
      if (!err) {
           D_ERROR( "Font/STB: Failed to load font!\n" );
           ret = DFB_FAILURE;
@@ -259,10 +294,13 @@ Construct( IDirectFBFont              *thiz,
           goto error;
 
      /* Fill font information. */
-     stbtt_GetFontVMetrics( fontinfo, &ascent, &descent, NULL );
+     data->scale         = stbtt_ScaleForPixelHeight( &data->fontinfo, desc->height );
+     data->advance_scale = stbtt_ScaleForMappingEmToPixels( &data->fontinfo, desc->height );
+
+     stbtt_GetFontVMetrics( &data->fontinfo, &ascent, &descent, NULL );
 
-     font->ascender  = ceil(  ascent  * stbtt_ScaleForMappingEmToPixels( fontinfo, desc->height ) );
-     font->descender = floor( descent * stbtt_ScaleForMappingEmToPixels( fontinfo, desc->height ) );
+     font->ascender  = ceil(  ascent  * data->advance_scale );
+     font->descender = floor( descent * data->advance_scale );
      font->height    = font->ascender - font->descender + 1;
      font->up_unit_x =  0.0;
      font->up_unit_y = -1.0;
@@ -273,7 +311,7 @@ Construct( IDirectFBFont              *thiz,
      font->GetGlyphData = get_glyph_info;
      font->RenderGlyph  = render_glyph;
 
-     font->impl_data = fontinfo;
+     font->impl_data = data;
 
      ret = dfb_font_register_encoding( font, "UTF8", &stbUTF8Funcs, DTEID_UTF8 );
      if (ret)
@@ -283,14 +321,20 @@ Construct( IDirectFBFont              *thiz,
 
      thiz->Release = IDirectFBFont_STB_Release;
 
+     font_preload_start( font );
+
      return DFB_OK;
 
 error:
      if (font)
           dfb_font_destroy( font );
 
-     if (fontinfo)
-          D_FREE( fontinfo );
+     if (data) {
+          if (data->file)
+               font_file_close( data->file );
+
+          D_FREE( data );
+     }
 
      return ret;
 }
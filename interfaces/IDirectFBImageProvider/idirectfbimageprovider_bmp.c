@@ -21,6 +21,8 @@
 #include <media/idirectfbimageprovider.h>
 #include <misc/gfx_util.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_BMP, "ImageProvider/BMP", "BMP Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -47,6 +49,9 @@ typedef struct {
      DFBColor               colors[256];
      u32                   *image;
 
+     bool                   cache;                   /* decoded image shared through the image cache */
+     ImageCacheSource       cache_source;
+
      DFBSurfaceDescription  desc;
 
      DIRenderCallback       render_callback;
@@ -88,9 +93,8 @@ IDirectFBImageProvider_BMP_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_BMP, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     if (data->image)
-          D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      /* Decrease the data buffer reference counter. */
      if (data->buffer)
@@ -285,6 +289,9 @@ IDirectFBImageProvider_BMP_RenderTo( IDirectFBImageProvider *thiz,
      if (!dfb_rectangle_region_intersects( &rect, &clip ))
           return DFB_OK;
 
+     if (!data->image && data->cache)
+          data->image = image_cache_lookup( &data->cache_source, data->desc.width, data->desc.height, DSPF_ARGB );
+
      ret = dfb_surface_lock_buffer( dst_data->surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret)
           return ret;
@@ -350,6 +357,10 @@ IDirectFBImageProvider_BMP_RenderTo( IDirectFBImageProvider *thiz,
                data->image = NULL;
                ret = DFB_INTERRUPTED;
           }
+          else if (!ret && data->cache) {
+               data->image = image_cache_insert( &data->cache_source, data->desc.width, data->desc.height, DSPF_ARGB,
+                                                 data->image, data->desc.width * data->desc.height * 4 );
+          }
      }
      else {
           dfb_scale_linear_32( data->image, data->desc.width, data->desc.height,
@@ -527,6 +538,8 @@ Construct( IDirectFBImageProvider *thiz,
                goto error;
      }
 
+     data->cache = image_cache_source( buffer, &data->cache_source );
+
      thiz->AddRef                = IDirectFBImageProvider_BMP_AddRef;
      thiz->Release               = IDirectFBImageProvider_BMP_Release;
      thiz->GetSurfaceDescription = IDirectFBImageProvider_BMP_GetSurfaceDescription;
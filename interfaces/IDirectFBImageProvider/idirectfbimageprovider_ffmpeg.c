@@ -23,6 +23,8 @@
 #include <media/idirectfbimageprovider.h>
 #include <misc/gfx_util.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_FFmpeg, "ImageProvider/FFmpeg", "FFmpeg Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -51,6 +53,9 @@ typedef struct {
      AVCodecContext        *codec_ctx;
      void                  *image;
 
+     bool                   cache;                   /* decoded image shared through the image cache */
+     ImageCacheSource       cache_source;
+
      DFBSurfaceDescription  desc;
 
      DIRenderCallback       render_callback;
@@ -83,6 +88,103 @@ av_read_callback( void    *opaque,
 
 /**********************************************************************************************************************/
 
+static DFBResult
+decode_image( IDirectFBImageProvider_FFmpeg_data *data )
+{
+     DFBResult          ret;
+     AVPacket          *pkt;
+     unsigned int       len;
+     uint8_t           *buf;
+     AVFrame           *frame;
+     struct SwsContext *sws_ctx;
+     uint8_t           *dst[1];
+     int                dstStride;
+     int                err;
+     void              *image;
+
+     ret = data->buffer->SeekTo( data->buffer, 0 );
+     if (ret == DFB_OK) {
+          data->buffer->GetLength( data->buffer, &len );
+     }
+     else {
+          len = 128 * 1024;
+          data->buffer->WaitForDataWithTimeout( data->buffer, len, 0, 200 );
+     }
+
+     /* The input buffer of the decoder must be padded. */
+     buf = D_CALLOC( 1, len + AV_INPUT_BUFFER_PADDING_SIZE );
+     if (!buf)
+          return D_OOM();
+
+     pkt   = av_packet_alloc();
+     frame = av_frame_alloc();
+     if (!pkt || !frame) {
+          av_packet_free( &pkt );
+          av_frame_free( &frame );
+          D_FREE( buf );
+          return D_OOM();
+     }
+
+     data->buffer->PeekData( data->buffer, len, 0, buf, &len );
+
+     pkt->data = buf;
+     pkt->size = len;
+
+     /* Send the whole stream followed by a flush, then take the first decoded frame. */
+     err = avcodec_send_packet( data->codec_ctx, pkt );
+     if (err >= 0) {
+          avcodec_send_packet( data->codec_ctx, NULL );
+
+          err = avcodec_receive_frame( data->codec_ctx, frame );
+     }
+
+     /* Reset the decoder so that the image can be rendered again. */
+     avcodec_flush_buffers( data->codec_ctx );
+
+     av_packet_free( &pkt );
+
+     if (err < 0) {
+          D_ERROR( "ImageProvider/FFmpeg: Couldn't decode frame!\n" );
+          av_frame_free( &frame );
+          D_FREE( buf );
+          return DFB_FAILURE;
+     }
+
+     sws_ctx = sws_getContext( data->codec_ctx->width, data->codec_ctx->height, data->codec_ctx->pix_fmt,
+                               data->codec_ctx->width, data->codec_ctx->height, AV_PIX_FMT_BGRA,
+                               SWS_FAST_BILINEAR, NULL, NULL, NULL );
+
+     /* Allocate image data. */
+     image = D_CALLOC( data->desc.height, data->desc.width * 4 );
+     if (!image) {
+          sws_freeContext( sws_ctx );
+          av_frame_free( &frame );
+          D_FREE( buf );
+          return D_OOM();
+     }
+
+     dst[0]    = image;
+     dstStride = data->desc.width * 4;
+
+     sws_scale( sws_ctx, (void*) frame->data, frame->linesize, 0, data->codec_ctx->height, dst, &dstStride );
+
+     sws_freeContext( sws_ctx );
+
+     av_frame_free( &frame );
+
+     D_FREE( buf );
+
+     if (data->cache)
+          image = image_cache_insert( &data->cache_source, data->desc.width, data->desc.height, DSPF_ARGB,
+                                      image, data->desc.width * data->desc.height * 4 );
+
+     data->image = image;
+
+     return DFB_OK;
+}
+
+/**********************************************************************************************************************/
+
 static void
 IDirectFBImageProvider_FFmpeg_Destruct( IDirectFBImageProvider *thiz )
 {
@@ -90,10 +192,10 @@ IDirectFBImageProvider_FFmpeg_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_FFmpeg, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
-     avcodec_close( data->codec_ctx );
+     avcodec_free_context( &data->codec_ctx );
 
      avformat_close_input( &data->fmt_ctx );
 
@@ -171,14 +273,6 @@ IDirectFBImageProvider_FFmpeg_RenderTo( IDirectFBImageProvider *thiz,
      DFBRectangle           rect;
      DFBRegion              clip;
      CoreSurfaceBufferLock  lock;
-     AVPacket               pkt;
-     unsigned int           len;
-     uint8_t               *buf;
-     AVFrame               *frame;
-     struct SwsContext     *sws_ctx;
-     uint8_t               *dst[1];
-     int                    dstStride;
-     int                    got_frame = 0;
 
      DIRECT_INTERFACE_GET_DATA( IDirectFBImageProvider_FFmpeg )
 
@@ -210,57 +304,15 @@ IDirectFBImageProvider_FFmpeg_RenderTo( IDirectFBImageProvider *thiz,
      if (!dfb_rectangle_region_intersects( &rect, &clip ))
           return DFB_OK;
 
-     ret = data->buffer->SeekTo( data->buffer, 0 );
-     if (ret == DFB_OK) {
-          data->buffer->GetLength( data->buffer, &len );
-     }
-     else {
-          len = 128 * 1024;
-          data->buffer->WaitForDataWithTimeout( data->buffer, len, 0, 200 );
-     }
-
-     buf = D_MALLOC( len );
-     if (!buf)
-          return D_OOM();
-
-     av_init_packet( &pkt );
+     if (!data->image && data->cache)
+          data->image = image_cache_lookup( &data->cache_source, data->desc.width, data->desc.height, DSPF_ARGB );
 
-     pkt.data = buf;
-
-     frame = av_frame_alloc();
-     if (!frame) {
-          D_FREE( buf );
-          return D_OOM();
-     }
-
-     do {
-          data->buffer->PeekData( data->buffer, len, 0, buf, (unsigned int*) &pkt.size );
-
-          avcodec_decode_video2( data->codec_ctx, frame, &got_frame, &pkt );
-     } while (pkt.size && !got_frame);
-
-     if (!got_frame) {
-          D_ERROR( "ImageProvider/FFmpeg: Couldn't decode frame!\n" );
-          av_frame_free( &frame );
-          D_FREE( buf );
-          return DFB_FAILURE;
+     if (!data->image) {
+          ret = decode_image( data );
+          if (ret)
+               return ret;
      }
 
-     sws_ctx = sws_getContext( data->codec_ctx->width, data->codec_ctx->height, data->codec_ctx->pix_fmt,
-                               data->codec_ctx->width, data->codec_ctx->height, AV_PIX_FMT_BGRA,
-                               SWS_FAST_BILINEAR, NULL, NULL, NULL );
-
-     dst[0]    = data->image;
-     dstStride = data->desc.width * 4;
-
-     sws_scale( sws_ctx, (void*) frame->data, frame->linesize, 0, data->codec_ctx->height, dst, &dstStride );
-
-     sws_freeContext( sws_ctx );
-
-     av_frame_free( &frame );
-
-     D_FREE( buf );
-
      ret = dfb_surface_lock_buffer( dst_data->surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret)
           return ret;
@@ -313,8 +365,10 @@ Construct( IDirectFBImageProvider *thiz,
            CoreDFB                *core,
            IDirectFB              *idirectfb )
 {
-     DFBResult    ret;
-     unsigned int len;
+     DFBResult      ret;
+     unsigned int   len;
+     AVStream      *st;
+     const AVCodec *codec;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IDirectFBImageProvider_FFmpeg )
 
@@ -326,7 +380,9 @@ Construct( IDirectFBImageProvider *thiz,
      /* Increase the data buffer reference counter. */
      buffer->AddRef( buffer );
 
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT( 58, 9, 100 )
      av_register_all();
+#endif
 
      av_log_set_level( AV_LOG_ERROR );
 
@@ -368,33 +424,42 @@ Construct( IDirectFBImageProvider *thiz,
           goto error;
      }
 
-     if (data->fmt_ctx->nb_streams != 1 || data->fmt_ctx->streams[0]->codec->codec_type != AVMEDIA_TYPE_VIDEO) {
+     if (data->fmt_ctx->nb_streams != 1 || data->fmt_ctx->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
           D_ERROR( "ImageProvider/FFmpeg: Couldn't find video stream!\n" );
           ret = DFB_FAILURE;
           goto error;
      }
 
-     data->codec_ctx = data->fmt_ctx->streams[0]->codec;
-
-     data->desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
-     data->desc.width       = data->codec_ctx->width;
-     data->desc.height      = data->codec_ctx->height;
-     data->desc.pixelformat = dfb_primary_layer_pixelformat();
+     st = data->fmt_ctx->streams[0];
 
-     if (avcodec_open2( data->codec_ctx, avcodec_find_decoder( data->codec_ctx->codec_id ), NULL ) < 0) {
-          D_ERROR( "ImageProvider/FFmpeg: Failed to open video codec!\n" );
-          data->codec_ctx = NULL;
+     codec = avcodec_find_decoder( st->codecpar->codec_id );
+     if (!codec) {
+          D_ERROR( "ImageProvider/FFmpeg: Couldn't find video codec!\n" );
           ret = DFB_FAILURE;
           goto error;
      }
 
-     /* Allocate image data. */
-     data->image = D_CALLOC( data->desc.height, data->desc.width * 4 );
-     if (!data->image) {
+     data->codec_ctx = avcodec_alloc_context3( codec );
+     if (!data->codec_ctx) {
           ret = D_OOM();
           goto error;
      }
 
+     avcodec_parameters_to_context( data->codec_ctx, st->codecpar );
+
+     if (avcodec_open2( data->codec_ctx, codec, NULL ) < 0) {
+          D_ERROR( "ImageProvider/FFmpeg: Failed to open video codec!\n" );
+          ret = DFB_FAILURE;
+          goto error;
+     }
+
+     data->desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+     data->desc.width       = data->codec_ctx->width;
+     data->desc.height      = data->codec_ctx->height;
+     data->desc.pixelformat = dfb_primary_layer_pixelformat();
+
+     data->cache = image_cache_source( buffer, &data->cache_source );
+
      thiz->AddRef                = IDirectFBImageProvider_FFmpeg_AddRef;
      thiz->Release               = IDirectFBImageProvider_FFmpeg_Release;
      thiz->GetSurfaceDescription = IDirectFBImageProvider_FFmpeg_GetSurfaceDescription;
@@ -406,7 +471,7 @@ Construct( IDirectFBImageProvider *thiz,
 
 error:
      if (data->codec_ctx)
-          avcodec_close( data->codec_ctx );
+          avcodec_free_context( &data->codec_ctx );
 
      if (data->fmt_ctx)
           avformat_close_input( &data->fmt_ctx );
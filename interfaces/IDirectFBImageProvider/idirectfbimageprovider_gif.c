@@ -22,6 +22,8 @@
 #include <media/idirectfbimageprovider.h>
 #include <misc/gfx_util.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_GIF, "ImageProvider/GIF", "GIF Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -233,7 +235,8 @@ IDirectFBImageProvider_GIF_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_GIF, "%s( %p )\n", __FUNCTION__, thiz );
 
-     gif_image_free( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
 }
@@ -392,11 +395,14 @@ Construct( IDirectFBImageProvider *thiz,
            CoreDFB                *core,
            IDirectFB              *idirectfb )
 {
-     DFBResult ret;
-     int       width, height;
-     u32       color_key;
-     int       transparent;
-     u8        cmap[3][256];
+     DFBResult         ret;
+     int               width, height;
+     u32               color_key;
+     int               transparent;
+     u8                cmap[3][256];
+     ImageCacheSource  source;
+     bool              cache;
+     u32              *image = NULL;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IDirectFBImageProvider_GIF )
 
@@ -410,7 +416,21 @@ Construct( IDirectFBImageProvider *thiz,
           goto error;
      }
 
-     gif_image_decode( buffer, data->image, width, height, color_key, transparent, cmap );
+     /* The decoded image may have been cached by another provider. */
+     cache = image_cache_source( buffer, &source );
+     if (cache)
+          image = image_cache_lookup( &source, width, height, DSPF_ARGB );
+
+     if (image) {
+          gif_image_free( data->image );
+          data->image = image;
+     }
+     else {
+          gif_image_decode( buffer, data->image, width, height, color_key, transparent, cmap );
+
+          if (cache)
+               data->image = image_cache_insert( &source, width, height, DSPF_ARGB, data->image, width * height * 4 );
+     }
 
      data->color_key   = color_key;
      data->color_keyed = (transparent != -1);
@@ -18,12 +18,16 @@
 
 #include <config.h>
 #include <core/layers.h>
+#include <direct/system.h>
+#include <direct/thread.h>
 #include <display/idirectfbsurface.h>
 #include <jpeglib.h>
 #include <media/idirectfbimageprovider.h>
 #include <misc/gfx_util.h>
 #include <setjmp.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_JPEG, "ImageProvider/JPEG", "JPEG Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -44,7 +48,19 @@ typedef struct {
 
      IDirectFBDataBuffer   *buffer;
 
-     u32                   *image;
+     DFBDimension           sizes[16];               /* output sizes for the scaling factors 1/8 to 16/8 */
+
+     u32                   *image;                   /* decoded image */
+     int                    image_scale;             /* scaling factor of the decoded image in 1/8 */
+     DFBRectangle           image_rect;              /* decoded area within the scaled image */
+
+     int                    restart_interval;        /* MCUs per restart interval, 0 if not decodable in bands */
+     int                    mcus_per_row;            /* MCUs per row of the scan */
+     int                    mcu_height;              /* image rows per MCU row */
+     int                    threads;                 /* number of threads decoding bands */
+
+     bool                   cache;                   /* full decoded images shared through the image cache */
+     ImageCacheSource       cache_source;
 
      DFBSurfaceDescription  desc;
 
@@ -56,6 +72,43 @@ typedef struct {
 
 #define JPEG_PROG_BUF_SIZE 0x10000
 
+#define MAX_THREADS        16
+#define BANDS_PER_THREAD   4
+#define BANDS_MIN_PIXELS   (1024 * 1024)
+
+/*
+ * A band is decoded together with the first MCU row of the next band, as the chroma upsampling of the rows next to
+ * the boundary needs both sides. The rows next to the boundary are written by the band above it.
+ */
+typedef struct {
+     unsigned int  offset;      /* start of the entropy-coded data of the band */
+     unsigned int  length;      /* length of the entropy-coded data, including the first MCU row of the next band */
+     int           row;         /* first MCU row */
+     int           height;      /* image rows */
+     int           extra;       /* image rows of the next band decoded as well */
+     int           y;           /* first output row */
+     int           skip;        /* output rows at the top written by the band above */
+     int           end;         /* output rows to decode */
+} JPEGBand;
+
+typedef struct {
+     IDirectFBImageProvider_JPEG_data *data;
+
+     const u8                         *file;          /* whole JPEG file */
+     unsigned int                      height_offset; /* offset of the image height in the SOF segment */
+     unsigned int                      header_length; /* length up to the end of the SOS segment */
+
+     JPEGBand                         *bands;
+     int                               num_bands;
+
+     int                               scale;
+     DFBDimension                      size;          /* output size */
+
+     DirectMutex                       lock;          /* lock for the following fields */
+     int                               next;          /* next band to decode */
+     bool                              failed;
+} JPEGBandContext;
+
 /**********************************************************************************************************************/
 
 typedef struct {
@@ -169,6 +222,113 @@ jpeg_panic( j_common_ptr cinfo )
 
 /**********************************************************************************************************************/
 
+typedef struct {
+     struct jpeg_source_mgr  pub;        /* public field */
+     const JOCTET           *chunks[5];  /* header up to the image height, image height, rest of the header,
+                                            entropy-coded data, EOI marker */
+     size_t                  sizes[5];
+     int                     chunk;      /* next chunk */
+     JOCTET                  height[2];  /* image height of the band */
+} band_source_mgr;
+
+static const JOCTET band_eoi[2] = { 0xff, JPEG_EOI };
+
+static void
+band_init_source( j_decompress_ptr cinfo )
+{
+     band_source_mgr *src = (band_source_mgr*) cinfo->src;
+
+     src->chunk = 0;
+
+     src->pub.next_input_byte = NULL;
+     src->pub.bytes_in_buffer = 0;
+}
+
+static boolean
+band_fill_input_buffer( j_decompress_ptr cinfo )
+{
+     band_source_mgr *src = (band_source_mgr*) cinfo->src;
+
+     /* Skip empty chunks. */
+     while (src->chunk < D_ARRAY_SIZE(src->chunks) && !src->sizes[src->chunk])
+          src->chunk++;
+
+     if (src->chunk < D_ARRAY_SIZE(src->chunks)) {
+          src->pub.next_input_byte = src->chunks[src->chunk];
+          src->pub.bytes_in_buffer = src->sizes[src->chunk];
+          src->chunk++;
+     }
+     else {
+          /* Insert a fake EOI marker. */
+          src->pub.next_input_byte = band_eoi;
+          src->pub.bytes_in_buffer = 2;
+     }
+
+     return TRUE;
+}
+
+static void
+band_skip_input_data( j_decompress_ptr cinfo,
+                      long             num_bytes )
+{
+     band_source_mgr *src = (band_source_mgr*) cinfo->src;
+
+     if (num_bytes > 0) {
+          while (num_bytes > src->pub.bytes_in_buffer) {
+               num_bytes -= src->pub.bytes_in_buffer;
+               band_fill_input_buffer( cinfo );
+          }
+
+          src->pub.next_input_byte += num_bytes;
+          src->pub.bytes_in_buffer -= num_bytes;
+     }
+}
+
+static void
+band_term_source( j_decompress_ptr cinfo )
+{
+}
+
+static void
+jpeg_band_src( j_decompress_ptr       cinfo,
+               const JPEGBandContext *ctx,
+               const JPEGBand        *band,
+               int                    height )
+{
+     band_source_mgr *src;
+
+     if (!cinfo->src)
+          cinfo->src = cinfo->mem->alloc_small( (j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(band_source_mgr) );
+
+     src = (band_source_mgr*) cinfo->src;
+
+     /* The band is a JPEG stream of its own: the headers with the image height of the band, followed by the
+        entropy-coded data starting at a restart marker, which resets the decoder like the start of a scan. */
+     src->height[0] = height >> 8;
+     src->height[1] = height & 0xff;
+
+     src->chunks[0] = ctx->file;
+     src->sizes[0]  = ctx->height_offset;
+     src->chunks[1] = src->height;
+     src->sizes[1]  = 2;
+     src->chunks[2] = ctx->file + ctx->height_offset + 2;
+     src->sizes[2]  = ctx->header_length - ctx->height_offset - 2;
+     src->chunks[3] = ctx->file + band->offset;
+     src->sizes[3]  = band->length;
+     src->chunks[4] = band_eoi;
+     src->sizes[4]  = 2;
+
+     src->pub.next_input_byte   = NULL;
+     src->pub.bytes_in_buffer   = 0;
+     src->pub.init_source       = band_init_source;
+     src->pub.fill_input_buffer = band_fill_input_buffer;
+     src->pub.skip_input_data   = band_skip_input_data;
+     src->pub.resync_to_restart = jpeg_resync_to_restart;
+     src->pub.term_source       = band_term_source;
+}
+
+/**********************************************************************************************************************/
+
 static __inline__ void
 copy_line32( u32      *argb,
              const u8 *rgb,
@@ -240,6 +400,473 @@ copy_line_uyvy( u32      *uyvy,
      }
 }
 
+static int
+get_scale( IDirectFBImageProvider_JPEG_data *data,
+           const DFBRectangle               *rect )
+{
+     int scale;
+
+     /* Prefer a scaling factor giving the exact size of the destination rectangle. */
+     for (scale = 1; scale <= 16; scale++) {
+          if (data->sizes[scale-1].w == rect->w && data->sizes[scale-1].h == rect->h)
+               return scale;
+     }
+
+     /* Otherwise use the smallest one which does not need upscaling afterwards. */
+     for (scale = 1; scale < 16; scale++) {
+          if (data->sizes[scale-1].w >= rect->w && data->sizes[scale-1].h >= rect->h)
+               break;
+     }
+
+     return scale;
+}
+
+static void
+get_area( const DFBRectangle *rect,
+          const DFBRegion    *clip,
+          const DFBDimension *size,
+          int                 margin,
+          DFBRectangle       *ret_area )
+{
+     int x1 = MAX( rect->x, clip->x1 ) - rect->x;
+     int y1 = MAX( rect->y, clip->y1 ) - rect->y;
+     int x2 = MIN( rect->x + rect->w - 1, clip->x2 ) - rect->x;
+     int y2 = MIN( rect->y + rect->h - 1, clip->y2 ) - rect->y;
+
+     /* Map the visible part of the destination rectangle into the scaled image. */
+     x1 = (long long) x1 * size->w / rect->w - margin;
+     y1 = (long long) y1 * size->h / rect->h - margin;
+     x2 = ((long long) (x2 + 1) * size->w + rect->w - 1) / rect->w - 1 + margin;
+     y2 = ((long long) (y2 + 1) * size->h + rect->h - 1) / rect->h - 1 + margin;
+
+     ret_area->x = MAX( x1, 0 );
+     ret_area->y = MAX( y1, 0 );
+     ret_area->w = MIN( x2, size->w - 1 ) - ret_area->x + 1;
+     ret_area->h = MIN( y2, size->h - 1 ) - ret_area->y + 1;
+}
+
+static bool
+image_contains( IDirectFBImageProvider_JPEG_data *data,
+                int                               scale,
+                const DFBRectangle               *area )
+{
+     return data->image && data->image_scale == scale &&
+            area->x >= data->image_rect.x && area->x + area->w <= data->image_rect.x + data->image_rect.w &&
+            area->y >= data->image_rect.y && area->y + area->h <= data->image_rect.y + data->image_rect.h;
+}
+
+static void
+render_image( IDirectFBImageProvider_JPEG_data *data,
+              CoreSurfaceBufferLock            *lock,
+              CoreSurface                      *surface,
+              const DFBRectangle               *rect,
+              const DFBRegion                  *clip )
+{
+     DFBRectangle        r;
+     const DFBDimension *size = &data->sizes[data->image_scale-1];
+
+     if (size->w == rect->w && size->h == rect->h) {
+          r.x = rect->x + data->image_rect.x;
+          r.y = rect->y + data->image_rect.y;
+          r.w = data->image_rect.w;
+          r.h = data->image_rect.h;
+
+          dfb_copy_buffer_32( data->image, lock->addr, lock->pitch, &r, surface, clip );
+     }
+     else {
+          /* Scale the decoded area to its part of the destination rectangle. */
+          r.x = rect->x + (long long) data->image_rect.x * rect->w / size->w;
+          r.y = rect->y + (long long) data->image_rect.y * rect->h / size->h;
+          r.w = rect->x + ((long long) (data->image_rect.x + data->image_rect.w) * rect->w + size->w - 1) / size->w - r.x;
+          r.h = rect->y + ((long long) (data->image_rect.y + data->image_rect.h) * rect->h + size->h - 1) / size->h - r.y;
+
+          dfb_scale_linear_32( data->image, data->image_rect.w, data->image_rect.h,
+                               lock->addr, lock->pitch, &r, surface, clip );
+     }
+}
+
+static bool
+parse_header( JPEGBandContext *ctx,
+              unsigned int     length )
+{
+     const u8     *file = ctx->file;
+     unsigned int  pos  = 2;
+
+     if (length < 2 || file[0] != 0xff || file[1] != 0xd8)
+          return false;
+
+     /* Walk the marker segments up to the SOS segment, remembering where the SOF segment stores the image height. */
+     while (pos + 3 < length) {
+          unsigned int marker;
+          unsigned int size;
+
+          if (file[pos] != 0xff)
+               return false;
+
+          while (pos + 3 < length && file[pos] == 0xff)
+               pos++;
+
+          marker = file[pos++];
+          size   = (file[pos] << 8) | file[pos+1];
+
+          if (size < 2 || pos + size > length)
+               return false;
+
+          if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+               if (size < 8)
+                    return false;
+
+               ctx->height_offset = pos + 3;
+          }
+          else if (marker == 0xda) {
+               ctx->header_length = pos + size;
+
+               return ctx->height_offset != 0;
+          }
+
+          pos += size;
+     }
+
+     return false;
+}
+
+static bool
+find_bands( JPEGBandContext *ctx,
+            unsigned int     length,
+            int              max_bands )
+{
+     IDirectFBImageProvider_JPEG_data *data      = ctx->data;
+     const u8                         *file      = ctx->file;
+     unsigned int                      pos       = ctx->header_length;
+     unsigned int                      end       = length;
+     int                               mcu_rows  = (data->desc.height + data->mcu_height - 1) / data->mcu_height;
+     int                               intervals = ((long long) data->mcus_per_row * mcu_rows +
+                                                    data->restart_interval - 1) / data->restart_interval;
+     int                               band_rows = (mcu_rows + max_bands - 1) / max_bands;
+     int                               interval  = 0;
+     JPEGBand                         *pending   = NULL;
+     long long                         mcus      = 0;
+     int                               i;
+
+     ctx->bands[0].offset = pos;
+     ctx->bands[0].row    = 0;
+     ctx->num_bands       = 1;
+
+     /* Scan the entropy-coded data for restart markers up to the end of the scan. */
+     while (pos + 1 < length) {
+          const u8 *p = memchr( file + pos, 0xff, length - pos - 1 );
+
+          if (!p)
+               break;
+
+          pos = p - file;
+
+          if (file[pos+1] == 0x00) {
+               pos += 2;
+               continue;
+          }
+
+          if (file[pos+1] == 0xff) {
+               pos++;
+               continue;
+          }
+
+          if (file[pos+1] < JPEG_RST0 || file[pos+1] > JPEG_RST0 + 7) {
+               end = pos;
+               break;
+          }
+
+          if (file[pos+1] != JPEG_RST0 + interval % 8)
+               return false;
+
+          interval++;
+
+          /* The previous band ends after the first MCU row of the last band. */
+          if (pending && (long long) interval * data->restart_interval >= mcus) {
+               pending->length = pos - pending->offset;
+               pending         = NULL;
+          }
+
+          pos += 2;
+
+          /* A band can start at a restart interval beginning an MCU row, numbered from RST0 again. */
+          if (interval % 8 == 0 && (long long) interval * data->restart_interval % data->mcus_per_row == 0) {
+               JPEGBand *band = &ctx->bands[ctx->num_bands-1];
+               int       row  = (long long) interval * data->restart_interval / data->mcus_per_row;
+
+               if (row < mcu_rows && row >= band->row + band_rows && ctx->num_bands < max_bands) {
+                    pending = band;
+                    mcus    = (long long) (row + 1) * data->mcus_per_row;
+
+                    band++;
+                    band->offset = pos;
+                    band->row    = row;
+
+                    ctx->num_bands++;
+               }
+          }
+     }
+
+     /* A truncated scan is left to the serial decoding. */
+     if (interval < intervals - 1 || ctx->num_bands < 2)
+          return false;
+
+     if (pending)
+          pending->length = end - pending->offset;
+
+     ctx->bands[ctx->num_bands-1].length = end - ctx->bands[ctx->num_bands-1].offset;
+
+     for (i = 0; i < ctx->num_bands - 1; i++)
+          ctx->bands[i].height = (ctx->bands[i+1].row - ctx->bands[i].row) * data->mcu_height;
+
+     ctx->bands[i].height = data->desc.height - ctx->bands[i].row * data->mcu_height;
+
+     for (i = 0; i < ctx->num_bands - 1; i++)
+          ctx->bands[i].extra = MIN( data->mcu_height, ctx->bands[i+1].height );
+
+     return true;
+}
+
+static int
+get_output_height( j_decompress_ptr       cinfo,
+                   const JPEGBandContext *ctx,
+                   const JPEGBand        *band,
+                   int                    height )
+{
+     jpeg_band_src( cinfo, ctx, band, height );
+     jpeg_read_header( cinfo, TRUE );
+
+     cinfo->scale_num   = ctx->scale;
+     cinfo->scale_denom = 8;
+     jpeg_calc_output_dimensions( cinfo );
+
+     jpeg_abort_decompress( cinfo );
+
+     return cinfo->output_height;
+}
+
+static bool
+get_band_rows( JPEGBandContext *ctx )
+{
+     struct jpeg_decompress_struct cinfo;
+     struct jpeg_error             jerr;
+     int                           i;
+     int                           y    = 0;
+     int                           skip = 0;
+
+     cinfo.err = jpeg_std_error( &jerr.pub );
+     jerr.pub.error_exit = jpeg_panic;
+
+     if (setjmp( jerr.jmpbuf )) {
+          jpeg_destroy_decompress( &cinfo );
+          return false;
+     }
+
+     jpeg_create_decompress( &cinfo );
+
+     /* Output rows of each band, as computed by the library. */
+     for (i = 0; i < ctx->num_bands; i++) {
+          JPEGBand *band = &ctx->bands[i];
+          int       rows = get_output_height( &cinfo, ctx, band, band->height );
+
+          band->y    = y;
+          band->skip = skip;
+          band->end  = rows;
+
+          /* The last output row of the extra rows lacks the context below. */
+          if (band->extra) {
+               band->end = get_output_height( &cinfo, ctx, band, band->height + band->extra ) - 1;
+               skip      = band->end - rows;
+          }
+
+          y += rows;
+     }
+
+     jpeg_destroy_decompress( &cinfo );
+
+     return y == ctx->size.h;
+}
+
+static bool
+decode_band( JPEGBandContext *ctx,
+             const JPEGBand  *band )
+{
+     struct jpeg_decompress_struct  cinfo;
+     struct jpeg_error              jerr;
+     JSAMPARRAY                     buffer;
+
+     cinfo.err = jpeg_std_error( &jerr.pub );
+     jerr.pub.error_exit = jpeg_panic;
+
+     if (setjmp( jerr.jmpbuf )) {
+          jpeg_destroy_decompress( &cinfo );
+          return false;
+     }
+
+     jpeg_create_decompress( &cinfo );
+     jpeg_band_src( &cinfo, ctx, band, band->height + band->extra );
+     jpeg_read_header( &cinfo, TRUE );
+
+     cinfo.scale_num       = ctx->scale;
+     cinfo.scale_denom     = 8;
+     cinfo.out_color_space = JCS_RGB;
+
+     if (ctx->data->flags & DIRENDER_FAST)
+          cinfo.dct_method = JDCT_IFAST;
+
+     jpeg_start_decompress( &cinfo );
+
+     if (cinfo.output_width != ctx->size.w || cinfo.output_height < band->end) {
+          jpeg_destroy_decompress( &cinfo );
+          return false;
+     }
+
+     buffer = (*cinfo.mem->alloc_sarray)( (j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1 );
+
+     while (cinfo.output_scanline < band->end) {
+          int y = cinfo.output_scanline;
+
+          jpeg_read_scanlines( &cinfo, buffer, 1 );
+
+          if (y >= band->skip)
+               copy_line32( ctx->data->image + (band->y + y) * ctx->size.w, *buffer, ctx->size.w );
+     }
+
+     /* The rest of the extra rows is not decoded. */
+     jpeg_destroy_decompress( &cinfo );
+
+     return true;
+}
+
+static void *
+JPEGDecode( DirectThread *thread,
+            void         *arg )
+{
+     JPEGBandContext *ctx = arg;
+
+     while (true) {
+          const JPEGBand *band;
+
+          direct_mutex_lock( &ctx->lock );
+
+          if (ctx->failed || ctx->next == ctx->num_bands) {
+               direct_mutex_unlock( &ctx->lock );
+               break;
+          }
+
+          band = &ctx->bands[ctx->next++];
+
+          direct_mutex_unlock( &ctx->lock );
+
+          if (!decode_band( ctx, band )) {
+               direct_mutex_lock( &ctx->lock );
+               ctx->failed = true;
+               direct_mutex_unlock( &ctx->lock );
+          }
+     }
+
+     return NULL;
+}
+
+static void
+decode_bands( IDirectFBImageProvider_JPEG_data *data,
+              int                               scale )
+{
+     JPEGBandContext  ctx;
+     unsigned int     length;
+     unsigned int     total;
+     unsigned int     read;
+     u8              *file;
+     DirectThread    *threads[MAX_THREADS];
+     int              num_threads = 0;
+     int              i;
+
+     memset( &ctx, 0, sizeof(ctx) );
+
+     ctx.data  = data;
+     ctx.scale = scale;
+     ctx.size  = data->sizes[scale-1];
+
+     /* The whole file is needed, which excludes streamed data buffers. */
+     if (data->buffer->GetLength( data->buffer, &length ) || !length)
+          return;
+
+     file = D_MALLOC( length );
+     if (!file) {
+          D_OOM();
+          return;
+     }
+
+     /* Peeking is relative to the position, which a previous serial decode has left at the end. */
+     if (data->buffer->SeekTo( data->buffer, 0 ))
+          goto out;
+
+     for (total = 0; total < length; total += read) {
+          if (data->buffer->PeekData( data->buffer, length - total, total, file + total, &read ) || !read)
+               goto out;
+     }
+
+     ctx.file = file;
+
+     ctx.bands = D_CALLOC( data->threads * BANDS_PER_THREAD, sizeof(JPEGBand) );
+     if (!ctx.bands) {
+          D_OOM();
+          goto out;
+     }
+
+     if (!parse_header( &ctx, length ) || !find_bands( &ctx, length, data->threads * BANDS_PER_THREAD ) ||
+         !get_band_rows( &ctx ))
+          goto out;
+
+     D_DEBUG_AT( ImageProvider_JPEG, "  -> decoding %d bands with %d thread(s)\n",
+                 ctx.num_bands, MIN( data->threads, ctx.num_bands ) );
+
+     data->image = D_CALLOC( ctx.size.h, ctx.size.w * 4 );
+     if (!data->image) {
+          D_OOM();
+          goto out;
+     }
+
+     direct_mutex_init( &ctx.lock );
+
+     /* The calling thread decodes bands as well. */
+     for (i = 1; i < MIN( data->threads, ctx.num_bands ); i++) {
+          threads[num_threads] = direct_thread_create( DTT_DEFAULT, JPEGDecode, &ctx, "JPEG Decode" );
+          if (threads[num_threads])
+               num_threads++;
+     }
+
+     JPEGDecode( NULL, &ctx );
+
+     for (i = 0; i < num_threads; i++) {
+          direct_thread_join( threads[i] );
+          direct_thread_destroy( threads[i] );
+     }
+
+     direct_mutex_deinit( &ctx.lock );
+
+     if (ctx.failed) {
+          D_DEBUG_AT( ImageProvider_JPEG, "  -> decoding bands failed, falling back to serial decoding\n" );
+
+          D_FREE( data->image );
+          data->image = NULL;
+     }
+     else {
+          data->image_scale = scale;
+          data->image_rect  = (DFBRectangle) { 0, 0, ctx.size.w, ctx.size.h };
+
+          if (data->cache)
+               data->image = image_cache_insert( &data->cache_source, ctx.size.w, ctx.size.h, DSPF_ARGB,
+                                                 data->image, ctx.size.w * ctx.size.h * 4 );
+     }
+
+out:
+     if (ctx.bands)
+          D_FREE( ctx.bands );
+
+     D_FREE( file );
+}
+
 /**********************************************************************************************************************/
 
 static void
@@ -249,9 +876,8 @@ IDirectFBImageProvider_JPEG_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_JPEG, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     if (data->image)
-          D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      /* Decrease the data buffer reference counter. */
      if (data->buffer)
@@ -326,6 +952,9 @@ IDirectFBImageProvider_JPEG_RenderTo( IDirectFBImageProvider *thiz,
      IDirectFBSurface_data  *dst_data;
      DFBRectangle            rect;
      DFBRegion               clip;
+     DFBRectangle            area;
+     int                     scale;
+     bool                    direct;
      CoreSurfaceBufferLock   lock;
      DIRenderCallbackResult  cb_result = DIRCR_OK;
 
@@ -359,27 +988,54 @@ IDirectFBImageProvider_JPEG_RenderTo( IDirectFBImageProvider *thiz,
      if (!dfb_rectangle_region_intersects( &rect, &clip ))
           return DFB_OK;
 
+     /* Let the IDCT do the scaling, ideally to the exact size of the destination rectangle. */
+     scale  = get_scale( data, &rect );
+     direct = data->sizes[scale-1].w == rect.w && data->sizes[scale-1].h == rect.h;
+
+     /* Only the visible area is needed, with a margin for the chroma upsampling and the interpolation. */
+#ifdef HAVE_JPEG_CROP_SCANLINE
+     get_area( &rect, &clip, &data->sizes[scale-1], 1, &area );
+#else
+     area = (DFBRectangle) { 0, 0, data->sizes[scale-1].w, data->sizes[scale-1].h };
+#endif
+
+     D_DEBUG_AT( ImageProvider_JPEG, "  -> scale %d/8, area "DFB_RECT_FORMAT"%s\n",
+                 scale, DFB_RECTANGLE_VALS( &area ), direct ? " (direct)" : "" );
+
+     /* The decoded image is kept as long as it covers the area at the same scaling factor. */
+     if (data->image && !image_contains( data, scale, &area )) {
+          image_cache_release( data->image );
+          data->image = NULL;
+     }
+
+     /* Full images at this scaling factor may have been decoded already by other providers. */
+     if (!data->image && data->cache) {
+          data->image = image_cache_lookup( &data->cache_source, data->sizes[scale-1].w, data->sizes[scale-1].h,
+                                            DSPF_ARGB );
+          if (data->image) {
+               data->image_scale = scale;
+               data->image_rect  = (DFBRectangle) { 0, 0, data->sizes[scale-1].w, data->sizes[scale-1].h };
+          }
+     }
+
+     /* Large images with restart markers are decoded in bands on several threads, except for YCbCr output. */
+     if (!data->image && data->restart_interval && data->threads > 1 &&
+         area.w == data->sizes[scale-1].w && area.h == data->sizes[scale-1].h && area.w * area.h >= BANDS_MIN_PIXELS &&
+         !(direct && (dst_data->surface->config.format == DSPF_NV16 || dst_data->surface->config.format == DSPF_UYVY)))
+          decode_bands( data, scale );
+
      ret = dfb_surface_lock_buffer( dst_data->surface, DSBR_BACK, CSAID_CPU, CSAF_WRITE, &lock );
      if (ret)
           return ret;
 
-     if (data->image && (rect.x || rect.y || rect.w != data->desc.width || rect.h != data->desc.height)) {
-           D_FREE( data->image );
-           data->image  = NULL;
-           data->desc.width  = 0;
-           data->desc.height = 0;
-     }
-
      /* Actual loading and rendering. */
      if (!data->image) {
           struct jpeg_decompress_struct  cinfo;
           struct jpeg_error              jerr;
           JSAMPARRAY                     buffer;
-          int                            row_stride;
-          u32                           *row_ptr;
-          int                            y         = 0;
+          int                            y;
           int                            uv_offset = 0;
-          bool                           direct    = false;
+          bool                           ycbcr     = false;
 
           cinfo.err = jpeg_std_error( &jerr.pub );
           jerr.pub.error_exit = jpeg_panic;
@@ -390,15 +1046,12 @@ IDirectFBImageProvider_JPEG_RenderTo( IDirectFBImageProvider *thiz,
                jpeg_destroy_decompress( &cinfo );
 
                if (data->image) {
-                    dfb_scale_linear_32( data->image, data->desc.width, data->desc.height,
-                                         lock.addr, lock.pitch, &rect, dst_data->surface, &clip );
+                    render_image( data, &lock, dst_data->surface, &rect, &clip );
 
                     dfb_surface_unlock_buffer( dst_data->surface, &lock );
 
                     if (data->render_callback) {
-                         DFBRectangle r = { 0, 0, data->desc.width, data->desc.height };
-
-                         if (data->render_callback( &r, data->render_callback_context ) != DIRCR_OK)
+                         if (data->render_callback( &data->image_rect, data->render_callback_context ) != DIRCR_OK)
                               return DFB_INTERRUPTED;
                     }
 
@@ -414,118 +1067,87 @@ IDirectFBImageProvider_JPEG_RenderTo( IDirectFBImageProvider *thiz,
           jpeg_buffer_src( &cinfo, data->buffer, 0 );
           jpeg_read_header( &cinfo, TRUE );
 
-          cinfo.scale_num = 8;
+          cinfo.scale_num   = scale;
           cinfo.scale_denom = 8;
-          jpeg_calc_output_dimensions( &cinfo );
-
-          if (cinfo.output_width == rect.w && cinfo.output_height == rect.h) {
-               direct = true;
-          }
-          else if (rect.x == 0 && rect.y == 0) {
-               cinfo.scale_num = 1;
-               jpeg_calc_output_dimensions( &cinfo );
-               while (cinfo.scale_num < 16 && cinfo.output_width < rect.w && cinfo.output_height < rect.h) {
-                    ++cinfo.scale_num;
-                    jpeg_calc_output_dimensions( &cinfo );
-               }
-          }
 
-          cinfo.output_components = 3;
-
-          switch (dst_data->surface->config.format) {
-               case DSPF_NV16:
-                    uv_offset = dst_data->surface->config.size.h * lock.pitch;
-               case DSPF_UYVY:
-                    if (direct && !rect.x && !rect.y) {
-                         cinfo.out_color_space = JCS_YCbCr;
+          /* YCbCr output is written straight into the destination, without keeping the decoded image. */
+          if (direct && !rect.x && !rect.y && area.w == rect.w && area.h == rect.h) {
+               switch (dst_data->surface->config.format) {
+                    case DSPF_NV16:
+                         uv_offset = dst_data->surface->config.size.h * lock.pitch;
+                    case DSPF_UYVY:
+                         ycbcr = true;
                          break;
-                    }
-                    cinfo.out_color_space = JCS_RGB;
-                    break;
 
-               default:
-                    cinfo.out_color_space = JCS_RGB;
-                    break;
+                    default:
+                         break;
+               }
           }
 
+          cinfo.out_color_space = ycbcr ? JCS_YCbCr : JCS_RGB;
+
           if (data->flags & DIRENDER_FAST)
                cinfo.dct_method = JDCT_IFAST;
 
           jpeg_start_decompress( &cinfo );
 
-          data->desc.width  = cinfo.output_width;
-          data->desc.height = cinfo.output_height;
-
-          row_stride = cinfo.output_width * 3;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+          /* Decode the columns of the area only, the crop is extended to iMCU boundaries. */
+          if (area.w < cinfo.output_width) {
+               JDIMENSION xoffset = area.x;
+               JDIMENSION width   = area.w;
 
-          buffer = (*cinfo.mem->alloc_sarray)( (j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1 );
+               jpeg_crop_scanline( &cinfo, &xoffset, &width );
 
-          /* Allocate image data. */
-          data->image = D_CALLOC( data->desc.height, data->desc.width * 4 );
-          if (!data->image) {
-               dfb_surface_unlock_buffer( dst_data->surface, &lock );
-               return D_OOM();
+               area.x = xoffset;
+               area.w = width;
           }
 
-          row_ptr = data->image;
-
-          while (cinfo.output_scanline < cinfo.output_height && cb_result == DIRCR_OK) {
-               jpeg_read_scanlines( &cinfo, buffer, 1 );
-
-               switch (dst_data->surface->config.format) {
-                    case DSPF_NV16:
-                    case DSPF_UYVY:
-                         if (direct) {
-                              switch (dst_data->surface->config.format) {
-                                   case DSPF_NV16:
-                                        copy_line_nv16( lock.addr, (u16*) lock.addr + uv_offset, *buffer, rect.w );
-                                        break;
-
-                                   case DSPF_UYVY:
-                                        copy_line_uyvy( lock.addr, *buffer, rect.w );
-                                        break;
+          /* Skip the rows above the area. */
+          if (area.y)
+               jpeg_skip_scanlines( &cinfo, area.y );
+#endif
 
-                                   default:
-                                        break;
-                              }
+          buffer = (*cinfo.mem->alloc_sarray)( (j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1 );
 
-                              lock.addr = lock.addr + lock.pitch;
+          if (!ycbcr) {
+               /* Allocate image data. */
+               data->image = D_CALLOC( area.h, area.w * 4 );
+               if (!data->image) {
+                    jpeg_destroy_decompress( &cinfo );
+                    dfb_surface_unlock_buffer( dst_data->surface, &lock );
+                    return D_OOM();
+               }
 
-                              if (data->render_callback) {
-                                   DFBRectangle r = { 0, y, data->desc.width, 1 };
+               data->image_scale = scale;
+               data->image_rect  = area;
+          }
 
-                                   cb_result = data->render_callback( &r, data->render_callback_context );
-                              }
-                              break;
-                         }
+          for (y = 0; y < area.h && cb_result == DIRCR_OK; y++) {
+               jpeg_read_scanlines( &cinfo, buffer, 1 );
 
-                    default:
-                         copy_line32( row_ptr, *buffer, data->desc.width );
+               if (ycbcr) {
+                    u8 *dst = (u8*) lock.addr + y * lock.pitch;
 
-                         if (direct) {
-                              DFBRectangle r = { rect.x, rect.y + y, rect.w, 1 };
+                    if (dst_data->surface->config.format == DSPF_NV16)
+                         copy_line_nv16( (u16*) dst, (u16*) (dst + uv_offset), *buffer, rect.w );
+                    else
+                         copy_line_uyvy( (u32*) dst, *buffer, rect.w );
+               }
+               else {
+                    u32 *row_ptr = data->image + y * area.w;
 
-                              dfb_copy_buffer_32( row_ptr, lock.addr, lock.pitch, &r, dst_data->surface, &clip );
+                    copy_line32( row_ptr, *buffer, area.w );
 
-                              if (data->render_callback) {
-                                   r = (DFBRectangle) { 0, y, data->desc.width, 1 };
+                    if (direct) {
+                         DFBRectangle r = { rect.x + area.x, rect.y + area.y + y, area.w, 1 };
 
-                                   cb_result = data->render_callback( &r, data->render_callback_context );
-                              }
-                         }
-                         break;
+                         dfb_copy_buffer_32( row_ptr, lock.addr, lock.pitch, &r, dst_data->surface, &clip );
+                    }
                }
 
-               row_ptr += data->desc.width;
-               y++;
-          }
-
-          if (!direct) {
-               dfb_scale_linear_32( data->image, data->desc.width, data->desc.height,
-                                    lock.addr, lock.pitch, &rect, dst_data->surface, &clip );
-
-               if (data->render_callback) {
-                    DFBRectangle r = { 0, 0, data->desc.width, data->desc.height };
+               if (direct && data->render_callback) {
+                    DFBRectangle r = { area.x, area.y + y, area.w, 1 };
 
                     cb_result = data->render_callback( &r, data->render_callback_context );
                }
@@ -533,30 +1155,46 @@ IDirectFBImageProvider_JPEG_RenderTo( IDirectFBImageProvider *thiz,
 
           if (cb_result != DIRCR_OK) {
                jpeg_abort_decompress( &cinfo );
-               D_FREE( data->image );
-               data->image = NULL;
+
+               if (data->image) {
+                    D_FREE( data->image );
+                    data->image = NULL;
+               }
+
                ret = DFB_INTERRUPTED;
           }
           else {
-               jpeg_finish_decompress( &cinfo );
+               /* Rows below the area are not decoded. */
+               if (cinfo.output_scanline < cinfo.output_height)
+                    jpeg_abort_decompress( &cinfo );
+               else
+                    jpeg_finish_decompress( &cinfo );
+
+               if (!direct) {
+                    render_image( data, &lock, dst_data->surface, &rect, &clip );
+
+                    if (data->render_callback)
+                         cb_result = data->render_callback( &data->image_rect, data->render_callback_context );
+               }
+
+               if (data->image && data->cache &&
+                   area.w == data->sizes[scale-1].w && area.h == data->sizes[scale-1].h)
+                    data->image = image_cache_insert( &data->cache_source, area.w, area.h, DSPF_ARGB,
+                                                      data->image, area.w * area.h * 4 );
           }
 
           jpeg_destroy_decompress( &cinfo );
      }
      else {
-          dfb_scale_linear_32( data->image, data->desc.width, data->desc.height,
-                               lock.addr, lock.pitch, &rect, dst_data->surface, &clip );
-
-          if (data->render_callback) {
-               DFBRectangle r = { 0, 0, data->desc.width, data->desc.height };
+          render_image( data, &lock, dst_data->surface, &rect, &clip );
 
-               data->render_callback( &r, data->render_callback_context );
-          }
+          if (data->render_callback)
+               data->render_callback( &data->image_rect, data->render_callback_context );
      }
 
      dfb_surface_unlock_buffer( dst_data->surface, &lock );
 
-     return DFB_OK;
+     return ret;
 }
 
 static DFBResult
@@ -620,6 +1258,8 @@ Construct( IDirectFBImageProvider *thiz,
            IDirectFB              *idirectfb )
 {
      DFBResult                     ret;
+     int                           i;
+     const char                   *value;
      struct jpeg_decompress_struct cinfo;
      struct jpeg_error             jerr;
 
@@ -646,17 +1286,51 @@ Construct( IDirectFBImageProvider *thiz,
      jpeg_create_decompress( &cinfo );
      jpeg_buffer_src( &cinfo, buffer, 1 );
      jpeg_read_header( &cinfo, TRUE );
-     jpeg_start_decompress( &cinfo );
+
+     /* Output sizes for the scaling factors, as computed by the library. */
+     for (i = 0; i < D_ARRAY_SIZE(data->sizes); i++) {
+          cinfo.scale_num   = i + 1;
+          cinfo.scale_denom = 8;
+          jpeg_calc_output_dimensions( &cinfo );
+
+          data->sizes[i].w = cinfo.output_width;
+          data->sizes[i].h = cinfo.output_height;
+     }
+
+     /* Decoding in bands needs restart markers in a single sequential scan of all components. */
+     if (cinfo.restart_interval && !cinfo.progressive_mode && cinfo.comps_in_scan == cinfo.num_components) {
+          int mcu_width = DCTSIZE;
+
+          data->mcu_height = DCTSIZE;
+
+          if (cinfo.comps_in_scan > 1) {
+               mcu_width        *= cinfo.max_h_samp_factor;
+               data->mcu_height *= cinfo.max_v_samp_factor;
+          }
+
+          data->restart_interval = cinfo.restart_interval;
+          data->mcus_per_row     = (cinfo.image_width + mcu_width - 1) / mcu_width;
+     }
+
+     /* Number of threads decoding bands, 0 for one thread per online CPU. */
+     if ((value = direct_getenv( "JPEG_THREADS" )))
+          data->threads = atoi( value );
+
+     if (data->threads <= 0)
+          data->threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+     data->threads = CLAMP( data->threads, 1, MAX_THREADS );
+
+     data->cache = image_cache_source( buffer, &data->cache_source );
 
      data->desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
-     data->desc.width       = cinfo.output_width;
-     data->desc.height      = cinfo.output_height;
+     data->desc.width       = data->sizes[7].w;
+     data->desc.height      = data->sizes[7].h;
      data->desc.pixelformat = dfb_primary_layer_pixelformat();
 
-     jpeg_abort_decompress( &cinfo );
      jpeg_destroy_decompress( &cinfo );
 
-     if ((cinfo.output_width == 0) || (cinfo.output_height == 0)) {
+     if ((data->desc.width == 0) || (data->desc.height == 0)) {
           ret = DFB_FAILURE;
           goto error;
      }
@@ -24,6 +24,8 @@
 #define  NANOSVGRAST_IMPLEMENTATION
 #include <nanosvgrast.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_NanoSVG, "ImageProvider/NanoSVG", "NanoSVG Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -61,8 +63,8 @@ IDirectFBImageProvider_NanoSVG_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_NanoSVG, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
 }
@@ -246,6 +248,8 @@ Construct( IDirectFBImageProvider *thiz,
      NSVGimage                *im          = NULL;
      NSVGrasterizer           *rast        = NULL;
      IDirectFBDataBuffer_data *buffer_data = buffer->priv;
+     ImageCacheSource          source;
+     bool                      cache;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IDirectFBImageProvider_NanoSVG )
 
@@ -301,23 +305,33 @@ Construct( IDirectFBImageProvider *thiz,
      width  = im->width;
      height = im->height;
 
-     /* Allocate image data. */
-     data->image = D_CALLOC( height, width * 4 );
+     /* The rasterized image may have been cached by another provider. */
+     cache = image_cache_source( buffer, &source );
+     if (cache)
+          data->image = image_cache_lookup( &source, width, height, DSPF_ABGR );
+
      if (!data->image) {
-          ret = D_OOM();
-          goto error;
-     }
+          /* Allocate image data. */
+          data->image = D_CALLOC( height, width * 4 );
+          if (!data->image) {
+               ret = D_OOM();
+               goto error;
+          }
 
-     rast = nsvgCreateRasterizer();
-     if (!rast) {
-          D_ERROR( "ImageProvider/NanoSVG: Failed to create rasterizer!\n" );
-          ret = DFB_FAILURE;
-          goto error;
-     }
+          rast = nsvgCreateRasterizer();
+          if (!rast) {
+               D_ERROR( "ImageProvider/NanoSVG: Failed to create rasterizer!\n" );
+               ret = DFB_FAILURE;
+               goto error;
+          }
+
+          nsvgRasterize( rast, im, 0, 0, 1, data->image, width, height, width * 4 );
 
-     nsvgRasterize( rast, im, 0, 0, 1, data->image, width, height, width * 4 );
+          nsvgDeleteRasterizer( rast );
 
-     nsvgDeleteRasterizer( rast );
+          if (cache)
+               data->image = image_cache_insert( &source, width, height, DSPF_ABGR, data->image, height * width * 4 );
+     }
 
      nsvgDelete( im );
 
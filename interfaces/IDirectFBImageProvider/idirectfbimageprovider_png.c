@@ -25,6 +25,8 @@
 #include <misc/gfx_util.h>
 #include <png.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_PNG, "ImageProvider/PNG", "PNG Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -66,6 +68,9 @@ typedef struct {
      DFBColor               colors[256];
      void                  *image;
 
+     bool                   cache;                   /* decoded image shared through the image cache */
+     ImageCacheSource       cache_source;
+
      DFBSurfaceDescription  desc;
 
      DIRenderCallback       render_callback;
@@ -93,9 +98,8 @@ IDirectFBImageProvider_PNG_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_PNG, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     if (data->image)
-          D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      /* Destroy the PNG read handle. */
      png_destroy_read_struct( &data->png_ptr, &data->info_ptr, NULL );
@@ -187,6 +191,7 @@ IDirectFBImageProvider_PNG_RenderTo( IDirectFBImageProvider *thiz,
      CoreSurfaceBufferLock  lock;
      int                    bit_depth;
      int                    x, y;
+     int                    stage;
 
      DIRECT_INTERFACE_GET_DATA( IDirectFBImageProvider_PNG )
 
@@ -213,6 +218,16 @@ IDirectFBImageProvider_PNG_RenderTo( IDirectFBImageProvider *thiz,
      else
           rect = dst_data->area.wanted;
 
+     /* The decoded image may have been cached by another provider. */
+     if (data->stage == STAGE_INFO && data->cache) {
+          data->image = image_cache_lookup( &data->cache_source, data->desc.width, data->desc.height,
+                                            data->desc.pixelformat );
+          if (data->image)
+               data->stage = STAGE_END;
+     }
+
+     stage = data->stage;
+
      /* setjmp() must be called in every function that calls a PNG-reading libpng function. */
      if (setjmp( png_jmpbuf( data->png_ptr ) )) {
           D_ERROR( "ImageProvider/PNG: Error during decoding!\n" );
@@ -229,6 +244,11 @@ IDirectFBImageProvider_PNG_RenderTo( IDirectFBImageProvider *thiz,
           ret = push_data_until_stage( data, STAGE_END, 16384 );
           if (ret)
                return ret;
+
+          if (stage < STAGE_END && data->stage == STAGE_END && data->cache)
+               data->image = image_cache_insert( &data->cache_source, data->desc.width, data->desc.height,
+                                                 data->desc.pixelformat, data->image,
+                                                 data->desc.height * data->pitch );
      }
 
      clipped = rect;
@@ -450,6 +470,8 @@ Construct( IDirectFBImageProvider *thiz,
           goto error;
      }
 
+     data->cache = image_cache_source( buffer, &data->cache_source );
+
      thiz->AddRef                = IDirectFBImageProvider_PNG_AddRef;
      thiz->Release               = IDirectFBImageProvider_PNG_Release;
      thiz->GetSurfaceDescription = IDirectFBImageProvider_PNG_GetSurfaceDescription;
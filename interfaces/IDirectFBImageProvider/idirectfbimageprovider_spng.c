@@ -20,6 +20,8 @@
 #include <display/idirectfbsurface.h>
 #include <media/idirectfbimageprovider.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_SPNG, "ImageProvider/SPNG", "SPNG Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -42,6 +44,9 @@ typedef struct {
 
      void                  *image;
 
+     bool                   cache;                   /* decoded image shared through the image cache */
+     ImageCacheSource       cache_source;
+
      DFBSurfaceDescription  desc;
 
      DIRenderCallback       render_callback;
@@ -79,8 +84,8 @@ IDirectFBImageProvider_SPNG_Destruct( IDirectFBImageProvider *thiz )
 
      D_DEBUG_AT( ImageProvider_SPNG, "%s( %p )\n", __FUNCTION__, thiz );
 
-     /* Deallocate image data. */
-     D_FREE( data->image );
+     /* Release image data. */
+     image_cache_release( data->image );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
 }
@@ -287,6 +292,15 @@ Construct( IDirectFBImageProvider *thiz,
           goto error;
      }
 
+     data->cache = image_cache_source( buffer, &data->cache_source );
+
+     /* The decoded image may have been cached by another provider. */
+     if (data->cache)
+          data->image = image_cache_lookup( &data->cache_source, ihdr.width, ihdr.height, DSPF_ABGR );
+
+     if (data->image)
+          goto out;
+
      result = spng_decoded_image_size( spng, SPNG_FMT_RGBA8, &size );
      if (result) {
           D_ERROR( "ImageProvider/SPNG: Failed to get image output buffer size!\n" );
@@ -308,6 +322,11 @@ Construct( IDirectFBImageProvider *thiz,
           goto error;
      }
 
+     if (data->cache)
+          data->image = image_cache_insert( &data->cache_source, ihdr.width, ihdr.height, DSPF_ABGR,
+                                            data->image, size );
+
+out:
      spng_ctx_free( spng );
 
      data->desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
@@ -325,8 +344,7 @@ Construct( IDirectFBImageProvider *thiz,
      return DFB_OK;
 
 error:
-     if (data->image)
-          D_FREE( data->image );
+     image_cache_release( data->image );
 
      if (spng)
           spng_ctx_free( spng );
@@ -20,6 +20,8 @@
 #include <media/idirectfbimageprovider.h>
 #include <webp/decode.h>
 
+#include "image_cache.h"
+
 D_DEBUG_DOMAIN( ImageProvider_WebP, "ImageProvider/WebP", "WebP Image Provider" );
 
 static DFBResult Probe    ( IDirectFBImageProvider_ProbeContext *ctx );
@@ -44,6 +46,12 @@ typedef struct {
      size_t                 image_size;
      uint8_t               *image;
 
+     void                  *decoded;                 /* decoded image */
+     int                    pitch;
+
+     bool                   cache;                   /* decoded image shared through the image cache */
+     ImageCacheSource       cache_source;
+
      DFBSurfaceDescription  desc;
 
      DIRenderCallback       render_callback;
@@ -62,6 +70,9 @@ IDirectFBImageProvider_WebP_Destruct( IDirectFBImageProvider *thiz )
      /* Deallocate image data. */
      D_FREE( data->image );
 
+     /* Release decoded image data. */
+     image_cache_release( data->decoded );
+
      /* Decrease the data buffer reference counter. */
      if (data->buffer)
           data->buffer->Release( data->buffer );
@@ -126,6 +137,63 @@ IDirectFBImageProvider_WebP_GetImageDescription( IDirectFBImageProvider *thiz,
      return DFB_OK;
 }
 
+static DFBResult
+decode_image( IDirectFBImageProvider_WebP_data *data )
+{
+     DFBResult          ret;
+     WebPDecoderConfig  config;
+     unsigned int       len;
+     VP8StatusCode      status;
+     void              *image;
+     WebPIDecoder      *idec;
+
+     ret = data->buffer->SeekTo( data->buffer, 0 );
+     if (ret)
+          return ret;
+
+     /* Allocate decoded image data. */
+     image = D_MALLOC( data->pitch * data->desc.height );
+     if (!image)
+          return D_OOM();
+
+     idec = WebPINewDecoder( &config.output );
+
+     config.output.colorspace         = (data->desc.pixelformat == DSPF_ARGB) ? MODE_bgrA : MODE_BGR;
+     config.output.u.RGBA.rgba        = image;
+     config.output.u.RGBA.stride      = data->pitch;
+     config.output.u.RGBA.size        = data->pitch * data->desc.height;
+     config.output.is_external_memory = 1;
+
+     status = VP8_STATUS_NOT_ENOUGH_DATA;
+
+     while (data->buffer->HasData( data->buffer ) == DFB_OK) {
+          ret = data->buffer->GetData( data->buffer, data->image_size, data->image, &len );
+          if (ret)
+               break;
+
+          status = WebPIAppend( idec, data->image, len );
+          if (!(status == VP8_STATUS_OK || status == VP8_STATUS_SUSPENDED))
+               break;
+     }
+
+     WebPIDelete( idec );
+
+     WebPFreeDecBuffer( &config.output );
+
+     if (ret || status != VP8_STATUS_OK) {
+          D_FREE( image );
+          return ret ?: DFB_FAILURE;
+     }
+
+     if (data->cache)
+          image = image_cache_insert( &data->cache_source, data->desc.width, data->desc.height, data->desc.pixelformat,
+                                      image, data->pitch * data->desc.height );
+
+     data->decoded = image;
+
+     return DFB_OK;
+}
+
 static DFBResult
 IDirectFBImageProvider_WebP_RenderTo( IDirectFBImageProvider *thiz,
                                       IDirectFBSurface       *destination,
@@ -136,13 +204,8 @@ IDirectFBImageProvider_WebP_RenderTo( IDirectFBImageProvider *thiz,
      DFBRectangle           rect;
      DFBRegion              clip;
      DFBRegion              old_clip;
-     WebPDecoderConfig      config;
-     unsigned int           len;
-     VP8StatusCode          status;
-     int                    pitch;
-     void                  *ptr;
+     DFBSurfaceDescription  desc;
      IDirectFBSurface      *source;
-     WebPIDecoder          *idec;
 
      DIRECT_INTERFACE_GET_DATA( IDirectFBImageProvider_WebP )
 
@@ -173,46 +236,26 @@ IDirectFBImageProvider_WebP_RenderTo( IDirectFBImageProvider *thiz,
      else
           clip = DFB_REGION_INIT_FROM_RECTANGLE( &rect );
 
-     ret = data->buffer->SeekTo( data->buffer, 0 );
-     if (ret)
-          return ret;
-
-     ret = data->idirectfb->CreateSurface( data->idirectfb, &data->desc, &source );
-     if (ret)
-          return ret;
-
-     source->Lock( source, DSLF_WRITE, &ptr, &pitch );
-
-     idec = WebPINewDecoder( &config.output );
-
-     config.output.colorspace         = (data->desc.pixelformat == DSPF_ARGB) ? MODE_bgrA : MODE_BGR;
-     config.output.u.RGBA.rgba        = ptr;
-     config.output.u.RGBA.stride      = pitch;
-     config.output.u.RGBA.size        = pitch * data->desc.height;
-     config.output.is_external_memory = 1;
-
-     status = VP8_STATUS_NOT_ENOUGH_DATA;
+     /* The decoded image may have been cached by another provider. */
+     if (!data->decoded && data->cache)
+          data->decoded = image_cache_lookup( &data->cache_source, data->desc.width, data->desc.height,
+                                              data->desc.pixelformat );
 
-     while (data->buffer->HasData( data->buffer ) == DFB_OK) {
-          ret = data->buffer->GetData( data->buffer, data->image_size, data->image, &len );
+     if (!data->decoded) {
+          ret = decode_image( data );
           if (ret)
-               break;
-
-          status = WebPIAppend( idec, data->image, len );
-          if (!(status == VP8_STATUS_OK || status == VP8_STATUS_SUSPENDED))
-               break;
+               return ret;
      }
 
-     WebPIDelete( idec );
-
-     WebPFreeDecBuffer( &config.output );
+     desc = data->desc;
 
-     source->Unlock( source );
+     desc.flags                 |= DSDESC_PREALLOCATED;
+     desc.preallocated[0].data   = data->decoded;
+     desc.preallocated[0].pitch  = data->pitch;
 
-     if (ret || status != VP8_STATUS_OK) {
-          source->Release( source );
-          return ret ?: DFB_FAILURE;
-     }
+     ret = data->idirectfb->CreateSurface( data->idirectfb, &desc, &source );
+     if (ret)
+          return ret;
 
      destination->GetClip( destination, &old_clip );
 
@@ -226,6 +269,12 @@ IDirectFBImageProvider_WebP_RenderTo( IDirectFBImageProvider *thiz,
 
      source->Release( source );
 
+     /* Without the cache, the image is decoded again for each rendering as before. */
+     if (!data->cache) {
+          image_cache_release( data->decoded );
+          data->decoded = NULL;
+     }
+
      if (data->render_callback) {
           DFBRectangle r = { 0, 0, data->desc.width, data->desc.height };
 
@@ -315,6 +364,10 @@ Construct( IDirectFBImageProvider *thiz,
      data->desc.pixelformat = features.has_alpha ? DSPF_ARGB : DSPF_RGB24;
      data->desc.caps        = DFB_PIXELFORMAT_HAS_ALPHA( data->desc.pixelformat ) ? DSCAPS_PREMULTIPLIED : DSCAPS_NONE;
 
+     data->pitch = DFB_BYTES_PER_LINE( data->desc.pixelformat, data->desc.width );
+
+     data->cache = image_cache_source( buffer, &data->cache_source );
+
      thiz->AddRef                = IDirectFBImageProvider_WebP_AddRef;
      thiz->Release               = IDirectFBImageProvider_WebP_Release;
      thiz->GetSurfaceDescription = IDirectFBImageProvider_WebP_GetSurfaceDescription;
@@ -0,0 +1,321 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#include <direct/clock.h>
+#include <direct/list.h>
+#include <direct/system.h>
+#include <direct/thread.h>
+#include <media/idirectfbdatabuffer.h>
+#include <sys/stat.h>
+
+#include "image_cache.h"
+
+D_DEBUG_DOMAIN( ImageCache, "ImageProvider/Cache", "Decoded Image Cache" );
+
+typedef struct {
+     DirectLink             link;
+
+     ImageCacheSource       source;
+     int                    width;
+     int                    height;
+     DFBSurfacePixelFormat  format;
+
+     void                  *image;      /* decoded image */
+     unsigned int           bytes;      /* size of the decoded image */
+     int                    refs;       /* number of providers using the image */
+} ImageCacheEntry;
+
+static struct {
+     DirectMutex            lock;
+
+     DirectLink            *entries;    /* most recently used first */
+
+     ImageCacheStats        stats;
+
+     long long              report;     /* interval of the statistics report in milliseconds, 0 if disabled */
+     long long              reported;   /* time of the last statistics report */
+} image_cache;
+
+/**********************************************************************************************************************/
+
+static bool
+image_cache_match( const ImageCacheEntry  *entry,
+                   const ImageCacheSource *source,
+                   int                     width,
+                   int                     height,
+                   DFBSurfacePixelFormat   format )
+{
+     return entry->source.dev        == source->dev        &&
+            entry->source.ino        == source->ino        &&
+            entry->source.size       == source->size       &&
+            entry->source.mtime      == source->mtime      &&
+            entry->source.mtime_nsec == source->mtime_nsec &&
+            entry->width == width && entry->height == height && entry->format == format;
+}
+
+/*
+ * Mutex must already be locked.
+ */
+static void
+image_cache_evict( void )
+{
+     ImageCacheEntry *entry;
+     DirectLink      *prev;
+
+     /* Walk from the least recently used image, skipping the ones in use. */
+     entry = image_cache.entries ? (ImageCacheEntry*) image_cache.entries->prev : NULL;
+
+     while (entry && image_cache.stats.used > image_cache.stats.budget) {
+          prev = &entry->link != image_cache.entries ? entry->link.prev : NULL;
+
+          if (!entry->refs) {
+               image_cache.stats.used -= entry->bytes;
+               image_cache.stats.images--;
+               image_cache.stats.evictions++;
+
+               D_DEBUG_AT( ImageCache, "  -> evicting %dx%d image, used %lu, evictions %lu\n",
+                           entry->width, entry->height, image_cache.stats.used, image_cache.stats.evictions );
+
+               direct_list_remove( &image_cache.entries, &entry->link );
+
+               D_FREE( entry->image );
+               D_FREE( entry );
+          }
+
+          entry = (ImageCacheEntry*) prev;
+     }
+}
+
+/*
+ * Mutex must already be locked.
+ */
+static void
+image_cache_report( void )
+{
+     long long now = direct_clock_get_millis();
+
+     if (now - image_cache.reported < image_cache.report)
+          return;
+
+     image_cache.reported = now;
+
+     D_INFO( "ImageProvider/Cache: %lu hits, %lu misses, %lu evictions, %u images using %lu of %lu bytes\n",
+             image_cache.stats.hits, image_cache.stats.misses, image_cache.stats.evictions,
+             image_cache.stats.images, image_cache.stats.used, image_cache.stats.budget );
+}
+
+/**********************************************************************************************************************/
+
+bool
+image_cache_source( IDirectFBDataBuffer *buffer,
+                    ImageCacheSource    *ret_source )
+{
+     IDirectFBDataBuffer_data *buffer_data = buffer->priv;
+     struct stat               st;
+
+     if (!image_cache.stats.budget)
+          return false;
+
+     /* Memory buffers would have to be compared in full on each lookup to be identified reliably. */
+     if (buffer_data->buffer || !buffer_data->filename)
+          return false;
+
+     if (stat( buffer_data->filename, &st ) || !S_ISREG( st.st_mode ))
+          return false;
+
+     ret_source->dev        = st.st_dev;
+     ret_source->ino        = st.st_ino;
+     ret_source->size       = st.st_size;
+     ret_source->mtime      = st.st_mtime;
+     ret_source->mtime_nsec = st.st_mtim.tv_nsec;
+
+     D_DEBUG_AT( ImageCache, "%s( '%s' ) -> inode %lu, %lld bytes\n", __FUNCTION__,
+                 buffer_data->filename, (unsigned long) st.st_ino, (long long) st.st_size );
+
+     return true;
+}
+
+void *
+image_cache_lookup( const ImageCacheSource *source,
+                    int                     width,
+                    int                     height,
+                    DFBSurfacePixelFormat   format )
+{
+     ImageCacheEntry *entry;
+     void            *image = NULL;
+
+     direct_mutex_lock( &image_cache.lock );
+
+     direct_list_foreach (entry, image_cache.entries) {
+          if (image_cache_match( entry, source, width, height, format )) {
+               entry->refs++;
+
+               direct_list_move_to_front( &image_cache.entries, &entry->link );
+
+               image = entry->image;
+               break;
+          }
+     }
+
+     if (image)
+          image_cache.stats.hits++;
+     else
+          image_cache.stats.misses++;
+
+     D_DEBUG_AT( ImageCache, "%s( %dx%d ) -> %s, hits %lu, misses %lu\n", __FUNCTION__,
+                 width, height, image ? "hit" : "miss", image_cache.stats.hits, image_cache.stats.misses );
+
+     if (image_cache.report)
+          image_cache_report();
+
+     direct_mutex_unlock( &image_cache.lock );
+
+     return image;
+}
+
+void *
+image_cache_insert( const ImageCacheSource *source,
+                    int                     width,
+                    int                     height,
+                    DFBSurfacePixelFormat   format,
+                    void                   *image,
+                    unsigned int            bytes )
+{
+     ImageCacheEntry *entry;
+
+     direct_mutex_lock( &image_cache.lock );
+
+     direct_list_foreach (entry, image_cache.entries) {
+          if (image_cache_match( entry, source, width, height, format )) {
+               entry->refs++;
+
+               direct_mutex_unlock( &image_cache.lock );
+
+               D_FREE( image );
+
+               return entry->image;
+          }
+     }
+
+     /* Images exceeding the whole budget are not cached. */
+     if (bytes <= image_cache.stats.budget) {
+          entry = D_CALLOC( 1, sizeof(ImageCacheEntry) );
+          if (entry) {
+               entry->source = *source;
+               entry->width  = width;
+               entry->height = height;
+               entry->format = format;
+               entry->image  = image;
+               entry->bytes  = bytes;
+               entry->refs   = 1;
+
+               direct_list_prepend( &image_cache.entries, &entry->link );
+
+               image_cache.stats.used += bytes;
+               image_cache.stats.images++;
+
+               D_DEBUG_AT( ImageCache, "%s( %dx%d ) -> used %lu\n", __FUNCTION__,
+                           width, height, image_cache.stats.used );
+
+               image_cache_evict();
+          }
+     }
+
+     direct_mutex_unlock( &image_cache.lock );
+
+     return image;
+}
+
+void
+image_cache_release( void *image )
+{
+     ImageCacheEntry *entry;
+
+     if (!image)
+          return;
+
+     direct_mutex_lock( &image_cache.lock );
+
+     direct_list_foreach (entry, image_cache.entries) {
+          if (entry->image == image) {
+               entry->refs--;
+
+               image_cache_evict();
+
+               direct_mutex_unlock( &image_cache.lock );
+
+               return;
+          }
+     }
+
+     direct_mutex_unlock( &image_cache.lock );
+
+     D_FREE( image );
+}
+
+void
+image_cache_get_stats( ImageCacheStats *ret_stats )
+{
+     direct_mutex_lock( &image_cache.lock );
+
+     *ret_stats = image_cache.stats;
+
+     direct_mutex_unlock( &image_cache.lock );
+}
+
+/**********************************************************************************************************************/
+
+__attribute__((constructor))
+static void
+image_cache_init( void )
+{
+     const char *value;
+
+     direct_mutex_init( &image_cache.lock );
+
+     if ((value = direct_getenv( "IMAGE_CACHE_SIZE" )))
+          image_cache.stats.budget = strtoul( value, NULL, 10 ) * 1024;
+
+     if ((value = direct_getenv( "IMAGE_CACHE_REPORT" )))
+          image_cache.report = strtoul( value, NULL, 10 ) * 1000;
+
+     image_cache.reported = direct_clock_get_millis();
+}
+
+__attribute__((destructor))
+static void
+image_cache_deinit( void )
+{
+     ImageCacheEntry *entry, *next;
+
+     if (image_cache.stats.hits || image_cache.stats.misses)
+          D_INFO( "ImageProvider/Cache: %lu hits, %lu misses, %lu evictions, %lu bytes used\n",
+                  image_cache.stats.hits, image_cache.stats.misses, image_cache.stats.evictions,
+                  image_cache.stats.used );
+
+     direct_list_foreach_safe (entry, next, image_cache.entries) {
+          if (!entry->refs) {
+               D_FREE( entry->image );
+               D_FREE( entry );
+          }
+     }
+
+     image_cache.entries = NULL;
+
+     direct_mutex_deinit( &image_cache.lock );
+}
@@ -0,0 +1,91 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#ifndef __IMAGE_CACHE_H__
+#define __IMAGE_CACHE_H__
+
+#include <directfb.h>
+#include <sys/types.h>
+
+/*
+ * Cache of decoded images, shared by all the image providers of the process and enabled by setting the
+ * IMAGE_CACHE_SIZE environment variable to its memory budget in kilobytes. The cache lives in its own library linked
+ * by the providers, so there is a single cache and a single budget however many provider modules are loaded.
+ *
+ * An image is identified by its source file (device, inode, size and modification time to the nanosecond), its size
+ * and its pixel format. Memory and streamed data buffers are not cached. Providers hold a reference on the images they
+ * use, unreferenced images stay in the cache until they are evicted, least recently used first, to stay within the
+ * budget.
+ *
+ * Setting IMAGE_CACHE_REPORT to a number of seconds prints the statistics at that interval.
+ */
+
+typedef struct {
+     dev_t                  dev;
+     ino_t                  ino;
+     off_t                  size;
+     time_t                 mtime;
+     long                   mtime_nsec; /* files rewritten within the same second differ in nanoseconds only */
+} ImageCacheSource;
+
+typedef struct {
+     unsigned long          budget;     /* memory budget in bytes, 0 if the cache is disabled */
+     unsigned long          used;       /* memory used by the cached images */
+     unsigned int           images;     /* number of cached images */
+
+     unsigned long          hits;
+     unsigned long          misses;
+     unsigned long          evictions;
+} ImageCacheStats;
+
+/*
+ * Identify the source file of the data buffer, returns false if the cache is disabled or the data is not a file.
+ */
+bool  image_cache_source   ( IDirectFBDataBuffer    *buffer,
+                             ImageCacheSource       *ret_source );
+
+/*
+ * Look up a decoded image, returns the image with a reference held by the caller, or NULL.
+ */
+void *image_cache_lookup   ( const ImageCacheSource *source,
+                             int                     width,
+                             int                     height,
+                             DFBSurfacePixelFormat   format );
+
+/*
+ * Hand over a decoded image allocated with D_MALLOC() to the cache, returns the image to use with a reference held by
+ * the caller, which may be an already cached one replacing the given image.
+ */
+void *image_cache_insert   ( const ImageCacheSource *source,
+                             int                     width,
+                             int                     height,
+                             DFBSurfacePixelFormat   format,
+                             void                   *image,
+                             unsigned int            bytes );
+
+/*
+ * Drop the reference on an image, images which are not cached are freed.
+ */
+void  image_cache_release  ( void                   *image );
+
+/*
+ * Get the usage and the hit, miss and eviction counters of the cache.
+ */
+void  image_cache_get_stats( ImageCacheStats        *ret_stats );
+
+#endif
@@ -49,16 +49,15 @@ DIRECT_INTERFACE_IMPLEMENTATION( IDirectFBVideoProvider, FFmpeg )
 /**********************************************************************************************************************/
 
 typedef struct {
-     DirectLink link;
-     AVPacket   packet;
-} PacketLink;
-
-typedef struct {
-     DirectLink  *list;
-     int          size;
-     s64          max_len;
-     int          max_size;
-     DirectMutex  lock;
+     AVPacket        *packets;                              /* ring buffer of packets */
+     int              capacity;
+     int              first;                                /* index of the oldest packet */
+     int              count;
+     int              size;
+     s64              max_len;
+     int              max_size;
+     DirectMutex      lock;
+     DirectWaitQueue  cond;
 } PacketQueue;
 
 typedef struct {
@@ -66,6 +65,8 @@ typedef struct {
      IDirectFBEventBuffer *buffer;
 } EventLink;
 
+#define FRAME_RING_SIZE     4
+
 typedef struct {
      int                            ref;                    /* reference counter */
 
@@ -89,8 +90,10 @@ typedef struct {
      struct {
           DirectThread             *thread;
           DirectMutex               lock;
+          DirectWaitQueue           cond;
 
           bool                      buffering;
+          bool                      drained;
 
           bool                      seeked;
           s64                       seek_time;
@@ -111,10 +114,16 @@ typedef struct {
 
           bool                      seeked;
 
-          AVFrame                  *frame;
+          AVFrame                  *frames[FRAME_RING_SIZE];
+          int                       frame_index;
+          AVFrame                  *frame;                 /* last decoded frame */
 
           IDirectFBSurface         *dest;
           DFBRectangle              rect;
+
+          int                       scaler;                /* scaling algorithm, 0 for automatic */
+          struct SwsContext        *sws_ctx;
+          IDirectFBSurface         *source;                /* intermediate surface */
      } video;
 
 #ifdef HAVE_FUSIONSOUND
@@ -154,10 +163,18 @@ typedef struct {
 
 #define MAX_QUEUE_LEN       3 /* in seconds */
 
+#define MIN_PACKET_SIZE   256 /* in bytes */
+
+#define MIN_QUEUE_PACKETS  64
+
+#define MAX_QUEUE_PACKETS 8192
+
 #define GAP_TOLERANCE   15000 /* in microseconds */
 
 #define GAP_THRESHOLD  250000 /* in microseconds */
 
+#define MAX_THREADS        16
+
 /**********************************************************************************************************************/
 
 static __inline__ s64
@@ -240,23 +257,37 @@ av_seek_callback( void    *opaque,
      return pos;
 }
 
+static DFBResult
+init_packets( PacketQueue *queue )
+{
+     /* The ring is sized for the smallest packets expected to fill the queue up to its maximum size. */
+     queue->capacity = CLAMP( queue->max_size / MIN_PACKET_SIZE, MIN_QUEUE_PACKETS, MAX_QUEUE_PACKETS );
+
+     queue->packets = D_CALLOC( queue->capacity, sizeof(AVPacket) );
+     if (!queue->packets)
+          return D_OOM();
+
+     return DFB_OK;
+}
+
 static bool
 put_packet( PacketQueue *queue,
             AVPacket    *pkt )
 {
-     PacketLink *p;
+     direct_mutex_lock( &queue->lock );
 
-     p = D_MALLOC( sizeof(PacketLink) );
-     if (!p) {
-          D_OOM();
+     if (queue->count == queue->capacity) {
+          direct_mutex_unlock( &queue->lock );
+          av_packet_unref( pkt );
           return false;
      }
 
-     p->packet = *pkt;
-
-     direct_mutex_lock( &queue->lock );
-     direct_list_append( &queue->list, &p->link );
+     queue->packets[(queue->first + queue->count) % queue->capacity] = *pkt;
+     queue->count++;
      queue->size += pkt->size;
+
+     direct_waitqueue_signal( &queue->cond );
+
      direct_mutex_unlock( &queue->lock );
 
      return true;
@@ -266,55 +297,139 @@ static bool
 get_packet( PacketQueue *queue,
             AVPacket    *pkt )
 {
-     PacketLink *p;
+     bool ret = false;
 
      direct_mutex_lock( &queue->lock );
-     p = (PacketLink*) queue->list;
-     if (p) {
-          direct_list_remove( &queue->list, &p->link );
-          queue->size -= p->packet.size;
-          *pkt = p->packet;
-          D_FREE( p );
+
+     if (queue->count) {
+          *pkt = queue->packets[queue->first];
+
+          queue->first = (queue->first + 1) % queue->capacity;
+          queue->count--;
+          queue->size -= pkt->size;
+
+          ret = true;
      }
+
      direct_mutex_unlock( &queue->lock );
 
-     return (p != NULL);
+     return ret;
 }
 
 static void
 flush_packets( PacketQueue *queue )
 {
-     PacketLink *p;
-
-     for (p = (PacketLink*) queue->list; p;) {
-          PacketLink *next = (PacketLink*) p->link.next;
-          direct_list_remove( &queue->list, &p->link );
-          av_packet_unref( &p->packet );
-          D_FREE( p );
-          p = next;
+     direct_mutex_lock( &queue->lock );
+
+     while (queue->count) {
+          av_packet_unref( &queue->packets[queue->first] );
+
+          queue->first = (queue->first + 1) % queue->capacity;
+          queue->count--;
      }
 
-     queue->list = NULL;
-     queue->size = 0;
+     queue->first = 0;
+     queue->size  = 0;
+
+     direct_mutex_unlock( &queue->lock );
 }
 
 static bool
 queue_is_full( PacketQueue *queue )
 {
-     PacketLink *first, *last;
+     AVPacket *first, *last;
+     bool      full = false;
 
-     if (!queue->list)
-          return false;
+     direct_mutex_lock( &queue->lock );
+
+     if (queue->count) {
+          first = &queue->packets[queue->first];
+          last  = &queue->packets[(queue->first + queue->count - 1) % queue->capacity];
+
+          if (first->dts != AV_NOPTS_VALUE && last->dts != AV_NOPTS_VALUE)
+               full = (last->dts - first->dts) >= queue->max_len;
 
-     first = (PacketLink*) queue->list;
-     last  = (PacketLink*) first->link.prev;
+          if (queue->size >= queue->max_size || queue->count == queue->capacity)
+               full = true;
+     }
+
+     direct_mutex_unlock( &queue->lock );
+
+     return full;
+}
 
-     if (first->packet.dts != AV_NOPTS_VALUE && last->packet.dts != AV_NOPTS_VALUE) {
-          if ((last->packet.dts - first->packet.dts) >= queue->max_len)
-               return true;
+static void
+wake_packets( PacketQueue *queue )
+{
+     direct_mutex_lock( &queue->lock );
+     direct_waitqueue_broadcast( &queue->cond );
+     direct_mutex_unlock( &queue->lock );
+}
+
+static void
+set_decoder_threads( AVCodecContext *codec_ctx )
+{
+     const char *value;
+     int         thread_count = 0;
+     int         thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+     /* Number of decoding threads, 0 for one thread per online CPU. */
+     if ((value = direct_getenv( "FFMPEG_THREADS" )))
+          thread_count = atoi( value );
+
+     if (thread_count <= 0)
+          thread_count = sysconf( _SC_NPROCESSORS_ONLN );
+
+     thread_count = CLAMP( thread_count, 1, MAX_THREADS );
+
+     /* Threading method: 'frame', 'slice' or 'auto' (both, chosen by the decoder). */
+     if ((value = direct_getenv( "FFMPEG_THREAD_TYPE" ))) {
+          if (!strcmp( value, "frame" ))
+               thread_type = FF_THREAD_FRAME;
+          else if (!strcmp( value, "slice" ))
+               thread_type = FF_THREAD_SLICE;
+          else if (strcmp( value, "auto" ))
+               D_ERROR( "VideoProvider/FFmpeg: Unknown thread type '%s'!\n", value );
      }
 
-     return (queue->size >= queue->max_size);
+     D_DEBUG_AT( VideoProvider_FFmpeg, "  -> %d decoding thread(s), type 0x%x\n", thread_count, thread_type );
+
+     codec_ctx->thread_count = thread_count;
+     codec_ctx->thread_type  = thread_type;
+}
+
+static AVCodecContext *
+open_decoder( AVStream *st,
+              bool      threads )
+{
+     const AVCodec  *codec;
+     AVCodecContext *codec_ctx;
+
+     codec = avcodec_find_decoder( st->codecpar->codec_id );
+     if (!codec)
+          return NULL;
+
+     codec_ctx = avcodec_alloc_context3( codec );
+     if (!codec_ctx)
+          return NULL;
+
+     if (avcodec_parameters_to_context( codec_ctx, st->codecpar ) < 0)
+          goto error;
+
+     codec_ctx->pkt_timebase = st->time_base;
+
+     if (threads)
+          set_decoder_threads( codec_ctx );
+
+     if (avcodec_open2( codec_ctx, codec, NULL ) < 0)
+          goto error;
+
+     return codec_ctx;
+
+error:
+     avcodec_free_context( &codec_ctx );
+
+     return NULL;
 }
 
 static void
@@ -339,19 +454,56 @@ dispatch_event( IDirectFBVideoProvider_FFmpeg_data *data,
      direct_mutex_unlock( &data->events_lock );
 }
 
+static void
+set_buffering( IDirectFBVideoProvider_FFmpeg_data *data,
+               bool                                buffering )
+{
+     if (data->input.buffering == buffering)
+          return;
+
+     direct_mutex_lock( &data->video.queue.lock );
+#ifdef HAVE_FUSIONSOUND
+     direct_mutex_lock( &data->audio.queue.lock );
+#endif
+
+     data->input.buffering = buffering;
+
+     /* Wake up the decoder threads when buffering is over. */
+     if (!buffering) {
+          direct_waitqueue_broadcast( &data->video.queue.cond );
+#ifdef HAVE_FUSIONSOUND
+          direct_waitqueue_broadcast( &data->audio.queue.cond );
+#endif
+     }
+
+#ifdef HAVE_FUSIONSOUND
+     direct_mutex_unlock( &data->audio.queue.lock );
+#endif
+     direct_mutex_unlock( &data->video.queue.lock );
+}
+
+static void
+wait_packet( IDirectFBVideoProvider_FFmpeg_data *data,
+             PacketQueue                        *queue )
+{
+     direct_mutex_lock( &queue->lock );
+
+     while ((data->input.buffering || !queue->count) && data->status != DVSTATE_STOP)
+          direct_waitqueue_wait( &queue->cond, &queue->lock );
+
+     direct_mutex_unlock( &queue->lock );
+}
+
 static void *
 FFmpegInput( DirectThread *thread,
              void         *arg )
 {
      IDirectFBVideoProvider_FFmpeg_data *data = arg;
 
-     if (!data->seekable) {
-          data->input.buffering = true;
-          direct_mutex_lock( &data->video.queue.lock );
-#ifdef HAVE_FUSIONSOUND
-          direct_mutex_lock( &data->audio.queue.lock );
-#endif
-     }
+     if (!data->seekable)
+          set_buffering( data, true );
+
+     data->input.drained = false;
 
 #ifdef HAVE_FUSIONSOUND
      data->audio.pts = -1;
@@ -376,17 +528,14 @@ FFmpegInput( DirectThread *thread,
                     flush_packets( &data->audio.queue );
 #endif
 
-                    if (!data->input.buffering && !data->seekable) {
-                         data->input.buffering = true;
-                         direct_mutex_lock( &data->video.queue.lock );
-#ifdef HAVE_FUSIONSOUND
-                         direct_mutex_lock( &data->audio.queue.lock );
-#endif
-                    }
+                    if (!data->seekable)
+                         set_buffering( data, true );
 
                     if (data->status == DVSTATE_FINISHED)
                          data->status = DVSTATE_PLAY;
 
+                    data->input.drained = false;
+
                     data->video.seeked = true;
 
 #ifdef HAVE_FUSIONSOUND
@@ -411,16 +560,10 @@ FFmpegInput( DirectThread *thread,
 #else
           if (queue_is_full( &data->video.queue )) {
 #endif
-               if (data->input.buffering) {
-#ifdef HAVE_FUSIONSOUND
-                    direct_mutex_unlock( &data->audio.queue.lock );
-#endif
-                    direct_mutex_unlock( &data->video.queue.lock );
-                    data->input.buffering = false;
-               }
+               set_buffering( data, false );
 
+               direct_waitqueue_wait_timeout( &data->input.cond, &data->input.lock, 20000 );
                direct_mutex_unlock( &data->input.lock );
-               usleep( 20000 );
                continue;
           }
 #ifdef HAVE_FUSIONSOUND
@@ -428,28 +571,32 @@ FFmpegInput( DirectThread *thread,
 #else
           else if (data->video.queue.size == 0) {
 #endif
-               if (!data->input.buffering && !data->seekable) {
-                    data->input.buffering = true;
-                    direct_mutex_lock( &data->video.queue.lock );
-#ifdef HAVE_FUSIONSOUND
-                    direct_mutex_lock( &data->audio.queue.lock );
-#endif
-               }
+               if (!data->seekable)
+                    set_buffering( data, true );
           }
 
           if (av_read_frame( data->fmt_ctx, &pkt ) < 0) {
                if (avio_feof( data->io_ctx )) {
-                    if (data->input.buffering) {
+                    set_buffering( data, false );
+
+                    /* Queue empty packets to drain the decoders. */
+                    if (!data->input.drained) {
+                         memset( &pkt, 0, sizeof(AVPacket) );
+                         pkt.pts = pkt.dts = AV_NOPTS_VALUE;
+
+                         put_packet( &data->video.queue, &pkt );
 #ifdef HAVE_FUSIONSOUND
-                         direct_mutex_unlock( &data->audio.queue.lock );
+                         if (data->audio.stream)
+                              put_packet( &data->audio.queue, &pkt );
 #endif
-                         direct_mutex_unlock( &data->video.queue.lock );
-                         data->input.buffering = false;
+
+                         data->input.drained = true;
                     }
+
 #ifdef HAVE_FUSIONSOUND
-                    if (data->video.queue.size == 0 && data->audio.queue.size == 0) {
+                    if (!data->video.queue.count && !data->audio.queue.count) {
 #else
-                    if (data->video.queue.size == 0) {
+                    if (!data->video.queue.count) {
 #endif
                          if (data->flags & DVPLAY_LOOPING) {
                               data->input.seeked    = true;
@@ -465,8 +612,13 @@ FFmpegInput( DirectThread *thread,
                     }
                }
 
+               /* Sleep until seeked or stopped when finished, otherwise wait for the queues to drain. */
+               if (data->status == DVSTATE_FINISHED && !data->input.seeked)
+                    direct_waitqueue_wait( &data->input.cond, &data->input.lock );
+               else if (!data->input.seeked)
+                    direct_waitqueue_wait_timeout( &data->input.cond, &data->input.lock, 10000 );
+
                direct_mutex_unlock( &data->input.lock );
-               usleep( 100 );
                continue;
           }
 
@@ -485,82 +637,272 @@ FFmpegInput( DirectThread *thread,
           direct_mutex_unlock( &data->input.lock );
      }
 
-     if (data->input.buffering) {
-#ifdef HAVE_FUSIONSOUND
-          direct_mutex_unlock( &data->audio.queue.lock );
-#endif
-          direct_mutex_unlock( &data->video.queue.lock );
-          data->input.buffering = false;
-     }
+     set_buffering( data, false );
 
      return NULL;
 }
 
-static void *
-FFmpegVideo( DirectThread *thread,
-             void         *arg )
+static enum AVPixelFormat
+get_pix_fmt( DFBSurfacePixelFormat format )
 {
-     long                                duration;
-     DFBSurfacePixelFormat               pixelformat;
-     enum AVPixelFormat                  pix_fmt;
-     AVFrame                             frame;
-     int                                 pitch;
-     void                               *ptr;
-     struct SwsContext                  *sws_ctx;
-     s64                                 firstpts = 0;
-     unsigned int                        framecnt = 0;
-     bool                                drop     = false;
-     IDirectFBVideoProvider_FFmpeg_data *data     = arg;
-
-     data->video.dest->GetPixelFormat( data->video.dest, &pixelformat );
-     switch (pixelformat) {
+     switch (format) {
           case DSPF_ARGB1555:
-               pix_fmt = AV_PIX_FMT_RGB555;
-               break;
+               return AV_PIX_FMT_RGB555;
           case DSPF_RGB16:
-               pix_fmt = AV_PIX_FMT_RGB565;
-               break;
+               return AV_PIX_FMT_RGB565;
           case DSPF_RGB24:
 #ifdef WORDS_BIGENDIAN
-               pix_fmt = AV_PIX_FMT_RGB24;
+               return AV_PIX_FMT_RGB24;
 #else
-               pix_fmt = AV_PIX_FMT_BGR24;
+               return AV_PIX_FMT_BGR24;
 #endif
-               break;
           case DSPF_RGB32:
           case DSPF_ARGB:
-               pix_fmt = AV_PIX_FMT_RGB32;
-               break;
+               return AV_PIX_FMT_RGB32;
           case DSPF_ABGR:
-               pix_fmt = AV_PIX_FMT_BGR32;
+               return AV_PIX_FMT_BGR32;
+          case DSPF_YUY2:
+               return AV_PIX_FMT_YUYV422;
+          case DSPF_UYVY:
+               return AV_PIX_FMT_UYVY422;
+          case DSPF_I420:
+               return AV_PIX_FMT_YUV420P;
+          case DSPF_Y42B:
+               return AV_PIX_FMT_YUV422P;
+          case DSPF_Y444:
+               return AV_PIX_FMT_YUV444P;
+          case DSPF_NV12:
+               return AV_PIX_FMT_NV12;
+          case DSPF_NV21:
+               return AV_PIX_FMT_NV21;
+          default:
+               return AV_PIX_FMT_NONE;
+     }
+}
+
+static void
+get_planes( DFBSurfacePixelFormat  format,
+            u8                    *ptr,
+            int                    pitch,
+            int                    height,
+            int                    x,
+            int                    y,
+            u8                    *planes[4],
+            int                    linesizes[4] )
+{
+     u8 *chroma = ptr + pitch * height;
+
+     memset( planes, 0, 4 * sizeof(u8*) );
+     memset( linesizes, 0, 4 * sizeof(int) );
+
+     linesizes[0] = pitch;
+
+     switch (format) {
+          case DSPF_YUY2:
+          case DSPF_UYVY:
+               planes[0] = ptr + y * pitch + (x & ~1) * 2;
+               break;
+          case DSPF_I420:
+               planes[0]    = ptr + y * pitch + x;
+               planes[1]    = chroma + y / 2 * pitch / 2 + x / 2;
+               planes[2]    = chroma + pitch / 2 * height / 2 + y / 2 * pitch / 2 + x / 2;
+               linesizes[1] = linesizes[2] = pitch / 2;
+               break;
+          case DSPF_Y42B:
+               planes[0]    = ptr + y * pitch + x;
+               planes[1]    = chroma + y * pitch / 2 + x / 2;
+               planes[2]    = chroma + pitch / 2 * height + y * pitch / 2 + x / 2;
+               linesizes[1] = linesizes[2] = pitch / 2;
+               break;
+          case DSPF_Y444:
+               planes[0]    = ptr + y * pitch + x;
+               planes[1]    = chroma + y * pitch + x;
+               planes[2]    = chroma + pitch * height + y * pitch + x;
+               linesizes[1] = linesizes[2] = pitch;
+               break;
+          case DSPF_NV12:
+          case DSPF_NV21:
+               planes[0]    = ptr + y * pitch + x;
+               planes[1]    = chroma + y / 2 * pitch + (x & ~1);
+               linesizes[1] = pitch;
                break;
           default:
-               return NULL;
+               planes[0] = ptr + y * pitch + DFB_BYTES_PER_LINE( format, x );
+               break;
      }
+}
 
-     sws_ctx = sws_getContext( data->video.codec_ctx->width, data->video.codec_ctx->height, data->video.codec_ctx->pix_fmt,
-                               data->video.rect.w, data->video.rect.h, pix_fmt,
-                               SWS_FAST_BILINEAR, NULL, NULL, NULL );
+static int
+get_scaler( IDirectFBVideoProvider_FFmpeg_data *data,
+            const AVFrame                      *frame,
+            const DFBRectangle                 *rect )
+{
+     IDirectFBSurface_data *dst_data = data->video.dest->priv;
+
+     if (data->video.scaler)
+          return data->video.scaler;
 
-     data->video.dest->Lock( data->video.dest, DSLF_WRITE, &ptr, &pitch );
-     av_image_fill_arrays(frame.data, frame.linesize, ptr, pix_fmt,
-                          data->video.codec_ctx->width, data->video.codec_ctx->height, 1);
-     data->video.dest->Unlock( data->video.dest );
+     /* Follow the smooth scaling render options of the destination. */
+     if (rect->w * rect->h < frame->width * frame->height) {
+          if (dst_data && dst_data->state.render_options & DSRO_SMOOTH_DOWNSCALE)
+               return SWS_AREA;
+     }
+     else if (rect->w * rect->h > frame->width * frame->height) {
+          if (dst_data && dst_data->state.render_options & DSRO_SMOOTH_UPSCALE)
+               return SWS_BICUBIC;
+     }
+
+     return SWS_FAST_BILINEAR;
+}
+
+static IDirectFBSurface *
+get_source( IDirectFBVideoProvider_FFmpeg_data *data,
+            int                                 width,
+            int                                 height,
+            DFBSurfacePixelFormat               format )
+{
+     DFBSurfaceDescription desc;
+
+     if (data->video.source) {
+          int                   w, h;
+          DFBSurfacePixelFormat f;
+
+          data->video.source->GetSize( data->video.source, &w, &h );
+          data->video.source->GetPixelFormat( data->video.source, &f );
+
+          if (w == width && h == height && f == format)
+               return data->video.source;
+
+          data->video.source->Release( data->video.source );
+          data->video.source = NULL;
+     }
+
+     desc.flags       = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
+     desc.width       = width;
+     desc.height      = height;
+     desc.pixelformat = format;
+
+     if (data->idirectfb->CreateSurface( data->idirectfb, &desc, &data->video.source ))
+          return NULL;
+
+     return data->video.source;
+}
+
+static void
+write_frame( const AVFrame         *frame,
+             struct SwsContext     *sws_ctx,
+             IDirectFBSurface      *surface,
+             DFBSurfacePixelFormat  format,
+             int                    x,
+             int                    y )
+{
+     int    height;
+     int    pitch;
+     void  *ptr;
+     u8    *planes[4];
+     int    linesizes[4];
+
+     surface->GetSize( surface, NULL, &height );
+
+     if (surface->Lock( surface, DSLF_WRITE, &ptr, &pitch ))
+          return;
+
+     get_planes( format, ptr, pitch, height, x, y, planes, linesizes );
+
+     if (sws_ctx)
+          sws_scale( sws_ctx, (void*) frame->data, frame->linesize, 0, frame->height, planes, linesizes );
+     else
+          av_image_copy( planes, linesizes, (void*) frame->data, frame->linesize,
+                         frame->format, frame->width, frame->height );
+
+     surface->Unlock( surface );
+}
+
+static void
+render_frame( IDirectFBVideoProvider_FFmpeg_data *data,
+              const AVFrame                      *frame )
+{
+     DFBSurfacePixelFormat  format;
+     enum AVPixelFormat     pix_fmt;
+     int                    width, height;
+     bool                   inside;
+     IDirectFBSurface      *source;
+     IDirectFBSurface      *dest = data->video.dest;
+     DFBRectangle           rect = data->video.rect;
+
+     dest->GetPixelFormat( dest, &format );
+     dest->GetSize( dest, &width, &height );
+
+     pix_fmt = get_pix_fmt( format );
+     if (pix_fmt == AV_PIX_FMT_NONE)
+          return;
+
+     inside = rect.x >= 0 && rect.x + rect.w <= width && rect.y >= 0 && rect.y + rect.h <= height;
+
+     if (frame->format == pix_fmt) {
+          /* Decoded planes are copied straight into the destination if no scaling is needed,
+             otherwise into an intermediate surface, leaving the scaling to the blitter. */
+          if (inside && rect.w == frame->width && rect.h == frame->height) {
+               write_frame( frame, NULL, dest, format, rect.x, rect.y );
+          }
+          else {
+               source = get_source( data, frame->width, frame->height, format );
+               if (source) {
+                    write_frame( frame, NULL, source, format, 0, 0 );
+
+                    dest->StretchBlit( dest, source, NULL, &rect );
+               }
+          }
+     }
+     else {
+          /* The scaler context is only recreated if the frame, the destination or the scaler changes. */
+          data->video.sws_ctx = sws_getCachedContext( data->video.sws_ctx,
+                                                      frame->width, frame->height, frame->format,
+                                                      rect.w, rect.h, pix_fmt,
+                                                      get_scaler( data, frame, &rect ), NULL, NULL, NULL );
+          if (!data->video.sws_ctx)
+               return;
+
+          if (inside) {
+               write_frame( frame, data->video.sws_ctx, dest, format, rect.x, rect.y );
+          }
+          else {
+               source = get_source( data, rect.w, rect.h, format );
+               if (source) {
+                    write_frame( frame, data->video.sws_ctx, source, format, 0, 0 );
+
+                    dest->Blit( dest, source, NULL, rect.x, rect.y );
+               }
+          }
+     }
+}
+
+static void *
+FFmpegVideo( DirectThread *thread,
+             void         *arg )
+{
+     long                                duration;
+     s64                                 firstpts = 0;
+     unsigned int                        framecnt = 0;
+     bool                                drop     = false;
+     IDirectFBVideoProvider_FFmpeg_data *data     = arg;
 
      duration = 1000000 / data->rate;
 
+     avcodec_flush_buffers( data->video.codec_ctx );
+
      while (data->status != DVSTATE_STOP) {
           AVPacket  pkt;
           long long time;
-          int       got_frame = 0;
+
+          wait_packet( data, &data->video.queue );
 
           time = direct_clock_get_abs_micros();
 
           direct_mutex_lock( &data->video.lock );
 
-          if (data->input.buffering || !get_packet( &data->video.queue, &pkt )) {
+          if (!get_packet( &data->video.queue, &pkt )) {
                direct_mutex_unlock( &data->video.lock );
-               usleep( 100 );
                continue;
           }
 
@@ -570,67 +912,81 @@ FFmpegVideo( DirectThread *thread,
                framecnt = 0;
           }
 
-          avcodec_decode_video2( data->video.codec_ctx, data->video.frame, &got_frame, &pkt );
+          /* An empty packet drains the frames still delayed in the decoder at end of stream. */
+          avcodec_send_packet( data->video.codec_ctx, pkt.data ? &pkt : NULL );
 
-          if (got_frame && !drop) {
-               sws_scale( sws_ctx, (void*) data->video.frame->data, data->video.frame->linesize,
-                          0, data->video.codec_ctx->height, frame.data, frame.linesize );
+          av_packet_unref( &pkt );
 
-               if (data->frame_callback)
-                    data->frame_callback( data->frame_callback_context );
-          }
+          /* A packet may yield no frame (decoder delay) or several frames. */
+          while (data->status != DVSTATE_STOP && !data->video.seeked) {
+               AVFrame *frame = data->video.frames[data->video.frame_index];
 
-          if (pkt.dts != AV_NOPTS_VALUE)
-               data->video.pts = av_rescale_q( pkt.dts, data->video.st->time_base, AV_TIME_BASE_Q );
-          else
-               data->video.pts += duration;
+               if (avcodec_receive_frame( data->video.codec_ctx, frame ) < 0)
+                    break;
 
-          av_packet_unref( &pkt );
+               /* Keep the previous frame referenced until the slot is reused. */
+               data->video.frame       = frame;
+               data->video.frame_index = (data->video.frame_index + 1) % FRAME_RING_SIZE;
 
-          if (!data->speed) {
-               direct_waitqueue_wait( &data->video.cond, &data->video.lock );
-          }
-          else {
-               long      length, delay;
-               long long now;
+               if (!drop) {
+                    render_frame( data, frame );
 
-               if (framecnt)
-                    duration = (data->video.pts - firstpts) / framecnt;
+                    if (data->frame_callback)
+                         data->frame_callback( data->frame_callback_context );
+               }
 
-               length = duration;
+               /* Use the timestamp of the decoded frame, as it lags behind the packets by the decoder delay. */
+               if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+                    data->video.pts = av_rescale_q( frame->best_effort_timestamp, data->video.st->time_base,
+                                                    AV_TIME_BASE_Q );
+               else
+                    data->video.pts += duration;
 
-               if (data->speed != 1.0)
-                    length = length / data->speed;
+               if (!data->speed) {
+                    direct_waitqueue_wait( &data->video.cond, &data->video.lock );
+               }
+               else {
+                    long      length, delay;
+                    long long now;
 
-               delay = data->video.pts - get_stream_clock( data );
+                    if (framecnt)
+                         duration = (data->video.pts - firstpts) / framecnt;
 
-               if (delay > -GAP_THRESHOLD && delay < GAP_THRESHOLD)
-                    delay = CLAMP( delay, -GAP_TOLERANCE, GAP_TOLERANCE );
+                    length = duration;
 
-               length += delay;
+                    if (data->speed != 1.0)
+                         length = length / data->speed;
 
-               time += length;
+                    delay = data->video.pts - get_stream_clock( data );
 
-               now = direct_clock_get_abs_micros();
-               if (time > now) {
-                    delay = time - now;
-                    direct_waitqueue_wait_timeout( &data->video.cond, &data->video.lock, delay );
-                    drop = false;
-               }
-               else {
-                    delay = now - time;
-                    drop = (delay >= duration);
+                    if (delay > -GAP_THRESHOLD && delay < GAP_THRESHOLD)
+                         delay = CLAMP( delay, -GAP_TOLERANCE, GAP_TOLERANCE );
+
+                    length += delay;
+
+                    time += length;
+
+                    now = direct_clock_get_abs_micros();
+                    if (time > now) {
+                         delay = time - now;
+                         direct_waitqueue_wait_timeout( &data->video.cond, &data->video.lock, delay );
+                         drop = false;
+                    }
+                    else {
+                         delay = now - time;
+                         drop = (delay >= duration);
+                    }
                }
+
+               if (framecnt++ == 0)
+                    firstpts = data->video.pts;
+
+               time = direct_clock_get_abs_micros();
           }
 
           direct_mutex_unlock( &data->video.lock );
-
-          if (framecnt++ == 0)
-               firstpts = data->video.pts;
      }
 
-     sws_freeContext( sws_ctx );
-
      return NULL;
 }
 
@@ -653,11 +1009,13 @@ FFmpegAudio( DirectThread *thread,
 
      swr_init( swr_ctx );
 
+     avcodec_flush_buffers( data->audio.codec_ctx );
+
      while (data->status != DVSTATE_STOP) {
           AVPacket pkt;
-          int      pkt_size;
-          int      got_frame;
-          int      length = 0;
+          bool     has_pts;
+
+          wait_packet( data, &data->audio.queue );
 
           direct_mutex_lock( &data->audio.lock );
 
@@ -667,9 +1025,8 @@ FFmpegAudio( DirectThread *thread,
                continue;
           }
 
-          if (data->input.buffering || !get_packet( &data->audio.queue, &pkt )) {
+          if (!get_packet( &data->audio.queue, &pkt )) {
                direct_mutex_unlock( &data->audio.lock );
-               usleep( 100 );
                continue;
           }
 
@@ -679,37 +1036,33 @@ FFmpegAudio( DirectThread *thread,
                data->audio.seeked = false;
           }
 
-          for (pkt_size = pkt.size; pkt_size > 0;) {
-               int decoded = avcodec_decode_audio4( data->audio.codec_ctx, data->audio.frame, &got_frame, &pkt );
-
-               if (decoded < 0)
-                    break;
-
-               pkt_size -= decoded;
+          /* An empty packet drains the frames still delayed in the decoder at end of stream. */
+          avcodec_send_packet( data->audio.codec_ctx, pkt.data ? &pkt : NULL );
 
-               length += data->audio.frame->nb_samples;
-          }
-
-          if (pkt.pts != AV_NOPTS_VALUE) {
+          has_pts = (pkt.pts != AV_NOPTS_VALUE);
+          if (has_pts)
                data->audio.pts = av_rescale_q( pkt.pts, data->audio.st->time_base, AV_TIME_BASE_Q );
-          }
-          else if (length && data->audio.pts != -1) {
-               data->audio.pts += (s64) length * AV_TIME_BASE / data->audio.codec_ctx->sample_rate;
-          }
 
           av_packet_unref( &pkt );
 
-          direct_mutex_unlock( &data->audio.lock );
+          while (!data->audio.seeked && avcodec_receive_frame( data->audio.codec_ctx, data->audio.frame ) >= 0) {
+               uint8_t *out[]  = { buf };
+               int      length = data->audio.frame->nb_samples;
 
-          if (length) {
-               uint8_t *out[] = { buf };
+               if (!has_pts && data->audio.pts != -1)
+                    data->audio.pts += (s64) length * AV_TIME_BASE / data->audio.codec_ctx->sample_rate;
 
-               swr_convert( swr_ctx, out, data->audio.codec_ctx->sample_rate, (void*) data->audio.frame->data, length );
+               direct_mutex_unlock( &data->audio.lock );
+
+               swr_convert( swr_ctx, out, data->audio.codec_ctx->sample_rate,
+                            (void*) data->audio.frame->extended_data, length );
 
                data->audio.stream->Write( data->audio.stream, buf, length );
+
+               direct_mutex_lock( &data->audio.lock );
           }
-          else
-               usleep( 1000 );
+
+          direct_mutex_unlock( &data->audio.lock );
      }
 
      swr_free( &swr_ctx );
@@ -723,6 +1076,7 @@ FFmpegAudio( DirectThread *thread,
 static void
 IDirectFBVideoProvider_FFmpeg_Destruct( IDirectFBVideoProvider *thiz )
 {
+     int                                 i;
      EventLink                          *link, *tmp;
      IDirectFBVideoProvider_FFmpeg_data *data = thiz->priv;
 
@@ -744,23 +1098,36 @@ IDirectFBVideoProvider_FFmpeg_Destruct( IDirectFBVideoProvider *thiz )
           data->audio.sound->Release( data->audio.sound );
 
      if (data->audio.codec_ctx)
-          avcodec_close( data->audio.codec_ctx );
+          avcodec_free_context( &data->audio.codec_ctx );
 
      flush_packets( &data->audio.queue );
+     if (data->audio.queue.packets)
+          D_FREE( data->audio.queue.packets );
+     direct_waitqueue_deinit( &data->audio.queue.cond );
      direct_mutex_deinit( &data->audio.queue.lock );
      direct_waitqueue_deinit( &data->audio.cond );
      direct_mutex_deinit( &data->audio.lock );
 #endif
 
-     av_frame_free( &data->video.frame );
+     if (data->video.source)
+          data->video.source->Release( data->video.source );
+
+     if (data->video.sws_ctx)
+          sws_freeContext( data->video.sws_ctx );
 
-     avcodec_close( data->video.codec_ctx );
+     for (i = 0; i < FRAME_RING_SIZE; i++)
+          av_frame_free( &data->video.frames[i] );
+
+     avcodec_free_context( &data->video.codec_ctx );
 
      flush_packets( &data->video.queue );
+     D_FREE( data->video.queue.packets );
+     direct_waitqueue_deinit( &data->video.queue.cond );
      direct_mutex_deinit( &data->video.queue.lock );
      direct_waitqueue_deinit( &data->video.cond );
      direct_mutex_deinit( &data->video.lock );
 
+     direct_waitqueue_deinit( &data->input.cond );
      direct_mutex_deinit( &data->input.lock );
 
      direct_list_foreach_safe (link, tmp, data->events) {
@@ -819,8 +1186,15 @@ IDirectFBVideoProvider_FFmpeg_GetCapabilities( IDirectFBVideoProvider       *thi
      *ret_caps = DVCAPS_BASIC | DVCAPS_SCALE | DVCAPS_SPEED;
      if (data->seekable)
           *ret_caps |= DVCAPS_SEEK;
+
+     /* The current frame is changed by the video thread. */
+     direct_mutex_lock( &data->video.lock );
+
      if (data->video.frame->interlaced_frame)
           *ret_caps |= DVCAPS_INTERLACED;
+
+     direct_mutex_unlock( &data->video.lock );
+
 #ifdef HAVE_FUSIONSOUND
      if (data->audio.playback)
           *ret_caps |= DVCAPS_VOLUME;
@@ -840,6 +1214,9 @@ IDirectFBVideoProvider_FFmpeg_GetSurfaceDescription( IDirectFBVideoProvider *thi
      if (!ret_desc)
           return DFB_INVARG;
 
+     /* The current frame is changed by the video thread. */
+     direct_mutex_lock( &data->video.lock );
+
      if (data->video.frame->interlaced_frame) {
           data->desc.flags |= DSDESC_CAPS;
           data->desc.caps   = DSCAPS_INTERLACED;
@@ -847,6 +1224,8 @@ IDirectFBVideoProvider_FFmpeg_GetSurfaceDescription( IDirectFBVideoProvider *thi
 
      *ret_desc = data->desc;
 
+     direct_mutex_unlock( &data->video.lock );
+
      return DFB_OK;
 }
 
@@ -968,12 +1347,23 @@ IDirectFBVideoProvider_FFmpeg_Stop( IDirectFBVideoProvider *thiz )
 
      data->status = DVSTATE_STOP;
 
+     direct_waitqueue_broadcast( &data->input.cond );
+
+     direct_mutex_unlock( &data->input.lock );
+
+     wake_packets( &data->video.queue );
+#ifdef HAVE_FUSIONSOUND
+     wake_packets( &data->audio.queue );
+#endif
+
      if (data->input.thread) {
           direct_thread_join( data->input.thread );
           direct_thread_destroy( data->input.thread );
           data->input.thread = NULL;
      }
 
+     direct_mutex_lock( &data->input.lock );
+
      if (data->video.thread) {
           direct_waitqueue_signal( &data->video.cond );
           direct_thread_join( data->video.thread );
@@ -1052,13 +1442,17 @@ IDirectFBVideoProvider_FFmpeg_SeekTo( IDirectFBVideoProvider *thiz,
 
      time = seconds * AV_TIME_BASE;
 
-     if (data->fmt_ctx->duration != AV_NOPTS_VALUE && time > data->fmt_ctx->duration)
+     if (data->fmt_ctx->duration != AV_NOPTS_VALUE && time > data->fmt_ctx->duration) {
+          direct_mutex_unlock( &data->input.lock );
           return DFB_OK;
+     }
 
      data->input.seeked    = true;
      data->input.seek_time = time;
      data->input.seek_flag = (seconds < pos) ? AVSEEK_FLAG_BACKWARD : 0;
 
+     direct_waitqueue_signal( &data->input.cond );
+
      direct_mutex_unlock( &data->input.lock );
 
      return DFB_OK;
@@ -1367,8 +1761,13 @@ IDirectFBVideoProvider_FFmpeg_SetDestination( IDirectFBVideoProvider *thiz,
      if (dest_rect->w < 1 || dest_rect->h < 1)
           return DFB_INVARG;
 
+     /* Takes effect with the next frame. */
+     direct_mutex_lock( &data->video.lock );
+
      data->video.rect = *dest_rect;
 
+     direct_mutex_unlock( &data->video.lock );
+
      return DFB_OK;
 }
 
@@ -1381,10 +1780,12 @@ Probe( IDirectFBVideoProvider_ProbeContext *ctx )
      AVProbeData          pd;
      unsigned int         len;
      unsigned char        buf[2048];
-     AVInputFormat       *fmt;
+     const AVInputFormat *fmt;
      IDirectFBDataBuffer *buffer = ctx->buffer;
 
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT( 58, 9, 100 )
      av_register_all();
+#endif
      avformat_network_init();
 
      if (direct_getenv( "D_STREAM_BYPASS" ) && ctx->filename)
@@ -1432,7 +1833,7 @@ Construct( IDirectFBVideoProvider *thiz,
      AVProbeData               pd;
      unsigned int              len;
      unsigned char             buf[2048];
-     AVInputFormat            *fmt         = NULL;
+     const AVInputFormat      *fmt         = NULL;
      IDirectFBDataBuffer_data *buffer_data = buffer->priv;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IDirectFBVideoProvider_FFmpeg )
@@ -1505,14 +1906,16 @@ Construct( IDirectFBVideoProvider *thiz,
      }
 
      for (i = 0; i < data->fmt_ctx->nb_streams; i++) {
-          switch (data->fmt_ctx->streams[i]->codec->codec_type) {
+          switch (data->fmt_ctx->streams[i]->codecpar->codec_type) {
                case AVMEDIA_TYPE_VIDEO:
-                    if (!data->video.st || data->video.st->codec->bit_rate < data->fmt_ctx->streams[i]->codec->bit_rate)
+                    if (!data->video.st ||
+                        data->video.st->codecpar->bit_rate < data->fmt_ctx->streams[i]->codecpar->bit_rate)
                          data->video.st = data->fmt_ctx->streams[i];
                     break;
 #ifdef HAVE_FUSIONSOUND
                case AVMEDIA_TYPE_AUDIO:
-                    if (!data->audio.st || data->audio.st->codec->bit_rate < data->fmt_ctx->streams[i]->codec->bit_rate)
+                    if (!data->audio.st ||
+                        data->audio.st->codecpar->bit_rate < data->fmt_ctx->streams[i]->codecpar->bit_rate)
                          data->audio.st = data->fmt_ctx->streams[i];
                     break;
 #endif
@@ -1527,7 +1930,12 @@ Construct( IDirectFBVideoProvider *thiz,
           goto error;
      }
 
-     data->video.codec_ctx = data->video.st->codec;
+     data->video.codec_ctx = open_decoder( data->video.st, true );
+     if (!data->video.codec_ctx) {
+          D_ERROR( "VideoProvider/FFmpeg: Failed to open video codec!\n" );
+          ret = DFB_FAILURE;
+          goto error;
+     }
 
      data->desc.flags  = DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_PIXELFORMAT;
      data->desc.width  = data->video.codec_ctx->width;
@@ -1579,19 +1987,33 @@ Construct( IDirectFBVideoProvider *thiz,
           data->rate = 25.0;
      }
 
-     if (avcodec_open2( data->video.codec_ctx, avcodec_find_decoder( data->video.codec_ctx->codec_id ), NULL ) < 0) {
-          D_ERROR( "VideoProvider/FFmpeg: Failed to open video codec!\n" );
-          data->video.codec_ctx = NULL;
-          ret = DFB_FAILURE;
-          goto error;
+     /* Scaling algorithm: 'fast-bilinear', 'bilinear', 'bicubic' or 'area',
+        otherwise chosen according to the smooth scaling render options of the destination. */
+     if (direct_getenv( "FFMPEG_SCALER" )) {
+          const char *value = direct_getenv( "FFMPEG_SCALER" );
+
+          if (!strcmp( value, "fast-bilinear" ))
+               data->video.scaler = SWS_FAST_BILINEAR;
+          else if (!strcmp( value, "bilinear" ))
+               data->video.scaler = SWS_BILINEAR;
+          else if (!strcmp( value, "bicubic" ))
+               data->video.scaler = SWS_BICUBIC;
+          else if (!strcmp( value, "area" ))
+               data->video.scaler = SWS_AREA;
+          else
+               D_ERROR( "VideoProvider/FFmpeg: Unknown scaler '%s'!\n", value );
      }
 
-     data->video.frame = av_frame_alloc();
-     if (!data->video.frame) {
-          ret = D_OOM();
-          goto error;
+     for (i = 0; i < FRAME_RING_SIZE; i++) {
+          data->video.frames[i] = av_frame_alloc();
+          if (!data->video.frames[i]) {
+               ret = D_OOM();
+               goto error;
+          }
      }
 
+     data->video.frame = data->video.frames[0];
+
      data->video.queue.max_len = av_rescale_q( MAX_QUEUE_LEN * AV_TIME_BASE, AV_TIME_BASE_Q,
                                                data->video.st->time_base );
      if (data->video.codec_ctx->bit_rate > 0)
@@ -1599,14 +2021,15 @@ Construct( IDirectFBVideoProvider *thiz,
      else
           data->video.queue.max_size = MAX_QUEUE_LEN * 256 * 1024;
 
+     ret = init_packets( &data->video.queue );
+     if (ret)
+          goto error;
+
 #ifdef HAVE_FUSIONSOUND
      if (data->audio.st) {
-          data->audio.codec_ctx = data->audio.st->codec;
-
-          if (avcodec_open2( data->audio.codec_ctx, avcodec_find_decoder( data->audio.codec_ctx->codec_id ), NULL ) < 0) {
-               data->audio.st        = NULL;
-               data->audio.codec_ctx = NULL;
-          }
+          data->audio.codec_ctx = open_decoder( data->audio.st, false );
+          if (!data->audio.codec_ctx)
+               data->audio.st = NULL;
      }
 
      if (data->audio.st &&
@@ -1649,6 +2072,10 @@ Construct( IDirectFBVideoProvider *thiz,
                data->audio.queue.max_size = MAX_QUEUE_LEN * data->audio.codec_ctx->bit_rate / 8;
           else
                data->audio.queue.max_size = MAX_QUEUE_LEN * 64 * 1024;
+
+          ret = init_packets( &data->audio.queue );
+          if (ret)
+               goto error;
      }
 #endif
 
@@ -1663,11 +2090,13 @@ Construct( IDirectFBVideoProvider *thiz,
      direct_mutex_init( &data->events_lock );
 
      direct_mutex_init( &data->input.lock );
+     direct_waitqueue_init( &data->input.cond );
 
      direct_mutex_init( &data->video.lock );
      direct_waitqueue_init( &data->video.cond );
 
-     direct_recursive_mutex_init( &data->video.queue.lock );
+     direct_mutex_init( &data->video.queue.lock );
+     direct_waitqueue_init( &data->video.queue.cond );
 
 #ifdef HAVE_FUSIONSOUND
      data->audio.volume = 1.0;
@@ -1675,7 +2104,8 @@ Construct( IDirectFBVideoProvider *thiz,
      direct_mutex_init( &data->audio.lock );
      direct_waitqueue_init( &data->audio.cond );
 
-     direct_recursive_mutex_init( &data->audio.queue.lock );
+     direct_mutex_init( &data->audio.queue.lock );
+     direct_waitqueue_init( &data->audio.queue.cond );
 #endif
 
      thiz->AddRef                = IDirectFBVideoProvider_FFmpeg_AddRef;
@@ -1707,6 +2137,9 @@ Construct( IDirectFBVideoProvider *thiz,
 
 error:
 #ifdef HAVE_FUSIONSOUND
+     if (data->audio.queue.packets)
+          D_FREE( data->audio.queue.packets );
+
      if (data->audio.frame)
           av_frame_free( &data->audio.frame );
 
@@ -1720,14 +2153,19 @@ error:
           data->audio.sound->Release( data->audio.sound );
 
      if (data->audio.codec_ctx)
-          avcodec_close( data->audio.codec_ctx );
+          avcodec_free_context( &data->audio.codec_ctx );
 #endif
 
-     if (data->video.frame)
-          av_frame_free( &data->video.frame );
+     if (data->video.queue.packets)
+          D_FREE( data->video.queue.packets );
+
+     for (i = 0; i < FRAME_RING_SIZE; i++) {
+          if (data->video.frames[i])
+               av_frame_free( &data->video.frames[i] );
+     }
 
      if (data->video.codec_ctx)
-          avcodec_close( data->video.codec_ctx );
+          avcodec_free_context( &data->video.codec_ctx );
 
      if (data->fmt_ctx)
           avformat_close_input( &data->fmt_ctx );
@@ -19,9 +19,12 @@
 #include <direct/stream.h>
 #include <direct/thread.h>
 #include <libavformat/avformat.h>
+#include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 #include <media/ifusionsoundmusicprovider.h>
 
+#include "pcm_convert.h"
+
 D_DEBUG_DOMAIN( MusicProvider_FFmpeg, "MusicProvider/FFmpeg", "FFmpeg Music Provider" );
 
 static DirectResult Probe    ( IFusionSoundMusicProvider_ProbeContext *ctx );
@@ -45,6 +48,7 @@ typedef struct {
      AVIOContext                  *io_ctx;
      AVFormatContext              *fmt_ctx;
      AVStream                     *st;
+     AVPacket                     *pkt;
      AVFrame                      *frame;
      AVCodecContext               *codec_ctx;
 
@@ -59,7 +63,8 @@ typedef struct {
 
      DirectThread                 *thread;
      DirectMutex                   lock;
-     DirectWaitQueue               cond;
+     DirectMutex                   status_lock;             /* only held to change or wait for the status */
+     DirectWaitQueue               cond;                    /* signaled on every status change */
 
      FSMusicProviderStatus         status;
      int                           finished;
@@ -151,11 +156,24 @@ av_seek_callback( void    *opaque,
 
 /**********************************************************************************************************************/
 
+static void
+FFmpeg_SetStatus( IFusionSoundMusicProvider_FFmpeg_data *data,
+                  FSMusicProviderStatus                  status )
+{
+     direct_mutex_lock( &data->status_lock );
+
+     data->status = status;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->status_lock );
+}
+
 static void
 FFmpeg_Stop( IFusionSoundMusicProvider_FFmpeg_data *data,
              bool                                   now )
 {
-     data->status = FMSTATE_STOP;
+     FFmpeg_SetStatus( data, FMSTATE_STOP );
 
      if (data->thread) {
           if (!direct_thread_is_joined( data->thread )) {
@@ -185,13 +203,75 @@ FFmpeg_Stop( IFusionSoundMusicProvider_FFmpeg_data *data,
      }
 }
 
+/*
+ * Decode the next frame, feeding the decoder with packets as needed.
+ * Returns the number of decoded samples, 0 if none yet, or -1 at end of stream.
+ * Mutex must already be locked.
+ */
+static int
+decode_frame( IFusionSoundMusicProvider_FFmpeg_data *data,
+              AVPacket                              *pkt )
+{
+     int ret;
+     s64 pts;
+
+     ret = avcodec_receive_frame( data->codec_ctx, data->frame );
+     if (ret == AVERROR(EAGAIN)) {
+          if (av_read_frame( data->fmt_ctx, pkt ) < 0) {
+               /* Drain the frames still delayed in the decoder. */
+               avcodec_send_packet( data->codec_ctx, NULL );
+               return 0;
+          }
+
+          if (pkt->stream_index == data->st->index)
+               avcodec_send_packet( data->codec_ctx, pkt );
+
+          av_packet_unref( pkt );
+
+          return 0;
+     }
+     else if (ret < 0) {
+          /* End of stream: rewind when looping. */
+          if (!(data->flags & FMPLAY_LOOPING) || av_seek_frame( data->fmt_ctx, -1, 0, 0 ) < 0)
+               return -1;
+
+          avcodec_flush_buffers( data->codec_ctx );
+
+          return 0;
+     }
+
+     pts = data->frame->best_effort_timestamp;
+     if (pts != AV_NOPTS_VALUE) {
+          if (data->st->start_time != AV_NOPTS_VALUE)
+               pts -= data->st->start_time;
+          data->pts = av_rescale_q( pts, data->st->time_base, AV_TIME_BASE_Q );
+     }
+
+     data->pts += (s64) data->frame->nb_samples * AV_TIME_BASE / data->samplerate;
+
+     return data->frame->nb_samples;
+}
+
+/*
+ * Use the same downmix levels as the other music providers.
+ */
+static void
+set_mix_levels( struct SwrContext *swr_ctx )
+{
+     float center, surround, lfe;
+
+     pcm_mix_levels( &center, &surround, &lfe );
+
+     av_opt_set_double( swr_ctx, "clev",          center,   0 );
+     av_opt_set_double( swr_ctx, "slev",          surround, 0 );
+     av_opt_set_double( swr_ctx, "lfe_mix_level", lfe,      0 );
+}
+
 static void *
 FFmpegStream( DirectThread *thread,
               void         *arg )
 {
      struct SwrContext                     *swr_ctx;
-     AVPacket                               pkt;
-     int                                    pkt_size       = 0;
      IFusionSoundMusicProvider_FFmpeg_data *data           = arg;
      int                                    bytespersample = av_get_bytes_per_sample( data->dest.sample_fmt ) *
                                                              av_get_channel_layout_nb_channels( data->dest.ch_layout );
@@ -203,12 +283,14 @@ FFmpegStream( DirectThread *thread,
                                    data->codec_ctx->channel_layout, data->codec_ctx->sample_fmt,
                                    data->samplerate, 0, NULL );
 
+     set_mix_levels( swr_ctx );
+
      swr_init( swr_ctx );
 
+     avcodec_flush_buffers( data->codec_ctx );
+
      while (data->status == FMSTATE_PLAY) {
-          int decoded;
-          int got_frame;
-          int length = 0;
+          int length;
 
           direct_mutex_lock( &data->lock );
 
@@ -219,72 +301,28 @@ FFmpegStream( DirectThread *thread,
 
           if (data->seeked) {
                data->dest.stream->Flush( data->dest.stream );
-               if (pkt_size > 0) {
-                    av_packet_unref( &pkt );
-                    pkt_size = 0;
-               }
                avcodec_flush_buffers( data->codec_ctx );
                data->seeked = false;
           }
 
-          if (pkt_size <= 0) {
-               s64 pkt_pts;
-
-               if (av_read_frame( data->fmt_ctx, &pkt ) < 0) {
-                    if (!(data->flags & FMPLAY_LOOPING) || av_seek_frame( data->fmt_ctx, -1, 0, 0 ) < 0) {
-                         data->finished = true;
-                         data->status = FMSTATE_FINISHED;
-                         direct_waitqueue_broadcast( &data->cond );
-                    }
-                    direct_mutex_unlock( &data->lock );
-                    continue;
-               }
-
-               if (pkt.stream_index != data->st->index) {
-                    av_packet_unref( &pkt );
-                    direct_mutex_unlock( &data->lock );
-                    continue;
-               }
-
-               pkt_size = pkt.size;
-               pkt_pts  = pkt.pts;
-               if (pkt_pts != AV_NOPTS_VALUE) {
-                    if (data->st->start_time != AV_NOPTS_VALUE)
-                         pkt_pts -= data->st->start_time;
-                    data->pts = av_rescale_q( pkt_pts, data->st->time_base, AV_TIME_BASE_Q );
-               }
-          }
-
-          decoded = avcodec_decode_audio4( data->codec_ctx, data->frame, &got_frame, &pkt );
-
-          if (decoded < 0) {
-               av_packet_unref( &pkt );
-               pkt_size = 0;
-          }
-          else {
-               pkt_size -= decoded;
-               if (pkt_size <= 0)
-                    av_packet_unref( &pkt );
-
-               length = data->frame->nb_samples;
-               data->pts += (s64) length * AV_TIME_BASE / data->samplerate;
+          length = decode_frame( data, data->pkt );
+          if (length < 0) {
+               data->finished = true;
+               FFmpeg_SetStatus( data, FMSTATE_FINISHED );
           }
 
           direct_mutex_unlock( &data->lock );
 
           /* Converting to output format. */
-          if (length) {
+          if (length > 0) {
                uint8_t *out[] = { buf };
 
-               swr_convert( swr_ctx, out, data->samplerate, (void*) data->frame->data, length );
+               swr_convert( swr_ctx, out, data->samplerate, (void*) data->frame->extended_data, length );
 
                data->dest.stream->Write( data->dest.stream, buf, length );
           }
      }
 
-     if (pkt_size > 0)
-          av_packet_unref( &pkt );
-
      swr_free( &swr_ctx );
 
      return NULL;
@@ -295,8 +333,6 @@ FFmpegBuffer( DirectThread *thread,
               void         *arg )
 {
      struct SwrContext                     *swr_ctx;
-     AVPacket                               pkt;
-     int                                    pkt_size       = 0;
      IFusionSoundMusicProvider_FFmpeg_data *data           = arg;
      int                                    pos            = 0;
      int                                    bytespersample = av_get_bytes_per_sample( data->dest.sample_fmt ) *
@@ -307,12 +343,14 @@ FFmpegBuffer( DirectThread *thread,
                                    data->codec_ctx->channel_layout, data->codec_ctx->sample_fmt, data->samplerate,
                                    0, NULL );
 
+     set_mix_levels( swr_ctx );
+
      swr_init( swr_ctx );
 
+     avcodec_flush_buffers( data->codec_ctx );
+
      while (data->status == FMSTATE_PLAY) {
-          int decoded;
-          int got_frame;
-          int length = 0;
+          int length;
 
           direct_mutex_lock( &data->lock );
 
@@ -322,59 +360,19 @@ FFmpegBuffer( DirectThread *thread,
           }
 
           if (data->seeked) {
-               if (pkt_size > 0) {
-                    av_packet_unref( &pkt );
-                    pkt_size = 0;
-               }
                avcodec_flush_buffers( data->codec_ctx );
                data->seeked = false;
           }
 
-          if (pkt_size <= 0) {
-               s64 pkt_pts;
-
-               if (av_read_frame( data->fmt_ctx, &pkt ) < 0) {
-                    if (!(data->flags & FMPLAY_LOOPING) || av_seek_frame( data->fmt_ctx, -1, 0, 0 ) < 0) {
-                         data->finished = true;
-                         data->status = FMSTATE_FINISHED;
-                         if (data->buffer_callback && pos) {
-                              if (data->buffer_callback( pos, data->buffer_callback_context ))
-                                   data->status = FMSTATE_STOP;
-                         }
-                         direct_waitqueue_broadcast( &data->cond );
-                    }
-                    direct_mutex_unlock( &data->lock );
-                    continue;
-               }
-
-               if (pkt.stream_index != data->st->index) {
-                    av_packet_unref( &pkt );
-                    direct_mutex_unlock( &data->lock );
-                    continue;
-               }
-
-               pkt_size = pkt.size;
-               pkt_pts  = pkt.pts;
-               if (pkt_pts != AV_NOPTS_VALUE) {
-                    if (data->st->start_time != AV_NOPTS_VALUE)
-                         pkt_pts -= data->st->start_time;
-                    data->pts = av_rescale_q( pkt_pts, data->st->time_base, AV_TIME_BASE_Q );
-               }
-          }
-
-          decoded = avcodec_decode_audio4( data->codec_ctx, data->frame, &got_frame, &pkt );
-
-          if (decoded < 0) {
-               av_packet_unref( &pkt );
-               pkt_size = 0;
-          }
-          else {
-               pkt_size -= decoded;
-               if (pkt_size <= 0)
-                    av_packet_unref( &pkt );
-
-               length = data->frame->nb_samples;
-               data->pts += (s64) length * AV_TIME_BASE / data->samplerate;
+          length = decode_frame( data, data->pkt );
+          if (length < 0) {
+               data->finished = true;
+               if (data->buffer_callback && pos && data->buffer_callback( pos, data->buffer_callback_context ))
+                    FFmpeg_SetStatus( data, FMSTATE_STOP );
+               else
+                    FFmpeg_SetStatus( data, FMSTATE_FINISHED );
+               direct_mutex_unlock( &data->lock );
+               continue;
           }
 
           /* Converting to output format. */
@@ -395,7 +393,7 @@ FFmpegBuffer( DirectThread *thread,
 
                dst += pos * bytespersample;
                *out =dst;
-               swr_convert( swr_ctx, out, data->samplerate, (void*) data->frame->data, len );
+               swr_convert( swr_ctx, out, data->samplerate, (void*) data->frame->extended_data, len );
 
                length -= len;
                pos    += len;
@@ -405,8 +403,7 @@ FFmpegBuffer( DirectThread *thread,
                if (pos >= frames) {
                     if (data->buffer_callback) {
                          if (data->buffer_callback( pos, data->buffer_callback_context )) {
-                              data->status = FMSTATE_STOP;
-                              direct_waitqueue_broadcast( &data->cond );
+                              FFmpeg_SetStatus( data, FMSTATE_STOP );
                               break;
                          }
                     }
@@ -417,9 +414,6 @@ FFmpegBuffer( DirectThread *thread,
           direct_mutex_unlock( &data->lock );
      }
 
-     if (pkt_size > 0)
-          av_packet_unref( &pkt );
-
      swr_free( &swr_ctx );
 
      return NULL;
@@ -439,10 +433,12 @@ IFusionSoundMusicProvider_FFmpeg_Destruct( IFusionSoundMusicProvider *thiz )
      direct_stream_destroy( data->stream );
 
      direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->status_lock );
      direct_mutex_deinit( &data->lock );
 
-     avcodec_close( data->codec_ctx );
-     av_free( data->frame );
+     avcodec_free_context( &data->codec_ctx );
+     av_frame_free( &data->frame );
+     av_packet_free( &data->pkt );
      avformat_close_input( &data->fmt_ctx );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
@@ -653,9 +649,7 @@ IFusionSoundMusicProvider_FFmpeg_PlayToStream( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     FFmpeg_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, FFmpegStream, data, "FFmpeg Stream" );
 
@@ -771,9 +765,7 @@ IFusionSoundMusicProvider_FFmpeg_PlayToBuffer( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     FFmpeg_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, FFmpegBuffer, data, "FFmpeg Buffer" );
 
@@ -793,8 +785,6 @@ IFusionSoundMusicProvider_FFmpeg_Stop( IFusionSoundMusicProvider *thiz )
 
      FFmpeg_Stop( data, false );
 
-     direct_waitqueue_broadcast( &data->cond );
-
      direct_mutex_unlock( &data->lock );
 
      return DR_OK;
@@ -926,8 +916,6 @@ IFusionSoundMusicProvider_FFmpeg_WaitStatus( IFusionSoundMusicProvider *thiz,
                                              FSMusicProviderStatus      mask,
                                              unsigned int               timeout )
 {
-     DirectResult ret;
-
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_FFmpeg )
 
      D_DEBUG_AT( MusicProvider_FFmpeg, "%s( %p )n", __FUNCTION__, thiz );
@@ -935,33 +923,27 @@ IFusionSoundMusicProvider_FFmpeg_WaitStatus( IFusionSoundMusicProvider *thiz,
      if (!mask || mask & ~FMSTATE_ALL)
           return DR_INVARG;
 
+     direct_mutex_lock( &data->status_lock );
+
      if (timeout) {
-          long long s;
+          long long deadline = direct_clock_get_abs_micros() + timeout * 1000ll;
 
-          s = direct_clock_get_abs_micros() + timeout * 1000ll;
+          while (!(data->status & mask)) {
+               long long now = direct_clock_get_abs_micros();
 
-          while (direct_mutex_trylock( &data->lock )) {
-               usleep( 1000 );
-               if (direct_clock_get_abs_micros() >= s)
+               if (now >= deadline ||
+                   direct_waitqueue_wait_timeout( &data->cond, &data->status_lock, deadline - now ) == DR_TIMEOUT) {
+                    direct_mutex_unlock( &data->status_lock );
                     return DR_TIMEOUT;
-          }
-
-          while (!(data->status & mask)) {
-               ret = direct_waitqueue_wait_timeout( &data->cond, &data->lock, timeout * 1000ll );
-               if (ret) {
-                    direct_mutex_unlock( &data->lock );
-                    return ret;
                }
           }
      }
      else {
-          direct_mutex_lock( &data->lock );
-
           while (!(data->status & mask))
-               direct_waitqueue_wait( &data->cond, &data->lock );
+               direct_waitqueue_wait( &data->cond, &data->status_lock );
      }
 
-     direct_mutex_unlock( &data->lock );
+     direct_mutex_unlock( &data->status_lock );
 
      return DR_OK;
 }
@@ -971,10 +953,12 @@ IFusionSoundMusicProvider_FFmpeg_WaitStatus( IFusionSoundMusicProvider *thiz,
 static DirectResult
 Probe( IFusionSoundMusicProvider_ProbeContext *ctx )
 {
-     AVProbeData    pd;
-     AVInputFormat *fmt;
+     AVProbeData          pd;
+     const AVInputFormat *fmt;
 
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT( 58, 9, 100 )
      av_register_all();
+#endif
 
      memset( &pd, 0, sizeof(AVProbeData) );
      pd.filename = ctx->filename;
@@ -996,13 +980,13 @@ Construct( IFusionSoundMusicProvider *thiz,
            const char                *filename,
            DirectStream              *stream )
 {
-     DirectResult   ret;
-     int            i;
-     AVProbeData    pd;
-     unsigned int   len;
-     unsigned char  buf[64];
-     AVInputFormat *fmt;
-     AVCodec       *codec;
+     DirectResult         ret;
+     int                  i;
+     AVProbeData          pd;
+     unsigned int         len;
+     unsigned char        buf[64];
+     const AVInputFormat *fmt;
+     const AVCodec       *codec;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IFusionSoundMusicProvider_FFmpeg )
 
@@ -1061,8 +1045,8 @@ Construct( IFusionSoundMusicProvider *thiz,
      }
 
      for (i = 0; i < data->fmt_ctx->nb_streams; i++) {
-          if (data->fmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
-               if (!data->st || data->st->codec->bit_rate < data->fmt_ctx->streams[i]->codec->bit_rate)
+          if (data->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+               if (!data->st || data->st->codecpar->bit_rate < data->fmt_ctx->streams[i]->codecpar->bit_rate)
                     data->st = data->fmt_ctx->streams[i];
           }
      }
@@ -1073,18 +1057,36 @@ Construct( IFusionSoundMusicProvider *thiz,
           goto error;
      }
 
-     data->codec_ctx = data->st->codec;
+     codec = avcodec_find_decoder( data->st->codecpar->codec_id );
+     if (!codec) {
+          D_ERROR( "MusicProvider/FFmpeg: Couldn't find audio codec!\n" );
+          ret = DR_FAILURE;
+          goto error;
+     }
+
+     data->codec_ctx = avcodec_alloc_context3( codec );
+     if (!data->codec_ctx) {
+          ret = D_OOM();
+          goto error;
+     }
+
+     avcodec_parameters_to_context( data->codec_ctx, data->st->codecpar );
 
-     codec = avcodec_find_decoder( data->codec_ctx->codec_id );
+     data->codec_ctx->pkt_timebase = data->st->time_base;
 
-     if (!codec || avcodec_open2( data->codec_ctx, codec, NULL ) < 0) {
+     if (avcodec_open2( data->codec_ctx, codec, NULL ) < 0) {
           D_ERROR( "MusicProvider/FFmpeg: Failed to open audio codec!\n" );
-          data->codec_ctx = NULL;
           ret = DR_FAILURE;
           goto error;
      }
 
+     /* Packet and frame are allocated once and reused by the decoding loop. */
+     data->pkt   = av_packet_alloc();
      data->frame = av_frame_alloc();
+     if (!data->pkt || !data->frame) {
+          ret = D_OOM();
+          goto error;
+     }
 
      data->channels   = MIN( data->codec_ctx->channels, FS_MAX_CHANNELS );
      data->samplerate = data->codec_ctx->sample_rate;
@@ -1094,6 +1096,7 @@ Construct( IFusionSoundMusicProvider *thiz,
      data->desc.bitrate = data->codec_ctx->bit_rate;
 
      direct_mutex_init( &data->lock );
+     direct_mutex_init( &data->status_lock );
      direct_waitqueue_init( &data->cond );
 
      data->status = FMSTATE_STOP;
@@ -1118,10 +1121,13 @@ Construct( IFusionSoundMusicProvider *thiz,
 
 error:
      if (data->frame)
-          av_free( data->frame );
+          av_frame_free( &data->frame );
+
+     if (data->pkt)
+          av_packet_free( &data->pkt );
 
      if (data->codec_ctx)
-          avcodec_close( data->codec_ctx );
+          avcodec_free_context( &data->codec_ctx );
 
      if (data->fmt_ctx)
           avformat_close_input( &data->fmt_ctx );
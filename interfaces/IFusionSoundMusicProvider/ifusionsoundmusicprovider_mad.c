@@ -23,6 +23,8 @@
 #include <mad.h>
 #include <media/ifusionsoundmusicprovider.h>
 
+#include "pcm_convert.h"
+
 D_DEBUG_DOMAIN( MusicProvider_MAD, "MusicProvider/MAD", "MAD Music Provider" );
 
 static DirectResult Probe    ( IFusionSoundMusicProvider_ProbeContext *ctx );
@@ -37,10 +39,16 @@ DIRECT_INTERFACE_IMPLEMENTATION( IFusionSoundMusicProvider, MAD )
 
 /**********************************************************************************************************************/
 
+typedef struct {
+     unsigned int                  sample;                  /* position in samples */
+     unsigned int                  offset;                  /* stream offset of the frame */
+} MADSeekPoint;
+
 typedef struct {
      int                           ref;                     /* reference counter */
 
      DirectStream                 *stream;
+     char                         *filename;                /* local file, scanned for seek points */
 
      struct mad_stream             st;
      struct mad_frame              frame;
@@ -51,13 +59,36 @@ typedef struct {
 
      unsigned int                  frames;                  /* number of frames */
 
+     unsigned int                  first;                   /* stream offset of the first audio frame */
+     unsigned int                  end;                     /* stream offset after the last audio frame */
+
+     MADSeekPoint                 *toc;                     /* estimated seek points from a Xing or VBRI header */
+     unsigned int                  toc_count;
+
+     MADSeekPoint                 *index;                   /* exact seek points found while decoding, sorted */
+     unsigned int                  index_count;
+     unsigned int                  index_size;
+     unsigned int                  index_next;              /* position of the next seek point to add */
+
+     unsigned int                  samples;                 /* position of the next frame */
+     unsigned int                  skip;                    /* samples left to skip up to the seek position */
+     bool                          exact;                   /* the position is counted from a known frame */
+
+     unsigned int                  seek_from;               /* pending seek, applied by the decoding thread */
+     unsigned int                  seek_to;
+     bool                          seek_exact;
+
+     DirectThread                 *scan;                    /* indexing the seek points after an estimated seek */
+     bool                          scan_stop;
+
      FSTrackDescription            desc;
 
      FSMusicProviderPlaybackFlags  flags;
 
      DirectThread                 *thread;
      DirectMutex                   lock;
-     DirectWaitQueue               cond;
+     DirectMutex                   status_lock;             /* only held to change or wait for the status */
+     DirectWaitQueue               cond;                    /* signaled on every status change */
 
      FSMusicProviderStatus         status;
      int                           finished;
@@ -73,6 +104,8 @@ typedef struct {
           FSChannelMode            mode;
      } dest;
 
+     PcmMatrix                     matrix;                  /* mixing of the decoded channels to the destination */
+
      FMBufferCallback              buffer_callback;
      void                         *buffer_callback_context;
 } IFusionSoundMusicProvider_MAD_data;
@@ -81,6 +114,12 @@ typedef struct {
 
 #define PREBUFFER_SIZE 1 /* seconds */
 
+#define STREAM_WAIT_TIMEOUT 100 /* milliseconds, bounds the time to notice a stop while the stream is stalled */
+
+#define SEEK_SCAN_LIMIT 30 /* seconds of frames skipped from an exact seek point, estimate the offset beyond */
+
+#define SEEK_PRIME_FRAMES 2 /* frames before the seek position fully decoded to fill the bit reservoir */
+
 #define XING_MAGIC (('X' << 24) | ('i' << 16) | ('n' << 8) | 'g')
 
 struct id3_tag {
@@ -122,237 +161,355 @@ static const char *id3_genres[] = {
      "Merengue", "Salsa", "Thrash Metal", "Anime", "JPop", "Synthpop"
 };
 
-typedef struct {
-#ifdef WORDS_BIGENDIAN
-     s8 c;
-     u8 b;
-     u8 a;
-#else
-     u8 a;
-     u8 b;
-     s8 c;
-#endif
-} __attribute__((packed)) s24;
-
-static __inline__ u8
-FtoU8( mad_fixed_t sample )
+static void
+mad_mix_audio( PcmMatrix      *matrix,
+               mad_fixed_t    *left,
+               mad_fixed_t    *right,
+               char           *dst,
+               int             frames,
+               FSSampleFormat  f,
+               int             channels,
+               FSChannelMode   mode )
 {
-     /* round */
-     sample += (1 << (MAD_F_FRACBITS - 8));
+     const s32 *src[2] = { (const s32*) left, (const s32*) right };
 
-     /* clip */
-     if (sample >= MAD_F_ONE)
-          sample = MAD_F_ONE - 1;
-     else if (sample < -MAD_F_ONE)
-          sample = -MAD_F_ONE;
+     if (matrix->channels != channels || matrix->mode != mode)
+          pcm_matrix_init( matrix, channels, mode );
 
-     /* quantize */
-     return (sample >> (MAD_F_FRACBITS - 7)) + 128;
+     pcm_mix_fixed( matrix, src, dst, f, frames );
 }
 
-static __inline__ s16
-FtoS16( mad_fixed_t sample )
+/**********************************************************************************************************************/
+
+/*
+ * Find the last seek point at or before a position, returns -1 if there is none.
+ */
+static int
+mad_seek_point_find( const MADSeekPoint *points,
+                     unsigned int        count,
+                     unsigned int        sample )
 {
-     /* round */
-     sample += (1 << (MAD_F_FRACBITS - 16));
+     unsigned int lo = 0;
+     unsigned int hi = count;
 
-     /* clip */
-     if (sample >= MAD_F_ONE)
-          sample = MAD_F_ONE - 1;
-     else if (sample < -MAD_F_ONE)
-          sample = -MAD_F_ONE;
+     while (lo < hi) {
+          unsigned int mid = (lo + hi) / 2;
+
+          if (points[mid].sample <= sample)
+               lo = mid + 1;
+          else
+               hi = mid;
+     }
 
-     /* quantize */
-     return sample >> (MAD_F_FRACBITS - 15);
+     return (int) lo - 1;
 }
 
-static __inline__ s24
-FtoS24( mad_fixed_t sample )
+/*
+ * Find the seek point of the index at a stream offset, returns -1 if there is none.
+ * Mutex must already be locked.
+ */
+static int
+mad_index_find_offset( IFusionSoundMusicProvider_MAD_data *data,
+                       unsigned int                        offset )
 {
-     /* round */
-     sample += (1 << (MAD_F_FRACBITS - 24));
+     unsigned int lo = 0;
+     unsigned int hi = data->index_count;
+
+     while (lo < hi) {
+          unsigned int mid = (lo + hi) / 2;
 
-     /* clip */
-     if (sample >= MAD_F_ONE)
-          sample = MAD_F_ONE - 1;
-     else if (sample < -MAD_F_ONE)
-          sample = -MAD_F_ONE;
+          if (data->index[mid].offset == offset)
+               return mid;
 
-     /* quantize */
-     sample >>= (MAD_F_FRACBITS - 23);
+          if (data->index[mid].offset < offset)
+               lo = mid + 1;
+          else
+               hi = mid;
+     }
 
-     return (s24) { a:sample, b:sample >> 8, c:sample >> 16 };
+     return -1;
 }
 
-static __inline__ s32
-FtoS32( mad_fixed_t sample )
+/*
+ * Add an exact seek point to the index, unless there is already one less than a second away.
+ * Mutex must already be locked.
+ */
+static void
+mad_index_add( IFusionSoundMusicProvider_MAD_data *data,
+               unsigned int                        sample,
+               unsigned int                        offset )
 {
-     /* clip */
-     if (sample >= MAD_F_ONE)
-          sample = MAD_F_ONE - 1;
-     else if (sample < -MAD_F_ONE)
-          sample = -MAD_F_ONE;
-
-     /* quantize */
-     return sample << (31 - MAD_F_FRACBITS);
+     int i = mad_seek_point_find( data->index, data->index_count, sample ) + 1;
+
+     if (i > 0 && sample - data->index[i-1].sample < data->samplerate)
+          return;
+
+     if (i < (int) data->index_count && data->index[i].sample - sample < data->samplerate)
+          return;
+
+     if (data->index_count == data->index_size) {
+          unsigned int  size  = data->index_size ? data->index_size * 2 : 256;
+          MADSeekPoint *index = D_REALLOC( data->index, size * sizeof(MADSeekPoint) );
+
+          if (!index) {
+               D_OOM();
+               return;
+          }
+
+          data->index      = index;
+          data->index_size = size;
+     }
+
+     memmove( &data->index[i+1], &data->index[i], (data->index_count - i) * sizeof(MADSeekPoint) );
+
+     data->index[i].sample = sample;
+     data->index[i].offset = offset;
+
+     data->index_count++;
 }
 
-static __inline__ float
-FtoF32( mad_fixed_t sample )
+/*
+ * Estimate the stream offset of a position, from the table of contents if any, otherwise from the bitrate.
+ */
+static unsigned int
+mad_estimate_offset( IFusionSoundMusicProvider_MAD_data *data,
+                     unsigned int                        sample )
 {
-     /* clip */
-     if (sample >= MAD_F_ONE)
-          sample = MAD_F_ONE - 1;
-     else if (sample < -MAD_F_ONE)
-          sample = -MAD_F_ONE;
-
-     /* quantize */
-     return (float) sample / MAD_F_ONE;
+     int          i;
+     MADSeekPoint from, to;
+
+     if (!data->toc_count)
+          return data->first + (u64) sample * (data->desc.bitrate >> 3) / data->samplerate;
+
+     i = mad_seek_point_find( data->toc, data->toc_count, sample );
+     if (i < 0)
+          return data->first;
+
+     from = data->toc[i];
+
+     if (i + 1 < (int) data->toc_count) {
+          to = data->toc[i+1];
+     }
+     else {
+          to.sample = data->frames;
+          to.offset = data->end;
+     }
+
+     if (to.sample <= from.sample || to.offset <= from.offset)
+          return from.offset;
+
+     return from.offset + (u64) (sample - from.sample) * (to.offset - from.offset) / (to.sample - from.sample);
 }
 
-#define MAD_MIX_LOOP()                                                  \
-do {                                                                    \
-     TYPE *d = (TYPE*) dst;                                             \
-     int   i;                                                           \
-     if (channels == 2) {                                               \
-          switch (mode) {                                               \
-               case FSCM_MONO:                                          \
-                    for (i = 0; i < frames; i++)                        \
-                         d[i] = CONV( (left[i] + right[i]) >> 1 );      \
-                    break;                                              \
-               case FSCM_STEREO:                                        \
-                    for (i = 0; i < frames; i++) {                      \
-                         d[0] = CONV( left[i] );                        \
-                         d[1] = CONV( right[i] );                       \
-                         d += 2;                                        \
-                    }                                                   \
-                    break;                                              \
-               default:                                                 \
-                    for (i = 0; i < frames; i++) {                      \
-                         *d++ = CONV( left[i] );                        \
-                         if (FS_MODE_HAS_CENTER( mode ))                \
-                              *d++ = CONV( (left[i] + right[i]) >> 1 ); \
-                         *d++ = CONV( right[i] );                       \
-                         switch (FS_MODE_NUM_REARS( mode )) {           \
-                              case 2:                                   \
-                                   *d++ = MUTE;                         \
-                              case 1:                                   \
-                                   *d++ = MUTE;                         \
-                         }                                              \
-                         if (FS_MODE_HAS_LFE( mode ))                   \
-                              *d++ = MUTE;                              \
-                    }                                                   \
-                    break;                                              \
-          }                                                             \
-     }                                                                  \
-     else {                                                             \
-          switch (mode) {                                               \
-               case FSCM_MONO:                                          \
-                    for (i = 0; i < frames; i++)                        \
-                         d[i] = CONV( left[i] );                        \
-                    break;                                              \
-               case FSCM_STEREO:                                        \
-                    for (i = 0; i < frames; i++) {                      \
-                         d[0] = d[1] = CONV( left[i] );                 \
-                         d += 2;                                        \
-                    }                                                   \
-                    break;                                              \
-               default:                                                 \
-                    for (i = 0; i < frames; i++) {                      \
-                         if (FS_MODE_HAS_CENTER( mode )) {              \
-                              d[0] = d[1] = d[2] = CONV( left[i] );     \
-                              d += 3;                                   \
-                         }                                              \
-                         else {                                         \
-                              d[0] = d[1] = CONV( left[i] );            \
-                              d += 2;                                   \
-                         }                                              \
-                         switch (FS_MODE_NUM_REARS( mode )) {           \
-                              case 2:                                   \
-                                   *d++ = MUTE;                         \
-                              case 1:                                   \
-                                   *d++ = MUTE;                         \
-                         }                                              \
-                         if (FS_MODE_HAS_LFE( mode ))                   \
-                              *d++ = MUTE;                              \
-                    }                                                   \
-                    break;                                              \
-          }                                                             \
-     }                                                                  \
-} while (0)
+/*
+ * Account for a frame found by the decoding thread at a stream offset, adding a seek point to the index every second.
+ * Returns true if the frame is before the seek position and has to be skipped.
+ */
+static bool
+mad_count_frame( IFusionSoundMusicProvider_MAD_data *data,
+                 unsigned int                        offset )
+{
+     unsigned int samples = 32 * MAD_NSBSAMPLES( &data->frame.header );
+
+     /* The frame with the Xing or VBRI header has no samples. */
+     if (offset < data->first)
+          return false;
+
+     /* After an estimated seek, the position is exact again from the first frame found in the index. */
+     if (!data->exact) {
+          int i;
+
+          direct_mutex_lock( &data->lock );
+
+          i = mad_index_find_offset( data, offset );
+          if (i >= 0) {
+               D_DEBUG_AT( MusicProvider_MAD, "  -> position %u estimated as %u\n",
+                           data->index[i].sample, data->samples );
+
+               data->samples    = data->index[i].sample;
+               data->exact      = true;
+               data->index_next = data->samples + data->samplerate;
+          }
+
+          direct_mutex_unlock( &data->lock );
+     }
 
+     if (data->exact && data->samples >= data->index_next) {
+          direct_mutex_lock( &data->lock );
+
+          mad_index_add( data, data->samples, offset );
+
+          direct_mutex_unlock( &data->lock );
+
+          data->index_next = data->samples + data->samplerate;
+     }
+
+     data->samples += samples;
+
+     if (data->skip >= samples) {
+          data->skip -= samples;
+          return true;
+     }
+
+     data->skip = 0;
+
+     return false;
+}
+
+/*
+ * Decode the next frame of the buffer starting at a stream offset, only decoding the headers of the frames skipped
+ * up to the seek position, except the last ones which fill the bit reservoir of the first frame output.
+ * Returns 1 if a frame has been decoded, 0 if there is none to output, or -1 if the buffer needs more data.
+ */
+static int
+mad_decode_frame( IFusionSoundMusicProvider_MAD_data *data,
+                  unsigned int                        base )
+{
+     bool prime;
+
+     if (mad_header_decode( &data->frame.header, &data->st ) == -1)
+          return MAD_RECOVERABLE(data->st.error) ? 0 : -1;
+
+     prime = data->skip && data->skip <= SEEK_PRIME_FRAMES * 32 * MAD_NSBSAMPLES( &data->frame.header );
+
+     /* The frame is counted as soon as its header is found, even if its data turns out to be bad. */
+     if (mad_count_frame( data, base + (data->st.this_frame - (u8*) data->buf) )) {
+          if (!prime) {
+               data->frame.header.flags &= ~MAD_FLAG_INCOMPLETE;
+               return 0;
+          }
+
+          mad_frame_decode( &data->frame, &data->st );
+          return 0;
+     }
+
+     /* The header is not decoded again. */
+     if (mad_frame_decode( &data->frame, &data->st ) == -1)
+          return MAD_RECOVERABLE(data->st.error) ? 0 : -1;
+
+     return 1;
+}
+
+/*
+ * Get the seek points of the table of contents of a Xing header, giving the offset at each percent of the duration in
+ * 1/256 of the number of bytes from the Xing frame.
+ */
 static void
-mad_mix_audio( mad_fixed_t    *left,
-               mad_fixed_t    *right,
-               char           *dst,
-               int             frames,
-               FSSampleFormat  f,
-               int             channels,
-               FSChannelMode   mode )
+mad_toc_xing( IFusionSoundMusicProvider_MAD_data *data,
+              const u8                           *toc,
+              unsigned int                        offset,
+              unsigned int                        bytes )
 {
-     switch (f) {
-          case FSSF_U8:
-               #define TYPE u8
-               #define MUTE 128
-               #define CONV FtoU8
-               MAD_MIX_LOOP();
-               #undef CONV
-               #undef MUTE
-               #undef TYPE
-               break;
+     int i;
 
-          case FSSF_S16:
-               #define TYPE s16
-               #define MUTE 0
-               #define CONV FtoS16
-               MAD_MIX_LOOP();
-               #undef CONV
-               #undef MUTE
-               #undef TYPE
-               break;
+     data->toc = D_MALLOC( 100 * sizeof(MADSeekPoint) );
+     if (!data->toc) {
+          D_OOM();
+          return;
+     }
 
-          case FSSF_S24:
-               #define TYPE s24
-               #define MUTE (s24) { 0, 0, 0 }
-               #define CONV FtoS24
-               MAD_MIX_LOOP();
-               #undef CONV
-               #undef MUTE
-               #undef TYPE
-               break;
+     for (i = 0; i < 100; i++) {
+          data->toc[i].sample = (u64) data->frames * i / 100;
+          data->toc[i].offset = offset + (u64) bytes * toc[i] / 256;
+     }
 
-          case FSSF_S32:
-               #define TYPE s32
-               #define MUTE 0
-               #define CONV FtoS32
-               MAD_MIX_LOOP();
-               #undef CONV
-               #undef MUTE
-               #undef TYPE
-               break;
+     data->toc_count = 100;
+}
 
-          case FSSF_FLOAT:
-               #define TYPE float
-               #define MUTE 0
-               #define CONV FtoF32
-               MAD_MIX_LOOP();
-               #undef CONV
-               #undef MUTE
-               #undef TYPE
-               break;
+/*
+ * Get the seek points of the table of contents of a VBRI header, giving the sizes of consecutive groups of frames.
+ */
+static void
+mad_toc_vbri( IFusionSoundMusicProvider_MAD_data *data,
+              const u8                           *vbri,
+              const u8                           *end )
+{
+     unsigned int  entries = (vbri[18] << 8) | vbri[19];
+     unsigned int  scale   = (vbri[20] << 8) | vbri[21];
+     unsigned int  size    = (vbri[22] << 8) | vbri[23];
+     unsigned int  frames  = (vbri[24] << 8) | vbri[25];
+     unsigned int  samples = 32 * MAD_NSBSAMPLES( &data->frame.header );
+     unsigned int  offset  = data->first;
+     const u8     *p       = vbri + 26;
+     unsigned int  i, n;
+
+     if (!entries || size < 1 || size > 4 || end - p < entries * size)
+          return;
+
+     data->toc = D_MALLOC( (entries + 1) * sizeof(MADSeekPoint) );
+     if (!data->toc) {
+          D_OOM();
+          return;
+     }
 
-          default:
+     for (i = 0; i <= entries; i++) {
+          unsigned int entry = 0;
+
+          data->toc[i].sample = i * frames * samples;
+          data->toc[i].offset = offset;
+
+          if (i == entries)
                break;
+
+          for (n = 0; n < size; n++)
+               entry = (entry << 8) | *p++;
+
+          offset += entry * scale;
      }
+
+     data->toc_count = entries + 1;
 }
 
-/**********************************************************************************************************************/
+/*
+ * Apply a seek done by SeekTo() or the start of playback. Mutex must already be locked.
+ */
+static void
+mad_apply_seek( IFusionSoundMusicProvider_MAD_data *data )
+{
+     data->samples    = data->seek_from;
+     data->skip       = data->seek_to - data->seek_from;
+     data->exact      = data->seek_exact;
+     data->index_next = data->seek_from;
+     data->seeked     = false;
+
+     data->st.next_frame = NULL;
+
+     mad_frame_mute( &data->frame );
+     mad_synth_mute( &data->synth );
+}
+
+/*
+ * Rewind to the start of the stream. Mutex must already be locked.
+ */
+static void
+mad_rewind( IFusionSoundMusicProvider_MAD_data *data )
+{
+     direct_stream_seek( data->stream, 0 );
+
+     data->samples    = 0;
+     data->skip       = 0;
+     data->exact      = true;
+     data->index_next = 0;
+}
+
+static void
+MAD_SetStatus( IFusionSoundMusicProvider_MAD_data *data,
+               FSMusicProviderStatus               status )
+{
+     direct_mutex_lock( &data->status_lock );
+
+     data->status = status;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->status_lock );
+}
 
 static void
 MAD_Stop( IFusionSoundMusicProvider_MAD_data *data,
           bool                                now )
 {
-     data->status = FMSTATE_STOP;
+     MAD_SetStatus( data, FMSTATE_STOP );
 
      if (data->thread) {
           if (!direct_thread_is_joined( data->thread )) {
@@ -369,6 +526,11 @@ MAD_Stop( IFusionSoundMusicProvider_MAD_data *data,
           }
           direct_thread_destroy( data->thread );
           data->thread = NULL;
+
+          /* Resume with the first frame not decoded, so that the position stays exact. */
+          if (!now && !data->seeked && data->buf && data->st.next_frame)
+               direct_stream_seek( data->stream,
+                                   direct_stream_offset( data->stream ) - (data->st.bufend - data->st.next_frame) );
      }
 
      if (data->buf) {
@@ -387,6 +549,101 @@ MAD_Stop( IFusionSoundMusicProvider_MAD_data *data,
      }
 }
 
+static void *
+MADScan( DirectThread *thread,
+         void         *arg )
+{
+     IFusionSoundMusicProvider_MAD_data *data = arg;
+     DirectStream                       *stream;
+     struct mad_stream                   st;
+     struct mad_header                   header;
+     MADSeekPoint                        from;
+     u8                                  buf[16384];
+     unsigned int                        base;
+     unsigned int                        next;
+     unsigned int                        offset = 0;
+
+     D_DEBUG_AT( MusicProvider_MAD, "%s()\n", __FUNCTION__ );
+
+     if (direct_stream_create( data->filename, &stream ))
+          return NULL;
+
+     /* Continue from the last exact seek point, only decoding the headers of the frames. */
+     direct_mutex_lock( &data->lock );
+
+     from = data->index[data->index_count-1];
+
+     direct_mutex_unlock( &data->lock );
+
+     if (direct_stream_seek( stream, from.offset )) {
+          direct_stream_destroy( stream );
+          return NULL;
+     }
+
+     mad_stream_init( &st );
+     mad_header_init( &header );
+
+     next = from.sample;
+
+     while (true) {
+          DirectResult ret;
+          unsigned int len = 0;
+          bool         stop;
+
+          direct_mutex_lock( &data->lock );
+
+          stop = data->scan_stop;
+
+          direct_mutex_unlock( &data->lock );
+
+          if (stop)
+               break;
+
+          if (st.next_frame) {
+               offset = st.bufend - st.next_frame;
+               direct_memmove( buf, st.next_frame, offset );
+          }
+
+          ret = direct_stream_read( stream, sizeof(buf) - offset, buf + offset, &len );
+          if (ret)
+               break;
+
+          base = direct_stream_offset( stream ) - (len + offset);
+
+          mad_stream_buffer( &st, buf, len + offset );
+
+          while (true) {
+               if (mad_header_decode( &header, &st ) == -1) {
+                    if (MAD_RECOVERABLE(st.error))
+                         continue;
+
+                    break;
+               }
+
+               if (from.sample >= next) {
+                    direct_mutex_lock( &data->lock );
+
+                    mad_index_add( data, from.sample, base + (st.this_frame - buf) );
+
+                    direct_mutex_unlock( &data->lock );
+
+                    next = from.sample + data->samplerate;
+               }
+
+               from.sample += 32 * MAD_NSBSAMPLES( &header );
+          }
+     }
+
+     D_DEBUG_AT( MusicProvider_MAD, "  -> indexed up to sample %u\n", from.sample );
+
+     mad_header_finish( &header );
+     mad_stream_finish( &st );
+
+     direct_stream_destroy( stream );
+
+     return NULL;
+}
+
 static void *
 MADStream( DirectThread *thread,
            void         *arg )
@@ -401,7 +658,12 @@ MADStream( DirectThread *thread,
           DirectResult   ret    = DR_OK;
           int            offset = 0;
           unsigned int   len    = data->len;
-          struct timeval tv     = { 0, 500 };
+          unsigned int   base;
+          struct timeval tv     = { 0, STREAM_WAIT_TIMEOUT * 1000 };
+
+          /* Block until the stream has data, without holding the lock. */
+          if (direct_stream_wait( data->stream, data->len, &tv ) == DR_TIMEOUT)
+               continue;
 
           direct_mutex_lock( &data->lock );
 
@@ -412,7 +674,7 @@ MADStream( DirectThread *thread,
 
           if (data->seeked) {
                data->dest.stream->Flush( data->dest.stream );
-               data->seeked = false;
+               mad_apply_seek( data );
           }
 
           if (data->st.next_frame) {
@@ -420,40 +682,39 @@ MADStream( DirectThread *thread,
                direct_memmove( data->buf, data->st.next_frame, offset );
           }
 
-          if (offset < data->len) {
-               ret = direct_stream_wait( data->stream, data->len, &tv );
-               if (ret != DR_TIMEOUT) {
-                    ret = direct_stream_read( data->stream, data->len - offset, data->buf + offset, &len );
-               }
-          }
+          if (offset < data->len)
+               ret = direct_stream_read( data->stream, data->len - offset, data->buf + offset, &len );
 
           if (ret) {
                if (ret == DR_EOF) {
                     if (data->flags & FMPLAY_LOOPING) {
-                         direct_stream_seek( data->stream, 0 );
+                         mad_rewind( data );
                     }
                     else {
                          data->finished = true;
-                         data->status   = FMSTATE_FINISHED;
-                         direct_waitqueue_broadcast( &data->cond );
+                         MAD_SetStatus( data, FMSTATE_FINISHED );
                     }
                }
                direct_mutex_unlock( &data->lock );
                continue;
           }
 
+          /* Stream offset of the buffer. */
+          base = direct_stream_offset( data->stream ) - (len + offset);
+
           direct_mutex_unlock( &data->lock );
 
           mad_stream_buffer( &data->st, data->buf, len + offset );
 
           while (data->status == FMSTATE_PLAY && !data->seeked) {
                unsigned int pos = 0;
+               int          decoded;
 
-               if (mad_frame_decode( &data->frame, &data->st ) == -1) {
-                    if (!MAD_RECOVERABLE(data->st.error))
-                         break;
+               decoded = mad_decode_frame( data, base );
+               if (decoded < 0)
+                    break;
+               else if (!decoded)
                     continue;
-               }
 
                mad_synth_frame( &data->synth, &data->frame );
 
@@ -472,7 +733,7 @@ MADStream( DirectThread *thread,
                     left  = data->synth.pcm.samples[0] + pos;
                     right = data->synth.pcm.samples[1] + pos;
 
-                    mad_mix_audio( left, right, dst, frames, data->dest.sampleformat,
+                    mad_mix_audio( &data->matrix, left, right, dst, frames, data->dest.sampleformat,
                                    data->synth.pcm.channels, data->dest.mode );
 
                     data->dest.stream->Commit( data->dest.stream, frames );
@@ -502,7 +763,12 @@ MADBuffer( DirectThread *thread,
           DirectResult   ret    = DR_OK;
           int            offset = 0;
           unsigned int   len    = data->len;
-          struct timeval tv     = { 0, 500 };
+          unsigned int   base;
+          struct timeval tv     = { 0, STREAM_WAIT_TIMEOUT * 1000 };
+
+          /* Block until the stream has data, without holding the lock. */
+          if (direct_stream_wait( data->stream, data->len, &tv ) == DR_TIMEOUT)
+               continue;
 
           direct_mutex_lock( &data->lock );
 
@@ -511,39 +777,38 @@ MADBuffer( DirectThread *thread,
                break;
           }
 
-          data->seeked = false;
+          if (data->seeked)
+               mad_apply_seek( data );
 
           if (data->st.next_frame) {
                offset = data->st.bufend - data->st.next_frame;
                direct_memmove( data->buf, data->st.next_frame, offset );
           }
 
-          if (offset < data->len) {
-               ret = direct_stream_wait( data->stream, data->len, &tv );
-               if (ret != DR_TIMEOUT) {
-                    ret = direct_stream_read( data->stream, data->len - offset, data->buf + offset, &len );
-               }
-          }
+          if (offset < data->len)
+               ret = direct_stream_read( data->stream, data->len - offset, data->buf + offset, &len );
 
           if (ret) {
                if (ret == DR_EOF) {
                     if (data->flags & FMPLAY_LOOPING) {
-                         direct_stream_seek( data->stream, 0 );
+                         mad_rewind( data );
                     }
                     else {
                          data->finished = true;
-                         data->status = FMSTATE_FINISHED;
-                         if (data->buffer_callback && pos) {
-                              if (data->buffer_callback( pos, data->buffer_callback_context ))
-                                   data->status = FMSTATE_STOP;
-                         }
-                         direct_waitqueue_broadcast( &data->cond );
+                         if (data->buffer_callback && pos &&
+                             data->buffer_callback( pos, data->buffer_callback_context ))
+                              MAD_SetStatus( data, FMSTATE_STOP );
+                         else
+                              MAD_SetStatus( data, FMSTATE_FINISHED );
                     }
                }
                direct_mutex_unlock( &data->lock );
                continue;
           }
 
+          /* Stream offset of the buffer. */
+          base = direct_stream_offset( data->stream ) - (len + offset);
+
           direct_mutex_unlock( &data->lock );
 
           mad_stream_buffer( &data->st, data->buf, len + offset );
@@ -553,12 +818,13 @@ MADBuffer( DirectThread *thread,
                int          frames;
                mad_fixed_t *left, *right;
                char        *dst;
+               int          decoded;
 
-               if (mad_frame_decode( &data->frame, &data->st ) == -1) {
-                    if (!MAD_RECOVERABLE(data->st.error))
-                         break;
+               decoded = mad_decode_frame( data, base );
+               if (decoded < 0)
+                    break;
+               else if (!decoded)
                     continue;
-               }
 
                mad_synth_frame( &data->synth, &data->frame );
 
@@ -576,7 +842,7 @@ MADBuffer( DirectThread *thread,
                do {
                     len = MIN( frames - pos, length );
 
-                    mad_mix_audio( left, right, &dst[pos*bytespersample], len, data->dest.sampleformat,
+                    mad_mix_audio( &data->matrix, left, right, &dst[pos*bytespersample], len, data->dest.sampleformat,
                                    data->synth.pcm.channels, data->dest.mode );
 
                     left   += len;
@@ -588,8 +854,7 @@ MADBuffer( DirectThread *thread,
                          if (data->buffer_callback) {
                               data->dest.buffer->Unlock( data->dest.buffer );
                               if (data->buffer_callback( pos, data->buffer_callback_context )) {
-                                   data->status = FMSTATE_STOP;
-                                   direct_waitqueue_broadcast( &data->cond );
+                                   MAD_SetStatus( data, FMSTATE_STOP );
                                    break;
                               }
                               data->dest.buffer->Lock( data->dest.buffer, (void*) &dst, &frames, NULL );
@@ -616,11 +881,32 @@ IFusionSoundMusicProvider_MAD_Destruct( IFusionSoundMusicProvider *thiz )
 
      MAD_Stop( data, true );
 
+     if (data->scan) {
+          direct_mutex_lock( &data->lock );
+
+          data->scan_stop = true;
+
+          direct_mutex_unlock( &data->lock );
+
+          direct_thread_join( data->scan );
+          direct_thread_destroy( data->scan );
+     }
+
      direct_stream_destroy( data->stream );
 
+     if (data->filename)
+          D_FREE( data->filename );
+
      direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->status_lock );
      direct_mutex_deinit( &data->lock );
 
+     if (data->index)
+          D_FREE( data->index );
+
+     if (data->toc)
+          D_FREE( data->toc );
+
      mad_synth_finish( &data->synth );
      mad_frame_finish( &data->frame );
      mad_stream_finish( &data->st );
@@ -806,13 +1092,11 @@ IFusionSoundMusicProvider_MAD_PlayToStream( IFusionSoundMusicProvider *thiz,
      data->dest.mode         = desc.channelmode;
 
      if (data->finished) {
-          direct_stream_seek( data->stream, 0 );
+          mad_rewind( data );
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     MAD_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, MADStream, data, "MAD Stream" );
 
@@ -904,13 +1188,11 @@ IFusionSoundMusicProvider_MAD_PlayToBuffer( IFusionSoundMusicProvider *thiz,
      data->buffer_callback_context = ctx;
 
      if (data->finished) {
-          direct_stream_seek( data->stream, 0 );
+          mad_rewind( data );
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     MAD_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, MADBuffer, data, "MAD Buffer" );
 
@@ -930,8 +1212,6 @@ IFusionSoundMusicProvider_MAD_Stop( IFusionSoundMusicProvider *thiz )
 
      MAD_Stop( data, false );
 
-     direct_waitqueue_broadcast( &data->cond );
-
      direct_mutex_unlock( &data->lock );
 
      return DR_OK;
@@ -958,7 +1238,8 @@ IFusionSoundMusicProvider_MAD_SeekTo( IFusionSoundMusicProvider *thiz,
                                       double                     seconds )
 {
      DirectResult ret = DR_FAILURE;
-     unsigned int offset;
+     unsigned int sample;
+     int          i;
 
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_MAD )
 
@@ -967,12 +1248,36 @@ IFusionSoundMusicProvider_MAD_SeekTo( IFusionSoundMusicProvider *thiz,
      if (seconds < 0.0)
           return DR_INVARG;
 
-     offset = seconds * (data->desc.bitrate >> 3);
+     sample = MIN( seconds * data->samplerate, data->frames );
 
      direct_mutex_lock( &data->lock );
 
-     ret = direct_stream_seek( data->stream, offset );
+     /* Seek to the closest exact seek point and skip the frames up to the position, unless it is too far away. */
+     i = mad_seek_point_find( data->index, data->index_count, sample );
+     if (i >= 0 && sample - data->index[i].sample <= SEEK_SCAN_LIMIT * data->samplerate) {
+          ret = direct_stream_seek( data->stream, data->index[i].offset );
+          if (ret == DR_OK) {
+               data->seek_from  = data->index[i].sample;
+               data->seek_exact = true;
+          }
+     }
+     else {
+          ret = direct_stream_seek( data->stream, mad_estimate_offset( data, sample ) );
+          if (ret == DR_OK) {
+               data->seek_from  = sample;
+               data->seek_exact = false;
+
+               /* Index the seek points in the background, the position becomes exact once it is reached. */
+               if (!data->scan && data->filename)
+                    data->scan = direct_thread_create( DTT_DEFAULT, MADScan, data, "MAD Scan" );
+          }
+     }
+
      if (ret == DR_OK) {
+          D_DEBUG_AT( MusicProvider_MAD, "  -> %s seek to sample %u from %u\n",
+                      data->seek_exact ? "exact" : "estimated", sample, data->seek_from );
+
+          data->seek_to  = sample;
           data->seeked   = true;
           data->finished = false;
      }
@@ -986,7 +1291,7 @@ static DirectResult
 IFusionSoundMusicProvider_MAD_GetPos( IFusionSoundMusicProvider *thiz,
                                       double                    *ret_seconds )
 {
-     int offset;
+     unsigned int sample;
 
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_MAD )
 
@@ -995,14 +1300,12 @@ IFusionSoundMusicProvider_MAD_GetPos( IFusionSoundMusicProvider *thiz,
      if (!ret_seconds)
           return DR_INVARG;
 
-     offset = direct_stream_offset( data->stream );
-
-     if (data->status == FMSTATE_PLAY && data->st.this_frame) {
-          offset -= data->st.bufend - data->st.this_frame;
-          offset  = (offset < 0) ? 0 : offset;
-     }
+     if (data->seeked)
+          sample = data->seek_to;
+     else
+          sample = data->samples + data->skip;
 
-     *ret_seconds = (double) offset / (data->desc.bitrate >> 3);
+     *ret_seconds = (double) sample / data->samplerate;
 
      return DR_OK;
 }
@@ -1047,8 +1350,6 @@ IFusionSoundMusicProvider_MAD_WaitStatus( IFusionSoundMusicProvider *thiz,
                                           FSMusicProviderStatus      mask,
                                           unsigned int               timeout )
 {
-     DirectResult ret;
-
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_MAD )
 
      D_DEBUG_AT( MusicProvider_MAD, "%s( %p )\n", __FUNCTION__, thiz );
@@ -1056,33 +1357,27 @@ IFusionSoundMusicProvider_MAD_WaitStatus( IFusionSoundMusicProvider *thiz,
      if (!mask || mask & ~FMSTATE_ALL)
           return DR_INVARG;
 
-     if (timeout) {
-          long long s;
-
-          s = direct_clock_get_abs_micros() + timeout * 1000ll;
+     direct_mutex_lock( &data->status_lock );
 
-          while (direct_mutex_trylock( &data->lock )) {
-               usleep( 1000 );
-               if (direct_clock_get_abs_micros() >= s)
-                    return DR_TIMEOUT;
-          }
+     if (timeout) {
+          long long deadline = direct_clock_get_abs_micros() + timeout * 1000ll;
 
           while (!(data->status & mask)) {
-               ret = direct_waitqueue_wait_timeout( &data->cond, &data->lock, timeout * 1000ll );
-               if (ret) {
-                    direct_mutex_unlock( &data->lock );
+               long long now = direct_clock_get_abs_micros();
+
+               if (now >= deadline ||
+                   direct_waitqueue_wait_timeout( &data->cond, &data->status_lock, deadline - now ) == DR_TIMEOUT) {
+                    direct_mutex_unlock( &data->status_lock );
                     return DR_TIMEOUT;
                }
           }
      }
      else {
-          direct_mutex_lock( &data->lock );
-
           while (!(data->status & mask))
-               direct_waitqueue_wait( &data->cond, &data->lock );
+               direct_waitqueue_wait( &data->cond, &data->status_lock );
      }
 
-     direct_mutex_unlock( &data->lock );
+     direct_mutex_unlock( &data->status_lock );
 
      return DR_OK;
 }
@@ -1119,8 +1414,13 @@ Construct( IFusionSoundMusicProvider *thiz,
      int             i;
      struct id3_tag  id3;
      const char     *version;
-     unsigned int    pos   = 0;
-     int             error = -1;
+     u8              toc[100];
+     bool            has_toc = false;
+     const u8       *vbri    = NULL;
+     unsigned int    header  = 0;
+     unsigned int    bytes   = 0;
+     unsigned int    pos     = 0;
+     int             error   = -1;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IFusionSoundMusicProvider_MAD )
 
@@ -1152,11 +1452,44 @@ Construct( IFusionSoundMusicProvider *thiz,
 
           error = mad_frame_decode( &data->frame, &data->st );
           if (!error) {
-               /* Get the number of frames from Xing header. */
-               if (data->st.anc_bitlen >= 128 && mad_bit_read( &data->st.anc_ptr, 32 ) == XING_MAGIC) {
-                    if (mad_bit_read( &data->st.anc_ptr, 32 ) & 1)
+               data->first = pos - size + (data->st.this_frame - buf);
+
+               /* Get the number of frames, the number of bytes and the table of contents from Xing header. */
+               if (data->st.anc_bitlen >= 64 && mad_bit_read( &data->st.anc_ptr, 32 ) == XING_MAGIC) {
+                    unsigned int flags  = mad_bit_read( &data->st.anc_ptr, 32 );
+                    unsigned int bitlen = data->st.anc_bitlen - 64;
+
+                    if ((flags & 1) && bitlen >= 32) {
                          data->frames = mad_bit_read( &data->st.anc_ptr, 32 );
+                         bitlen -= 32;
+                    }
+
+                    if ((flags & 2) && bitlen >= 32) {
+                         bytes   = mad_bit_read( &data->st.anc_ptr, 32 );
+                         bitlen -= 32;
+                    }
+
+                    if ((flags & 4) && bitlen >= 800) {
+                         for (i = 0; i < 100; i++)
+                              toc[i] = mad_bit_read( &data->st.anc_ptr, 8 );
+
+                         has_toc = true;
+                    }
+               }
+               /* Otherwise get them from VBRI header, 32 bytes after the frame header. */
+               else if (data->st.bufend - data->st.this_frame >= 36 + 26 &&
+                        !memcmp( data->st.this_frame + 36, "VBRI", 4 )) {
+                    vbri = data->st.this_frame + 36;
+
+                    bytes        = (vbri[10] << 24) | (vbri[11] << 16) | (vbri[12] << 8) | vbri[13];
+                    data->frames = (vbri[14] << 24) | (vbri[15] << 16) | (vbri[16] << 8) | vbri[17];
                }
+               else
+                    break;
+
+               /* The audio starts with the next frame. */
+               header      = data->first;
+               data->first = pos - size + (data->st.next_frame - buf);
                break;
           }
      }
@@ -1174,6 +1507,9 @@ Construct( IFusionSoundMusicProvider *thiz,
 
      /* Get ID3 tag. */
      if (direct_stream_seekable( data->stream ) && !direct_stream_remote( data->stream )) {
+          if (filename)
+               data->filename = D_STRDUP( filename );
+
           direct_stream_peek( data->stream, sizeof(id3), size - sizeof(id3), &id3, NULL );
 
           if (!strncmp( (char*) id3.tag, "TAG", 3 )) {
@@ -1238,7 +1574,20 @@ Construct( IFusionSoundMusicProvider *thiz,
           data->desc.bitrate = data->frame.header.bitrate;
      }
 
+     data->end = size;
+
+     /* Estimated seek points from the table of contents, and the first exact seek point. */
+     if (has_toc && data->frames)
+          mad_toc_xing( data, toc, header, bytes ?: size - header );
+     else if (vbri)
+          mad_toc_vbri( data, vbri, data->st.bufend );
+
+     mad_index_add( data, 0, data->first );
+
+     data->exact = true;
+
      direct_mutex_init( &data->lock );
+     direct_mutex_init( &data->status_lock );
      direct_waitqueue_init( &data->cond );
 
      data->status = FMSTATE_STOP;
@@ -16,11 +16,15 @@
    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
 */
 
-#include <direct/list.h>
+#include <direct/filesystem.h>
+#include <direct/hash.h>
 #include <direct/memcpy.h>
 #include <direct/stream.h>
+#include <direct/system.h>
+#include <direct/thread.h>
 #include <direct/util.h>
 #include <media/ifusionsoundmusicprovider.h>
+#include <sys/stat.h>
 
 D_DEBUG_DOMAIN( MusicProvider_Playlist, "MusicProvider/Playlist", "Playlist Music Provider" );
 
@@ -36,24 +40,77 @@ DIRECT_INTERFACE_IMPLEMENTATION( IFusionSoundMusicProvider, Playlist )
 
 /**********************************************************************************************************************/
 
-typedef struct {
-     DirectLink                 link;
+typedef enum {
+     PLT_NONE,
+     PLT_M3U,
+     PLT_PLS,
+     PLT_XSPF
+} PlaylistType;
 
+typedef struct {
      FSTrackID                  id;
+     unsigned int               index;          /* position in the playlist */
 
-     char                      *url;
-     char                      *artist;
-     char                      *title;
-     char                      *album;
+     const char                *url;            /* interned strings */
+     const char                *artist;
+     const char                *title;
+     const char                *album;
 
      IFusionSoundMusicProvider *provider;
+
+     FSTrackDescription         desc;           /* description of the track, once described */
+     bool                       described;
+
+     bool                       local;          /* the track is a local file with the following size and time */
+     u64                        file_size;
+     s64                        file_mtime;     /* in nanoseconds */
 } PlaylistEntry;
 
+typedef struct {
+     char                     **blocks;         /* blocks holding the strings */
+     unsigned int               num_blocks;
+     unsigned int               used;           /* bytes used in the last block */
+     unsigned int               size;           /* size of the last block */
+
+     const char               **table;          /* open addressing hash table of the strings */
+     unsigned int               capacity;
+     unsigned int               count;
+} PlaylistStrings;
+
+typedef struct {
+     PlaylistType               type;
+
+     char                      *buf;            /* data read but not parsed yet */
+     unsigned int               len;
+     unsigned int               size;
+
+     FSTrackID                  id;             /* track id of the next M3U or XSPF entry */
+     const char                *title;          /* title of the next M3U entry */
+} PlaylistParser;
+
 typedef struct {
      int                           ref;                     /* reference counter */
 
-     DirectLink                   *playlist;
+     PlaylistEntry               **blocks;                  /* blocks of entries, entries are never moved */
+     unsigned int                  num_entries;
+     DirectHash                   *ids;                     /* entries by track id */
+     PlaylistStrings               strings;
+
+     DirectStream                 *stream;                  /* playlist being parsed */
+     PlaylistParser                parser;
+     DirectThread                 *parse_thread;
+     bool                          parsing;                 /* entries are still being added */
+
      PlaylistEntry                *selected;
+     PlaylistEntry                *prepared;                /* track prepared to follow the selected one */
+     bool                          advanced;                /* selected track started after the previous one */
+
+     DirectMutex                   lock;                    /* protects the entries, the selection and the providers */
+     DirectWaitQueue               cond;                    /* signaled on changes of entries, selection, playback */
+
+     unsigned int                  preroll;                 /* seconds before the end to prepare the next track */
+     DirectThread                 *thread;
+     bool                          quit;
 
      FSMusicProviderPlaybackFlags  flags;
 
@@ -64,67 +121,218 @@ typedef struct {
 
      FMBufferCallback              buffer_callback;
      void                         *buffer_callback_context;
+
+     int                           threads;                 /* number of threads describing the tracks */
+     DirectMutex                   describe_lock;           /* serializes the description of the tracks */
+     char                         *cache;                   /* path of the track description cache, if enabled */
 } IFusionSoundMusicProvider_Playlist_data;
 
 /**********************************************************************************************************************/
 
+#define ENTRY_BLOCK_SIZE  1024
+#define STRING_BLOCK_SIZE 65536
+#define PARSE_CHUNK_SIZE  16384
+
+#define STREAM_WAIT_TIMEOUT 100 /* milliseconds, bounds the time to notice a destruction while the stream is stalled */
+
 #define space(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n' || (c) == '"' || (c) == '\'')
 
+static __inline__ PlaylistEntry *
+playlist_entry( IFusionSoundMusicProvider_Playlist_data *data,
+                unsigned int                             index )
+{
+     return &data->blocks[index / ENTRY_BLOCK_SIZE][index % ENTRY_BLOCK_SIZE];
+}
+
+/*
+ * Look up the entry of a track id. Mutex must already be locked.
+ */
+static __inline__ PlaylistEntry *
+playlist_lookup( IFusionSoundMusicProvider_Playlist_data *data,
+                 FSTrackID                                id )
+{
+     return direct_hash_lookup( data->ids, id );
+}
+
+static u32
+string_hash( const char *s )
+{
+     u32 hash = 2166136261u;
+
+     /* FNV-1a */
+     while (*s) {
+          hash ^= (u8) *s++;
+          hash *= 16777619u;
+     }
+
+     return hash;
+}
+
+/*
+ * Get the interned copy of a string, stored once for all the entries using it. Mutex must already be locked.
+ */
+static const char *
+intern( IFusionSoundMusicProvider_Playlist_data *data,
+        const char                              *s )
+{
+     PlaylistStrings *strings = &data->strings;
+     unsigned int     len     = strlen( s ) + 1;
+     unsigned int     i;
+     char            *copy;
+
+     if (!*s)
+          return NULL;
+
+     /* Grow the table to keep it at most half full. */
+     if ((strings->count + 1) * 2 > strings->capacity) {
+          unsigned int  capacity = strings->capacity ? strings->capacity * 2 : 1024;
+          const char  **table    = D_CALLOC( capacity, sizeof(const char*) );
+
+          if (!table) {
+               D_OOM();
+               return NULL;
+          }
+
+          for (i = 0; i < strings->capacity; i++) {
+               unsigned int n;
+
+               if (!strings->table[i])
+                    continue;
+
+               for (n = string_hash( strings->table[i] ) & (capacity - 1); table[n]; n = (n + 1) & (capacity - 1));
+
+               table[n] = strings->table[i];
+          }
+
+          if (strings->table)
+               D_FREE( strings->table );
+
+          strings->table    = table;
+          strings->capacity = capacity;
+     }
+
+     for (i = string_hash( s ) & (strings->capacity - 1); strings->table[i]; i = (i + 1) & (strings->capacity - 1)) {
+          if (!strcmp( strings->table[i], s ))
+               return strings->table[i];
+     }
+
+     /* Copy the string to the last block, or to a new one. */
+     if (strings->size - strings->used < len) {
+          unsigned int   size   = MAX( len, STRING_BLOCK_SIZE );
+          char         **blocks = D_REALLOC( strings->blocks, (strings->num_blocks + 1) * sizeof(char*) );
+
+          if (!blocks) {
+               D_OOM();
+               return NULL;
+          }
+
+          strings->blocks = blocks;
+
+          strings->blocks[strings->num_blocks] = D_MALLOC( size );
+          if (!strings->blocks[strings->num_blocks]) {
+               D_OOM();
+               return NULL;
+          }
+
+          strings->num_blocks++;
+          strings->used = 0;
+          strings->size = size;
+     }
+
+     copy = strings->blocks[strings->num_blocks-1] + strings->used;
+
+     direct_memcpy( copy, s, len );
+
+     strings->used += len;
+
+     strings->table[i] = copy;
+     strings->count++;
+
+     return copy;
+}
+
+/*
+ * Add an entry to the playlist. Mutex must already be locked.
+ */
 static DirectResult
-add_media( FSTrackID    id,
-           const char  *url,
-           const char  *artist,
-           const char  *title,
-           const char  *album,
-           DirectLink **playlist )
+add_media( IFusionSoundMusicProvider_Playlist_data *data,
+           FSTrackID                                id,
+           const char                              *url,
+           const char                              *artist,
+           const char                              *title,
+           const char                              *album )
 {
      PlaylistEntry *entry;
 
      D_ASSERT( url != NULL );
-     D_ASSERT( playlist != NULL );
 
-     entry = D_CALLOC( 1, sizeof(PlaylistEntry) );
-     if (!entry)
-          return D_OOM();
+     if (playlist_lookup( data, id ))
+          return DR_BUSY;
 
-     entry->id  = id;
-     entry->url = D_STRDUP( url );
+     if (data->num_entries % ENTRY_BLOCK_SIZE == 0) {
+          unsigned int    num    = data->num_entries / ENTRY_BLOCK_SIZE;
+          PlaylistEntry **blocks = D_REALLOC( data->blocks, (num + 1) * sizeof(PlaylistEntry*) );
 
-     if (artist && *artist)
-          entry->artist = D_STRDUP( artist );
-     if (title && *title)
-          entry->title = D_STRDUP( title );
-     if (album && *album)
-          entry->album = D_STRDUP( album );
+          if (!blocks)
+               return D_OOM();
 
-     direct_list_append( playlist, &entry->link );
+          data->blocks = blocks;
+
+          data->blocks[num] = D_CALLOC( ENTRY_BLOCK_SIZE, sizeof(PlaylistEntry) );
+          if (!data->blocks[num])
+               return D_OOM();
+     }
+
+     entry = playlist_entry( data, data->num_entries );
+
+     entry->id    = id;
+     entry->index = data->num_entries;
+     entry->url   = intern( data, url );
+
+     if (!entry->url)
+          return DR_FAILURE;
+
+     if (artist)
+          entry->artist = intern( data, artist );
+     if (title)
+          entry->title = intern( data, title );
+     if (album)
+          entry->album = intern( data, album );
+
+     if (direct_hash_insert( data->ids, id, entry ))
+          return DR_FAILURE;
+
+     data->num_entries++;
 
      return DR_OK;
 }
 
 static void
-remove_media( PlaylistEntry  *entry,
-              DirectLink    **playlist )
+remove_media( IFusionSoundMusicProvider_Playlist_data *data )
 {
-     D_ASSERT( entry != NULL );
-     D_ASSERT( playlist != NULL );
+     unsigned int i;
+
+     for (i = 0; i < data->num_entries; i++) {
+          PlaylistEntry *entry = playlist_entry( data, i );
+
+          if (entry->provider)
+               entry->provider->Release( entry->provider );
+     }
 
-     direct_list_remove( playlist, &entry->link );
+     for (i = 0; i < (data->num_entries + ENTRY_BLOCK_SIZE - 1) / ENTRY_BLOCK_SIZE; i++)
+          D_FREE( data->blocks[i] );
 
-     if (entry->url)
-          D_FREE( entry->url );
+     if (data->blocks)
+          D_FREE( data->blocks );
 
-     if (entry->artist)
-          D_FREE( entry->artist );
-     if (entry->title)
-          D_FREE( entry->title );
-     if (entry->album)
-          D_FREE( entry->album );
+     for (i = 0; i < data->strings.num_blocks; i++)
+          D_FREE( data->strings.blocks[i] );
 
-     if (entry->provider)
-          entry->provider->Release( entry->provider );
+     if (data->strings.blocks)
+          D_FREE( data->strings.blocks );
 
-     D_FREE( entry );
+     if (data->strings.table)
+          D_FREE( data->strings.table );
 }
 
 /**********************************************************************************************************************/
@@ -145,12 +353,12 @@ trim( char *s )
 }
 
 static void
-m3u_playlist_parse( DirectLink **playlist,
-                    char        *src )
+m3u_playlist_parse( IFusionSoundMusicProvider_Playlist_data *data,
+                    char                                    *src )
 {
-     char *end;
-     char *title = NULL;
-     int   id    = 0;
+     PlaylistParser *parser = &data->parser;
+     char           *end;
+     char           *title;
 
      while (src) {
           end = strchr( src, '\n' );
@@ -162,12 +370,12 @@ m3u_playlist_parse( DirectLink **playlist,
                if (!strncmp( src + 1, "EXTINF:", 7 )) {
                     title = strchr( src + 8, ',' );
                     if (title)
-                         title++;
+                         parser->title = intern( data, title + 1 );
                }
           }
           else if (*src) {
-               add_media( id++, src, NULL, title, NULL, playlist );
-               title = NULL;
+               add_media( data, parser->id++, src, NULL, parser->title, NULL );
+               parser->title = NULL;
           }
 
           src = end;
@@ -177,8 +385,8 @@ m3u_playlist_parse( DirectLink **playlist,
 }
 
 static void
-pls_playlist_parse( DirectLink **playlist,
-                    char        *src )
+pls_playlist_parse( IFusionSoundMusicProvider_Playlist_data *data,
+                    char                                    *src )
 {
      char *end;
      int   id;
@@ -194,21 +402,17 @@ pls_playlist_parse( DirectLink **playlist,
                id = atoi( src );
                src = strchr( src, '=' );
                if (id && src && *(src + 1))
-                    add_media( id - 1, src + 1, NULL, NULL, NULL, playlist );
+                    add_media( data, id - 1, src + 1, NULL, NULL, NULL );
           }
           else if (!strncmp( src, "Title", 5 )) {
                src += 5;
                id = atoi( src );
                src = strchr( src, '=' );
                if (id && src && *(src + 1)) {
-                    PlaylistEntry *entry;
-
-                    direct_list_foreach (entry, *playlist) {
-                         if (entry->id == id - 1) {
-                              entry->title = D_STRDUP( src + 1 );
-                              break;
-                         }
-                    }
+                    PlaylistEntry *entry = playlist_lookup( data, id - 1 );
+
+                    if (entry)
+                         entry->title = intern( data, src + 1 );
                }
           }
 
@@ -258,29 +462,17 @@ replace_xml_entities( char *s )
 }
 
 static void
-xspf_playlist_parse( DirectLink **playlist,
-                     char        *src )
+xspf_track_parse( IFusionSoundMusicProvider_Playlist_data *data,
+                  char                                    *src )
 {
      char *end;
      char *url     = NULL;
      char *creator = NULL;
      char *title   = NULL;
      char *album   = NULL;
-     int   id      = 0;
 
      while ((src = strchr( src, '<' ))) {
-          if (!strncmp( src, "<!--", 4 )) {
-               src += 4;
-               end = strstr( src, "-->" );
-               if (!end)
-                    break;
-               src = end + 3;
-          }
-          else if (!strncmp( src, "<track>", 7 )) {
-               src += 7;
-               url = creator = title = album = NULL;
-          }
-          else if (!strncmp( src, "<location>", 10 )) {
+          if (!strncmp( src, "<location>", 10 )) {
                src += 10;
                end = strstr( src, "</location>" );
                if (end > src) {
@@ -316,29 +508,622 @@ xspf_playlist_parse( DirectLink **playlist,
                     src = end + 8;
                }
           }
-          else if (!strncmp( src, "</track>", 8 )) {
-               src += 8;
-               if (url) {
-                    if (creator)
-                         replace_xml_entities( creator );
-                    if (title)
-                         replace_xml_entities( title );
-                    if (album)
-                         replace_xml_entities( album );
+          else {
+               src++;
+          }
+     }
+
+     if (url) {
+          if (creator)
+               replace_xml_entities( creator );
+          if (title)
+               replace_xml_entities( title );
+          if (album)
+               replace_xml_entities( album );
+
+          add_media( data, data->parser.id++, url, creator, title, album );
+     }
+}
+
+/*
+ * Parse the complete tracks, returns the number of bytes parsed.
+ */
+static unsigned int
+xspf_playlist_parse( IFusionSoundMusicProvider_Playlist_data *data,
+                     char                                    *buf,
+                     unsigned int                             len,
+                     bool                                     eof )
+{
+     char *src = buf;
+     char *end;
+
+     while ((src = strchr( src, '<' ))) {
+          /* Wait for the rest of a tag cut at the end of the data. */
+          if (!eof && buf + len - src < 8)
+               return src - buf;
+
+          if (!strncmp( src, "<!--", 4 )) {
+               end = strstr( src + 4, "-->" );
+               if (!end)
+                    return eof ? len : src - buf;
+               src = end + 3;
+          }
+          else if (!strncmp( src, "<track>", 7 )) {
+               end = strstr( src + 7, "</track>" );
+               if (!end)
+                    return eof ? len : src - buf;
+               *end = '\0';
+               xspf_track_parse( data, src + 7 );
+               src = end + 8;
+          }
+          else {
+               src++;
+          }
+     }
+
+     return len;
+}
+
+/*
+ * Parse the playlist data read so far, returns the number of bytes parsed, the rest has to be parsed with more data.
+ * Mutex must already be locked.
+ */
+static unsigned int
+playlist_parse( IFusionSoundMusicProvider_Playlist_data *data,
+                char                                    *buf,
+                unsigned int                             len,
+                bool                                     eof )
+{
+     char         *end = buf + len;
+     unsigned int  parsed;
+
+     if (data->parser.type == PLT_XSPF)
+          return xspf_playlist_parse( data, buf, len, eof );
+
+     /* Parse the complete lines only. */
+     if (!eof) {
+          end = strrchr( buf, '\n' );
+          if (!end)
+               return 0;
+     }
+
+     parsed = end - buf;
+
+     *end = '\0';
+
+     if (data->parser.type == PLT_M3U)
+          m3u_playlist_parse( data, buf );
+     else
+          pls_playlist_parse( data, buf );
+
+     return eof ? len : parsed + 1;
+}
+
+/*
+ * Read and parse the next chunk of the playlist, returns DR_EOF once the whole playlist has been parsed, or
+ * DR_INTERRUPTED once the provider is being destroyed.
+ */
+static DirectResult
+playlist_read( IFusionSoundMusicProvider_Playlist_data *data )
+{
+     DirectResult    ret;
+     PlaylistParser *parser = &data->parser;
+     unsigned int    len    = 0;
+     unsigned int    parsed;
+
+     if (parser->size - parser->len < PARSE_CHUNK_SIZE + 1) {
+          char *buf = D_REALLOC( parser->buf, parser->len + PARSE_CHUNK_SIZE + 1 );
+
+          if (!buf)
+               return D_OOM();
+
+          parser->buf  = buf;
+          parser->size = parser->len + PARSE_CHUNK_SIZE + 1;
+     }
+
+     while (true) {
+          struct timeval tv = { 0, STREAM_WAIT_TIMEOUT * 1000 };
+          bool           quit;
+
+          if (direct_stream_wait( data->stream, PARSE_CHUNK_SIZE, &tv ) != DR_TIMEOUT)
+               break;
+
+          direct_mutex_lock( &data->lock );
+
+          quit = data->quit;
+
+          direct_mutex_unlock( &data->lock );
+
+          if (quit)
+               return DR_INTERRUPTED;
+     }
+
+     ret = direct_stream_read( data->stream, PARSE_CHUNK_SIZE, parser->buf + parser->len, &len );
+     if (ret) {
+          if (ret != DR_EOF)
+               D_DERROR( ret, "MusicProvider/Playlist: Failed to read playlist!\n" );
+
+          ret = DR_EOF;
+          len = 0;
+     }
+
+     parser->len += len;
+     parser->buf[parser->len] = '\0';
+
+     direct_mutex_lock( &data->lock );
+
+     parsed = playlist_parse( data, parser->buf, parser->len, ret == DR_EOF );
+
+     if (ret == DR_OK && data->quit)
+          ret = DR_INTERRUPTED;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->lock );
+
+     parser->len -= parsed;
+
+     direct_memmove( parser->buf, parser->buf + parsed, parser->len );
+
+     return ret;
+}
+
+static void *
+PlaylistParse( DirectThread *thread,
+               void         *arg )
+{
+     IFusionSoundMusicProvider_Playlist_data *data = arg;
+
+     while (!playlist_read( data ));
+
+     direct_mutex_lock( &data->lock );
+
+     data->parsing = false;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->lock );
+
+     D_DEBUG_AT( MusicProvider_Playlist, "  -> parsed %u entries\n", data->num_entries );
+
+     return NULL;
+}
+
+/*
+ * Wait until the whole playlist has been parsed. Mutex must already be locked.
+ */
+static void
+playlist_wait_parsed( IFusionSoundMusicProvider_Playlist_data *data )
+{
+     while (data->parsing)
+          direct_waitqueue_wait( &data->cond, &data->lock );
+}
+
+/**********************************************************************************************************************/
+
+#define MAX_SCAN_THREADS 8
+
+/* The last character is the version of the cache format, 2 since the modification times are in nanoseconds. */
+#define CACHE_MAGIC (('F' << 24) | ('S' << 16) | ('P' << 8) | '2')
+
+typedef struct {
+     u32                 magic;
+     u32                 desc_size;     /* size of the track descriptions, the cache is not used by other builds */
+} PlaylistCacheHeader;
+
+typedef struct {
+     u64                 size;          /* size of the file */
+     s64                 mtime;         /* modification time of the file in nanoseconds */
+     FSTrackDescription  desc;
+     u32                 length;        /* length of the URL following the record */
+} PlaylistCacheRecord;
+
+typedef struct {
+     const char          *url;          /* not null terminated */
+     PlaylistCacheRecord  record;
+} PlaylistCacheItem;
+
+typedef struct {
+     u8                 *buf;           /* content of the cache file */
+     PlaylistCacheItem  *items;         /* sorted by URL */
+     unsigned int        num;
+} PlaylistCache;
+
+typedef struct {
+     IFusionSoundMusicProvider_Playlist_data *data;
+
+     DirectMutex                              lock;
+
+     PlaylistEntry                          **entries;     /* entries to describe */
+     unsigned int                             num;
+     unsigned int                             next;        /* next entry to describe */
+} PlaylistScan;
+
+/*
+ * Get the size and the modification time of a local file, the track descriptions of other URLs are not cached. The
+ * time is in nanoseconds, files rewritten within the same second with the same size would not be described again.
+ */
+static bool
+playlist_file_info( const char *url,
+                    u64        *ret_size,
+                    s64        *ret_mtime )
+{
+     struct stat st;
+
+     if (!strncmp( url, "file://", 7 ))
+          url += 7;
+     else if (strstr( url, "://" ))
+          return false;
+
+     if (stat( url, &st ))
+          return false;
+
+     *ret_size  = st.st_size;
+     *ret_mtime = st.st_mtime * 1000000000LL + st.st_mtim.tv_nsec;
+
+     return true;
+}
+
+static int
+playlist_cache_compare( const void *a,
+                        const void *b )
+{
+     const PlaylistCacheItem *item_a = a;
+     const PlaylistCacheItem *item_b = b;
+     int                      ret;
+
+     ret = memcmp( item_a->url, item_b->url, MIN( item_a->record.length, item_b->record.length ) );
+     if (ret)
+          return ret;
+
+     return (item_a->record.length > item_b->record.length) - (item_a->record.length < item_b->record.length);
+}
+
+static const PlaylistCacheItem *
+playlist_cache_find( const PlaylistCacheItem *items,
+                     unsigned int             num,
+                     const char              *url )
+{
+     PlaylistCacheItem key;
+
+     key.url           = url;
+     key.record.length = strlen( url );
+
+     return bsearch( &key, items, num, sizeof(PlaylistCacheItem), playlist_cache_compare );
+}
+
+static void
+playlist_cache_load( PlaylistCache *cache,
+                     const char    *path )
+{
+     DirectResult         ret;
+     DirectFile           fd;
+     DirectFileInfo       info;
+     PlaylistCacheHeader  header;
+     size_t               size     = 0;
+     unsigned int         capacity = 0;
+     size_t               pos;
+     size_t               bytes;
+
+     memset( cache, 0, sizeof(PlaylistCache) );
+
+     if (direct_file_open( &fd, path, O_RDONLY, 0 ))
+          return;
+
+     if (!direct_file_get_info( &fd, &info ) && info.size > sizeof(PlaylistCacheHeader)) {
+          cache->buf = D_MALLOC( info.size );
+          if (!cache->buf)
+               D_OOM();
+     }
+
+     for (; cache->buf && size < info.size; size += bytes) {
+          ret = direct_file_read( &fd, cache->buf + size, info.size - size, &bytes );
+          if (ret || !bytes)
+               break;
+     }
+
+     direct_file_close( &fd );
+
+     if (!cache->buf)
+          return;
+
+     direct_memcpy( &header, cache->buf, sizeof(PlaylistCacheHeader) );
+
+     if (size < info.size || header.magic != CACHE_MAGIC || header.desc_size != sizeof(FSTrackDescription)) {
+          D_DEBUG_AT( MusicProvider_Playlist, "  -> ignoring cache '%s'\n", path );
+          return;
+     }
+
+     for (pos = sizeof(PlaylistCacheHeader); pos + sizeof(PlaylistCacheRecord) <= size;) {
+          PlaylistCacheItem *item;
+
+          if (cache->num == capacity) {
+               PlaylistCacheItem *items;
+
+               capacity = capacity ? capacity * 2 : 256;
+
+               items = D_REALLOC( cache->items, capacity * sizeof(PlaylistCacheItem) );
+               if (!items) {
+                    D_OOM();
+                    break;
+               }
+
+               cache->items = items;
+          }
+
+          item = &cache->items[cache->num];
+
+          direct_memcpy( &item->record, cache->buf + pos, sizeof(PlaylistCacheRecord) );
+          pos += sizeof(PlaylistCacheRecord);
+
+          if (item->record.length > size - pos)
+               break;
+
+          item->url = (const char*) cache->buf + pos;
+          pos += item->record.length;
+
+          cache->num++;
+     }
+
+     qsort( cache->items, cache->num, sizeof(PlaylistCacheItem), playlist_cache_compare );
+
+     D_DEBUG_AT( MusicProvider_Playlist, "  -> loaded %u track descriptions from cache '%s'\n", cache->num, path );
+}
+
+static void
+playlist_cache_free( PlaylistCache *cache )
+{
+     if (cache->items)
+          D_FREE( cache->items );
+
+     if (cache->buf)
+          D_FREE( cache->buf );
+}
+
+static bool
+playlist_cache_write( DirectFile              *fd,
+                      const PlaylistCacheItem *item )
+{
+     size_t bytes;
+
+     if (direct_file_write( fd, &item->record, sizeof(PlaylistCacheRecord), &bytes ) ||
+         bytes != sizeof(PlaylistCacheRecord))
+          return false;
+
+     if (direct_file_write( fd, item->url, item->record.length, &bytes ) || bytes != item->record.length)
+          return false;
+
+     return true;
+}
+
+/*
+ * Write the descriptions of the local tracks of the playlist to the cache, along with the ones of other tracks loaded
+ * from it, replacing the cache file once complete.
+ */
+static void
+playlist_cache_save( IFusionSoundMusicProvider_Playlist_data *data,
+                     const PlaylistCache                     *cache )
+{
+     DirectFile           fd;
+     PlaylistEntry       *entry;
+     PlaylistCacheItem   *items;
+     PlaylistCacheHeader  header;
+     size_t               bytes;
+     char                 tmp[PATH_MAX];
+     unsigned int         i;
+     unsigned int         num = 0;
+     bool                 ok  = true;
+
+     items = D_MALLOC( data->num_entries * sizeof(PlaylistCacheItem) );
+     if (!items) {
+          D_OOM();
+          return;
+     }
+
+     for (i = 0; i < data->num_entries; i++) {
+          entry = playlist_entry( data, i );
+
+          if (!entry->described || !entry->local)
+               continue;
+
+          items[num].url           = entry->url;
+          items[num].record.size   = entry->file_size;
+          items[num].record.mtime  = entry->file_mtime;
+          items[num].record.desc   = entry->desc;
+          items[num].record.length = strlen( entry->url );
+          num++;
+     }
+
+     qsort( items, num, sizeof(PlaylistCacheItem), playlist_cache_compare );
+
+     snprintf( tmp, sizeof(tmp), "%s.tmp", data->cache );
+
+     if (direct_file_open( &fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 )) {
+          D_ERROR( "MusicProvider/Playlist: Failed to create cache '%s'!\n", tmp );
+          D_FREE( items );
+          return;
+     }
+
+     header.magic     = CACHE_MAGIC;
+     header.desc_size = sizeof(FSTrackDescription);
+
+     if (direct_file_write( &fd, &header, sizeof(header), &bytes ) || bytes != sizeof(header))
+          ok = false;
+
+     for (i = 0; i < num && ok; i++)
+          ok = playlist_cache_write( &fd, &items[i] );
+
+     /* Keep the descriptions of the tracks of other playlists. */
+     for (i = 0; i < cache->num && ok; i++) {
+          if (!bsearch( &cache->items[i], items, num, sizeof(PlaylistCacheItem), playlist_cache_compare ))
+               ok = playlist_cache_write( &fd, &cache->items[i] );
+     }
+
+     direct_file_close( &fd );
+
+     if (!ok || rename( tmp, data->cache )) {
+          D_ERROR( "MusicProvider/Playlist: Failed to write cache '%s'!\n", data->cache );
+          unlink( tmp );
+     }
+
+     D_FREE( items );
+}
+
+static void *
+PlaylistScanThread( DirectThread *thread,
+                    void         *arg )
+{
+     PlaylistScan *scan = arg;
+
+     while (true) {
+          PlaylistEntry             *entry;
+          IFusionSoundMusicProvider *provider;
+          FSTrackDescription         desc;
+
+          direct_mutex_lock( &scan->lock );
+
+          if (scan->next == scan->num) {
+               direct_mutex_unlock( &scan->lock );
+               break;
+          }
+
+          entry = scan->entries[scan->next++];
+
+          direct_mutex_unlock( &scan->lock );
+
+          /* Use the provider of the selected or prepared track if any. */
+          direct_mutex_lock( &scan->data->lock );
+
+          provider = entry->provider;
+          if (provider)
+               provider->AddRef( provider );
+
+          direct_mutex_unlock( &scan->data->lock );
+
+          if (!provider && IFusionSoundMusicProvider_Create( entry->url, &provider ))
+               continue;
+
+          provider->GetTrackDescription( provider, &desc );
+          provider->Release( provider );
+
+          direct_mutex_lock( &scan->data->lock );
+
+          entry->desc      = desc;
+          entry->described = true;
+
+          direct_mutex_unlock( &scan->data->lock );
+     }
+
+     return NULL;
+}
+
+/*
+ * Describe the tracks not described yet, from the cache if enabled, otherwise by creating their providers with a pool
+ * of threads. The tracks are only described by one caller at a time, which also writes the cache.
+ */
+static void
+playlist_describe( IFusionSoundMusicProvider_Playlist_data *data )
+{
+     PlaylistScan   scan;
+     PlaylistCache  cache;
+     PlaylistEntry *entry;
+     DirectThread  *threads[MAX_SCAN_THREADS];
+     int            num_threads = 0;
+     int            i;
+     unsigned int   n;
+
+     memset( &scan, 0, sizeof(scan) );
+     memset( &cache, 0, sizeof(cache) );
+
+     direct_mutex_lock( &data->describe_lock );
+
+     /* The descriptions are only changed with the describe lock held, so they are read here without the main lock. */
+     for (n = 0; n < data->num_entries; n++) {
+          if (!playlist_entry( data, n )->described)
+               scan.num++;
+     }
+
+     if (!scan.num) {
+          direct_mutex_unlock( &data->describe_lock );
+          return;
+     }
+
+     scan.data    = data;
+     scan.entries = D_MALLOC( scan.num * sizeof(PlaylistEntry*) );
+     if (!scan.entries) {
+          D_OOM();
+          direct_mutex_unlock( &data->describe_lock );
+          return;
+     }
+
+     if (data->cache)
+          playlist_cache_load( &cache, data->cache );
+
+     scan.num = 0;
+
+     for (n = 0; n < data->num_entries; n++) {
+          const PlaylistCacheItem *item;
+
+          entry = playlist_entry( data, n );
+
+          if (entry->described)
+               continue;
+
+          entry->local = playlist_file_info( entry->url, &entry->file_size, &entry->file_mtime );
+
+          if (entry->local && cache.num) {
+               item = playlist_cache_find( cache.items, cache.num, entry->url );
+               if (item && item->record.size == entry->file_size && item->record.mtime == entry->file_mtime) {
+                    direct_mutex_lock( &data->lock );
+
+                    entry->desc      = item->record.desc;
+                    entry->described = true;
+
+                    direct_mutex_unlock( &data->lock );
+                    continue;
+               }
+          }
 
-                    add_media( id++, url, creator, title, album, playlist );
+          scan.entries[scan.num++] = entry;
+     }
 
-                    url = creator = title = album = NULL;
-               }
+     D_DEBUG_AT( MusicProvider_Playlist, "  -> describing %u tracks with %d thread(s)\n",
+                 scan.num, MIN( data->threads, (int) scan.num ) );
+
+     if (scan.num) {
+          direct_mutex_init( &scan.lock );
+
+          /* The calling thread describes tracks as well. */
+          for (i = 1; i < MIN( data->threads, (int) scan.num ); i++) {
+               threads[num_threads] = direct_thread_create( DTT_DEFAULT, PlaylistScanThread, &scan, "Playlist Scan" );
+               if (threads[num_threads])
+                    num_threads++;
           }
-          else {
-               src++;
+
+          PlaylistScanThread( NULL, &scan );
+
+          for (i = 0; i < num_threads; i++) {
+               direct_thread_join( threads[i] );
+               direct_thread_destroy( threads[i] );
           }
+
+          direct_mutex_deinit( &scan.lock );
+
+          if (data->cache)
+               playlist_cache_save( data, &cache );
      }
+
+     playlist_cache_free( &cache );
+
+     D_FREE( scan.entries );
+
+     direct_mutex_unlock( &data->describe_lock );
 }
 
 /**********************************************************************************************************************/
 
+#define PREROLL_TIMEOUT 100 /* milliseconds, bounds the time to notice the end of the track or a change of selection */
+
 static void
 Playlist_Stop( IFusionSoundMusicProvider_Playlist_data *data )
 {
@@ -353,20 +1138,182 @@ Playlist_Stop( IFusionSoundMusicProvider_Playlist_data *data )
      }
 }
 
+/*
+ * Release the provider of the track prepared to follow the selected one, unless it is selected. Mutex must already be
+ * locked.
+ */
+static void
+Playlist_Unprepare( IFusionSoundMusicProvider_Playlist_data *data )
+{
+     PlaylistEntry *entry = data->prepared;
+
+     data->prepared = NULL;
+
+     if (entry && entry != data->selected && entry->provider) {
+          entry->provider->Release( entry->provider );
+          entry->provider = NULL;
+     }
+}
+
+/*
+ * Create the provider of the track following the selected one before the selected one ends, and start it on the same
+ * sound stream as soon as the selected one has finished, so that the first samples of the track directly follow the
+ * last samples of the previous one.
+ */
+static void *
+PlaylistPreroll( DirectThread *thread,
+                 void         *arg )
+{
+     IFusionSoundMusicProvider_Playlist_data *data = arg;
+
+     direct_mutex_lock( &data->lock );
+
+     while (!data->quit) {
+          PlaylistEntry             *entry    = data->selected;
+          PlaylistEntry             *next     = NULL;
+          IFusionSoundMusicProvider *provider = entry ? entry->provider : NULL;
+          FSMusicProviderStatus      status   = FMSTATE_UNKNOWN;
+          double                     length   = 0.0;
+          double                     pos      = 0.0;
+          double                     left;
+
+          if (entry && entry->index + 1 < data->num_entries)
+               next = playlist_entry( data, entry->index + 1 );
+
+          if (!provider || !next || !data->dest.stream || (data->flags & FMPLAY_LOOPING)) {
+               direct_waitqueue_wait( &data->cond, &data->lock );
+               continue;
+          }
+
+          provider->GetStatus( provider, &status );
+
+          if (status == FMSTATE_FINISHED) {
+               if (data->prepared != next || !next->provider) {
+                    direct_waitqueue_wait( &data->cond, &data->lock );
+                    continue;
+               }
+
+               D_DEBUG_AT( MusicProvider_Playlist, "  -> starting track %u\n", next->id );
+
+               provider->Release( provider );
+               entry->provider = NULL;
+
+               data->selected = next;
+               data->prepared = NULL;
+               data->advanced = true;
+
+               if (next->provider->PlayToStream( next->provider, data->dest.stream ))
+                    D_ERROR( "MusicProvider/Playlist: Failed to continue with track %u!\n", next->id );
+
+               continue;
+          }
+
+          provider->GetLength( provider, &length );
+          provider->GetPos( provider, &pos );
+
+          left = length - pos;
+
+          /* Prepare the next track once the selected one is about to end. */
+          if (status == FMSTATE_PLAY && left <= data->preroll && data->prepared != next) {
+               IFusionSoundMusicProvider *prepared;
+
+               Playlist_Unprepare( data );
+
+               data->prepared = next;
+
+               D_DEBUG_AT( MusicProvider_Playlist, "  -> preparing track %u (%.1f seconds left)\n", next->id, left );
+
+               direct_mutex_unlock( &data->lock );
+
+               if (IFusionSoundMusicProvider_Create( next->url, &prepared ))
+                    prepared = NULL;
+
+               direct_mutex_lock( &data->lock );
+
+               if (!prepared)
+                    continue;
+
+               if (data->prepared != next || next->provider) {
+                    prepared->Release( prepared );
+                    continue;
+               }
+
+               prepared->SetPlaybackFlags( prepared, data->flags );
+
+               next->provider = prepared;
+               continue;
+          }
+
+          /* Wait for the end of the selected track without holding the lock. */
+          if (status == FMSTATE_PLAY && data->prepared == next) {
+               provider->AddRef( provider );
+
+               direct_mutex_unlock( &data->lock );
+
+               provider->WaitStatus( provider, FMSTATE_FINISHED, PREROLL_TIMEOUT );
+
+               direct_mutex_lock( &data->lock );
+
+               provider->Release( provider );
+               continue;
+          }
+
+          /* Check again when the next track has to be prepared, at least every second to follow seeking. */
+          left -= data->preroll;
+
+          direct_waitqueue_wait_timeout( &data->cond, &data->lock,
+                                         (left > 0.0 && left < 1.0) ? left * 1000000 : 1000000 );
+     }
+
+     direct_mutex_unlock( &data->lock );
+
+     return NULL;
+}
+
 /**********************************************************************************************************************/
 
 static void
 IFusionSoundMusicProvider_Playlist_Destruct( IFusionSoundMusicProvider *thiz )
 {
      IFusionSoundMusicProvider_Playlist_data *data = thiz->priv;
-     PlaylistEntry                           *entry, *next;
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
+     data->quit = true;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->lock );
+
+     if (data->parse_thread) {
+          direct_thread_join( data->parse_thread );
+          direct_thread_destroy( data->parse_thread );
+     }
+
+     if (data->thread) {
+          direct_thread_join( data->thread );
+          direct_thread_destroy( data->thread );
+     }
+
      Playlist_Stop( data );
 
-     direct_list_foreach_safe (entry, next, data->playlist)
-          remove_media( entry, &data->playlist );
+     remove_media( data );
+
+     direct_hash_destroy( data->ids );
+
+     direct_stream_destroy( data->stream );
+
+     if (data->parser.buf)
+          D_FREE( data->parser.buf );
+
+     direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->describe_lock );
+     direct_mutex_deinit( &data->lock );
+
+     if (data->cache)
+          D_FREE( data->cache );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
 }
@@ -400,14 +1347,20 @@ static DirectResult
 IFusionSoundMusicProvider_Playlist_GetCapabilities( IFusionSoundMusicProvider   *thiz,
                                                     FSMusicProviderCapabilities *ret_caps )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetCapabilities( data->selected->provider, ret_caps );
+          ret = data->selected->provider->GetCapabilities( data->selected->provider, ret_caps );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
@@ -415,7 +1368,7 @@ IFusionSoundMusicProvider_Playlist_EnumTracks( IFusionSoundMusicProvider *thiz,
                                                FSTrackCallback            callback,
                                                void                      *ctx )
 {
-     PlaylistEntry *entry, *next;
+     unsigned int i;
 
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
@@ -424,19 +1377,30 @@ IFusionSoundMusicProvider_Playlist_EnumTracks( IFusionSoundMusicProvider *thiz,
      if (!callback)
           return DR_INVARG;
 
-     direct_list_foreach_safe (entry, next, data->playlist) {
-          FSTrackDescription desc;
+     /* The entries are not changed once the whole playlist has been parsed. */
+     direct_mutex_lock( &data->lock );
 
-          if (entry->provider) {
-               entry->provider->GetTrackDescription( entry->provider, &desc );
-          }
-          else {
-               if (IFusionSoundMusicProvider_Create( entry->url, &entry->provider))
-                    continue;
-               entry->provider->GetTrackDescription( entry->provider, &desc );
-               entry->provider->Release( entry->provider );
-               entry->provider = NULL;
-          }
+     playlist_wait_parsed( data );
+
+     direct_mutex_unlock( &data->lock );
+
+     playlist_describe( data );
+
+     for (i = 0; i < data->num_entries; i++) {
+          PlaylistEntry      *entry = playlist_entry( data, i );
+          FSTrackDescription  desc;
+          bool                described;
+
+          /* Another caller may be describing the tracks left. */
+          direct_mutex_lock( &data->lock );
+
+          described = entry->described;
+          desc      = entry->desc;
+
+          direct_mutex_unlock( &data->lock );
+
+          if (!described)
+               continue;
 
           if (entry->artist)
                direct_snputs( desc.artist, entry->artist, sizeof(desc.artist) );
@@ -463,8 +1427,12 @@ IFusionSoundMusicProvider_Playlist_GetTrackID( IFusionSoundMusicProvider *thiz,
      if (!ret_track_id)
           return DR_INVARG;
 
+     direct_mutex_lock( &data->lock );
+
      *ret_track_id = data->selected->id;
 
+     direct_mutex_unlock( &data->lock );
+
      return DR_OK;
 }
 
@@ -481,6 +1449,8 @@ IFusionSoundMusicProvider_Playlist_GetTrackDescription( IFusionSoundMusicProvide
 
      memset( ret_desc, 0, sizeof(FSTrackDescription) );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
           data->selected->provider->GetTrackDescription( data->selected->provider, ret_desc );
 
@@ -491,6 +1461,8 @@ IFusionSoundMusicProvider_Playlist_GetTrackDescription( IFusionSoundMusicProvide
      if (data->selected->album)
           direct_snputs( ret_desc->album, data->selected->album, sizeof(ret_desc->album) );
 
+     direct_mutex_unlock( &data->lock );
+
      return DR_OK;
 }
 
@@ -498,72 +1470,109 @@ static DirectResult
 IFusionSoundMusicProvider_Playlist_GetStreamDescription( IFusionSoundMusicProvider *thiz,
                                                          FSStreamDescription       *ret_desc )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetStreamDescription( data->selected->provider, ret_desc );
+          ret = data->selected->provider->GetStreamDescription( data->selected->provider, ret_desc );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_GetBufferDescription( IFusionSoundMusicProvider *thiz,
                                                          FSBufferDescription       *ret_desc )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetBufferDescription( data->selected->provider, ret_desc );
+          ret = data->selected->provider->GetBufferDescription( data->selected->provider, ret_desc );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_SelectTrack( IFusionSoundMusicProvider *thiz,
                                                 FSTrackID                  track_id )
 {
+     DirectResult   ret;
      PlaylistEntry *entry;
 
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
-     direct_list_foreach (entry, data->playlist) {
-          DirectResult ret;
+     direct_mutex_lock( &data->lock );
 
-          if (entry->id != track_id)
-               continue;
+     /* Wait for the entry if the playlist is still being parsed. */
+     while (!(entry = playlist_lookup( data, track_id )) && data->parsing)
+          direct_waitqueue_wait( &data->cond, &data->lock );
 
-          if (data->selected) {
-               if (data->selected->provider) {
-                    data->selected->provider->Release( data->selected->provider );
-                    data->selected->provider = NULL;
-               }
+     if (!entry) {
+          direct_mutex_unlock( &data->lock );
+          return DR_ITEMNOTFOUND;
+     }
+
+     /* The track has already been started after the previous one, selecting it again later restarts it. */
+     if (entry == data->selected && data->advanced) {
+          data->advanced = false;
+          direct_mutex_unlock( &data->lock );
+          return DR_OK;
+     }
+
+     if (data->selected) {
+          if (data->selected->provider) {
+               data->selected->provider->Release( data->selected->provider );
+               data->selected->provider = NULL;
           }
+     }
+
+     data->selected = entry;
+     data->advanced = false;
+
+     /* Use the provider already created if the track has been prepared. */
+     if (entry != data->prepared)
+          Playlist_Unprepare( data );
 
-          data->selected = entry;
+     data->prepared = NULL;
 
+     direct_waitqueue_broadcast( &data->cond );
+
+     if (!entry->provider) {
           ret = IFusionSoundMusicProvider_Create( entry->url, &entry->provider );
-          if (ret)
+          if (ret) {
+               direct_mutex_unlock( &data->lock );
                return ret;
+          }
 
           entry->provider->SetPlaybackFlags( entry->provider, data->flags );
+     }
 
-          if (data->dest.stream)
-               entry->provider->PlayToStream( entry->provider, data->dest.stream );
+     if (data->dest.stream)
+          entry->provider->PlayToStream( entry->provider, data->dest.stream );
 
-          if (data->dest.buffer)
-               entry->provider->PlayToBuffer( entry->provider, data->dest.buffer,
-                                              data->buffer_callback, data->buffer_callback_context );
+     if (data->dest.buffer)
+          entry->provider->PlayToBuffer( entry->provider, data->dest.buffer,
+                                         data->buffer_callback, data->buffer_callback_context );
 
-          return DR_OK;
-     }
+     direct_mutex_unlock( &data->lock );
 
-     return DR_ITEMNOTFOUND;
+     return DR_OK;
 }
 
 static DirectResult
@@ -576,6 +1585,8 @@ IFusionSoundMusicProvider_Playlist_PlayToStream( IFusionSoundMusicProvider *thiz
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->dest.stream) {
           data->dest.stream->Release( data->dest.stream );
           data->dest.stream = NULL;
@@ -586,20 +1597,21 @@ IFusionSoundMusicProvider_Playlist_PlayToStream( IFusionSoundMusicProvider *thiz
           data->dest.buffer = NULL;
      }
 
-     if (data->selected->provider) {
+     if (data->selected->provider)
           ret = data->selected->provider->PlayToStream( data->selected->provider, destination );
-          if (ret)
-               return ret;
-     }
-     else
-          return DR_UNSUPPORTED;
 
-     /* Increase the sound stream reference counter. */
-     destination->AddRef( destination );
+     if (ret == DR_OK) {
+          /* Increase the sound stream reference counter. */
+          destination->AddRef( destination );
 
-     data->dest.stream = destination;
+          data->dest.stream = destination;
 
-     return DR_OK;
+          direct_waitqueue_broadcast( &data->cond );
+     }
+
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
@@ -614,111 +1626,155 @@ IFusionSoundMusicProvider_Playlist_PlayToBuffer( IFusionSoundMusicProvider *thiz
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      Playlist_Stop( data );
 
-     if (data->selected->provider) {
+     if (data->selected->provider)
           ret = data->selected->provider->PlayToBuffer( data->selected->provider, destination, callback, ctx );
-          if (ret)
-               return ret;
-     }
-     else
-          return DR_UNSUPPORTED;
 
-     /* Increase the sound buffer reference counter. */
-     destination->AddRef( destination );
+     if (ret == DR_OK) {
+          /* Increase the sound buffer reference counter. */
+          destination->AddRef( destination );
+
+          data->dest.buffer             = destination;
+          data->buffer_callback         = callback;
+          data->buffer_callback_context = ctx;
+     }
 
-     data->dest.buffer             = destination;
-     data->buffer_callback         = callback;
-     data->buffer_callback_context = ctx;
+     direct_mutex_unlock( &data->lock );
 
-     return DR_OK;
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_Stop( IFusionSoundMusicProvider *thiz )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      Playlist_Stop( data );
 
      if (data->selected->provider)
-          return data->selected->provider->Stop( data->selected->provider );
+          ret = data->selected->provider->Stop( data->selected->provider );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_GetStatus( IFusionSoundMusicProvider *thiz,
                                               FSMusicProviderStatus     *ret_status )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetStatus( data->selected->provider, ret_status );
+          ret = data->selected->provider->GetStatus( data->selected->provider, ret_status );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_SeekTo( IFusionSoundMusicProvider *thiz,
                                            double                     seconds )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->SeekTo( data->selected->provider, seconds );
+          ret = data->selected->provider->SeekTo( data->selected->provider, seconds );
 
-     return DR_UNSUPPORTED;
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_GetPos( IFusionSoundMusicProvider *thiz,
                                            double                    *ret_seconds )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetPos( data->selected->provider, ret_seconds );
+          ret = data->selected->provider->GetPos( data->selected->provider, ret_seconds );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_GetLength( IFusionSoundMusicProvider *thiz,
                                               double                    *ret_seconds )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      if (data->selected->provider)
-          return data->selected->provider->GetLength( data->selected->provider, ret_seconds );
+          ret = data->selected->provider->GetLength( data->selected->provider, ret_seconds );
 
-     return DR_UNSUPPORTED;
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
 IFusionSoundMusicProvider_Playlist_SetPlaybackFlags( IFusionSoundMusicProvider    *thiz,
                                                      FSMusicProviderPlaybackFlags  flags )
 {
+     DirectResult ret = DR_UNSUPPORTED;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
+     direct_mutex_lock( &data->lock );
+
      data->flags = flags;
 
      if (data->selected->provider)
-          return data->selected->provider->SetPlaybackFlags( data->selected->provider, flags );
+          ret = data->selected->provider->SetPlaybackFlags( data->selected->provider, flags );
 
-     return DR_UNSUPPORTED;
+     if (data->prepared && data->prepared->provider)
+          data->prepared->provider->SetPlaybackFlags( data->prepared->provider, flags );
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->lock );
+
+     return ret;
 }
 
 static DirectResult
@@ -726,25 +1782,33 @@ IFusionSoundMusicProvider_Playlist_WaitStatus( IFusionSoundMusicProvider *thiz,
                                                FSMusicProviderStatus      mask,
                                                unsigned int               timeout )
 {
+     DirectResult               ret = DR_UNSUPPORTED;
+     IFusionSoundMusicProvider *provider;
+
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
-     if (data->selected->provider)
-          return data->selected->provider->WaitStatus( data->selected->provider, mask, timeout );
+     /* Wait without holding the lock, the provider may be released meanwhile by starting the next track. */
+     direct_mutex_lock( &data->lock );
 
-     return DR_UNSUPPORTED;
+     provider = data->selected->provider;
+     if (provider)
+          provider->AddRef( provider );
+
+     direct_mutex_unlock( &data->lock );
+
+     if (provider) {
+          ret = provider->WaitStatus( provider, mask, timeout );
+
+          provider->Release( provider );
+     }
+
+     return ret;
 }
 
 /**********************************************************************************************************************/
 
-typedef enum {
-     PLT_NONE,
-     PLT_M3U,
-     PLT_PLS,
-     PLT_XSPF
-} PlaylistType;
-
 static PlaylistType
 get_playlist_type( const char *mimetype,
                    const char *filename,
@@ -811,83 +1875,79 @@ Construct( IFusionSoundMusicProvider *thiz,
            DirectStream              *stream )
 {
      DirectResult  ret;
-     unsigned int  size;
-     char         *src = NULL;
+     char          header[1024];
+     unsigned int  len = 0;
+     const char   *value;
 
      DIRECT_ALLOCATE_INTERFACE_DATA( thiz, IFusionSoundMusicProvider_Playlist )
 
      D_DEBUG_AT( MusicProvider_Playlist, "%s( %p )\n", __FUNCTION__, thiz );
 
-     data->ref = 1;
+     data->ref    = 1;
+     data->stream = direct_stream_dup( stream );
 
-     size = direct_stream_length( stream );
-     if (size) {
-          int pos = 0;
+     direct_mutex_init( &data->lock );
+     direct_mutex_init( &data->describe_lock );
+     direct_waitqueue_init( &data->cond );
 
-          src = D_MALLOC( size + 1 );
-          if (!src) {
-               ret = D_OOM();
-               goto error;
-          }
+     ret = direct_hash_create( ENTRY_BLOCK_SIZE, &data->ids );
+     if (ret)
+          goto error;
 
-          while (pos < size) {
-               unsigned int len;
+     direct_stream_wait( stream, sizeof(header) - 1, NULL );
 
-               direct_stream_wait( stream, size, NULL );
+     if (direct_stream_peek( stream, sizeof(header) - 1, 0, header, &len ))
+          len = 0;
 
-               ret = direct_stream_read( stream, size, src + pos, &len );
-               if (ret)
-                    goto error;
+     header[len] = '\0';
 
-               pos += len;
-          }
+     data->parser.type = get_playlist_type( direct_stream_mime( stream ), filename, header, len );
+     if (data->parser.type == PLT_NONE) {
+          D_ERROR( "MusicProvider/Playlist: Unknown playlist format!\n" );
+          ret = DR_FAILURE;
+          goto error;
      }
-     else {
-          char buf[1024];
 
-          while (1) {
-               unsigned int len;
+     /* Parse the playlist up to the first entry, the rest is parsed while the first track is playing. */
+     data->parsing = true;
 
-               direct_stream_wait( stream, sizeof(buf), NULL );
+     do {
+          ret = playlist_read( data );
+     } while (ret == DR_OK && !data->num_entries);
 
-               ret = direct_stream_read( stream, sizeof(buf), buf, &len );
-               if (ret)
-                    break;
+     if (!data->num_entries) {
+          ret = DR_FAILURE;
+          goto error;
+     }
 
-               src = D_REALLOC( src, size + len + 1 );
-               if (src) {
-                   direct_memcpy( src + size, buf, len );
-                   size += len;
-               }
-          }
+     if (ret == DR_OK)
+          data->parse_thread = direct_thread_create( DTT_DEFAULT, PlaylistParse, data, "Playlist Parse" );
 
-          if (!src)
-               goto error;
-     }
-     src[size] = 0;
+     if (!data->parse_thread) {
+          while (ret == DR_OK)
+               ret = playlist_read( data );
 
-     switch (get_playlist_type( direct_stream_mime( stream ), filename, src, size )) {
-          case PLT_M3U:
-               m3u_playlist_parse( &data->playlist, src );
-               break;
-          case PLT_PLS:
-               pls_playlist_parse( &data->playlist, src );
-               break;
-          case PLT_XSPF:
-               xspf_playlist_parse( &data->playlist, src );
-               break;
-          default:
-               D_ERROR( "MusicProvider/Playlist: Unknown playlist format!" );
-               ret = DR_FAILURE;
-               goto error;
+          data->parsing = false;
      }
 
-     if (!data->playlist) {
-          ret = DR_FAILURE;
-          goto error;
-     }
+     /* Number of seconds before the end of a track to prepare the next one, 0 to disable gapless playback. */
+     data->preroll = 5;
+
+     if ((value = direct_getenv( "PLAYLIST_PREROLL" )))
+          data->preroll = MAX( atoi( value ), 0 );
 
-     D_FREE( src );
+     /* Number of threads describing the tracks, 0 for one thread per online CPU. */
+     if ((value = direct_getenv( "PLAYLIST_THREADS" )))
+          data->threads = atoi( value );
+
+     if (data->threads <= 0)
+          data->threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+     data->threads = CLAMP( data->threads, 1, MAX_SCAN_THREADS );
+
+     /* File caching the descriptions of local tracks, enumerating them again doesn't have to create their providers. */
+     if ((value = direct_getenv( "PLAYLIST_CACHE" )) && *value)
+          data->cache = D_STRDUP( value );
 
      thiz->AddRef               = IFusionSoundMusicProvider_Playlist_AddRef;
      thiz->Release              = IFusionSoundMusicProvider_Playlist_Release;
@@ -911,11 +1971,25 @@ Construct( IFusionSoundMusicProvider *thiz,
      /* Select the first track. */
      thiz->SelectTrack( thiz, 0 );
 
+     if (data->preroll)
+          data->thread = direct_thread_create( DTT_DEFAULT, PlaylistPreroll, data, "Playlist Preroll" );
+
      return DR_OK;
 
 error:
-     if (src)
-          D_FREE( src );
+     remove_media( data );
+
+     if (data->ids)
+          direct_hash_destroy( data->ids );
+
+     if (data->parser.buf)
+          D_FREE( data->parser.buf );
+
+     direct_stream_destroy( data->stream );
+
+     direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->describe_lock );
+     direct_mutex_deinit( &data->lock );
 
      DIRECT_DEALLOCATE_INTERFACE( thiz );
 
@@ -17,12 +17,13 @@
 */
 
 #include <config.h>
-#include <direct/memcpy.h>
 #include <direct/stream.h>
 #include <direct/thread.h>
 #include <media/ifusionsoundmusicprovider.h>
 #include <tremor/ivorbisfile.h>
 
+#include "pcm_convert.h"
+
 D_DEBUG_DOMAIN( MusicProvider_Tremor, "MusicProvider/Tremor", "Tremor Music Provider" );
 
 static DirectResult Probe    ( IFusionSoundMusicProvider_ProbeContext *ctx );
@@ -55,7 +56,8 @@ typedef struct {
 
      DirectThread                 *thread;
      DirectMutex                   lock;
-     DirectWaitQueue               cond;
+     DirectMutex                   status_lock;             /* only held to change or wait for the status */
+     DirectWaitQueue               cond;                    /* signaled on every status change */
 
      FSMusicProviderStatus         status;
      int                           finished;
@@ -69,80 +71,17 @@ typedef struct {
           int                      buffersize;
      } dest;
 
+     PcmMatrix                     matrix;                  /* mixing of the decoded channels to the destination */
+
      FMBufferCallback              buffer_callback;
      void                         *buffer_callback_context;
 } IFusionSoundMusicProvider_Tremor_data;
 
 /**********************************************************************************************************************/
 
-typedef struct {
-#ifdef WORDS_BIGENDIAN
-     s8 c;
-     u8 b;
-     u8 a;
-#else
-     u8 a;
-     u8 b;
-     s8 c;
-#endif
-} __attribute__((packed)) s24;
-
-#define VORBIS_MIX_LOOP()                                           \
- do {                                                               \
-     int i, n;                                                      \
-     if (d_n == s_n) {                                              \
-          s16 *s = src + pos * s_n;                                 \
-          if (sizeof(TYPE) == sizeof(s16)) {                        \
-               direct_memcpy( dst, s, frames * s_n * sizeof(s16) ); \
-          }                                                         \
-          else {                                                    \
-               TYPE *d = (TYPE*) dst;                               \
-               for (i = frames * s_n; i; i--) {                     \
-                    *d++ = CONV( *s );                              \
-                    s++;                                            \
-               }                                                    \
-          }                                                         \
-          break;                                                    \
-     }                                                              \
-     else if (d_n < s_n) {                                          \
-          if (d_n == 1 && s_n == 2) {                               \
-               /* Downmix to stereo to mono */                      \
-               s16  *s = src + pos * 2;                             \
-               TYPE *d = (TYPE*) dst;                               \
-               for (i = frames; i; i--) {                           \
-                    *d++ = CONV( (s[0] + s[1]) >> 1 );              \
-                    s += 2;                                         \
-               }                                                    \
-               break;                                               \
-          }                                                         \
-     }                                                              \
-     else if (d_n > s_n) {                                          \
-          if (d_n == 2 && s_n == 1) {                               \
-               /* Upmix stereo to mono */                           \
-               s16  *s = src + pos;                                 \
-               TYPE *d = (TYPE*) dst;                               \
-               for (i = frames; i; i--) {                           \
-                    d[0] = d[1] = CONV( *s );                       \
-                    d += 2;                                         \
-                    s++;                                            \
-               }                                                    \
-               break;                                               \
-          }                                                         \
-          memset( dst, 0, frames * d_n * sizeof(TYPE) );            \
-     }                                                              \
-     for (n = 0; n < MIN( s_n, d_n ); n++) {                        \
-          s16  *s = &(src + pos * s_n)[n];                          \
-          TYPE *d = &((TYPE*) dst)[n];                              \
-          for (i = frames; i; i--) {                                \
-               *d = CONV( *s );                                     \
-               d += d_n;                                            \
-               s += s_n;                                            \
-          }                                                         \
-     }                                                              \
-} while (0)
-
 static void
-vorbis_mix_audio( s16            *src,
+vorbis_mix_audio( PcmMatrix      *matrix,
+                  s16            *src,
                   void           *dst,
                   int             pos,
                   int             frames,
@@ -150,53 +89,10 @@ vorbis_mix_audio( s16            *src,
                   int             channels,
                   FSChannelMode   mode )
 {
-     int s_n = channels;
-     int d_n = FS_CHANNELS_FOR_MODE( mode );
-
-     switch (f) {
-          case FSSF_U8:
-               #define TYPE u8
-               #define CONV(s) (((s) >> 8) + 128)
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_S16:
-               #define TYPE s16
-               #define CONV(s) (s)
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_S24:
-               #define TYPE s24
-               #define CONV(s) ((s24) { a:0, b:(s), c:(s) >> 8 })
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_S32:
-               #define TYPE s32
-               #define CONV(s) ((s) << 8)
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_FLOAT:
-               #define TYPE float
-               #define CONV(s) ((s) / 32768.f)
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
+     if (matrix->channels != channels || matrix->mode != mode)
+          pcm_matrix_init( matrix, channels, mode );
 
-          default:
-               break;
-     }
+     pcm_mix_s16( matrix, src + pos * channels, dst, f, frames );
 }
 
 static size_t
@@ -281,11 +177,24 @@ ov_tell_func( void *user )
 
 /**********************************************************************************************************************/
 
+static void
+Tremor_SetStatus( IFusionSoundMusicProvider_Tremor_data *data,
+                  FSMusicProviderStatus                  status )
+{
+     direct_mutex_lock( &data->status_lock );
+
+     data->status = status;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->status_lock );
+}
+
 static void
 Tremor_Stop( IFusionSoundMusicProvider_Tremor_data *data,
              bool                                   now )
 {
-     data->status = FMSTATE_STOP;
+     Tremor_SetStatus( data, FMSTATE_STOP );
 
      if (data->thread) {
           if (!direct_thread_is_joined( data->thread )) {
@@ -351,8 +260,7 @@ TremorStream( DirectThread *thread,
                }
                else {
                     data->finished = true;
-                    data->status = FMSTATE_FINISHED;
-                    direct_waitqueue_broadcast( &data->cond );
+                    Tremor_SetStatus( data, FMSTATE_FINISHED );
                }
           }
 
@@ -369,7 +277,7 @@ TremorStream( DirectThread *thread,
                if (frames > length - pos)
                     frames = length - pos;
 
-               vorbis_mix_audio( src, dst, pos, frames, data->dest.sampleformat,
+               vorbis_mix_audio( &data->matrix, src, dst, pos, frames, data->dest.sampleformat,
                                  data->channels, data->dest.mode );
 
                data->dest.stream->Commit( data->dest.stream, frames );
@@ -426,8 +334,7 @@ TremorBuffer( DirectThread *thread,
                     }
                     else {
                          data->finished = true;
-                         data->status = FMSTATE_FINISHED;
-                         direct_waitqueue_broadcast( &data->cond );
+                         Tremor_SetStatus( data, FMSTATE_FINISHED );
                     }
                     continue;
                }
@@ -439,8 +346,8 @@ TremorBuffer( DirectThread *thread,
                     do {
                          len = MIN( frames - pos, length );
 
-                         vorbis_mix_audio( src, &dst[pos*bytespersample], 0, len, data->dest.sampleformat,
-                                           data->channels, data->dest.mode );
+                         vorbis_mix_audio( &data->matrix, src, &dst[pos*bytespersample], 0, len,
+                                           data->dest.sampleformat, data->channels, data->dest.mode );
 
                          length -= len;
                          pos    += len;
@@ -454,8 +361,7 @@ TremorBuffer( DirectThread *thread,
 
           if (data->buffer_callback) {
                if (data->buffer_callback( pos, data->buffer_callback_context )) {
-                    data->status = FMSTATE_STOP;
-                    direct_waitqueue_broadcast( &data->cond );
+                    Tremor_SetStatus( data, FMSTATE_STOP );
                }
           }
      }
@@ -477,6 +383,7 @@ IFusionSoundMusicProvider_Tremor_Destruct( IFusionSoundMusicProvider *thiz )
      direct_stream_destroy( data->stream );
 
      direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->status_lock );
      direct_mutex_deinit( &data->lock );
 
      ov_clear( &data->vf );
@@ -657,9 +564,7 @@ IFusionSoundMusicProvider_Tremor_PlayToStream( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     Tremor_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, TremorStream, data, "Tremor Stream" );
 
@@ -745,9 +650,7 @@ IFusionSoundMusicProvider_Tremor_PlayToBuffer( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     Tremor_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, TremorBuffer, data, "Tremor Buffer" );
 
@@ -767,8 +670,6 @@ IFusionSoundMusicProvider_Tremor_Stop( IFusionSoundMusicProvider *thiz )
 
      Tremor_Stop( data, false );
 
-     direct_waitqueue_broadcast( &data->cond );
-
      direct_mutex_unlock( &data->lock );
 
      return DR_OK;
@@ -894,8 +795,6 @@ IFusionSoundMusicProvider_Tremor_WaitStatus( IFusionSoundMusicProvider *thiz,
                                              FSMusicProviderStatus      mask,
                                              unsigned int               timeout )
 {
-     DirectResult ret;
-
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Tremor)
 
      D_DEBUG_AT( MusicProvider_Tremor, "%s( %p )\n", __FUNCTION__, thiz );
@@ -903,33 +802,27 @@ IFusionSoundMusicProvider_Tremor_WaitStatus( IFusionSoundMusicProvider *thiz,
      if (!mask || mask & ~FMSTATE_ALL)
           return DR_INVARG;
 
-     if (timeout) {
-          long long s;
-
-          s = direct_clock_get_abs_micros() + timeout * 1000ll;
+     direct_mutex_lock( &data->status_lock );
 
-          while (direct_mutex_trylock( &data->lock )) {
-               usleep( 1000 );
-               if (direct_clock_get_abs_micros() >= s)
-                    return DR_TIMEOUT;
-          }
+     if (timeout) {
+          long long deadline = direct_clock_get_abs_micros() + timeout * 1000ll;
 
           while (!(data->status & mask)) {
-               ret = direct_waitqueue_wait_timeout( &data->cond, &data->lock, timeout * 1000ll );
-               if (ret) {
-                    direct_mutex_unlock( &data->lock );
+               long long now = direct_clock_get_abs_micros();
+
+               if (now >= deadline ||
+                   direct_waitqueue_wait_timeout( &data->cond, &data->status_lock, deadline - now ) == DR_TIMEOUT) {
+                    direct_mutex_unlock( &data->status_lock );
                     return DR_TIMEOUT;
                }
           }
      }
      else {
-          direct_mutex_lock( &data->lock );
-
           while (!(data->status & mask))
-               direct_waitqueue_wait( &data->cond, &data->lock );
+               direct_waitqueue_wait( &data->cond, &data->status_lock );
      }
 
-     direct_mutex_unlock( &data->lock );
+     direct_mutex_unlock( &data->status_lock );
 
      return DR_OK;
 }
@@ -1015,6 +908,7 @@ Construct( IFusionSoundMusicProvider *thiz,
      data->desc.bitrate = ov_bitrate( &data->vf, -1 ) ?: ov_bitrate_instant( &data->vf );
 
      direct_mutex_init( &data->lock );
+     direct_mutex_init( &data->status_lock );
      direct_waitqueue_init( &data->cond );
 
      data->status = FMSTATE_STOP;
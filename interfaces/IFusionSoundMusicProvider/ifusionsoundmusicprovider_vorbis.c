@@ -19,11 +19,12 @@
 #include <config.h>
 #include <direct/stream.h>
 #include <direct/thread.h>
-#include <fusionsound_util.h>
 #include <math.h>
 #include <media/ifusionsoundmusicprovider.h>
 #include <vorbis/vorbisfile.h>
 
+#include "pcm_convert.h"
+
 D_DEBUG_DOMAIN( MusicProvider_Vorbis, "MusicProvider/Vorbis", "Vorbis Music Provider" );
 
 static DirectResult Probe    ( IFusionSoundMusicProvider_ProbeContext *ctx );
@@ -56,7 +57,8 @@ typedef struct {
 
      DirectThread                 *thread;
      DirectMutex                   lock;
-     DirectWaitQueue               cond;
+     DirectMutex                   status_lock;             /* only held to change or wait for the status */
+     DirectWaitQueue               cond;                    /* signaled on every status change */
 
      FSMusicProviderStatus         status;
      int                           finished;
@@ -70,178 +72,17 @@ typedef struct {
           int                      buffersize;
      } dest;
 
+     PcmMatrix                     matrix;                  /* mixing of the decoded channels to the destination */
+
      FMBufferCallback              buffer_callback;
      void                         *buffer_callback_context;
 } IFusionSoundMusicProvider_Vorbis_data;
 
 /**********************************************************************************************************************/
 
-typedef struct {
-#ifdef WORDS_BIGENDIAN
-     s8 c;
-     u8 b;
-     u8 a;
-#else
-     u8 a;
-     u8 b;
-     s8 c;
-#endif
-} __attribute__((packed)) s24;
-
-static __inline__ u8
-FtoU8( float s )
-{
-     int d;
-
-     d = s * 128.0f + 128.5f;
-
-     return CLAMP( d, 0, 255 );
-}
-
-static __inline__ s16
-FtoS16( float s )
-{
-     int d;
-
-     d = s * 32768.0f + 0.5f;
-
-     return CLAMP( d, -32768, 32767 );
-}
-
-static __inline__ s24
-FtoS24( float s )
-{
-     int d;
-
-     d = s * 8388608.0f + 0.5f;
-     d = CLAMP( d, -8388608, 8388607 );
-
-     return (s24) { a:d, b:d >> 8, c:d >> 16 };
-}
-
-static __inline__ s32
-FtoS32( float s )
-{
-     s = CLAMP( s, -1.0f, 1.0f );
-
-     return s * 2147483647.0f;
-}
-
-static __inline__ float
-FtoF32( float s )
-{
-     return CLAMP( s, -1.0f, 1.0f );
-}
-
-#define VORBIS_MIX_LOOP()                                                          \
-do {                                                                               \
-     int i;                                                                        \
-     if (fs_mode_for_channels( s_n ) == mode) {                                    \
-          int n;                                                                   \
-          for (n = 0; n < s_n; n++) {                                              \
-               float *s = src[n] + pos;                                            \
-               TYPE  *d = &((TYPE*) dst)[n];                                       \
-               for (i = frames; i; i--) {                                          \
-                    *d = CONV( *s );                                               \
-                    d += d_n;                                                      \
-                    s++;                                                           \
-               }                                                                   \
-          }                                                                        \
-     }                                                                             \
-     else {                                                                        \
-                       /* L  C  R Rl Rr LFE */                                     \
-          float  c[6] = { 0, 0, 0, 0, 0,  0 };                                     \
-          TYPE  *d    = (TYPE*) dst;                                               \
-          for (i = pos; i < pos + frames; i++) {                                   \
-               float s;                                                            \
-               switch (s_n) {                                                      \
-                    case 1:                                                        \
-                         c[0] = c[2] = src[0][i];                                  \
-                         break;                                                    \
-                    case 4:                                                        \
-                         c[3] = src[2][i];                                         \
-                         c[4] = src[3][i];                                         \
-                    case 2:                                                        \
-                         c[0] = src[0][i];                                         \
-                         c[2] = src[1][i];                                         \
-                         break;                                                    \
-                    case 6:                                                        \
-                         c[5] = src[5][i];                                         \
-                    case 5:                                                        \
-                         c[3] = src[3][i];                                         \
-                         c[4] = src[4][i];                                         \
-                    case 3:                                                        \
-                         c[0] = src[0][i];                                         \
-                         c[1] = src[1][i];                                         \
-                         c[2] = src[2][i];                                         \
-                         break;                                                    \
-                    default:                                                       \
-                         break;                                                    \
-               }                                                                   \
-               switch (mode) {                                                     \
-                    case FSCM_MONO:                                                \
-                         s = c[0] + c[2];                                          \
-                         if (s_n > 2) s += (c[1] * 2 + c[3] + c[4]) * 0.7079f;     \
-                         s *= 0.5f;                                                \
-                         *d++ = CONV( s );                                         \
-                         break;                                                    \
-                    case FSCM_STEREO:                                              \
-                    case FSCM_STEREO21:                                            \
-                         s = c[0];                                                 \
-                         if (s_n > 2) s += (c[1] + c[3]) * 0.7079f;                \
-                         *d++ = CONV( s );                                         \
-                         s = c[2];                                                 \
-                         if (s_n > 2) s += (c[1] + c[4]) * 0.7079f;                \
-                         *d++ = CONV( s );                                         \
-                         if (FS_MODE_HAS_LFE( mode ))                              \
-                              *d++ = CONV( c[5] );                                 \
-                         break;                                                    \
-                    case FSCM_STEREO30:                                            \
-                    case FSCM_STEREO31:                                            \
-                         s = c[0] + c[3] * 0.7079f;                                \
-                         *d++ = CONV( s );                                         \
-                         s = (s_n == 2 || s_n == 4) ? (c[0] + c[2]) * 0.5f : c[1]; \
-                         *d++ = CONV( s );                                         \
-                         s = c[2] + c[4] * 0.7079f;                                \
-                         *d++ = CONV( s );                                         \
-                         if (FS_MODE_HAS_LFE( mode ))                              \
-                              *d++ = CONV( c[5] );                                 \
-                         break;                                                    \
-                    default:                                                       \
-                         if (FS_MODE_HAS_CENTER( mode )) {                         \
-                              *d++ = CONV( c[0] );                                 \
-                              if (s_n == 2 || s_n == 4) {                          \
-                                   s = (c[0] + c[2]) * 0.5f;                       \
-                                   *d++ = CONV( s );                               \
-                              }                                                    \
-                              else                                                 \
-                                   *d++ = CONV( c[1] );                            \
-                              *d++ = CONV( c[2] );                                 \
-                         }                                                         \
-                         else {                                                    \
-                              s = c[0] + c[1] * 0.7079f;                           \
-                              *d++ = CONV( s );                                    \
-                              s = c[2] + c[1] * 0.7079f;                           \
-                              *d++ = CONV( s );                                    \
-                         }                                                         \
-                         if (FS_MODE_NUM_REARS( mode ) == 1) {                     \
-                              s = (c[3] + c[4]) * 0.5f;                            \
-                              *d++ = CONV( s );                                    \
-                         }                                                         \
-                         else {                                                    \
-                              *d++ = CONV( c[3] );                                 \
-                              *d++ = CONV( c[4] );                                 \
-                         }                                                         \
-                         if (FS_MODE_HAS_LFE( mode ))                              \
-                              *d++ = CONV( c[5] );                                 \
-                         break;                                                    \
-               }                                                                   \
-          }                                                                        \
-     }                                                                             \
-} while (0)
-
 static void
-vorbis_mix_audio( float          **src,
+vorbis_mix_audio( PcmMatrix       *matrix,
+                  float          **src,
                   void            *dst,
                   int              pos,
                   int              frames,
@@ -249,53 +90,16 @@ vorbis_mix_audio( float          **src,
                   int              channels,
                   FSChannelMode    mode )
 {
-     int s_n = channels;
-     int d_n = FS_CHANNELS_FOR_MODE( mode );
+     int          n;
+     const float *s[FS_MAX_CHANNELS];
 
-     switch (f) {
-          case FSSF_U8:
-               #define TYPE u8
-               #define CONV FtoU8
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_S16:
-               #define TYPE s16
-               #define CONV FtoS16
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
+     if (matrix->channels != channels || matrix->mode != mode)
+          pcm_matrix_init( matrix, channels, mode );
 
-          case FSSF_S24:
-               #define TYPE s24
-               #define CONV FtoS24
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
+     for (n = 0; n < channels; n++)
+          s[n] = src[n] + pos;
 
-          case FSSF_S32:
-               #define TYPE s32
-               #define CONV FtoS32
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          case FSSF_FLOAT:
-               #define TYPE float
-               #define CONV FtoF32
-               VORBIS_MIX_LOOP();
-               #undef CONV
-               #undef TYPE
-               break;
-
-          default:
-               break;
-     }
+     pcm_mix_float( matrix, s, dst, f, frames );
 }
 
 static size_t
@@ -380,11 +184,24 @@ ov_tell_func( void *user )
 
 /**********************************************************************************************************************/
 
+static void
+Vorbis_SetStatus( IFusionSoundMusicProvider_Vorbis_data *data,
+                  FSMusicProviderStatus                  status )
+{
+     direct_mutex_lock( &data->status_lock );
+
+     data->status = status;
+
+     direct_waitqueue_broadcast( &data->cond );
+
+     direct_mutex_unlock( &data->status_lock );
+}
+
 static void
 Vorbis_Stop( IFusionSoundMusicProvider_Vorbis_data *data,
              bool                                   now )
 {
-     data->status = FMSTATE_STOP;
+     Vorbis_SetStatus( data, FMSTATE_STOP );
 
      if (data->thread) {
           if (!direct_thread_is_joined( data->thread )) {
@@ -449,8 +266,7 @@ VorbisStream( DirectThread *thread,
                }
                else {
                     data->finished = true;
-                    data->status = FMSTATE_FINISHED;
-                    direct_waitqueue_broadcast( &data->cond );
+                    Vorbis_SetStatus( data, FMSTATE_FINISHED );
                }
           }
 
@@ -467,7 +283,7 @@ VorbisStream( DirectThread *thread,
                if (frames > length - pos)
                     frames = length - pos;
 
-               vorbis_mix_audio( src, dst, pos, frames, data->dest.sampleformat,
+               vorbis_mix_audio( &data->matrix, src, dst, pos, frames, data->dest.sampleformat,
                                  data->channels, data->dest.mode );
 
                data->dest.stream->Commit( data->dest.stream, frames );
@@ -523,8 +339,7 @@ VorbisBuffer( DirectThread *thread,
                     }
                     else {
                          data->finished = true;
-                         data->status = FMSTATE_FINISHED;
-                         direct_waitqueue_broadcast( &data->cond );
+                         Vorbis_SetStatus( data, FMSTATE_FINISHED );
                     }
                     continue;
                }
@@ -536,8 +351,8 @@ VorbisBuffer( DirectThread *thread,
                     do {
                          len = MIN( frames - pos, length );
 
-                         vorbis_mix_audio( src, &dst[pos*bytespersample], 0, len, data->dest.sampleformat,
-                                           data->channels, data->dest.mode );
+                         vorbis_mix_audio( &data->matrix, src, &dst[pos*bytespersample], 0, len,
+                                           data->dest.sampleformat, data->channels, data->dest.mode );
 
                          length -= len;
                          pos    += len;
@@ -551,8 +366,7 @@ VorbisBuffer( DirectThread *thread,
 
           if (data->buffer_callback) {
                if (data->buffer_callback( pos, data->buffer_callback_context )) {
-                    data->status = FMSTATE_STOP;
-                    direct_waitqueue_broadcast( &data->cond );
+                    Vorbis_SetStatus( data, FMSTATE_STOP );
                }
           }
      }
@@ -574,6 +388,7 @@ IFusionSoundMusicProvider_Vorbis_Destruct( IFusionSoundMusicProvider *thiz )
      direct_stream_destroy( data->stream );
 
      direct_waitqueue_deinit( &data->cond );
+     direct_mutex_deinit( &data->status_lock );
      direct_mutex_deinit( &data->lock );
 
      ov_clear( &data->vf );
@@ -764,9 +579,7 @@ IFusionSoundMusicProvider_Vorbis_PlayToStream( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     Vorbis_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, VorbisStream, data, "Vorbis Stream" );
 
@@ -862,9 +675,7 @@ IFusionSoundMusicProvider_Vorbis_PlayToBuffer( IFusionSoundMusicProvider *thiz,
           data->finished = false;
      }
 
-     data->status = FMSTATE_PLAY;
-
-     direct_waitqueue_broadcast( &data->cond );
+     Vorbis_SetStatus( data, FMSTATE_PLAY );
 
      data->thread = direct_thread_create( DTT_DEFAULT, VorbisBuffer, data, "Vorbis Buffer" );
 
@@ -884,8 +695,6 @@ IFusionSoundMusicProvider_Vorbis_Stop( IFusionSoundMusicProvider *thiz )
 
      Vorbis_Stop( data, false );
 
-     direct_waitqueue_broadcast( &data->cond );
-
      direct_mutex_unlock( &data->lock );
 
      return DR_OK;
@@ -1010,8 +819,6 @@ IFusionSoundMusicProvider_Vorbis_WaitStatus( IFusionSoundMusicProvider *thiz,
                                              FSMusicProviderStatus      mask,
                                              unsigned int               timeout )
 {
-     DirectResult ret;
-
      DIRECT_INTERFACE_GET_DATA( IFusionSoundMusicProvider_Vorbis)
 
      D_DEBUG_AT( MusicProvider_Vorbis, "%s( %p )\n", __FUNCTION__, thiz );
@@ -1019,33 +826,27 @@ IFusionSoundMusicProvider_Vorbis_WaitStatus( IFusionSoundMusicProvider *thiz,
      if (!mask || mask & ~FMSTATE_ALL)
           return DR_INVARG;
 
-     if (timeout) {
-          long long s;
-
-          s = direct_clock_get_abs_micros() + timeout * 1000ll;
+     direct_mutex_lock( &data->status_lock );
 
-          while (direct_mutex_trylock( &data->lock )) {
-               usleep( 1000 );
-               if (direct_clock_get_abs_micros() >= s)
-                    return DR_TIMEOUT;
-          }
+     if (timeout) {
+          long long deadline = direct_clock_get_abs_micros() + timeout * 1000ll;
 
           while (!(data->status & mask)) {
-               ret = direct_waitqueue_wait_timeout( &data->cond, &data->lock, timeout * 1000ll );
-               if (ret) {
-                    direct_mutex_unlock( &data->lock );
+               long long now = direct_clock_get_abs_micros();
+
+               if (now >= deadline ||
+                   direct_waitqueue_wait_timeout( &data->cond, &data->status_lock, deadline - now ) == DR_TIMEOUT) {
+                    direct_mutex_unlock( &data->status_lock );
                     return DR_TIMEOUT;
                }
           }
      }
      else {
-          direct_mutex_lock( &data->lock );
-
           while (!(data->status & mask))
-               direct_waitqueue_wait( &data->cond, &data->lock );
+               direct_waitqueue_wait( &data->cond, &data->status_lock );
      }
 
-     direct_mutex_unlock( &data->lock );
+     direct_mutex_unlock( &data->status_lock );
 
      return DR_OK;
 }
@@ -1169,6 +970,7 @@ Construct( IFusionSoundMusicProvider *thiz,
           data->desc.replaygain_album = compute_gain( album_gain, album_peak );
 
      direct_mutex_init( &data->lock );
+     direct_mutex_init( &data->status_lock );
      direct_waitqueue_init( &data->cond );
 
      data->status = FMSTATE_STOP;
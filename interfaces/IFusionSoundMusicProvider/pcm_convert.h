@@ -0,0 +1,865 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#ifndef __PCM_CONVERT_H__
+#define __PCM_CONVERT_H__
+
+#include <direct/memcpy.h>
+#include <direct/system.h>
+#include <direct/util.h>
+#include <fusionsound.h>
+#include <math.h>
+
+/* Defining PCM_NO_SIMD leaves only the per sample conversions, which the tests compare with the SIMD kernels. */
+#if defined(__SSE2__) && !defined(PCM_NO_SIMD)
+#include <emmintrin.h>
+#define PCM_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(PCM_NO_SIMD)
+#include <arm_neon.h>
+#define PCM_NEON
+#endif
+
+/*
+ * Conversion of decoded samples to the sample format of the destination, from planar fixed point samples (MAD),
+ * planar float samples (Vorbis) or interleaved 16 bit samples (Tremor), either to the same channels or through a
+ * mixing matrix. The stereo 16 bit and float paths have SSE2 or NEON kernels giving the same output as the per sample
+ * conversions.
+ */
+
+#define PCM_FIXED_FRACBITS 28 /* as MAD_F_FRACBITS */
+#define PCM_FIXED_ONE      (1 << PCM_FIXED_FRACBITS)
+
+typedef struct {
+#ifdef WORDS_BIGENDIAN
+     s8 c;
+     u8 b;
+     u8 a;
+#else
+     u8 a;
+     u8 b;
+     s8 c;
+#endif
+} __attribute__((packed)) s24;
+
+/**********************************************************************************************************************/
+
+static __inline__ s32
+fixed_clip( s32 sample )
+{
+     if (sample >= PCM_FIXED_ONE)
+          return PCM_FIXED_ONE - 1;
+     else if (sample < -PCM_FIXED_ONE)
+          return -PCM_FIXED_ONE;
+
+     return sample;
+}
+
+static __inline__ u8
+fixed_to_u8( s32 sample )
+{
+     sample = fixed_clip( sample + (1 << (PCM_FIXED_FRACBITS - 8)) );
+
+     return (sample >> (PCM_FIXED_FRACBITS - 7)) + 128;
+}
+
+static __inline__ s16
+fixed_to_s16( s32 sample )
+{
+     sample = fixed_clip( sample + (1 << (PCM_FIXED_FRACBITS - 16)) );
+
+     return sample >> (PCM_FIXED_FRACBITS - 15);
+}
+
+static __inline__ s24
+fixed_to_s24( s32 sample )
+{
+     sample = fixed_clip( sample + (1 << (PCM_FIXED_FRACBITS - 24)) ) >> (PCM_FIXED_FRACBITS - 23);
+
+     return (s24) { a:sample, b:sample >> 8, c:sample >> 16 };
+}
+
+static __inline__ s32
+fixed_to_s32( s32 sample )
+{
+     return fixed_clip( sample ) << (31 - PCM_FIXED_FRACBITS);
+}
+
+static __inline__ float
+fixed_to_float( s32 sample )
+{
+     return (float) fixed_clip( sample ) / PCM_FIXED_ONE;
+}
+
+/**********************************************************************************************************************/
+
+static __inline__ u8
+float_to_u8( float s )
+{
+     int d;
+
+     d = s * 128.0f + 128.5f;
+
+     return CLAMP( d, 0, 255 );
+}
+
+static __inline__ s16
+float_to_s16( float s )
+{
+     int d;
+
+     d = s * 32768.0f + 0.5f;
+
+     return CLAMP( d, -32768, 32767 );
+}
+
+static __inline__ s24
+float_to_s24( float s )
+{
+     int d;
+
+     d = s * 8388608.0f + 0.5f;
+     d = CLAMP( d, -8388608, 8388607 );
+
+     return (s24) { a:d, b:d >> 8, c:d >> 16 };
+}
+
+static __inline__ s32
+float_to_s32( float s )
+{
+     s = CLAMP( s, -1.0f, 1.0f );
+
+     return s * 2147483647.0f;
+}
+
+static __inline__ float
+float_to_float( float s )
+{
+     return CLAMP( s, -1.0f, 1.0f );
+}
+
+/**********************************************************************************************************************/
+
+static __inline__ u8
+s16_to_u8( int s )
+{
+     return (s >> 8) + 128;
+}
+
+static __inline__ s16
+s16_to_s16( int s )
+{
+     return s;
+}
+
+static __inline__ s24
+s16_to_s24( int s )
+{
+     return (s24) { a:0, b:s, c:s >> 8 };
+}
+
+static __inline__ s32
+s16_to_s32( int s )
+{
+     return s << 8;
+}
+
+static __inline__ float
+s16_to_float( int s )
+{
+     return s / 32768.f;
+}
+
+/**********************************************************************************************************************/
+
+static __inline__ void
+fixed_stereo_to_s16( const s32 *left, const s32 *right, s16 *dst, int frames )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128i round = _mm_set1_epi32( 1 << (PCM_FIXED_FRACBITS - 16) );
+
+     /* Clipping is done by the saturation when packing to 16 bit. */
+     for (; i + 8 <= frames; i += 8) {
+          __m128i l0 = _mm_add_epi32( _mm_loadu_si128( (const __m128i*) &left[i] ), round );
+          __m128i l1 = _mm_add_epi32( _mm_loadu_si128( (const __m128i*) &left[i+4] ), round );
+          __m128i r0 = _mm_add_epi32( _mm_loadu_si128( (const __m128i*) &right[i] ), round );
+          __m128i r1 = _mm_add_epi32( _mm_loadu_si128( (const __m128i*) &right[i+4] ), round );
+          __m128i l  = _mm_packs_epi32( _mm_srai_epi32( l0, PCM_FIXED_FRACBITS - 15 ),
+                                        _mm_srai_epi32( l1, PCM_FIXED_FRACBITS - 15 ) );
+          __m128i r  = _mm_packs_epi32( _mm_srai_epi32( r0, PCM_FIXED_FRACBITS - 15 ),
+                                        _mm_srai_epi32( r1, PCM_FIXED_FRACBITS - 15 ) );
+
+          _mm_storeu_si128( (__m128i*) &dst[i*2],   _mm_unpacklo_epi16( l, r ) );
+          _mm_storeu_si128( (__m128i*) &dst[i*2+8], _mm_unpackhi_epi16( l, r ) );
+     }
+#elif defined(PCM_NEON)
+     const int32x4_t round = vdupq_n_s32( 1 << (PCM_FIXED_FRACBITS - 16) );
+
+     /* Clipping is done by the saturation when narrowing to 16 bit. */
+     for (; i + 8 <= frames; i += 8) {
+          int16x8x2_t d;
+
+          d.val[0] = vcombine_s16( vqmovn_s32( vshrq_n_s32( vaddq_s32( vld1q_s32( &left[i] ), round ),
+                                                            PCM_FIXED_FRACBITS - 15 ) ),
+                                   vqmovn_s32( vshrq_n_s32( vaddq_s32( vld1q_s32( &left[i+4] ), round ),
+                                                            PCM_FIXED_FRACBITS - 15 ) ) );
+          d.val[1] = vcombine_s16( vqmovn_s32( vshrq_n_s32( vaddq_s32( vld1q_s32( &right[i] ), round ),
+                                                            PCM_FIXED_FRACBITS - 15 ) ),
+                                   vqmovn_s32( vshrq_n_s32( vaddq_s32( vld1q_s32( &right[i+4] ), round ),
+                                                            PCM_FIXED_FRACBITS - 15 ) ) );
+
+          vst2q_s16( &dst[i*2], d );
+     }
+#endif
+
+     for (; i < frames; i++) {
+          dst[i*2]   = fixed_to_s16( left[i] );
+          dst[i*2+1] = fixed_to_s16( right[i] );
+     }
+}
+
+static __inline__ void
+fixed_stereo_to_float( const s32 *left, const s32 *right, float *dst, int frames )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128  min   = _mm_set1_ps( -PCM_FIXED_ONE );
+     const __m128  max   = _mm_set1_ps( PCM_FIXED_ONE - 1 );
+     const __m128  scale = _mm_set1_ps( 1.0f / PCM_FIXED_ONE );
+
+     /* Clipping after the conversion to float gives the same result, as rounding preserves the order. */
+     for (; i + 4 <= frames; i += 4) {
+          __m128 l = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*) &left[i] ) );
+          __m128 r = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*) &right[i] ) );
+
+          l = _mm_mul_ps( _mm_min_ps( max, _mm_max_ps( min, l ) ), scale );
+          r = _mm_mul_ps( _mm_min_ps( max, _mm_max_ps( min, r ) ), scale );
+
+          _mm_storeu_ps( &dst[i*2],   _mm_unpacklo_ps( l, r ) );
+          _mm_storeu_ps( &dst[i*2+4], _mm_unpackhi_ps( l, r ) );
+     }
+#elif defined(PCM_NEON)
+     const float32x4_t min = vdupq_n_f32( -PCM_FIXED_ONE );
+     const float32x4_t max = vdupq_n_f32( PCM_FIXED_ONE - 1 );
+
+     /* Clipping after the conversion to float gives the same result, as rounding preserves the order. */
+     for (; i + 4 <= frames; i += 4) {
+          float32x4x2_t d;
+
+          d.val[0] = vcvtq_f32_s32( vld1q_s32( &left[i] ) );
+          d.val[1] = vcvtq_f32_s32( vld1q_s32( &right[i] ) );
+
+          d.val[0] = vmulq_n_f32( vminq_f32( max, vmaxq_f32( min, d.val[0] ) ), 1.0f / PCM_FIXED_ONE );
+          d.val[1] = vmulq_n_f32( vminq_f32( max, vmaxq_f32( min, d.val[1] ) ), 1.0f / PCM_FIXED_ONE );
+
+          vst2q_f32( &dst[i*2], d );
+     }
+#endif
+
+     for (; i < frames; i++) {
+          dst[i*2]   = fixed_to_float( left[i] );
+          dst[i*2+1] = fixed_to_float( right[i] );
+     }
+}
+
+static __inline__ void
+float_stereo_to_s16( const float *left, const float *right, s16 *dst, int frames )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128 scale = _mm_set1_ps( 32768.0f );
+     const __m128 half  = _mm_set1_ps( 0.5f );
+
+     /* Conversion with truncation as by a cast, clipping is done by the saturation when packing to 16 bit. */
+     for (; i + 8 <= frames; i += 8) {
+          __m128i l0 = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( &left[i] ), scale ), half ) );
+          __m128i l1 = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( &left[i+4] ), scale ), half ) );
+          __m128i r0 = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( &right[i] ), scale ), half ) );
+          __m128i r1 = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( &right[i+4] ), scale ), half ) );
+          __m128i l  = _mm_packs_epi32( l0, l1 );
+          __m128i r  = _mm_packs_epi32( r0, r1 );
+
+          _mm_storeu_si128( (__m128i*) &dst[i*2],   _mm_unpacklo_epi16( l, r ) );
+          _mm_storeu_si128( (__m128i*) &dst[i*2+8], _mm_unpackhi_epi16( l, r ) );
+     }
+#elif defined(PCM_NEON)
+     const float32x4_t half = vdupq_n_f32( 0.5f );
+
+     /* Conversion with truncation as by a cast, clipping is done by the saturation when narrowing to 16 bit. */
+     for (; i + 8 <= frames; i += 8) {
+          int16x8x2_t d;
+
+          d.val[0] = vcombine_s16( vqmovn_s32( vcvtq_s32_f32( vaddq_f32( vmulq_n_f32( vld1q_f32( &left[i] ),
+                                                                                      32768.0f ), half ) ) ),
+                                   vqmovn_s32( vcvtq_s32_f32( vaddq_f32( vmulq_n_f32( vld1q_f32( &left[i+4] ),
+                                                                                      32768.0f ), half ) ) ) );
+          d.val[1] = vcombine_s16( vqmovn_s32( vcvtq_s32_f32( vaddq_f32( vmulq_n_f32( vld1q_f32( &right[i] ),
+                                                                                      32768.0f ), half ) ) ),
+                                   vqmovn_s32( vcvtq_s32_f32( vaddq_f32( vmulq_n_f32( vld1q_f32( &right[i+4] ),
+                                                                                      32768.0f ), half ) ) ) );
+
+          vst2q_s16( &dst[i*2], d );
+     }
+#endif
+
+     for (; i < frames; i++) {
+          dst[i*2]   = float_to_s16( left[i] );
+          dst[i*2+1] = float_to_s16( right[i] );
+     }
+}
+
+static __inline__ void
+float_stereo_to_float( const float *left, const float *right, float *dst, int frames )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128 min = _mm_set1_ps( -1.0f );
+     const __m128 max = _mm_set1_ps( 1.0f );
+
+     /* The operand order of min/max keeps a NaN, as CLAMP() does. */
+     for (; i + 4 <= frames; i += 4) {
+          __m128 l = _mm_min_ps( max, _mm_max_ps( min, _mm_loadu_ps( &left[i] ) ) );
+          __m128 r = _mm_min_ps( max, _mm_max_ps( min, _mm_loadu_ps( &right[i] ) ) );
+
+          _mm_storeu_ps( &dst[i*2],   _mm_unpacklo_ps( l, r ) );
+          _mm_storeu_ps( &dst[i*2+4], _mm_unpackhi_ps( l, r ) );
+     }
+#elif defined(PCM_NEON)
+     const float32x4_t min = vdupq_n_f32( -1.0f );
+     const float32x4_t max = vdupq_n_f32( 1.0f );
+
+     for (; i + 4 <= frames; i += 4) {
+          float32x4x2_t d;
+
+          d.val[0] = vminq_f32( max, vmaxq_f32( min, vld1q_f32( &left[i] ) ) );
+          d.val[1] = vminq_f32( max, vmaxq_f32( min, vld1q_f32( &right[i] ) ) );
+
+          vst2q_f32( &dst[i*2], d );
+     }
+#endif
+
+     for (; i < frames; i++) {
+          dst[i*2]   = float_to_float( left[i] );
+          dst[i*2+1] = float_to_float( right[i] );
+     }
+}
+
+static __inline__ void
+s16_samples_to_float( const s16 *src, float *dst, int samples )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128 scale = _mm_set1_ps( 1.0f / 32768.0f );
+
+     for (; i + 8 <= samples; i += 8) {
+          __m128i s = _mm_loadu_si128( (const __m128i*) &src[i] );
+
+          _mm_storeu_ps( &dst[i],   _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpacklo_epi16( s, s ), 16 ) ),
+                                                scale ) );
+          _mm_storeu_ps( &dst[i+4], _mm_mul_ps( _mm_cvtepi32_ps( _mm_srai_epi32( _mm_unpackhi_epi16( s, s ), 16 ) ),
+                                                scale ) );
+     }
+#elif defined(PCM_NEON)
+     for (; i + 8 <= samples; i += 8) {
+          int16x8_t s = vld1q_s16( &src[i] );
+
+          vst1q_f32( &dst[i],   vmulq_n_f32( vcvtq_f32_s32( vmovl_s16( vget_low_s16( s ) ) ), 1.0f / 32768.0f ) );
+          vst1q_f32( &dst[i+4], vmulq_n_f32( vcvtq_f32_s32( vmovl_s16( vget_high_s16( s ) ) ), 1.0f / 32768.0f ) );
+     }
+#endif
+
+     for (; i < samples; i++)
+          dst[i] = s16_to_float( src[i] );
+}
+
+/**********************************************************************************************************************/
+
+#define PCM_INTERLEAVE_LOOP( TYPE, CONV )              \
+do {                                                   \
+     int n, i;                                         \
+     for (n = 0; n < channels; n++) {                  \
+          TYPE *d = (TYPE*) dst + n;                   \
+          for (i = 0; i < frames; i++, d += channels)  \
+               *d = CONV( src[n][i] );                 \
+     }                                                 \
+} while (0)
+
+/*
+ * Convert planar fixed point samples to interleaved samples of the destination format with the same channels.
+ */
+static __inline__ void
+pcm_convert_fixed( const s32 *const *src, int channels, void *dst, FSSampleFormat format, int frames )
+{
+     switch (format) {
+          case FSSF_U8:
+               PCM_INTERLEAVE_LOOP( u8, fixed_to_u8 );
+               break;
+          case FSSF_S16:
+               if (channels == 2)
+                    fixed_stereo_to_s16( src[0], src[1], dst, frames );
+               else
+                    PCM_INTERLEAVE_LOOP( s16, fixed_to_s16 );
+               break;
+          case FSSF_S24:
+               PCM_INTERLEAVE_LOOP( s24, fixed_to_s24 );
+               break;
+          case FSSF_S32:
+               PCM_INTERLEAVE_LOOP( s32, fixed_to_s32 );
+               break;
+          case FSSF_FLOAT:
+               if (channels == 2)
+                    fixed_stereo_to_float( src[0], src[1], dst, frames );
+               else
+                    PCM_INTERLEAVE_LOOP( float, fixed_to_float );
+               break;
+          default:
+               break;
+     }
+}
+
+/*
+ * Convert planar float samples to interleaved samples of the destination format with the same channels.
+ */
+static __inline__ void
+pcm_convert_float( const float *const *src, int channels, void *dst, FSSampleFormat format, int frames )
+{
+     switch (format) {
+          case FSSF_U8:
+               PCM_INTERLEAVE_LOOP( u8, float_to_u8 );
+               break;
+          case FSSF_S16:
+               if (channels == 2)
+                    float_stereo_to_s16( src[0], src[1], dst, frames );
+               else
+                    PCM_INTERLEAVE_LOOP( s16, float_to_s16 );
+               break;
+          case FSSF_S24:
+               PCM_INTERLEAVE_LOOP( s24, float_to_s24 );
+               break;
+          case FSSF_S32:
+               PCM_INTERLEAVE_LOOP( s32, float_to_s32 );
+               break;
+          case FSSF_FLOAT:
+               if (channels == 2)
+                    float_stereo_to_float( src[0], src[1], dst, frames );
+               else
+                    PCM_INTERLEAVE_LOOP( float, float_to_float );
+               break;
+          default:
+               break;
+     }
+}
+
+/*
+ * Convert interleaved 16 bit samples to samples of the destination format with the same channels.
+ */
+static __inline__ void
+pcm_convert_s16( const s16 *src, void *dst, FSSampleFormat format, int samples )
+{
+     int i;
+
+     switch (format) {
+          case FSSF_U8:
+               for (i = 0; i < samples; i++)
+                    ((u8*) dst)[i] = s16_to_u8( src[i] );
+               break;
+          case FSSF_S16:
+               direct_memcpy( dst, src, samples * sizeof(s16) );
+               break;
+          case FSSF_S24:
+               for (i = 0; i < samples; i++)
+                    ((s24*) dst)[i] = s16_to_s24( src[i] );
+               break;
+          case FSSF_S32:
+               for (i = 0; i < samples; i++)
+                    ((s32*) dst)[i] = s16_to_s32( src[i] );
+               break;
+          case FSSF_FLOAT:
+               s16_samples_to_float( src, dst, samples );
+               break;
+          default:
+               break;
+     }
+}
+
+
+/**********************************************************************************************************************/
+
+/*
+ * Mixing matrix from the channels of the source, in Vorbis order (L, C, R, Rl, Rr, LFE as present), to the channels of
+ * the destination mode, in FusionSound order (L, C, R, one or two rears, LFE as present).
+ *
+ * Missing channels are mixed with the ITU-R BS.775 downmix coefficients, with the levels of the center, surround and
+ * LFE channels configurable by the MUSIC_CENTER_MIX, MUSIC_SURROUND_MIX and MUSIC_LFE_MIX environment variables (as
+ * linear gains, by default 0.7071, 0.7071 and 0 to omit the LFE channel). Channels added by the destination are mixed
+ * with the same levels from the front channels. Each output channel is normalized to avoid clipping, so a stereo
+ * source in a mono destination is still the average of both channels.
+ */
+
+#define PCM_MIX_FRAMES 256 /* frames mixed at once, the planar block stays in the L1 cache */
+
+typedef struct {
+     int                  channels;                                     /* source channels */
+     FSChannelMode        mode;                                         /* destination mode */
+     bool                 identity;                                     /* same channels, no mixing */
+     float                gain[FS_MAX_CHANNELS][FS_MAX_CHANNELS];       /* [destination][source] */
+} PcmMatrix;
+
+typedef enum {
+     PCM_L   = 0x01,
+     PCM_C   = 0x02,
+     PCM_R   = 0x04,
+     PCM_RL  = 0x08,
+     PCM_RR  = 0x10,
+     PCM_LFE = 0x20,
+     PCM_S   = 0x40,                                                    /* single rear */
+     PCM_M   = 0x80                                                     /* mono */
+} PcmPosition;
+
+static __inline__ void
+pcm_mix_levels( float *ret_center,
+                float *ret_surround,
+                float *ret_lfe )
+{
+     const char *value;
+
+     *ret_center   = M_SQRT1_2;
+     *ret_surround = M_SQRT1_2;
+     *ret_lfe      = 0.0f;
+
+     if ((value = direct_getenv( "MUSIC_CENTER_MIX" )))
+          *ret_center = atof( value );
+
+     if ((value = direct_getenv( "MUSIC_SURROUND_MIX" )))
+          *ret_surround = atof( value );
+
+     if ((value = direct_getenv( "MUSIC_LFE_MIX" )))
+          *ret_lfe = atof( value );
+}
+
+static __inline__ int
+pcm_source_positions( int channels, PcmPosition *positions )
+{
+     static const PcmPosition layouts[FS_MAX_CHANNELS][FS_MAX_CHANNELS] = {
+          { PCM_M },
+          { PCM_L, PCM_R },
+          { PCM_L, PCM_C, PCM_R },
+          { PCM_L, PCM_R, PCM_RL, PCM_RR },
+          { PCM_L, PCM_C, PCM_R, PCM_RL, PCM_RR },
+          { PCM_L, PCM_C, PCM_R, PCM_RL, PCM_RR, PCM_LFE }
+     };
+
+     channels = CLAMP( channels, 1, FS_MAX_CHANNELS );
+
+     direct_memcpy( positions, layouts[channels-1], channels * sizeof(PcmPosition) );
+
+     return channels;
+}
+
+static __inline__ int
+pcm_destination_positions( FSChannelMode mode, PcmPosition *positions )
+{
+     int n = 0;
+
+     if (mode == FSCM_MONO) {
+          positions[n++] = PCM_M;
+          return n;
+     }
+
+     positions[n++] = PCM_L;
+
+     if (FS_MODE_HAS_CENTER( mode ))
+          positions[n++] = PCM_C;
+
+     positions[n++] = PCM_R;
+
+     if (FS_MODE_NUM_REARS( mode ) == 1) {
+          positions[n++] = PCM_S;
+     }
+     else if (FS_MODE_NUM_REARS( mode ) == 2) {
+          positions[n++] = PCM_RL;
+          positions[n++] = PCM_RR;
+     }
+
+     if (FS_MODE_HAS_LFE( mode ))
+          positions[n++] = PCM_LFE;
+
+     return n;
+}
+
+/*
+ * Gain of a source channel in a destination channel, given the positions present in the source and the destination.
+ */
+static __inline__ float
+pcm_mix_gain( PcmPosition  d,
+              PcmPosition  s,
+              unsigned int src,
+              unsigned int dst,
+              float        center,
+              float        surround,
+              float        lfe )
+{
+     if (d == s)
+          return 1.0f;
+
+     switch (d) {
+          case PCM_M:
+               if (s == PCM_C)
+                    return 1.0f;
+               if (s & (PCM_L | PCM_R))
+                    return M_SQRT1_2;
+               if (s & (PCM_RL | PCM_RR))
+                    return surround * M_SQRT1_2;
+               if (s == PCM_LFE)
+                    return lfe;
+               break;
+
+          case PCM_L:
+          case PCM_R:
+               if (s == PCM_C && !(dst & PCM_C))
+                    return center;
+               if (s == (d == PCM_L ? PCM_RL : PCM_RR) && !(dst & (PCM_RL | PCM_S)))
+                    return surround;
+               if (s == PCM_LFE && !(dst & PCM_LFE))
+                    return lfe;
+               break;
+
+          case PCM_C:
+               if ((s & (PCM_L | PCM_R)) && !(src & PCM_C))
+                    return center;
+               break;
+
+          case PCM_S:
+               if (s & (PCM_RL | PCM_RR))
+                    return M_SQRT1_2;
+               if ((s & (PCM_L | PCM_R)) && !(src & PCM_RL))
+                    return surround * M_SQRT1_2;
+               break;
+
+          case PCM_RL:
+          case PCM_RR:
+               if (s == (d == PCM_RL ? PCM_L : PCM_R) && !(src & PCM_RL))
+                    return surround;
+               break;
+
+          case PCM_LFE:
+               if ((s & (PCM_L | PCM_C | PCM_R)) && !(src & PCM_LFE))
+                    return lfe;
+               break;
+
+          default:
+               break;
+     }
+
+     return 0.0f;
+}
+
+/*
+ * Set up the matrix for the source channels and the destination mode.
+ */
+static __inline__ void
+pcm_matrix_init( PcmMatrix     *matrix,
+                 int            channels,
+                 FSChannelMode  mode )
+{
+     PcmPosition  src[FS_MAX_CHANNELS];
+     PcmPosition  dst[FS_MAX_CHANNELS];
+     unsigned int src_mask = 0;
+     unsigned int dst_mask = 0;
+     int          s_n, d_n;
+     int          d, s;
+     float        center, surround, lfe;
+
+     s_n = pcm_source_positions( channels, src );
+     d_n = pcm_destination_positions( mode, dst );
+
+     matrix->channels = s_n;
+     matrix->mode     = mode;
+     matrix->identity = s_n == d_n && !memcmp( src, dst, s_n * sizeof(PcmPosition) );
+
+     memset( matrix->gain, 0, sizeof(matrix->gain) );
+
+     if (matrix->identity)
+          return;
+
+     pcm_mix_levels( &center, &surround, &lfe );
+
+     /* A mono source is mixed as identical left and right channels. */
+     for (s = 0; s < s_n; s++)
+          src_mask |= (src[s] == PCM_M) ? (PCM_L | PCM_R) : src[s];
+
+     for (d = 0; d < d_n; d++)
+          dst_mask |= dst[d];
+
+     for (d = 0; d < d_n; d++) {
+          float sum = 0.0f;
+
+          for (s = 0; s < s_n; s++) {
+               float gain;
+
+               if (src[s] == PCM_M)
+                    gain = pcm_mix_gain( dst[d], PCM_L, src_mask, dst_mask, center, surround, lfe ) +
+                           pcm_mix_gain( dst[d], PCM_R, src_mask, dst_mask, center, surround, lfe );
+               else
+                    gain = pcm_mix_gain( dst[d], src[s], src_mask, dst_mask, center, surround, lfe );
+
+               matrix->gain[d][s] = gain;
+
+               sum += fabsf( gain );
+          }
+
+          if (sum > 1.0f) {
+               for (s = 0; s < s_n; s++)
+                    matrix->gain[d][s] /= sum;
+          }
+     }
+}
+
+static __inline__ void
+float_mix_add( float *dst, const float *src, float gain, int len )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128 g = _mm_set1_ps( gain );
+
+     for (; i + 4 <= len; i += 4)
+          _mm_storeu_ps( &dst[i], _mm_add_ps( _mm_loadu_ps( &dst[i] ), _mm_mul_ps( _mm_loadu_ps( &src[i] ), g ) ) );
+#elif defined(PCM_NEON)
+     for (; i + 4 <= len; i += 4)
+          vst1q_f32( &dst[i], vaddq_f32( vld1q_f32( &dst[i] ), vmulq_n_f32( vld1q_f32( &src[i] ), gain ) ) );
+#endif
+
+     for (; i < len; i++)
+          dst[i] += gain * src[i];
+}
+
+static __inline__ void
+fixed_mix_add( float *dst, const s32 *src, float gain, int len )
+{
+     int i = 0;
+
+#if defined(PCM_SSE2)
+     const __m128 g = _mm_set1_ps( gain );
+
+     for (; i + 4 <= len; i += 4) {
+          __m128 x = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*) &src[i] ) );
+
+          _mm_storeu_ps( &dst[i], _mm_add_ps( _mm_loadu_ps( &dst[i] ), _mm_mul_ps( x, g ) ) );
+     }
+#elif defined(PCM_NEON)
+     for (; i + 4 <= len; i += 4) {
+          float32x4_t x = vcvtq_f32_s32( vld1q_s32( &src[i] ) );
+
+          vst1q_f32( &dst[i], vaddq_f32( vld1q_f32( &dst[i] ), vmulq_n_f32( x, gain ) ) );
+     }
+#endif
+
+     for (; i < len; i++)
+          dst[i] += gain * src[i];
+}
+
+static __inline__ void
+s16_mix_add( float *dst, const s16 *src, int stride, float gain, int len )
+{
+     int i;
+
+     for (i = 0; i < len; i++)
+          dst[i] += gain * src[i*stride];
+}
+
+/*
+ * Each destination channel is accumulated in a planar block from the source channels with a gain in the matrix, then
+ * the block is converted and interleaved by pcm_convert_float().
+ */
+#define PCM_MIX_LOOP( MIX_ADD, SCALE )                                                             \
+do {                                                                                               \
+     int          d_n   = FS_CHANNELS_FOR_MODE( matrix->mode );                                   \
+     int          bytes = d_n * FS_BYTES_PER_SAMPLE( format );                                     \
+     int          pos, len, d, s;                                                                  \
+     float        buf[FS_MAX_CHANNELS][PCM_MIX_FRAMES];                                            \
+     const float *planes[FS_MAX_CHANNELS];                                                         \
+     for (d = 0; d < d_n; d++)                                                                     \
+          planes[d] = buf[d];                                                                      \
+     for (pos = 0; pos < frames; pos += len) {                                                     \
+          len = MIN( frames - pos, PCM_MIX_FRAMES );                                               \
+          for (d = 0; d < d_n; d++) {                                                              \
+               memset( buf[d], 0, len * sizeof(float) );                                           \
+               for (s = 0; s < matrix->channels; s++) {                                            \
+                    if (matrix->gain[d][s] != 0.0f)                                                \
+                         MIX_ADD( buf[d], s, matrix->gain[d][s] * (SCALE), pos, len );             \
+               }                                                                                   \
+          }                                                                                        \
+          pcm_convert_float( planes, d_n, (u8*) dst + pos * bytes, format, len );                  \
+     }                                                                                             \
+} while (0)
+
+/*
+ * Mix planar fixed point samples to interleaved samples of the destination format.
+ */
+static __inline__ void
+pcm_mix_fixed( const PcmMatrix *matrix, const s32 *const *src, void *dst, FSSampleFormat format, int frames )
+{
+     if (matrix->identity) {
+          pcm_convert_fixed( src, matrix->channels, dst, format, frames );
+          return;
+     }
+
+     #define MIX_ADD(b,s,gain,pos,len) fixed_mix_add( b, src[s] + (pos), gain, len )
+     PCM_MIX_LOOP( MIX_ADD, 1.0f / PCM_FIXED_ONE );
+     #undef MIX_ADD
+}
+
+/*
+ * Mix planar float samples to interleaved samples of the destination format.
+ */
+static __inline__ void
+pcm_mix_float( const PcmMatrix *matrix, const float *const *src, void *dst, FSSampleFormat format, int frames )
+{
+     if (matrix->identity) {
+          pcm_convert_float( src, matrix->channels, dst, format, frames );
+          return;
+     }
+
+     #define MIX_ADD(b,s,gain,pos,len) float_mix_add( b, src[s] + (pos), gain, len )
+     PCM_MIX_LOOP( MIX_ADD, 1.0f );
+     #undef MIX_ADD
+}
+
+/*
+ * Mix interleaved 16 bit samples to interleaved samples of the destination format.
+ */
+static __inline__ void
+pcm_mix_s16( const PcmMatrix *matrix, const s16 *src, void *dst, FSSampleFormat format, int frames )
+{
+     if (matrix->identity) {
+          pcm_convert_s16( src, dst, format, frames * matrix->channels );
+          return;
+     }
+
+     #define MIX_ADD(b,s,gain,pos,len) s16_mix_add( b, &src[(pos)*matrix->channels+(s)], matrix->channels, gain, len )
+     PCM_MIX_LOOP( MIX_ADD, 1.0f / 32768.0f );
+     #undef MIX_ADD
+}
+
+#endif
@@ -0,0 +1,284 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#include "idirectfbimageprovider_jpeg.c"
+
+#include <media/idirectfbdatabuffer.h>
+#include <stdio.h>
+
+/*
+ * Check that the full image is still decoded in bands after a serial decode at a small scale, which leaves the
+ * position of the data buffer at the end. The JPEG file is encoded with restart markers in memory and read through a
+ * data buffer implementing the calls of the provider only, so that neither a display nor a file is needed.
+ */
+
+#define IMAGE_SIZE 1024 /* width and height, reaching BANDS_MIN_PIXELS at full scale */
+
+static unsigned char *file_data;
+static unsigned long  file_length;
+static unsigned int   file_pos;
+
+static IDirectFBDataBuffer_data buffer_data;
+
+/* The test has no primary layer. */
+DFBSurfacePixelFormat
+dfb_primary_layer_pixelformat( void )
+{
+     return DSPF_ARGB;
+}
+
+/**********************************************************************************************************************/
+
+static DirectResult
+Buffer_AddRef( IDirectFBDataBuffer *thiz )
+{
+     return DFB_OK;
+}
+
+static DirectResult
+Buffer_Release( IDirectFBDataBuffer *thiz )
+{
+     return DFB_OK;
+}
+
+static DFBResult
+Buffer_SeekTo( IDirectFBDataBuffer *thiz,
+               unsigned int         offset )
+{
+     if (offset > file_length)
+          return DFB_INVARG;
+
+     file_pos = offset;
+
+     return DFB_OK;
+}
+
+static DFBResult
+Buffer_GetLength( IDirectFBDataBuffer *thiz,
+                  unsigned int        *ret_length )
+{
+     *ret_length = file_length;
+
+     return DFB_OK;
+}
+
+static DFBResult
+Buffer_WaitForDataWithTimeout( IDirectFBDataBuffer *thiz,
+                               unsigned int         length,
+                               unsigned int         seconds,
+                               unsigned int         milli_seconds )
+{
+     return file_pos < file_length ? DFB_OK : DFB_EOF;
+}
+
+static DFBResult
+Buffer_GetData( IDirectFBDataBuffer *thiz,
+                unsigned int         length,
+                void                *ret_data,
+                unsigned int        *ret_read )
+{
+     if (file_pos >= file_length)
+          return DFB_EOF;
+
+     length = MIN( length, file_length - file_pos );
+
+     memcpy( ret_data, file_data + file_pos, length );
+
+     file_pos += length;
+
+     if (ret_read)
+          *ret_read = length;
+
+     return DFB_OK;
+}
+
+/* The offset is relative to the current position, as for the data buffers of DirectFB. */
+static DFBResult
+Buffer_PeekData( IDirectFBDataBuffer *thiz,
+                 unsigned int         length,
+                 int                  offset,
+                 void                *ret_data,
+                 unsigned int        *ret_read )
+{
+     if (offset < 0 || file_pos + offset >= file_length)
+          return DFB_EOF;
+
+     length = MIN( length, file_length - file_pos - offset );
+
+     memcpy( ret_data, file_data + file_pos + offset, length );
+
+     if (ret_read)
+          *ret_read = length;
+
+     return DFB_OK;
+}
+
+/**********************************************************************************************************************/
+
+static bool
+encode_image( void )
+{
+     struct jpeg_compress_struct cinfo;
+     struct jpeg_error_mgr       jerr;
+     JSAMPROW                    row;
+     int                         x, y;
+
+     row = malloc( IMAGE_SIZE * 3 );
+     if (!row)
+          return false;
+
+     cinfo.err = jpeg_std_error( &jerr );
+
+     jpeg_create_compress( &cinfo );
+     jpeg_mem_dest( &cinfo, &file_data, &file_length );
+
+     cinfo.image_width      = IMAGE_SIZE;
+     cinfo.image_height     = IMAGE_SIZE;
+     cinfo.input_components = 3;
+     cinfo.in_color_space   = JCS_RGB;
+
+     jpeg_set_defaults( &cinfo );
+
+     cinfo.restart_in_rows = 1;
+
+     jpeg_start_compress( &cinfo, TRUE );
+
+     for (y = 0; y < IMAGE_SIZE; y++) {
+          for (x = 0; x < IMAGE_SIZE; x++) {
+               row[x*3+0] = x;
+               row[x*3+1] = y;
+               row[x*3+2] = x ^ y;
+          }
+
+          jpeg_write_scanlines( &cinfo, &row, 1 );
+     }
+
+     jpeg_finish_compress( &cinfo );
+     jpeg_destroy_compress( &cinfo );
+
+     free( row );
+
+     return true;
+}
+
+/* Same reading of the data buffer as the serial path of RenderTo(). */
+static bool
+decode_serial( IDirectFBImageProvider_JPEG_data *data,
+               int                               scale )
+{
+     struct jpeg_decompress_struct cinfo;
+     struct jpeg_error             jerr;
+     JSAMPARRAY                    buffer;
+
+     cinfo.err = jpeg_std_error( &jerr.pub );
+     jerr.pub.error_exit = jpeg_panic;
+
+     if (setjmp( jerr.jmpbuf )) {
+          jpeg_destroy_decompress( &cinfo );
+          return false;
+     }
+
+     jpeg_create_decompress( &cinfo );
+     jpeg_buffer_src( &cinfo, data->buffer, 0 );
+     jpeg_read_header( &cinfo, TRUE );
+
+     cinfo.scale_num       = scale;
+     cinfo.scale_denom     = 8;
+     cinfo.out_color_space = JCS_RGB;
+
+     jpeg_start_decompress( &cinfo );
+
+     buffer = (*cinfo.mem->alloc_sarray)( (j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1 );
+
+     while (cinfo.output_scanline < cinfo.output_height)
+          jpeg_read_scanlines( &cinfo, buffer, 1 );
+
+     jpeg_finish_decompress( &cinfo );
+     jpeg_destroy_decompress( &cinfo );
+
+     return true;
+}
+
+/**********************************************************************************************************************/
+
+int
+main( void )
+{
+     DFBResult                         ret;
+     IDirectFBDataBuffer               buffer;
+     IDirectFBImageProvider           *thiz;
+     IDirectFBImageProvider_JPEG_data *data;
+
+     if (!encode_image()) {
+          fprintf( stderr, "Encoding the image failed\n" );
+          return 1;
+     }
+
+     /* Bands are only decoded with several threads. */
+     setenv( "JPEG_THREADS", "4", 1 );
+
+     memset( &buffer, 0, sizeof(buffer) );
+
+     buffer.priv                   = &buffer_data;
+     buffer.AddRef                 = Buffer_AddRef;
+     buffer.Release                = Buffer_Release;
+     buffer.SeekTo                 = Buffer_SeekTo;
+     buffer.GetLength              = Buffer_GetLength;
+     buffer.WaitForDataWithTimeout = Buffer_WaitForDataWithTimeout;
+     buffer.GetData                = Buffer_GetData;
+     buffer.PeekData               = Buffer_PeekData;
+
+     DIRECT_ALLOCATE_INTERFACE( thiz, IDirectFBImageProvider );
+
+     ret = Construct( thiz, &buffer, NULL, NULL );
+     if (ret) {
+          fprintf( stderr, "Construct() failed: %s\n", DirectFBErrorString( ret ) );
+          return 1;
+     }
+
+     data = thiz->priv;
+
+     if (!data->restart_interval || data->threads < 2) {
+          fprintf( stderr, "Bands are not enabled (restart interval %d, %d thread(s))\n",
+                   data->restart_interval, data->threads );
+          thiz->Release( thiz );
+          return 1;
+     }
+
+     if (!decode_serial( data, 1 ) || file_pos == 0) {
+          fprintf( stderr, "Decoding at scale 1/8 failed\n" );
+          thiz->Release( thiz );
+          return 1;
+     }
+
+     decode_bands( data, 8 );
+
+     if (!data->image || data->image_scale != 8) {
+          fprintf( stderr, "Decoding at scale 8/8 did not take the band path\n" );
+          thiz->Release( thiz );
+          return 1;
+     }
+
+     printf( "Full image decoded in bands after a serial decode at scale 1/8\n" );
+
+     thiz->Release( thiz );
+
+     free( file_data );
+
+     return 0;
+}
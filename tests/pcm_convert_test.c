@@ -0,0 +1,686 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pcm_convert.h"
+
+/*
+ * Check that the conversions of pcm_convert.h give, for every sample format and number of channels, the same bytes as
+ * the per sample conversions the MAD, Vorbis and Tremor providers had before sharing them. This is built with and
+ * without PCM_NO_SIMD, so that both the SIMD kernels (SSE2 or NEON, depending on the target) and the scalar code are
+ * compared, including out of range, infinite and NaN samples.
+ *
+ * The mixing matrix is checked against the former mixing loops of the providers for mono to stereo and stereo to mono,
+ * and for 5.1 to stereo against the Vorbis downmix and the normalized matrix of libswresample used by the FFmpeg
+ * provider. Mixing goes through float samples, so these results have to be within a step of the destination format.
+ */
+
+#define MAX_FRAMES 1031 /* odd count leaving a tail after the SIMD blocks */
+#define ITERATIONS 50
+
+#define REF_FIXED_FRACBITS 28
+#define REF_FIXED_ONE      (1 << REF_FIXED_FRACBITS)
+
+static const FSSampleFormat formats[] = { FSSF_U8, FSSF_S16, FSSF_S24, FSSF_S32, FSSF_FLOAT };
+
+static const char *format_names[] = { "U8", "S16", "S24", "S32", "FLOAT" };
+
+static s32   fixed_src[FS_MAX_CHANNELS][MAX_FRAMES];
+static float float_src[FS_MAX_CHANNELS][MAX_FRAMES];
+static s16   s16_src[FS_MAX_CHANNELS*MAX_FRAMES];
+static float scaled_src[FS_MAX_CHANNELS][MAX_FRAMES];
+
+static u8    ref_buf[FS_MAX_CHANNELS*MAX_FRAMES*4+16];
+static u8    out_buf[FS_MAX_CHANNELS*MAX_FRAMES*4+16];
+
+static unsigned int seed = 1;
+
+/**********************************************************************************************************************/
+
+/* Conversions of the MAD provider. */
+
+static s32
+ref_fixed_clip( s32 sample )
+{
+     if (sample >= REF_FIXED_ONE)
+          sample = REF_FIXED_ONE - 1;
+     else if (sample < -REF_FIXED_ONE)
+          sample = -REF_FIXED_ONE;
+
+     return sample;
+}
+
+static u8
+ref_fixed_to_u8( s32 sample )
+{
+     sample = ref_fixed_clip( sample + (1 << (REF_FIXED_FRACBITS - 8)) );
+
+     return (sample >> (REF_FIXED_FRACBITS - 7)) + 128;
+}
+
+static s16
+ref_fixed_to_s16( s32 sample )
+{
+     sample = ref_fixed_clip( sample + (1 << (REF_FIXED_FRACBITS - 16)) );
+
+     return sample >> (REF_FIXED_FRACBITS - 15);
+}
+
+static s24
+ref_fixed_to_s24( s32 sample )
+{
+     sample = ref_fixed_clip( sample + (1 << (REF_FIXED_FRACBITS - 24)) );
+
+     sample >>= (REF_FIXED_FRACBITS - 23);
+
+     return (s24) { a:sample, b:sample >> 8, c:sample >> 16 };
+}
+
+static s32
+ref_fixed_to_s32( s32 sample )
+{
+     return ref_fixed_clip( sample ) << (31 - REF_FIXED_FRACBITS);
+}
+
+static float
+ref_fixed_to_float( s32 sample )
+{
+     return (float) ref_fixed_clip( sample ) / REF_FIXED_ONE;
+}
+
+/* Conversions of the Vorbis provider. */
+
+static u8
+ref_float_to_u8( float s )
+{
+     int d;
+
+     d = s * 128.0f + 128.5f;
+
+     return CLAMP( d, 0, 255 );
+}
+
+static s16
+ref_float_to_s16( float s )
+{
+     int d;
+
+     d = s * 32768.0f + 0.5f;
+
+     return CLAMP( d, -32768, 32767 );
+}
+
+static s24
+ref_float_to_s24( float s )
+{
+     int d;
+
+     d = s * 8388608.0f + 0.5f;
+     d = CLAMP( d, -8388608, 8388607 );
+
+     return (s24) { a:d, b:d >> 8, c:d >> 16 };
+}
+
+static s32
+ref_float_to_s32( float s )
+{
+     s = CLAMP( s, -1.0f, 1.0f );
+
+     return s * 2147483647.0f;
+}
+
+static float
+ref_float_to_float( float s )
+{
+     return CLAMP( s, -1.0f, 1.0f );
+}
+
+/* Conversions of the Tremor provider. */
+
+#define REF_S16_TO_U8(s)    (((s) >> 8) + 128)
+#define REF_S16_TO_S16(s)   (s)
+#define REF_S16_TO_S24(s)   ((s24) { a:0, b:(s), c:(s) >> 8 })
+#define REF_S16_TO_S32(s)   ((s) << 8)
+#define REF_S16_TO_FLOAT(s) ((s) / 32768.f)
+
+/**********************************************************************************************************************/
+
+#define REF_PLANAR_LOOP( TYPE, CONV )                  \
+do {                                                   \
+     int n, i;                                         \
+     for (n = 0; n < channels; n++) {                  \
+          TYPE *d = (TYPE*) dst + n;                   \
+          for (i = 0; i < frames; i++, d += channels)  \
+               *d = CONV( src[n][i] );                 \
+     }                                                 \
+} while (0)
+
+#define REF_INTERLEAVED_LOOP( TYPE, CONV )             \
+do {                                                   \
+     int i;                                            \
+     for (i = 0; i < samples; i++)                     \
+          ((TYPE*) dst)[i] = CONV( src[i] );           \
+} while (0)
+
+static void
+ref_convert_fixed( s32 src[][MAX_FRAMES], int channels, void *dst, FSSampleFormat format, int frames )
+{
+     switch (format) {
+          case FSSF_U8:
+               REF_PLANAR_LOOP( u8, ref_fixed_to_u8 );
+               break;
+          case FSSF_S16:
+               REF_PLANAR_LOOP( s16, ref_fixed_to_s16 );
+               break;
+          case FSSF_S24:
+               REF_PLANAR_LOOP( s24, ref_fixed_to_s24 );
+               break;
+          case FSSF_S32:
+               REF_PLANAR_LOOP( s32, ref_fixed_to_s32 );
+               break;
+          case FSSF_FLOAT:
+               REF_PLANAR_LOOP( float, ref_fixed_to_float );
+               break;
+          default:
+               break;
+     }
+}
+
+static void
+ref_convert_float( float src[][MAX_FRAMES], int channels, void *dst, FSSampleFormat format, int frames )
+{
+     switch (format) {
+          case FSSF_U8:
+               REF_PLANAR_LOOP( u8, ref_float_to_u8 );
+               break;
+          case FSSF_S16:
+               REF_PLANAR_LOOP( s16, ref_float_to_s16 );
+               break;
+          case FSSF_S24:
+               REF_PLANAR_LOOP( s24, ref_float_to_s24 );
+               break;
+          case FSSF_S32:
+               REF_PLANAR_LOOP( s32, ref_float_to_s32 );
+               break;
+          case FSSF_FLOAT:
+               REF_PLANAR_LOOP( float, ref_float_to_float );
+               break;
+          default:
+               break;
+     }
+}
+
+static void
+ref_convert_s16( const s16 *src, void *dst, FSSampleFormat format, int samples )
+{
+     switch (format) {
+          case FSSF_U8:
+               REF_INTERLEAVED_LOOP( u8, REF_S16_TO_U8 );
+               break;
+          case FSSF_S16:
+               REF_INTERLEAVED_LOOP( s16, REF_S16_TO_S16 );
+               break;
+          case FSSF_S24:
+               REF_INTERLEAVED_LOOP( s24, REF_S16_TO_S24 );
+               break;
+          case FSSF_S32:
+               REF_INTERLEAVED_LOOP( s32, REF_S16_TO_S32 );
+               break;
+          case FSSF_FLOAT:
+               REF_INTERLEAVED_LOOP( float, REF_S16_TO_FLOAT );
+               break;
+          default:
+               break;
+     }
+}
+
+/**********************************************************************************************************************/
+
+/*
+ * Former mixing loops of the MAD (fixed point), Vorbis (float) and Tremor (16 bit) providers, and the 5.1 to stereo
+ * downmix of Vorbis and libswresample. The center and surround levels of the matrix are set to the Vorbis coefficient.
+ */
+
+#define REF_MIX_LEVEL "0.7079"
+#define REF_MIX_GAIN  0.7079f
+
+#define REF_UPMIX_LOOP( TYPE, CONV )                                  \
+do {                                                                  \
+     TYPE *d = (TYPE*) dst;                                           \
+     int   i;                                                         \
+     for (i = 0; i < frames; i++, d += 2)                             \
+          d[0] = d[1] = CONV( REF_MONO( i ) );                        \
+} while (0)
+
+#define REF_DOWNMIX_LOOP( TYPE, CONV )                                \
+do {                                                                  \
+     TYPE *d = (TYPE*) dst;                                           \
+     int   i;                                                         \
+     for (i = 0; i < frames; i++)                                     \
+          d[i] = CONV( REF_AVERAGE( i ) );                            \
+} while (0)
+
+#define REF_DOWNMIX51_LOOP( TYPE, CONV )                              \
+do {                                                                  \
+     TYPE *d = (TYPE*) dst;                                           \
+     int   i;                                                         \
+     for (i = 0; i < frames; i++, d += 2) {                           \
+          d[0] = CONV( REF_LEFT( i ) );                               \
+          d[1] = CONV( REF_RIGHT( i ) );                              \
+     }                                                                \
+} while (0)
+
+#define REF_FORMAT_SWITCH( LOOP, U8, S16, S24, S32, FLOAT )           \
+do {                                                                  \
+     switch (format) {                                                \
+          case FSSF_U8:                                               \
+               LOOP( u8, U8 );                                        \
+               break;                                                 \
+          case FSSF_S16:                                              \
+               LOOP( s16, S16 );                                      \
+               break;                                                 \
+          case FSSF_S24:                                              \
+               LOOP( s24, S24 );                                      \
+               break;                                                 \
+          case FSSF_S32:                                              \
+               LOOP( s32, S32 );                                      \
+               break;                                                 \
+          case FSSF_FLOAT:                                            \
+               LOOP( float, FLOAT );                                  \
+               break;                                                 \
+          default:                                                    \
+               break;                                                 \
+     }                                                                \
+} while (0)
+
+/* The lists of conversions are expanded before the switch gets its arguments. */
+#define REF_MIX( LOOP, CONVS ) REF_FORMAT_SWITCH( LOOP, CONVS )
+
+#define REF_FIXED_CONV ref_fixed_to_u8, ref_fixed_to_s16, ref_fixed_to_s24, ref_fixed_to_s32, ref_fixed_to_float
+#define REF_FLOAT_CONV ref_float_to_u8, ref_float_to_s16, ref_float_to_s24, ref_float_to_s32, ref_float_to_float
+#define REF_S16_CONV   REF_S16_TO_U8, REF_S16_TO_S16, REF_S16_TO_S24, REF_S16_TO_S32, REF_S16_TO_FLOAT
+
+/* Mono to stereo or stereo to mono. */
+static void
+ref_mix_fixed( s32 src[][MAX_FRAMES], int channels, void *dst, FSSampleFormat format, int frames )
+{
+     #define REF_MONO(i)    src[0][i]
+     #define REF_AVERAGE(i) ((src[0][i] + src[1][i]) >> 1)
+
+     if (channels == 1)
+          REF_MIX( REF_UPMIX_LOOP, REF_FIXED_CONV );
+     else
+          REF_MIX( REF_DOWNMIX_LOOP, REF_FIXED_CONV );
+
+     #undef REF_MONO
+     #undef REF_AVERAGE
+}
+
+/* Mono to stereo, stereo to mono or 5.1 to stereo. */
+static void
+ref_mix_float( float src[][MAX_FRAMES], int channels, void *dst, FSSampleFormat format, int frames )
+{
+     #define REF_MONO(i)    src[0][i]
+     #define REF_AVERAGE(i) ((src[0][i] + src[1][i]) * 0.5f)
+     #define REF_LEFT(i)    (src[0][i] + (src[1][i] + src[3][i]) * REF_MIX_GAIN)
+     #define REF_RIGHT(i)   (src[2][i] + (src[1][i] + src[4][i]) * REF_MIX_GAIN)
+
+     if (channels == 1)
+          REF_MIX( REF_UPMIX_LOOP, REF_FLOAT_CONV );
+     else if (channels == 2)
+          REF_MIX( REF_DOWNMIX_LOOP, REF_FLOAT_CONV );
+     else
+          REF_MIX( REF_DOWNMIX51_LOOP, REF_FLOAT_CONV );
+
+     #undef REF_MONO
+     #undef REF_AVERAGE
+     #undef REF_LEFT
+     #undef REF_RIGHT
+}
+
+/* Mono to stereo or stereo to mono as Tremor, 5.1 to stereo as libswresample with its rows normalized. */
+static void
+ref_mix_s16( const s16 *src, int channels, void *dst, FSSampleFormat format, int frames )
+{
+     const float sum = 1.0f + REF_MIX_GAIN + REF_MIX_GAIN;
+
+     #define REF_MONO(i)    src[i]
+     #define REF_AVERAGE(i) ((src[i*2] + src[i*2+1]) >> 1)
+     #define REF_LEFT(i)    ((src[i*6]   + src[i*6+1] * REF_MIX_GAIN + src[i*6+3] * REF_MIX_GAIN) / sum / 32768.0f)
+     #define REF_RIGHT(i)   ((src[i*6+2] + src[i*6+1] * REF_MIX_GAIN + src[i*6+4] * REF_MIX_GAIN) / sum / 32768.0f)
+
+     if (channels == 1)
+          REF_MIX( REF_UPMIX_LOOP, REF_S16_CONV );
+     else if (channels == 2)
+          REF_MIX( REF_DOWNMIX_LOOP, REF_S16_CONV );
+     else
+          REF_MIX( REF_DOWNMIX51_LOOP, REF_FLOAT_CONV );
+
+     #undef REF_MONO
+     #undef REF_AVERAGE
+     #undef REF_LEFT
+     #undef REF_RIGHT
+}
+
+/**********************************************************************************************************************/
+
+static unsigned int
+random_next( void )
+{
+     seed = seed * 1103515245 + 12345;
+
+     return seed >> 1;
+}
+
+static s32
+random_fixed( void )
+{
+     /* Out of range samples, without overflowing when adding the rounding offset. */
+     static const s32 special[] = {
+          0, 1, -1, REF_FIXED_ONE, REF_FIXED_ONE - 1, -REF_FIXED_ONE, -REF_FIXED_ONE - 1,
+          REF_FIXED_ONE - (1 << 12), REF_FIXED_ONE - (1 << 12) - 1, -REF_FIXED_ONE - (1 << 12),
+          -REF_FIXED_ONE + (1 << 12) - 1, 0x70000000, -0x70000000
+     };
+
+     switch (random_next() % 4) {
+          case 0:
+               return special[random_next() % D_ARRAY_SIZE(special)];
+          case 1:
+               return (random_next() & 1 ? 1 : -1) * (s32) (random_next() % 0x70000000u);
+          default:
+               return (s32) (random_next() % (3u << REF_FIXED_FRACBITS)) - (3 << (REF_FIXED_FRACBITS - 1));
+     }
+}
+
+static float
+random_float( void )
+{
+     static const float special[] = {
+          0.0f, -0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 1e10f, -1e10f, INFINITY, -INFINITY, NAN, -NAN,
+          32767.5f / 32768.0f, -32768.5f / 32768.0f, 0.5f / 32768.0f, -0.5f / 32768.0f
+     };
+
+     switch (random_next() % 4) {
+          case 0:
+               return special[random_next() % D_ARRAY_SIZE(special)];
+          case 1:
+               /* Close to the rounding boundaries of 16 bit samples. */
+               return ((int) (random_next() % 65536) - 32768) / 32768.0f +
+                      ((int) (random_next() % 3) - 1) / 65536.0f;
+          default:
+               return random_next() / (float) (1u << 31) * 3.0f - 1.5f;
+     }
+}
+
+static void
+fill_sources( void )
+{
+     int n, i;
+
+     for (n = 0; n < FS_MAX_CHANNELS; n++) {
+          for (i = 0; i < MAX_FRAMES; i++) {
+               fixed_src[n][i] = random_fixed();
+               float_src[n][i] = random_float();
+          }
+     }
+
+     for (i = 0; i < FS_MAX_CHANNELS * MAX_FRAMES; i++)
+          s16_src[i] = random_next();
+}
+
+/*
+ * Sources for mixing, up to one and a half times the full scale. Larger values would lose their difference to the
+ * other channels in the float sums, and would overflow the fixed point sum of the former stereo to mono loop.
+ */
+static void
+fill_mix_sources( void )
+{
+     const float sum = 1.0f + REF_MIX_GAIN + REF_MIX_GAIN;
+     int         n, i;
+
+     for (n = 0; n < FS_MAX_CHANNELS; n++) {
+          for (i = 0; i < MAX_FRAMES; i++) {
+               fixed_src[n][i] = (s32) (random_next() % (3u << REF_FIXED_FRACBITS)) - (3 << (REF_FIXED_FRACBITS - 1));
+               float_src[n][i] = random_next() / (float) (1u << 31) * 3.0f - 1.5f;
+
+               /* The normalization of the matrix, which the former Vorbis downmix did not have. */
+               scaled_src[n][i] = float_src[n][i] / sum;
+          }
+     }
+}
+
+static int
+compare( const char   *source,
+         unsigned int  format,
+         int           channels,
+         int           frames )
+{
+     unsigned int i;
+
+     if (!memcmp( ref_buf, out_buf, sizeof(ref_buf) ))
+          return 0;
+
+     for (i = 0; ref_buf[i] == out_buf[i]; i++);
+
+     fprintf( stderr, "%s to %s with %d channel(s) and %d frame(s) differs at byte %u: %02x instead of %02x\n",
+              source, format_names[format], channels, frames, i, out_buf[i], ref_buf[i] );
+
+     return 1;
+}
+
+static double
+sample_value( const u8 *buf, FSSampleFormat format, int index )
+{
+     const s24 *s;
+
+     switch (format) {
+          case FSSF_U8:
+               return buf[index];
+          case FSSF_S16:
+               return ((const s16*) buf)[index];
+          case FSSF_S24:
+               s = &((const s24*) buf)[index];
+               return s->c * 65536 + s->b * 256 + s->a;
+          case FSSF_S32:
+               return ((const s32*) buf)[index];
+          case FSSF_FLOAT:
+               return ((const float*) buf)[index];
+          default:
+               return 0;
+     }
+}
+
+static int
+compare_mix( const char   *source,
+             const char   *layout,
+             unsigned int  format,
+             int           samples,
+             bool          s16 )
+{
+     /* One step of the integer formats, more for the bits beyond the precision of float samples. */
+     static const double tolerance[]     = { 1.0, 1.0, 2.0, 512.0, 1e-6 };
+     /* One step of 16 bit samples, to which the former Tremor loop rounded its averages. */
+     static const double tolerance_s16[] = { 1.0, 1.0, 256.0, 65536.0, 1.0 / 32768 };
+
+     int bytes = samples * FS_BYTES_PER_SAMPLE( formats[format] );
+     int i;
+
+     for (i = 0; i < samples; i++) {
+          double ref = sample_value( ref_buf, formats[format], i );
+          double out = sample_value( out_buf, formats[format], i );
+
+          if (fabs( out - ref ) > (s16 ? tolerance_s16 : tolerance)[format]) {
+               fprintf( stderr, "%s %s to %s differs at sample %d: %g instead of %g\n",
+                        source, layout, format_names[format], i, out, ref );
+               return 1;
+          }
+     }
+
+     if (memcmp( ref_buf + bytes, out_buf + bytes, sizeof(ref_buf) - bytes )) {
+          fprintf( stderr, "%s %s to %s wrote beyond %d sample(s)\n", source, layout, format_names[format], samples );
+          return 1;
+     }
+
+     return 0;
+}
+
+/**********************************************************************************************************************/
+
+int
+main( void )
+{
+     const s32   *fixed[FS_MAX_CHANNELS];
+     const float *floats[FS_MAX_CHANNELS];
+     unsigned int format;
+     PcmMatrix    matrix;
+     int          iteration, channels, n;
+     int          checks   = 0;
+     int          failures = 0;
+
+     for (n = 0; n < FS_MAX_CHANNELS; n++) {
+          fixed[n]  = fixed_src[n];
+          floats[n] = float_src[n];
+     }
+
+     setenv( "MUSIC_CENTER_MIX", REF_MIX_LEVEL, 1 );
+     setenv( "MUSIC_SURROUND_MIX", REF_MIX_LEVEL, 1 );
+     unsetenv( "MUSIC_LFE_MIX" );
+
+     for (iteration = 0; iteration < ITERATIONS; iteration++) {
+          int frames;
+
+          /* All the short lengths first, then the maximum and random ones. */
+          if (iteration < 20)
+               frames = iteration;
+          else if (iteration == 20)
+               frames = MAX_FRAMES;
+          else
+               frames = random_next() % MAX_FRAMES;
+
+          fill_sources();
+
+          for (format = 0; format < D_ARRAY_SIZE(formats); format++) {
+               for (channels = 1; channels <= FS_MAX_CHANNELS; channels++) {
+                    /* The guard bytes after the samples have to stay untouched. */
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_convert_fixed( fixed_src, channels, ref_buf, formats[format], frames );
+                    pcm_convert_fixed( fixed, channels, out_buf, formats[format], frames );
+
+                    failures += compare( "fixed", format, channels, frames );
+
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_convert_float( float_src, channels, ref_buf, formats[format], frames );
+                    pcm_convert_float( floats, channels, out_buf, formats[format], frames );
+
+                    failures += compare( "float", format, channels, frames );
+
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_convert_s16( s16_src, ref_buf, formats[format], frames * channels );
+                    pcm_convert_s16( s16_src, out_buf, formats[format], frames * channels );
+
+                    failures += compare( "s16", format, channels, frames );
+
+                    checks += 3;
+               }
+          }
+
+          fill_mix_sources();
+
+          for (format = 0; format < D_ARRAY_SIZE(formats); format++) {
+               for (channels = 1; channels <= 2; channels++) {
+                    const char    *layout = channels == 1 ? "mono to stereo" : "stereo to mono";
+                    FSChannelMode  mode   = channels == 1 ? FSCM_STEREO : FSCM_MONO;
+                    int            count  = frames * FS_CHANNELS_FOR_MODE( mode );
+
+                    pcm_matrix_init( &matrix, channels, mode );
+
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_mix_fixed( fixed_src, channels, ref_buf, formats[format], frames );
+                    pcm_mix_fixed( &matrix, fixed, out_buf, formats[format], frames );
+
+                    failures += compare_mix( "fixed", layout, format, count, false );
+
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_mix_float( float_src, channels, ref_buf, formats[format], frames );
+                    pcm_mix_float( &matrix, floats, out_buf, formats[format], frames );
+
+                    failures += compare_mix( "float", layout, format, count, false );
+
+                    checks += 2;
+
+                    /* The former Tremor code wrote S32 samples at 24 bit full scale, mixing gives them at 32 bit. */
+                    if (formats[format] == FSSF_S32)
+                         continue;
+
+                    memset( ref_buf, 0xa5, sizeof(ref_buf) );
+                    memset( out_buf, 0xa5, sizeof(out_buf) );
+
+                    ref_mix_s16( s16_src, channels, ref_buf, formats[format], frames );
+                    pcm_mix_s16( &matrix, s16_src, out_buf, formats[format], frames );
+
+                    failures += compare_mix( "s16", layout, format, count, true );
+
+                    checks++;
+               }
+
+               pcm_matrix_init( &matrix, 6, FSCM_STEREO );
+
+               memset( ref_buf, 0xa5, sizeof(ref_buf) );
+               memset( out_buf, 0xa5, sizeof(out_buf) );
+
+               ref_mix_float( scaled_src, 6, ref_buf, formats[format], frames );
+               pcm_mix_float( &matrix, floats, out_buf, formats[format], frames );
+
+               failures += compare_mix( "float", "5.1 to stereo", format, frames * 2, false );
+
+               memset( ref_buf, 0xa5, sizeof(ref_buf) );
+               memset( out_buf, 0xa5, sizeof(out_buf) );
+
+               ref_mix_s16( s16_src, 6, ref_buf, formats[format], frames );
+               pcm_mix_s16( &matrix, s16_src, out_buf, formats[format], frames );
+
+               failures += compare_mix( "s16", "5.1 to stereo", format, frames * 2, false );
+
+               checks += 2;
+          }
+     }
+
+#if defined(PCM_SSE2)
+     printf( "SSE2: " );
+#elif defined(PCM_NEON)
+     printf( "NEON: " );
+#else
+     printf( "scalar: " );
+#endif
+     printf( "%d conversions and mixes checked, %d failed\n", checks, failures );
+
+     return failures ? 1 : 0;
+}
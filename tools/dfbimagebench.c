@@ -0,0 +1,527 @@
+/*
+   This file is part of DirectFB.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+*/
+
+#include <config.h>
+#include <direct/clock.h>
+#include <direct/interface.h>
+#include <direct/mem.h>
+#include <direct/util.h>
+#include <dirent.h>
+#include <idirectfb.h>
+#include <media/idirectfbimageprovider.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+/**********************************************************************************************************************/
+
+#define MAX_SCALES 8
+
+static IDirectFB   *dfb;
+
+static const char  *corpus       = NULL;
+static const char  *provider_arg = NULL;
+static double       scales[MAX_SCALES];
+static int          num_scales   = 0;
+static int          runs         = 5;
+
+/* Image provider implementations of DirectFB2-media. */
+static const char  *implementations[] = {
+     "AVIF", "BMP", "FFmpeg", "GdkPixbuf", "GIF", "HEIF", "Imlib2", "JasPer", "JPEG", "JXL",
+     "LodePNG", "NanoSVG", "OpenEXR", "PNG", "SPNG", "STB", "SVG", "TIFF", "WebP", "YUV", NULL
+};
+
+typedef struct {
+     char          *path;
+     const char    *name;
+     const char    *format;
+     unsigned char *data;
+     unsigned int   length;
+} BenchFile;
+
+/**********************************************************************************************************************/
+
+static void
+print_usage( const char *prg )
+{
+     fprintf( stderr, "\nDirectFB Image Provider Benchmark\n\n" );
+     fprintf( stderr, "Usage: %s [options] <corpus directory>\n\n", prg );
+     fprintf( stderr, "Options:\n\n" );
+     fprintf( stderr, "  -p, --providers <list>  Comma separated list of image provider implementations (default: all)\n" );
+     fprintf( stderr, "  -s, --scales <list>     Comma separated list of scale factors (default: 1,0.5,0.25,0.125)\n" );
+     fprintf( stderr, "  -r, --runs <num>        Number of decodes per image and scale (default: 5)\n" );
+     fprintf( stderr, "  -h, --help              Show this help message\n\n" );
+     fprintf( stderr, "Results are written to stdout as CSV, one line per provider, image and scale:\n" );
+     fprintf( stderr, "  open_us     average time of Construct() and GetSurfaceDescription()\n" );
+     fprintf( stderr, "  render_us   average time of RenderTo() into a system memory surface\n" );
+     fprintf( stderr, "  mpix_s      image pixels decoded per second (in millions)\n" );
+     fprintf( stderr, "  peak_rss_kb peak resident set size during the decodes\n\n" );
+}
+
+static bool
+parse_scales( const char *arg )
+{
+     char *end;
+
+     num_scales = 0;
+
+     while (*arg) {
+          if (num_scales == MAX_SCALES)
+               return false;
+
+          scales[num_scales] = strtod( arg, &end );
+          if (end == arg || scales[num_scales] <= 0.0 || scales[num_scales] > 1.0)
+               return false;
+
+          num_scales++;
+
+          if (*end == ',')
+               end++;
+          else if (*end)
+               return false;
+
+          arg = end;
+     }
+
+     return num_scales > 0;
+}
+
+static bool
+parse_command_line( int argc, char *argv[] )
+{
+     int n;
+
+     for (n = 1; n < argc; n++) {
+          const char *arg = argv[n];
+
+          if (strcmp( arg, "-h" ) == 0 || strcmp( arg, "--help" ) == 0) {
+               print_usage( argv[0] );
+               return false;
+          }
+
+          if (strcmp( arg, "-p" ) == 0 || strcmp( arg, "--providers" ) == 0) {
+               if (++n == argc) {
+                    print_usage( argv[0] );
+                    return false;
+               }
+
+               provider_arg = argv[n];
+               continue;
+          }
+
+          if (strcmp( arg, "-s" ) == 0 || strcmp( arg, "--scales" ) == 0) {
+               if (++n == argc || !parse_scales( argv[n] )) {
+                    print_usage( argv[0] );
+                    return false;
+               }
+
+               continue;
+          }
+
+          if (strcmp( arg, "-r" ) == 0 || strcmp( arg, "--runs" ) == 0) {
+               if (++n == argc || (runs = atoi( argv[n] )) < 1) {
+                    print_usage( argv[0] );
+                    return false;
+               }
+
+               continue;
+          }
+
+          if (corpus || arg[0] == '-') {
+               print_usage( argv[0] );
+               return false;
+          }
+
+          corpus = arg;
+     }
+
+     if (!corpus) {
+          print_usage( argv[0] );
+          return false;
+     }
+
+     if (!num_scales)
+          parse_scales( "1,0.5,0.25,0.125" );
+
+     return true;
+}
+
+/**********************************************************************************************************************/
+
+static void
+reset_peak_rss( void )
+{
+     FILE *f;
+
+     /* Reset the peak resident set size of the process (Linux 4.0 and later). */
+     f = fopen( "/proc/self/clear_refs", "w" );
+     if (f) {
+          fputs( "5", f );
+          fclose( f );
+     }
+}
+
+static long
+get_peak_rss( void )
+{
+     FILE          *f;
+     char           line[128];
+     struct rusage  usage;
+     long           kb = -1;
+
+     f = fopen( "/proc/self/status", "r" );
+     if (f) {
+          while (fgets( line, sizeof(line), f )) {
+               if (sscanf( line, "VmHWM: %ld", &kb ) == 1)
+                    break;
+          }
+
+          fclose( f );
+     }
+
+     if (kb < 0 && !getrusage( RUSAGE_SELF, &usage ))
+          kb = usage.ru_maxrss;
+
+     return kb;
+}
+
+/**********************************************************************************************************************/
+
+static int
+compare_files( const void *a,
+               const void *b )
+{
+     const BenchFile *fa = a;
+     const BenchFile *fb = b;
+
+     return strcmp( fa->name, fb->name );
+}
+
+static bool
+load_file( BenchFile *file )
+{
+     FILE        *f;
+     struct stat  st;
+
+     if (stat( file->path, &st ) || !S_ISREG( st.st_mode ) || !st.st_size)
+          return false;
+
+     f = fopen( file->path, "rb" );
+     if (!f)
+          return false;
+
+     file->length = st.st_size;
+     file->data   = D_MALLOC( file->length );
+
+     if (!file->data) {
+          fclose( f );
+          return false;
+     }
+
+     if (fread( file->data, 1, file->length, f ) != file->length) {
+          D_FREE( file->data );
+          fclose( f );
+          return false;
+     }
+
+     fclose( f );
+
+     return true;
+}
+
+static int
+load_corpus( BenchFile **ret_files )
+{
+     DIR           *dir;
+     struct dirent *entry;
+     BenchFile     *files = NULL;
+     int            num   = 0;
+
+     dir = opendir( corpus );
+     if (!dir) {
+          fprintf( stderr, "Failed to open corpus directory '%s'!\n", corpus );
+          return -1;
+     }
+
+     while ((entry = readdir( dir ))) {
+          BenchFile  file;
+          BenchFile *tmp;
+
+          if (entry->d_name[0] == '.')
+               continue;
+
+          file.path = D_MALLOC( strlen( corpus ) + strlen( entry->d_name ) + 2 );
+          if (!file.path)
+               break;
+
+          sprintf( file.path, "%s/%s", corpus, entry->d_name );
+
+          if (!load_file( &file )) {
+               D_FREE( file.path );
+               continue;
+          }
+
+          file.name   = file.path + strlen( corpus ) + 1;
+          file.format = strrchr( file.name, '.' ) ? strrchr( file.name, '.' ) + 1 : "";
+
+          tmp = D_REALLOC( files, (num + 1) * sizeof(BenchFile) );
+          if (!tmp) {
+               D_FREE( file.data );
+               D_FREE( file.path );
+               break;
+          }
+
+          files = tmp;
+          files[num++] = file;
+     }
+
+     closedir( dir );
+
+     if (num)
+          qsort( files, num, sizeof(BenchFile), compare_files );
+
+     *ret_files = files;
+
+     return num;
+}
+
+/**********************************************************************************************************************/
+
+static DFBResult
+decode( DirectInterfaceFuncs   *funcs,
+        const BenchFile        *file,
+        IDirectFBSurface      **surface,
+        double                  scale,
+        DFBSurfaceDescription  *ret_desc,
+        long long              *open_us,
+        long long              *render_us )
+{
+     DFBResult                 ret;
+     DFBDataBufferDescription  ddsc;
+     DFBSurfaceDescription     desc;
+     long long                 t0, t1, t2;
+     IDirectFBDataBuffer      *buffer;
+     IDirectFBImageProvider   *provider;
+     IDirectFB_data           *dfb_data = dfb->priv;
+
+     ddsc.flags         = DBDESC_MEMORY;
+     ddsc.memory.data   = file->data;
+     ddsc.memory.length = file->length;
+
+     ret = dfb->CreateDataBuffer( dfb, &ddsc, &buffer );
+     if (ret)
+          return ret;
+
+     DIRECT_ALLOCATE_INTERFACE( provider, IDirectFBImageProvider );
+     if (!provider) {
+          buffer->Release( buffer );
+          return D_OOM();
+     }
+
+     t0 = direct_clock_get_abs_micros();
+
+     /* The provider takes over the interface, it is deallocated by Construct() on failure. */
+     ret = funcs->Construct( provider, buffer, dfb_data->core, dfb );
+     if (ret) {
+          buffer->Release( buffer );
+          return ret;
+     }
+
+     ret = provider->GetSurfaceDescription( provider, &desc );
+     if (ret)
+          goto out;
+
+     t1 = direct_clock_get_abs_micros();
+
+     if (!*surface) {
+          DFBSurfaceDescription dsc = desc;
+
+          dsc.flags  |= DSDESC_WIDTH | DSDESC_HEIGHT | DSDESC_CAPS;
+          dsc.width   = MAX( 1, desc.width  * scale + 0.5 );
+          dsc.height  = MAX( 1, desc.height * scale + 0.5 );
+          dsc.caps    = ((desc.flags & DSDESC_CAPS) ? desc.caps : DSCAPS_NONE) | DSCAPS_SYSTEMONLY;
+
+          ret = dfb->CreateSurface( dfb, &dsc, surface );
+          if (ret)
+               goto out;
+
+          /* Surface creation is excluded from the measurement. */
+          t1 = direct_clock_get_abs_micros();
+     }
+
+     ret = provider->RenderTo( provider, *surface, NULL );
+
+     t2 = direct_clock_get_abs_micros();
+
+     *ret_desc   = desc;
+     *open_us   += t1 - t0;
+     *render_us += t2 - t1;
+
+out:
+     provider->Release( provider );
+     buffer->Release( buffer );
+
+     return ret;
+}
+
+static void
+bench_file( const char           *implementation,
+            DirectInterfaceFuncs *funcs,
+            const BenchFile      *file )
+{
+     DFBResult                           ret;
+     int                                 i, n;
+     IDirectFBImageProvider_ProbeContext ctx;
+
+     memset( &ctx, 0, sizeof(ctx) );
+     memcpy( ctx.header, file->data, MIN( file->length, sizeof(ctx.header) ) );
+     ctx.filename = file->path;
+
+     if (funcs->Probe( &ctx ))
+          return;
+
+     for (i = 0; i < num_scales; i++) {
+          DFBSurfaceDescription  desc;
+          int                    width, height;
+          long                   peak_rss;
+          long long              total_us;
+          long long              open_us   = 0;
+          long long              render_us = 0;
+          IDirectFBSurface      *surface   = NULL;
+
+          reset_peak_rss();
+
+          for (n = 0; n < runs; n++) {
+               ret = decode( funcs, file, &surface, scales[i], &desc, &open_us, &render_us );
+               if (ret)
+                    break;
+          }
+
+          peak_rss = get_peak_rss();
+
+          if (ret) {
+               fprintf( stderr, "%s: Failed to decode '%s' at scale %g: %s\n",
+                        implementation, file->name, scales[i], DirectFBErrorString( ret ) );
+
+               if (surface)
+                    surface->Release( surface );
+
+               return;
+          }
+
+          surface->GetSize( surface, &width, &height );
+          surface->Release( surface );
+
+          total_us = (open_us + render_us) / runs;
+
+          printf( "%s,%s,%s,%d,%d,%g,%d,%d,%d,%lld,%lld,%lld,%.2f,%ld\n",
+                  implementation, file->name, file->format, desc.width, desc.height,
+                  scales[i], width, height, runs, open_us / runs, render_us / runs, total_us,
+                  total_us ? (double) desc.width * desc.height / total_us : 0.0, peak_rss );
+
+          fflush( stdout );
+     }
+}
+
+static bool
+selected( const char *implementation )
+{
+     const char *p = provider_arg;
+     size_t      len;
+
+     if (!p)
+          return true;
+
+     len = strlen( implementation );
+
+     while (p) {
+          if (!strncasecmp( p, implementation, len ) && (p[len] == ',' || p[len] == '\0'))
+               return true;
+
+          p = strchr( p, ',' );
+          if (p)
+               p++;
+     }
+
+     return false;
+}
+
+/**********************************************************************************************************************/
+
+int
+main( int argc, char *argv[] )
+{
+     DFBResult  ret;
+     int        i, n;
+     int        num_files;
+     BenchFile *files;
+
+     ret = DirectFBInit( &argc, &argv );
+     if (ret) {
+          DirectFBError( "DirectFBInit() failed", ret );
+          return 1;
+     }
+
+     if (!parse_command_line( argc, argv ))
+          return 1;
+
+     ret = DirectFBCreate( &dfb );
+     if (ret) {
+          DirectFBError( "DirectFBCreate() failed", ret );
+          return 1;
+     }
+
+     num_files = load_corpus( &files );
+     if (num_files < 0) {
+          dfb->Release( dfb );
+          return 1;
+     }
+
+     printf( "provider,file,format,width,height,scale,dst_width,dst_height,runs,"
+             "open_us,render_us,total_us,mpix_s,peak_rss_kb\n" );
+
+     for (i = 0; implementations[i]; i++) {
+          DirectInterfaceFuncs *funcs;
+
+          if (!selected( implementations[i] ))
+               continue;
+
+          ret = DirectGetInterface( &funcs, "IDirectFBImageProvider", implementations[i], NULL, NULL );
+          if (ret) {
+               if (provider_arg)
+                    fprintf( stderr, "%s: Image provider not available!\n", implementations[i] );
+
+               continue;
+          }
+
+          for (n = 0; n < num_files; n++)
+               bench_file( implementations[i], funcs, &files[n] );
+     }
+
+     for (n = 0; n < num_files; n++) {
+          D_FREE( files[n].data );
+          D_FREE( files[n].path );
+     }
+
+     if (files)
+          D_FREE( files );
+
+     dfb->Release( dfb );
+
+     return 0;
+}